@@ -1,10 +1,56 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_mixer.h>
 #include <SDL2/SDL_ttf.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+// 外部AI接口和集群用到的进程、共享内存、futex和套接字接口
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600 // WSAPoll和inet_ntop需要Vista以上
+#endif
+#include <fcntl.h>
+#include <io.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#else
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+#endif
+
 // 游戏窗口尺寸
 #define WINDOW_WIDTH 600  // 游戏窗口的宽度（像素）
 #define WINDOW_HEIGHT 600 // 游戏窗口的高度（像素）
@@ -13,7 +59,6 @@
 #define ARENA_WIDTH 12 // 游戏区域（俄罗斯方块下落区域）的宽度（方块数量）
 #define ARENA_HEIGHT 20 // 游戏区域的高度（方块数量）
 
-int score = 0;       // 当前游戏分数
 Uint32 lastFall = 0; // 记录上次下落时间
 Uint32 lastFallInterval = 300; // 方块下落间隔时间, 初始化为中间值 (100 + 500)/2
 int scoreMultiplier = 3; // 分数倍数，默认值为3
@@ -34,8 +79,6 @@ typedef struct {
     bool visible;     // 当前是否可见（用于实现闪烁效果）
 } ClearAnimation;
 
-ClearAnimation clearAnim = {0}; // 消除动画状态
-
 // 游戏状态历史记录结构体
 typedef struct {
     uint8_t arena[ARENA_HEIGHT][ARENA_WIDTH]; // 游戏区域状态
@@ -44,13 +87,228 @@ typedef struct {
     int score;                                // 当前分数
 } GameState;
 
-#define HISTORY_SIZE 3           // 保存最近3个游戏状态
-GameState history[HISTORY_SIZE]; // 历史状态数组，用于实现撤销功能
-int historyIndex = 0; // 当前历史状态索引，用于循环记录
+#define HISTORY_SIZE 3 // 保存最近3个游戏状态
+
+// 一局游戏的全部状态，规则函数都作用于传入的对局。窗口模式只有一局（session），
+// 多局服务器在同一个进程里同时运行成千上万局
+typedef struct {
+    uint8_t arena[ARENA_HEIGHT][ARENA_WIDTH];
+    Tetromino currentPiece;   // 当前下落的方块
+    Tetromino nextPiece;      // 存储下一个方块
+    int score;                // 当前游戏分数
+    int lines;                // 本局消除的行数
+    int pieceCount;           // 本局已生成的方块数量
+    uint64_t arenaHash;       // 游戏区域的哈希，在lockPiece()和消行时增量更新
+    bool gameOver;            // 游戏是否结束
+    ClearAnimation clearAnim; // 消除动画状态
+    GameState history[HISTORY_SIZE]; // 历史状态数组，用于实现撤销功能
+    int historyIndex;         // 当前历史状态索引，用于循环记录
+    uint32_t rng;             // 生成方块的xorshift随机数状态
+    uint64_t chain; // 状态哈希链，每个生效的操作后混入sessionHash()
+    int multiplier; // 分数倍数，消行得分乘以它
+} GameSession;
+
+GameSession session; // 窗口模式和无窗口对局使用的对局
+
+// 运行指标：渲染线程、音频回调和服务器分片线程只用原子加法记录，
+// --metrics打开的端点在被抓取时才汇总成Prometheus文本格式
+#define METRIC_BUCKETS 12
+
+// 直方图的桶上界（秒），从0.5毫秒到1秒按2倍增长
+const double metricBounds[METRIC_BUCKETS] = {
+    0.0005, 0.001, 0.002, 0.004, 0.008, 0.016,
+    0.032,  0.064, 0.128, 0.256, 0.512, 1.024};
+
+typedef struct {
+    uint64_t buckets[METRIC_BUCKETS + 1]; // 每个桶自己的次数，最后一个为+Inf
+    uint64_t sumMicros;
+} MetricHistogram;
+
+typedef struct {
+    MetricHistogram frameTime;    // 相邻两次呈现画面的间隔
+    MetricHistogram inputLatency; // 按键事件到包含它的画面呈现
+    MetricHistogram saveTime;     // 保存进度和输入记录的耗时
+    MetricHistogram musicDsp;     // 每次音频回调中背景音乐变速的耗时
+    uint64_t frames;
+    uint64_t inputs;
+    uint64_t pieces;
+    uint64_t lines;
+    uint64_t fontHits;
+    uint64_t fontMisses;
+    uint64_t audioCallbacks;
+    uint64_t audioUnderruns;
+    uint64_t sfxPlayed;
+    uint64_t sfxStolen;  // 抢占了其他音效的声道
+    uint64_t sfxDropped; // 没有可抢占的声道而丢弃
+} Metrics;
+
+Metrics metrics = {0};
+
+static inline void metricAdd(uint64_t *counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+void metricObserve(MetricHistogram *h, double seconds) {
+    int b = 0;
+    while (b < METRIC_BUCKETS && seconds > metricBounds[b]) {
+        b++;
+    }
+    metricAdd(&h->buckets[b], 1);
+    metricAdd(&h->sumMicros, seconds > 0 ? (uint64_t)(seconds * 1e6) : 0);
+}
+
+// 从start（SDL_GetPerformanceCounter()）到现在的秒数
+static inline double metricSince(Uint64 start) {
+    return (double)(SDL_GetPerformanceCounter() - start) /
+           SDL_GetPerformanceFrequency();
+}
+
+// 界面用到的字体都是simhei.ttf，按字号缓存，不再每帧打开和关闭
+#define FONT_CACHE_SIZES 8
+
+SDL_RWops *assetOpen(const char *name); // 从资源包或散文件打开资源
+
+typedef struct {
+    int size;
+    TTF_Font *font;
+} FontCacheEntry;
+
+FontCacheEntry fontCache[FONT_CACHE_SIZES];
+
+TTF_Font *fontOpen(int size) {
+    for (int i = 0; i < FONT_CACHE_SIZES && fontCache[i].font; i++) {
+        if (fontCache[i].size == size) {
+            metricAdd(&metrics.fontHits, 1);
+            return fontCache[i].font;
+        }
+    }
+    metricAdd(&metrics.fontMisses, 1);
+    SDL_RWops *rw = assetOpen("simhei.ttf");
+    if (!rw) {
+        rw = assetOpen("arial.ttf"); // 没有中文字体时至少能显示英文和数字
+    }
+    TTF_Font *font = rw ? TTF_OpenFontRW(rw, 1, size) : NULL;
+    for (int i = 0; font && i < FONT_CACHE_SIZES; i++) {
+        if (!fontCache[i].font) {
+            fontCache[i].size = size;
+            fontCache[i].font = font;
+            return font;
+        }
+    }
+    return font; // 缓存已满时调用者得到的字体不会被释放，字号种类是固定的
+}
+
+void fontCacheFree() {
+    for (int i = 0; i < FONT_CACHE_SIZES; i++) {
+        if (fontCache[i].font) {
+            TTF_CloseFont(fontCache[i].font);
+        }
+    }
+    memset(fontCache, 0, sizeof(fontCache));
+}
+
+// Zobrist哈希：每个格子、当前方块类型、下一个方块类型各对应一个随机数，
+// 局面的哈希是所有占用格子和两个方块对应随机数的异或
+_Static_assert(ARENA_WIDTH <= 12, "zobristRow() only covers 12 columns");
+uint64_t zobristCells[ARENA_HEIGHT][ARENA_WIDTH];
+uint64_t zobristRowLow[ARENA_HEIGHT][64];  // 一行低6列所有组合的哈希
+uint64_t zobristRowHigh[ARENA_HEIGHT][64]; // 一行高6列所有组合的哈希
+uint64_t zobristCurrent[7];
+uint64_t zobristNext[7];
+
+// 64位整数混合函数（splitmix64的输出变换）
+static inline uint64_t mix64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// xorshift随机数，状态不能为0
+static inline uint32_t xorshift32(uint32_t *rng) {
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 17;
+    *rng ^= *rng << 5;
+    return *rng;
+}
+
+// 用xorshift随机数状态产生下一个方块类型
+static inline int randomPieceType(uint32_t *rng) {
+    return (int)(xorshift32(rng) % 7);
+}
+
+// 用固定的种子生成Zobrist随机数，保证每次运行的哈希相同
+void initZobrist() {
+    uint64_t state = 0x5eed5eed5eed5eedULL;
+    for (int i = 0; i < ARENA_HEIGHT; i++) {
+        for (int j = 0; j < ARENA_WIDTH; j++) {
+            state += 0x9e3779b97f4a7c15ULL;
+            zobristCells[i][j] = mix64(state);
+        }
+        for (int m = 0; m < 64; m++) {
+            zobristRowLow[i][m] = 0;
+            zobristRowHigh[i][m] = 0;
+            for (int j = 0; j < 6; j++) {
+                if (m & (1 << j)) {
+                    zobristRowLow[i][m] ^= zobristCells[i][j];
+                    zobristRowHigh[i][m] ^= zobristCells[i][j + 6];
+                }
+            }
+        }
+    }
+    for (int t = 0; t < 7; t++) {
+        state += 0x9e3779b97f4a7c15ULL;
+        zobristCurrent[t] = mix64(state);
+        state += 0x9e3779b97f4a7c15ULL;
+        zobristNext[t] = mix64(state);
+    }
+}
+
+// 第row行中mask所表示的格子的哈希
+static inline uint64_t zobristRow(int row, uint16_t mask) {
+    return zobristRowLow[row][mask & 63] ^ zobristRowHigh[row][(mask >> 6) & 63];
+}
+
+// 游戏区域第row行的占用位掩码
+uint16_t arenaRowMask(const GameSession *s, int row) {
+    uint16_t mask = 0;
+    for (int j = 0; j < ARENA_WIDTH; j++) {
+        if (s->arena[row][j]) {
+            mask |= 1 << j;
+        }
+    }
+    return mask;
+}
+
+// 重新计算整个游戏区域的哈希（只在加载存档和回退时使用）
+uint64_t computeArenaHash(const GameSession *s) {
+    uint64_t hash = 0;
+    for (int i = 0; i < ARENA_HEIGHT; i++) {
+        hash ^= zobristRow(i, arenaRowMask(s, i));
+    }
+    return hash;
+}
+
+// 完整局面（游戏区域+当前方块+下一个方块）的哈希
+uint64_t gameStateHash(const GameSession *s) {
+    return s->arenaHash ^ zobristCurrent[s->currentPiece.type] ^
+           zobristNext[s->nextPiece.type];
+}
 
-Tetromino currentPiece; // 当前下落的方块
-Tetromino nextPiece;    // 存储下一个方块
-uint8_t arena[ARENA_HEIGHT][ARENA_WIDTH];
+// 对局全部状态的哈希：在gameStateHash()之外加上当前方块的位置和形状、
+// 分数、待删除的行数和随机数状态。游戏区域部分由锁定和消行增量维护，
+// 其余字段只需几次位运算
+uint64_t sessionHash(const GameSession *s) {
+    uint64_t shape = 0;
+    for (int i = 0; i < 16; i++) {
+        shape |= (uint64_t)s->currentPiece.shape[i / 4][i % 4] << i;
+    }
+    uint64_t piece = shape << 48 | (uint64_t)(uint8_t)s->currentPiece.x << 40 |
+                     (uint64_t)(uint8_t)s->currentPiece.y << 32 | s->rng;
+    uint64_t progress = (uint64_t)(uint32_t)s->score << 32 |
+                        (uint32_t)s->clearAnim.isAnimating << 8 |
+                        (uint32_t)s->clearAnim.count << 1 | s->gameOver;
+    return gameStateHash(s) ^ mix64(piece) ^ mix64(~progress);
+}
 
 // 所有俄罗斯方块的形状
 const int tetrominoes[7][4][4] = {
@@ -69,8 +327,8 @@ const int tetrominoes[7][4][4] = {
     // L型
     {{0, 0, 0, 0}, {0, 0, 0, 1}, {0, 1, 1, 1}, {0, 0, 0, 0}}};
 
-// 检测方块是否发生碰撞
-bool checkCollision(Tetromino *piece) {
+// 检测方块是否与对局s的游戏区域发生碰撞
+bool checkCollision(const GameSession *s, const Tetromino *piece) {
     // 遍历方块的4x4矩阵
     for (int i = 0; i < 4; i++) {
         for (int j = 0; j < 4; j++) {
@@ -80,7 +338,7 @@ bool checkCollision(Tetromino *piece) {
 
                 // 检查是否超出边界或与已有方块碰撞
                 if (x < 0 || x >= ARENA_WIDTH || y >= ARENA_HEIGHT ||
-                    (y >= 0 && arena[y][x])) {
+                    (y >= 0 && s->arena[y][x])) {
                     return true; // 发生碰撞
                 }
             }
@@ -90,7 +348,6 @@ bool checkCollision(Tetromino *piece) {
 }
 
 // 游戏状态标志
-bool gameOver = false;         // 游戏是否结束
 bool isPaused = false;         // 游戏是否暂停
 bool inStartMenu = true;       // 是否在开始菜单界面
 bool inHelpMenu = false;       // 是否在帮助说明界面
@@ -98,18 +355,226 @@ bool inSettingsMenu = false;   // 在否在游戏设置界面
 bool inGameSelectMenu = false; // 是否在新游戏/加载游戏选择界面
 bool blindMode = false;        // 是否处于盲打模式
 
-bool lockPiece() {
+// 一次落子：放置前的棋盘和玩家选择的落点，每条记录可以单独分析
+typedef struct {
+    uint16_t rows[ARENA_HEIGHT]; // 放置前的棋盘
+    uint8_t type;                // 当前方块
+    uint8_t nextType;            // 下一个方块
+    uint8_t rotation;            // 玩家的落点
+    int8_t x, y;
+    uint8_t pad[3];
+} ReplayMove;
+
+_Static_assert(sizeof(ReplayMove) == 48, "replay files use 48-byte moves");
+
+typedef struct {
+    ReplayMove *moves;
+    int count;
+    int capacity;
+    int score; // 对局结束时的分数
+} Replay;
+
+#define REPLAY_FILE_MAGIC 0x4c505254 // 对局记录文件头"TRPL"
+
+Replay gameReplay = {0};     // 当前对局的记录
+bool gameAnalyzed = false;   // 本局结束后是否已经分析过
+
+void replayClear(Replay *r) {
+    r->count = 0;
+    r->score = 0;
+}
+
+void replayFree(Replay *r) {
+    free(r->moves);
+    memset(r, 0, sizeof(*r));
+}
+
+bool replayAppend(Replay *r, const ReplayMove *m) {
+    if (r->count == r->capacity) {
+        int capacity = r->capacity ? r->capacity * 2 : 256;
+        ReplayMove *moves = realloc(r->moves, capacity * sizeof(*moves));
+        if (!moves) {
+            return false;
+        }
+        r->moves = moves;
+        r->capacity = capacity;
+    }
+    r->moves[r->count++] = *m;
+    return true;
+}
+
+// 检查点保存的对局快照，从这里可以继续重新模拟而不必从种子开始。
+// 方块颜色和撤销历史不影响规则，不保存；分数倍数在输入记录的文件头里
+typedef struct {
+    uint64_t chain;              // 状态哈希链
+    uint32_t rng;
+    int32_t score, lines, pieces;
+    uint16_t rows[ARENA_HEIGHT]; // 每行的占用位掩码
+    uint16_t shape;              // 当前方块的形状，第i*4+j位对应shape[i][j]
+    int8_t x, y;                 // 当前方块的位置
+    uint8_t curType, nextType;
+    uint8_t clearing, clearCount; // 消除动画是否进行中、待删除的行数
+    uint8_t clearLines[4];
+    uint8_t gameOver, pad[3];
+} InputSnapshot;
+
+_Static_assert(sizeof(InputSnapshot) == 80, "checkpoint layout");
+
+void sessionSnapshot(const GameSession *s, InputSnapshot *snap) {
+    memset(snap, 0, sizeof(*snap));
+    snap->chain = s->chain;
+    snap->rng = s->rng;
+    snap->score = s->score;
+    snap->lines = s->lines;
+    snap->pieces = s->pieceCount;
+    for (int i = 0; i < ARENA_HEIGHT; i++) {
+        snap->rows[i] = arenaRowMask(s, i);
+    }
+    for (int i = 0; i < 16; i++) {
+        snap->shape |= (uint16_t)((s->currentPiece.shape[i / 4][i % 4] != 0)
+                                  << i);
+    }
+    snap->x = (int8_t)s->currentPiece.x;
+    snap->y = (int8_t)s->currentPiece.y;
+    snap->curType = (uint8_t)s->currentPiece.type;
+    snap->nextType = (uint8_t)s->nextPiece.type;
+    snap->clearing = s->clearAnim.isAnimating;
+    snap->clearCount = (uint8_t)s->clearAnim.count;
+    for (int i = 0; i < 4; i++) {
+        snap->clearLines[i] = (uint8_t)s->clearAnim.lines[i];
+    }
+    snap->gameOver = s->gameOver;
+}
+
+// 从快照恢复对局，恢复后的格子不记颜色，都当作I型方块
+void sessionRestore(GameSession *s, const InputSnapshot *snap,
+                    int multiplier) {
+    memset(s, 0, sizeof(*s));
+    for (int i = 0; i < ARENA_HEIGHT; i++) {
+        for (int j = 0; j < ARENA_WIDTH; j++) {
+            s->arena[i][j] = snap->rows[i] >> j & 1;
+        }
+    }
+    s->arenaHash = computeArenaHash(s);
+    for (int i = 0; i < 16; i++) {
+        s->currentPiece.shape[i / 4][i % 4] = snap->shape >> i & 1;
+    }
+    s->currentPiece.x = snap->x;
+    s->currentPiece.y = snap->y;
+    s->currentPiece.type = snap->curType % 7;
+    s->nextPiece.type = snap->nextType % 7;
+    memcpy(s->nextPiece.shape, tetrominoes[s->nextPiece.type],
+           sizeof(s->nextPiece.shape));
+    s->clearAnim.isAnimating = snap->clearing != 0;
+    s->clearAnim.visible = true;
+    s->clearAnim.count = snap->clearCount > 4 ? 4 : snap->clearCount;
+    for (int i = 0; i < 4; i++) {
+        s->clearAnim.lines[i] = snap->clearLines[i] % ARENA_HEIGHT;
+    }
+    s->score = snap->score;
+    s->lines = snap->lines;
+    s->pieceCount = snap->pieces;
+    s->gameOver = snap->gameOver != 0;
+    s->rng = snap->rng;
+    s->chain = snap->chain;
+    s->multiplier = multiplier;
+}
+
+// 对局的输入记录：种子加上按顺序执行的操作，提交成绩时附带，
+// 服务器从种子重新模拟一遍就能验证分数
+typedef struct {
+    uint8_t *inputs;
+    int count;
+    int capacity;
+    uint32_t seed;
+    int multiplier; // 对局使用的分数倍数
+    bool valid; // 从存档继续或回退过的对局无法从种子重新模拟
+    InputSnapshot *checkpoints; // 每INPUT_LOG_CHECKPOINT个操作记录一次快照
+    int checkpointCapacity;
+} InputLog;
+
+#define INPUT_LOG_MAGIC 0x504e4954 // 输入记录文件头"TINP"
+#define INPUT_LOG_HEADER 6          // 文件头的int32_t个数
+#define INPUT_LOG_CHECKPOINT 64     // 记录快照的间隔（操作数）
+
+InputLog gameInputs = {0}; // 当前对局的输入记录
+
+void inputLogStart(InputLog *log, uint32_t seed) {
+    log->count = 0;
+    log->seed = seed;
+    log->multiplier = scoreMultiplier;
+    log->valid = true;
+}
+
+// 追加一个操作，s是执行这个操作后的对局
+void inputLogAppend(InputLog *log, uint8_t input, const GameSession *s) {
+    if (!log->valid) {
+        return;
+    }
+    if (log->count == log->capacity) {
+        int capacity = log->capacity ? log->capacity * 2 : 4096;
+        uint8_t *inputs = realloc(log->inputs, capacity);
+        InputSnapshot *checkpoints =
+            inputs ? realloc(log->checkpoints,
+                             (capacity / INPUT_LOG_CHECKPOINT) *
+                                 sizeof(*checkpoints))
+                   : NULL;
+        if (inputs) {
+            log->inputs = inputs;
+        }
+        if (!checkpoints) {
+            log->valid = false;
+            return;
+        }
+        log->checkpoints = checkpoints;
+        log->capacity = capacity;
+    }
+    log->inputs[log->count++] = input;
+    if (log->count % INPUT_LOG_CHECKPOINT == 0) {
+        int k = log->count / INPUT_LOG_CHECKPOINT - 1;
+        sessionSnapshot(s, &log->checkpoints[k]);
+    }
+}
+
+// 保存输入记录，文件头为魔数、种子、操作数、声称的分数、分数倍数和检查点间隔，
+// 后面每个操作一个字节，最后是每个检查点的快照
+bool inputLogSave(const InputLog *log, int score, const char *path) {
+    if (!log->valid) {
+        return false;
+    }
+    Uint64 start = SDL_GetPerformanceCounter();
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    int32_t header[INPUT_LOG_HEADER] = {INPUT_LOG_MAGIC,  (int32_t)log->seed,
+                                        log->count,       score,
+                                        log->multiplier, INPUT_LOG_CHECKPOINT};
+    size_t checkpoints = log->count / INPUT_LOG_CHECKPOINT;
+    bool ok = fwrite(header, sizeof(header), 1, file) == 1 &&
+              fwrite(log->inputs, 1, log->count, file) == (size_t)log->count &&
+              fwrite(log->checkpoints, sizeof(InputSnapshot), checkpoints,
+                     file) == checkpoints;
+    ok = fclose(file) == 0 && ok;
+    metricObserve(&metrics.saveTime, metricSince(start));
+    return ok;
+}
+
+bool lockPiece(GameSession *s) {
     // 将当前方块锁定到游戏区域
     for (int i = 0; i < 4; i++) {
         for (int j = 0; j < 4; j++) {
-            if (currentPiece.shape[i][j]) {
-                int x = currentPiece.x + j;
-                int y = currentPiece.y + i;
+            if (s->currentPiece.shape[i][j]) {
+                int x = s->currentPiece.x + j;
+                int y = s->currentPiece.y + i;
 
                 // 检查方块是否在游戏区域内
                 if (x >= 0 && x < ARENA_WIDTH && y >= 0 && y < ARENA_HEIGHT) {
-                    arena[y][x] =
-                        currentPiece.type + 1; // 存储方块类型+1（0表示空）
+                    if (!s->arena[y][x]) {
+                        s->arenaHash ^= zobristCells[y][x]; // 增量更新哈希
+                    }
+                    s->arena[y][x] =
+                        s->currentPiece.type + 1; // 存储方块类型+1（0表示空）
                 }
             }
         }
@@ -118,78 +583,150 @@ bool lockPiece() {
     return false;
 }
 
-void undoLastMove() {
+void undoLastMove(GameSession *s) {
     // 计算要恢复的历史状态索引
-    int restoreIndex = (historyIndex - 1 + HISTORY_SIZE) % HISTORY_SIZE;
+    int restoreIndex = (s->historyIndex - 1 + HISTORY_SIZE) % HISTORY_SIZE;
 
     // 恢复游戏状态
-    memcpy(arena, history[restoreIndex].arena, sizeof(arena));
-    currentPiece = history[restoreIndex].currentPiece;
-    nextPiece = history[restoreIndex].nextPiece;
-    score = history[restoreIndex].score;
+    memcpy(s->arena, s->history[restoreIndex].arena, sizeof(s->arena));
+    s->arenaHash = computeArenaHash(s);
+    s->currentPiece = s->history[restoreIndex].currentPiece;
+    s->nextPiece = s->history[restoreIndex].nextPiece;
+    s->score = s->history[restoreIndex].score;
 
     // 更新历史索引
-    historyIndex = restoreIndex;
+    s->historyIndex = restoreIndex;
 }
 
-void newPiece() {
+void newPiece(GameSession *s) {
     // 保存当前游戏状态到历史记录
-    historyIndex = (historyIndex + 1) % HISTORY_SIZE;
-    memcpy(history[historyIndex].arena, arena, sizeof(arena));
-    history[historyIndex].currentPiece = currentPiece;
-    history[historyIndex].nextPiece = nextPiece;
-    history[historyIndex].score = score;
+    s->historyIndex = (s->historyIndex + 1) % HISTORY_SIZE;
+    memcpy(s->history[s->historyIndex].arena, s->arena, sizeof(s->arena));
+    s->history[s->historyIndex].currentPiece = s->currentPiece;
+    s->history[s->historyIndex].nextPiece = s->nextPiece;
+    s->history[s->historyIndex].score = s->score;
 
     // 如果游戏已经结束，直接返回
-    if (gameOver) {
+    if (s->gameOver) {
         return;
     }
 
     // 检查游戏场地最顶部一行是否有任何非空单元格
     for (int j = 0; j < ARENA_WIDTH; j++) {
-        if (arena[0][j]) {
-            gameOver = true;
+        if (s->arena[0][j]) {
+            s->gameOver = true;
             return;
         }
     }
 
     // 将下一个方块设为当前方块
-    currentPiece = nextPiece;
-    currentPiece.x = ARENA_WIDTH / 2 - 2; // 初始位置居中，-2是因为方块宽度为4
-    currentPiece.y = -2;
+    s->currentPiece = s->nextPiece;
+    s->currentPiece.x = ARENA_WIDTH / 2 - 2; // 初始位置居中，-2是因为方块宽度为4
+    s->currentPiece.y = -2;
 
     // 生成新的下一个方块
-    nextPiece.type = rand() % 7;
-    memcpy(nextPiece.shape, tetrominoes[nextPiece.type],
-           sizeof(nextPiece.shape));
+    s->nextPiece.type = randomPieceType(&s->rng);
+    memcpy(s->nextPiece.shape, tetrominoes[s->nextPiece.type],
+           sizeof(s->nextPiece.shape));
+    s->pieceCount++;
 }
 
-// 初始化游戏
-void initGame() {
+// 把游戏状态保存到存档文件，格式与loadSavedGame()对应
+bool saveGame(const GameSession *s, const char *path) {
+    Uint64 start = SDL_GetPerformanceCounter();
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    fwrite(s->arena, sizeof(s->arena), 1, file);                // 保存游戏区域
+    fwrite(&s->currentPiece, sizeof(s->currentPiece), 1, file); // 保存当前方块
+    fwrite(&s->nextPiece, sizeof(s->nextPiece), 1, file);       // 保存下一个方块
+    fwrite(&s->score, sizeof(s->score), 1, file);               // 保存分数
+    fclose(file);
+    metricObserve(&metrics.saveTime, metricSince(start));
+    return true;
+}
+
+// 从存档文件加载游戏状态，文件不存在时返回false
+bool loadSavedGame(GameSession *s, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    fread(s->arena, sizeof(s->arena), 1, file);                // 加载游戏区域
+    fread(&s->currentPiece, sizeof(s->currentPiece), 1, file); // 加载当前方块
+    fread(&s->nextPiece, sizeof(s->nextPiece), 1, file);       // 加载下一个方块
+    fread(&s->score, sizeof(s->score), 1, file);               // 加载分数
+    fclose(file);
+    s->arenaHash = computeArenaHash(s);
+    return true;
+}
+
+// 开始一局新游戏，seed为随机数种子，multiplier为这一局的分数倍数
+void resetGame(GameSession *s, unsigned int seed, int multiplier) {
     // 清空游戏区域
-    memset(arena, 0, sizeof(arena));
-    // 初始化随机数种子
-    srand(SDL_GetTicks());
+    memset(s->arena, 0, sizeof(s->arena));
+    s->arenaHash = 0;
+    memset(&s->clearAnim, 0, sizeof(s->clearAnim));
+    s->score = 0;
+    s->lines = 0;
+    s->pieceCount = 0;
+    s->multiplier = multiplier;
+    s->gameOver = false;
+    // 初始化随机数种子，xorshift的状态不能为0
+    s->rng = (uint32_t)mix64(seed) | 1;
+    // 随机生成第一个下一个方块
+    s->nextPiece.type = randomPieceType(&s->rng);
+    memcpy(s->nextPiece.shape, tetrominoes[s->nextPiece.type],
+           sizeof(s->nextPiece.shape));
+    // 生成第一个当前方块
+    newPiece(s);
+    s->chain = sessionHash(s);
+}
 
-    // 尝试加载保存的游戏进度
-    FILE *file = fopen("savegame.dat", "rb");
-    if (file) {
-        // 从文件加载游戏状态
-        fread(arena, sizeof(arena), 1, file); // 加载游戏区域
-        fread(&currentPiece, sizeof(currentPiece), 1, file); // 加载当前方块
-        fread(&nextPiece, sizeof(nextPiece), 1, file); // 加载下一个方块
-        fread(&score, sizeof(score), 1, file);         // 加载分数
-        fclose(file);
-    } else {
-        // 如果没有保存的进度，初始化新的游戏
-        // 随机生成第一个下一个方块
-        nextPiece.type = rand() % 7;
-        memcpy(nextPiece.shape, tetrominoes[nextPiece.type],
-               sizeof(nextPiece.shape));
+// 窗口模式和无窗口对局开始新的一局，同时清空对局记录
+void startGame(unsigned int seed) {
+    resetGame(&session, seed, scoreMultiplier);
+    replayClear(&gameReplay);
+    inputLogStart(&gameInputs, seed);
+    gameAnalyzed = false;
+}
+
+// 初始化游戏（窗口模式）
+void initGame() {
+    // 以当前时间为种子开始新的一局
+    startGame(SDL_GetTicks());
+    // 尝试加载保存的游戏进度，存档的局面无法从种子重新得到
+    if (loadSavedGame(&session, "savegame.dat")) {
+        gameInputs.valid = false;
+    }
+}
+
+// 尝试平移当前方块，成功返回true（键盘和AI共用的移动路径）
+bool movePiece(GameSession *s, int dx, int dy) {
+    Tetromino temp = s->currentPiece;
+    temp.x += dx;
+    temp.y += dy;
+    if (checkCollision(s, &temp)) {
+        return false;
+    }
+    s->currentPiece = temp;
+    return true;
+}
 
-        // 生成第一个当前方块
-        newPiece();
+// 尝试顺时针旋转当前方块，成功返回true
+bool rotatePiece(GameSession *s) {
+    Tetromino rotated = s->currentPiece;
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            rotated.shape[i][j] = s->currentPiece.shape[3 - j][i];
+        }
     }
+    if (checkCollision(s, &rotated)) {
+        return false;
+    }
+    s->currentPiece = rotated;
+    return true;
 }
 
 // 定义每种方块类型的颜色
@@ -234,31 +771,22 @@ void drawPiece(SDL_Renderer *renderer, Tetromino *piece, bool isPreview) {
     }
 }
 
-void drawPreview(SDL_Renderer *renderer, Tetromino *piece) {
-    // 创建临时方块用于预览
-    Tetromino preview = *piece;
-
-    // 模拟下落直到碰撞
-    while (!checkCollision(&preview)) {
-        preview.y++;
-    }
-    preview.y--; // 回退到最后有效位置
-
-    // 使用当前方块的填充颜色绘制轮廓
-    SDL_Color color = pieceColors[piece->type];
+// 绘制方块的轮廓，thickness为边框粗细（像素）
+void drawOutline(SDL_Renderer *renderer, const Tetromino *piece,
+                 SDL_Color color, int thickness) {
     int blockSize = 24; // 每个小方块的实际大小
     int gap = 6;        // 方块之间的间隔
 
     for (int i = 0; i < 4; i++) {
         for (int j = 0; j < 4; j++) {
-            if (preview.shape[i][j]) {
-                SDL_Rect rect = {(preview.x + j) * (blockSize + gap) + gap,
-                                 (preview.y + i) * (blockSize + gap) + gap,
+            if (piece->shape[i][j]) {
+                SDL_Rect rect = {(piece->x + j) * (blockSize + gap) + gap,
+                                 (piece->y + i) * (blockSize + gap) + gap,
                                  blockSize, blockSize};
-                // 绘制更粗的边框，使用当前方块的填充颜色，但透明度为0
-                SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, 0);
+                SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b,
+                                       color.a);
                 // 绘制多个偏移的矩形来创建更粗的边框
-                for (int offset = 0; offset < 3; offset++) {
+                for (int offset = 0; offset < thickness; offset++) {
                     SDL_Rect thickRect = {rect.x - offset, rect.y - offset,
                                           rect.w + offset * 2,
                                           rect.h + offset * 2};
@@ -269,43 +797,222 @@ void drawPreview(SDL_Renderer *renderer, Tetromino *piece) {
     }
 }
 
-Mix_Chunk *clearSound = NULL; // 消除音效
+void drawPreview(SDL_Renderer *renderer, Tetromino *piece) {
+    // 创建临时方块用于预览
+    Tetromino preview = *piece;
+
+    // 模拟下落直到碰撞
+    while (!checkCollision(&session, &preview)) {
+        preview.y++;
+    }
+    preview.y--; // 回退到最后有效位置
+
+    // 使用当前方块的填充颜色绘制更粗的轮廓，但透明度为0
+    SDL_Color color = pieceColors[piece->type];
+    color.a = 0;
+    drawOutline(renderer, &preview, color, 3);
+}
+
+// 音效在启动时全部解码成Mix_Chunk，播放时只占用一个声道。声道数固定，
+// 全部占用时抢占优先级不高于新音效的声道中最早开始的一个，
+// 否则丢弃新音效。找不到wav文件的音效用合成的短音代替
+enum {
+    SFX_MOVE,
+    SFX_ROTATE,
+    SFX_LOCK,
+    SFX_CLEAR,
+    SFX_TETRIS,
+    SFX_GAME_OVER,
+    SFX_COUNT
+};
+
+#define SFX_VOICES 8        // 音效使用的声道数
+#define SFX_RATE 44100      // 合成音效的采样率
+#define SFX_MAX_MS 800      // 合成音效的最长时长
+
+typedef struct {
+    const char *file; // 优先加载的wav文件
+    int priority;     // 越大越重要
+    float from, to;   // 合成时的起止频率（Hz）
+    int steps;        // 大于0时频率分这么多级跳变（琶音），否则连续滑动
+    int ms;           // 合成时长
+    float volume;     // 合成音量（0~1）
+    bool noise;       // 用噪声代替方波
+} SfxDef;
+
+const SfxDef sfxDefs[SFX_COUNT] = {
+    {"move.wav", 0, 1400, 1400, 0, 25, 0.12f, false},
+    {"rotate.wav", 1, 900, 1500, 0, 45, 0.15f, false},
+    {"lock.wav", 2, 180, 90, 0, 70, 0.35f, true},
+    {"clear.wav", 3, 660, 990, 2, 220, 0.3f, false},
+    {"tetris.wav", 4, 523, 1047, 4, 420, 0.35f, false},
+    {"gameover.wav", 5, 440, 110, 0, 750, 0.35f, false},
+};
+
+Mix_Chunk *sfxChunks[SFX_COUNT];
+
+// 每个声道正在播放的音效，-1表示没有分配过
+typedef struct {
+    int sfx;
+    Uint32 started;
+} SfxVoice;
+
+SfxVoice sfxVoices[SFX_VOICES];
+
+// 按定义合成一段16位单声道wav，写入wav（至少44 + SFX_RATE * SFX_MAX_MS / 1000 * 2字节），
+// 返回总字节数
+int sfxSynthesize(const SfxDef *d, uint8_t *wav) {
+    int samples = SFX_RATE / 1000 * (d->ms < SFX_MAX_MS ? d->ms : SFX_MAX_MS);
+    int16_t *pcm = (int16_t *)(wav + 44);
+    uint32_t noise = 0x12345678;
+    double phase = 0;
+    for (int i = 0; i < samples; i++) {
+        float t = (float)i / samples;
+        // 琶音按级跳变，频率按对数插值，听起来是均匀的音高变化
+        float pos = d->steps > 1 ? floorf(t * d->steps) / (d->steps - 1) : t;
+        double freq = d->from * pow(d->to / d->from, pos);
+        phase += freq / SFX_RATE;
+        phase -= floor(phase);
+        float value;
+        if (d->noise) {
+            noise ^= noise << 13;
+            noise ^= noise >> 17;
+            noise ^= noise << 5;
+            // 噪声乘上低频方波，得到有音高的撞击声
+            value = ((noise >> 16) / 32768.0f - 1) * (phase < 0.5 ? 1 : 0.4f);
+        } else {
+            value = phase < 0.5 ? 1 : -1;
+        }
+        // 5毫秒起音，之后线性衰减，避免爆音
+        float attack = i < SFX_RATE / 200 ? (float)i / (SFX_RATE / 200) : 1;
+        pcm[i] = (int16_t)(value * d->volume * attack * (1 - t) * 32767);
+    }
+    uint32_t dataBytes = samples * 2;
+    uint32_t header[11] = {0x46464952, 36 + dataBytes, 0x45564157, 0x20746d66,
+                           16, 1 | 1 << 16, SFX_RATE, SFX_RATE * 2, 2 | 16 << 16,
+                           0x61746164, dataBytes};
+    memcpy(wav, header, sizeof(header)); // "RIFF" "WAVE" "fmt " "data"，小端
+    return 44 + dataBytes;
+}
+
+// 加载或合成全部音效，Mix_LoadWAV_RW会把数据转换成设备的采样格式
+void sfxLoad() {
+    uint8_t *wav = malloc(44 + SFX_RATE / 1000 * SFX_MAX_MS * 2);
+    for (int e = 0; e < SFX_COUNT; e++) {
+        SDL_RWops *rw = assetOpen(sfxDefs[e].file);
+        sfxChunks[e] = rw ? Mix_LoadWAV_RW(rw, 1) : NULL;
+        if (!sfxChunks[e] && wav) {
+            int size = sfxSynthesize(&sfxDefs[e], wav);
+            sfxChunks[e] = Mix_LoadWAV_RW(SDL_RWFromConstMem(wav, size), 1);
+        }
+    }
+    free(wav);
+    Mix_AllocateChannels(SFX_VOICES);
+    for (int v = 0; v < SFX_VOICES; v++) {
+        sfxVoices[v].sfx = -1;
+    }
+}
+
+void sfxFree() {
+    Mix_HaltChannel(-1);
+    for (int e = 0; e < SFX_COUNT; e++) {
+        Mix_FreeChunk(sfxChunks[e]);
+        sfxChunks[e] = NULL;
+    }
+}
+
+// 播放一个音效。没有空闲声道时，在优先级不高于它的声道中抢占优先级最低、
+// 开始最早的一个
+void sfxPlay(int sfx) {
+    if (!sfxChunks[sfx]) {
+        return; // 无窗口模式或音频初始化失败
+    }
+    int voice = -1;
+    for (int v = 0; v < SFX_VOICES && voice < 0; v++) {
+        if (!Mix_Playing(v)) {
+            voice = v;
+        }
+    }
+    if (voice < 0) {
+        // 在优先级不高于新音效的声道中选优先级最低、开始最早的
+        int lowest = sfxDefs[sfx].priority;
+        for (int v = 0; v < SFX_VOICES; v++) {
+            const SfxVoice *c = &sfxVoices[v];
+            int priority = c->sfx >= 0 ? sfxDefs[c->sfx].priority : -1;
+            if (priority < lowest ||
+                (priority == lowest &&
+                 (voice < 0 || c->started < sfxVoices[voice].started))) {
+                voice = v;
+                lowest = priority;
+            }
+        }
+        if (voice < 0) {
+            metricAdd(&metrics.sfxDropped, 1);
+            return;
+        }
+        metricAdd(&metrics.sfxStolen, 1);
+    }
+    // 指定声道播放会先停止该声道上的音效
+    if (Mix_PlayChannel(voice, sfxChunks[sfx], 0) < 0) {
+        metricAdd(&metrics.sfxDropped, 1);
+        return;
+    }
+    sfxVoices[voice].sfx = sfx;
+    sfxVoices[voice].started = SDL_GetTicks();
+    metricAdd(&metrics.sfxPlayed, 1);
+}
+
+// 实际删除clearAnim中标记的行，并结束消除动画
+void removeClearedLines(GameSession *s) {
+    // 从下往上消除，避免影响上面的行号
+    for (int i = s->clearAnim.count - 1; i >= 0; i--) {
+        int line = s->clearAnim.lines[i];
+        // 只有被移动的行需要更新哈希：先去掉旧内容，移动后再加上新内容
+        for (int k = 0; k <= line; k++) {
+            s->arenaHash ^= zobristRow(k, arenaRowMask(s, k));
+        }
+        // 将当前行以上的所有行向下移动一行
+        for (int k = line; k > 0; k--) {
+            memcpy(s->arena[k], s->arena[k - 1], ARENA_WIDTH);
+        }
+        // 将最顶行清零
+        memset(s->arena[0], 0, ARENA_WIDTH);
+        for (int k = 1; k <= line; k++) {
+            s->arenaHash ^= zobristRow(k, arenaRowMask(s, k));
+        }
+    }
+    s->clearAnim.isAnimating = false;
+    s->clearAnim.count = 0;      // 重置消除行数
+    s->clearAnim.timer = 0;      // 重置计时器
+    s->clearAnim.visible = true; // 重置可见状态
+}
 
-void updateAnimation(float deltaTime) {
-    if (clearAnim.isAnimating) {
+// 推进消除动画，动画结束、应该删除满行时返回true
+bool updateAnimation(GameSession *s, float deltaTime) {
+    if (s->clearAnim.isAnimating) {
         // 更新计时器
-        clearAnim.timer += deltaTime;
+        s->clearAnim.timer += deltaTime;
 
         // 每0.1秒切换一次可见状态
-        if ((int)(clearAnim.timer * 10) % 2 == 0) {
-            clearAnim.visible = true;
+        if ((int)(s->clearAnim.timer * 10) % 2 == 0) {
+            s->clearAnim.visible = true;
         } else {
-            clearAnim.visible = false;
+            s->clearAnim.visible = false;
         }
 
-        // 动画持续0.5秒后结束
-        if (clearAnim.timer >= 0.5f) {
-            // 动画结束，实际消除所有标记的行
-            // 从下往上消除，避免影响上面的行号
-            for (int i = clearAnim.count - 1; i >= 0; i--) {
-                int line = clearAnim.lines[i];
-                // 将当前行以上的所有行向下移动一行
-                for (int k = line; k > 0; k--) {
-                    memcpy(arena[k], arena[k - 1], ARENA_WIDTH);
-                }
-                // 将最顶行清零
-                memset(arena[0], 0, ARENA_WIDTH);
-            }
-            clearAnim.isAnimating = false;
-            clearAnim.count = 0;      // 重置消除行数
-            clearAnim.timer = 0;      // 重置计时器
-            clearAnim.visible = true; // 重置可见状态
+        // 动画持续0.5秒后结束，由调用者删除标记的行
+        if (s->clearAnim.timer >= 0.5f) {
+            return true;
         }
     }
+    return false;
 }
 
-void clearLines() {
-    clearAnim.count = 0; // 重置消除行数
+// 一次消除0~4行的基础得分
+const int lineClearScores[5] = {0, 100, 300, 500, 800};
+
+void clearLines(GameSession *s) {
+    s->clearAnim.count = 0; // 重置消除行数
 
     // 第一步：检查有多少行需要消除
     // 从底部开始向上检查每一行
@@ -313,99 +1020,9665 @@ void clearLines() {
         bool full = true;
         // 检查当前行是否被完全填满
         for (int j = 0; j < ARENA_WIDTH; j++) {
-            if (!arena[i][j]) {
+            if (!s->arena[i][j]) {
                 full = false;
                 break;
             }
         }
         // 如果当前行被填满，记录行号
-        if (full && clearAnim.count < 4) {
-            clearAnim.lines[clearAnim.count++] = i;
+        if (full && s->clearAnim.count < 4) {
+            s->clearAnim.lines[s->clearAnim.count++] = i;
         }
     }
 
     // 如果有消除行
-    if (clearAnim.count > 0) {
-        // 第二步：播放消除音效
-        if (clearSound) {
-            Mix_PlayChannel(-1, clearSound, 0);
-        }
-
-        // 第三步：启动动画
-        clearAnim.timer = 0;
-        clearAnim.visible = true;
-        clearAnim.isAnimating = true;
-
-        // 第四步：根据消除的行数更新分数，并应用分数倍数
-        int baseScore = 0;
-        switch (clearAnim.count) {
-        case 1:
-            baseScore = 100;
-            break;
-        case 2:
-            baseScore = 300;
-            break;
-        case 3:
-            baseScore = 500;
-            break;
-        case 4:
-            baseScore = 800;
-            break;
+    if (s->clearAnim.count > 0) {
+        // 第二步：启动动画（音效由playerInput()按操作结果播放）
+        s->clearAnim.timer = 0;
+        s->clearAnim.visible = true;
+        s->clearAnim.isAnimating = true;
+
+        // 第三步：根据消除的行数更新分数，并应用分数倍数
+        s->score += lineClearScores[s->clearAnim.count] * s->multiplier;
+        s->lines += s->clearAnim.count;
+    }
+}
+
+// 一次操作。按键、AI、服务器的客户端都转换成操作，对局的输入记录也按操作保存，
+// 从同一个种子开始按顺序执行同样的操作一定得到同样的局面和分数
+enum {
+    GAME_INPUT_LEFT = 1,
+    GAME_INPUT_RIGHT,
+    GAME_INPUT_DOWN,    // 软降一格
+    GAME_INPUT_ROTATE,
+    GAME_INPUT_DROP,    // 硬降并立即锁定、消行（无窗口时没有消除动画）
+    GAME_INPUT_GRAVITY, // 自动下落一格，落地时锁定并开始消除动画
+    GAME_INPUT_CLEAR,   // 消除动画结束，删除满行
+};
+
+static bool applyRule(GameSession *s, uint8_t input) {
+    switch (input) {
+    case GAME_INPUT_LEFT:
+        return movePiece(s, -1, 0);
+    case GAME_INPUT_RIGHT:
+        return movePiece(s, 1, 0);
+    case GAME_INPUT_DOWN:
+        return movePiece(s, 0, 1);
+    case GAME_INPUT_ROTATE:
+        return rotatePiece(s);
+    case GAME_INPUT_DROP:
+        while (movePiece(s, 0, 1)) {
+        }
+        lockPiece(s);
+        clearLines(s);
+        removeClearedLines(s);
+        newPiece(s);
+        return true;
+    case GAME_INPUT_GRAVITY:
+        if (!movePiece(s, 0, 1)) {
+            lockPiece(s);
+            clearLines(s);
+            newPiece(s);
         }
-        score += baseScore * scoreMultiplier;
+        return true;
+    case GAME_INPUT_CLEAR:
+        if (!s->clearAnim.isAnimating) {
+            return false;
+        }
+        removeClearedLines(s);
+        return true;
     }
+    return false;
 }
 
-void drawNextPiece(SDL_Renderer *renderer) {
-    // 设置预览区域的位置和大小
-    int rightPanelWidth = WINDOW_WIDTH - ARENA_WIDTH * 30; // 右侧面板宽度
-    int blockSize = 20; // 预览方块的大小
-    int previewX =
-        ARENA_WIDTH * 30 + (rightPanelWidth - blockSize * 4) / 2; // 水平居中
-    int previewY = 100; // 在分数下方
+// 对对局s执行一次操作，返回操作是否改变了局面。生效的操作更新状态哈希链，
+// 之前任何一步的不同都会让之后的链值全部不同
+bool applyInput(GameSession *s, uint8_t input) {
+    if (!applyRule(s, input)) {
+        return false;
+    }
+    s->chain = mix64(s->chain ^ sessionHash(s));
+    return true;
+}
 
-    // 绘制"Next Piece"文字
-    TTF_Font *font = TTF_OpenFont("simhei.ttf", 30);
+// 按一次操作前后的局面变化播放音效，操作前游戏还没有结束
+void sfxForInput(uint8_t input, int pieces, int lines) {
+    if (session.gameOver) {
+        sfxPlay(SFX_GAME_OVER);
+    } else if (session.lines - lines >= 4) {
+        sfxPlay(SFX_TETRIS);
+    } else if (session.lines > lines) {
+        sfxPlay(SFX_CLEAR);
+    } else if (session.pieceCount != pieces) {
+        sfxPlay(SFX_LOCK);
+    } else if (input == GAME_INPUT_ROTATE) {
+        sfxPlay(SFX_ROTATE);
+    } else if (input == GAME_INPUT_LEFT || input == GAME_INPUT_RIGHT) {
+        sfxPlay(SFX_MOVE);
+    }
+}
 
-    if (font) {
-        SDL_Color textColor = {255, 255, 255, 255};
-        SDL_Surface *textSurface =
-            TTF_RenderUTF8_Solid(font, "下一个方块:", textColor);
-        if (textSurface) {
-            SDL_Texture *textTexture =
-                SDL_CreateTextureFromSurface(renderer, textSurface);
-            if (textTexture) {
-                SDL_Rect destRect = {previewX - 30, previewY - 30,
-                                     textSurface->w, textSurface->h};
-                SDL_RenderCopy(renderer, textTexture, NULL, &destRect);
-                SDL_DestroyTexture(textTexture);
-            }
-            SDL_FreeSurface(textSurface);
-        }
-        TTF_CloseFont(font);
+// 窗口模式和无窗口对局执行一次操作，生效的操作写入输入记录。
+// 游戏结束后不再执行操作，分数停在结束时
+bool playerInput(uint8_t input) {
+    int pieces = session.pieceCount, lines = session.lines;
+    if (session.gameOver || !applyInput(&session, input)) {
+        return false;
     }
+    sfxForInput(input, pieces, lines);
+    inputLogAppend(&gameInputs, input, &session);
+    metricAdd(&metrics.inputs, 1);
+    metricAdd(&metrics.pieces, session.pieceCount - pieces);
+    metricAdd(&metrics.lines, session.lines - lines);
+    return true;
+}
 
-    // 绘制下一个方块的预览
-    SDL_Color color = pieceColors[nextPiece.type];
-    for (int i = 0; i < 4; i++) {
-        for (int j = 0; j < 4; j++) {
-            if (nextPiece.shape[i][j]) {
-                SDL_Rect rect = {previewX + j * blockSize,
-                                 30 + previewY + i * blockSize, blockSize,
-                                 blockSize};
-                SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b,
-                                       color.a);
-                SDL_RenderFillRect(renderer, &rect);
+// ==================== AI自动玩家 ====================
 
-                // 绘制边框
-                SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-                SDL_RenderDrawRect(renderer, &rect);
+// AI搜索使用的位棋盘：每行一个位掩码，第j位表示第j列是否有方块
+typedef struct {
+    uint16_t rows[ARENA_HEIGHT];
+    uint64_t hash; // 占用格子的Zobrist哈希，与arenaHash的算法相同
+} BitBoard;
+
+#define FULL_ROW ((uint16_t)((1 << ARENA_WIDTH) - 1)) // 填满一行的位掩码
+#define BOT_MAX_PLACEMENTS 64 // 一个方块最多的落点数量（4种旋转 x 每行位置）
+
+// 方块类型0-6对应的字母，用于命令行和文本协议
+const char pieceLetters[7] = {'I', 'O', 'T', 'S', 'Z', 'J', 'L'};
+
+// 方块每种旋转状态的形状（按W键的旋转方式依次旋转得到）
+int pieceShapes[7][4][4][4];
+// 方块每种旋转状态下各行的位掩码，第j位表示4x4矩阵中的第j列
+uint16_t pieceMasks[7][4][4];
+// 每种旋转状态下有方块的最小/最大列号和行号
+int pieceMinCol[7][4], pieceMaxCol[7][4];
+int pieceMinRow[7][4], pieceMaxRow[7][4];
+// 每种旋转状态下4x4矩阵各列最低一格的行号，没有方块的列为-1
+int pieceColBottom[7][4][4];
+
+// 预先计算所有方块的旋转形状和位掩码
+void initPieceTables() {
+    for (int t = 0; t < 7; t++) {
+        memcpy(pieceShapes[t][0], tetrominoes[t], sizeof(pieceShapes[t][0]));
+        for (int r = 1; r < 4; r++) {
+            // 与rotatePiece()相同的旋转方式
+            for (int i = 0; i < 4; i++) {
+                for (int j = 0; j < 4; j++) {
+                    pieceShapes[t][r][i][j] = pieceShapes[t][r - 1][3 - j][i];
+                }
+            }
+        }
+
+        for (int r = 0; r < 4; r++) {
+            pieceMinCol[t][r] = 4;
+            pieceMaxCol[t][r] = -1;
+            pieceMinRow[t][r] = 4;
+            pieceMaxRow[t][r] = -1;
+            for (int j = 0; j < 4; j++) {
+                pieceColBottom[t][r][j] = -1;
+            }
+            for (int i = 0; i < 4; i++) {
+                pieceMasks[t][r][i] = 0;
+                for (int j = 0; j < 4; j++) {
+                    if (pieceShapes[t][r][i][j]) {
+                        pieceMasks[t][r][i] |= 1 << j;
+                        pieceColBottom[t][r][j] = i;
+                        if (j < pieceMinCol[t][r])
+                            pieceMinCol[t][r] = j;
+                        if (j > pieceMaxCol[t][r])
+                            pieceMaxCol[t][r] = j;
+                        if (i < pieceMinRow[t][r])
+                            pieceMinRow[t][r] = i;
+                        if (i > pieceMaxRow[t][r])
+                            pieceMaxRow[t][r] = i;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// 根据形状矩阵找出方块当前的旋转状态
+int pieceRotation(const Tetromino *piece) {
+    for (int r = 0; r < 4; r++) {
+        if (memcmp(piece->shape, pieceShapes[piece->type][r],
+                   sizeof(piece->shape)) == 0) {
+            return r;
+        }
+    }
+    return 0;
+}
+
+// 将游戏区域转换为位棋盘
+BitBoard boardFromArena(const GameSession *s) {
+    BitBoard board;
+    for (int i = 0; i < ARENA_HEIGHT; i++) {
+        board.rows[i] = arenaRowMask(s, i);
+    }
+    board.hash = s->arenaHash;
+    return board;
+}
+
+// 将方块第i行的位掩码平移到第x列
+static inline uint16_t shiftMask(uint16_t mask, int x) {
+    return x >= 0 ? (uint16_t)(mask << x) : (uint16_t)(mask >> -x);
+}
+
+// 位棋盘上的碰撞检测，规则与checkCollision()一致
+bool bitCollision(const BitBoard *board, int type, int rot, int x, int y) {
+    // 先检查左右边界
+    if (x + pieceMinCol[type][rot] < 0 ||
+        x + pieceMaxCol[type][rot] >= ARENA_WIDTH) {
+        return true;
+    }
+    for (int i = pieceMinRow[type][rot]; i <= pieceMaxRow[type][rot]; i++) {
+        int row = y + i;
+        if (row >= ARENA_HEIGHT) {
+            return true; // 超出底部
+        }
+        if (row >= 0 && (board->rows[row] & shiftMask(pieceMasks[type][rot][i], x))) {
+            return true; // 与已有方块重叠
+        }
+    }
+    return false;
+}
+
+// 从y开始让方块直接落到底，返回最终的y坐标
+int bitDrop(const BitBoard *board, int type, int rot, int x, int y) {
+    while (!bitCollision(board, type, rot, x, y + 1)) {
+        y++;
+    }
+    return y;
+}
+
+// 把方块锁定到位棋盘并消除满行，返回消除的行数
+// 与lockPiece()一致，游戏区域上方的部分会被丢弃
+int bitLock(BitBoard *board, int type, int rot, int x, int y) {
+    for (int i = pieceMinRow[type][rot]; i <= pieceMaxRow[type][rot]; i++) {
+        int row = y + i;
+        if (row >= 0 && row < ARENA_HEIGHT) {
+            uint16_t cells = shiftMask(pieceMasks[type][rot][i], x);
+            board->rows[row] |= cells;
+            board->hash ^= zobristRow(row, cells);
+        }
+    }
+
+    // 从下往上压缩，跳过所有满行，被移动的行同时更新哈希
+    int lines = 0;
+    int dst = ARENA_HEIGHT - 1;
+    for (int src = ARENA_HEIGHT - 1; src >= 0; src--) {
+        uint16_t row = board->rows[src];
+        if (row == FULL_ROW) {
+            board->hash ^= zobristRow(src, row);
+            lines++;
+        } else {
+            if (dst != src && row) {
+                board->hash ^= zobristRow(src, row) ^ zobristRow(dst, row);
+            }
+            board->rows[dst--] = row;
+        }
+    }
+    while (dst >= 0) {
+        board->rows[dst--] = 0;
+    }
+    return lines;
+}
+
+// 棋盘特征，全部为整数，标量和SIMD实现的结果完全一致
+typedef struct {
+    int heights[ARENA_WIDTH]; // 各列高度
+    int aggregate;            // 总高度
+    int holes;                // 空洞数量
+    int bumpiness;            // 相邻列高度差之和
+    int wells;                // 井深之和
+    int rowTransitions;       // 行内空/实变换次数（左右边界视为有方块）
+    int colTransitions;       // 列内空/实变换次数（底部视为有方块）
+} BoardFeatures;
+
+// 计算单个棋盘的特征
+void boardFeatures(const BitBoard *board, BoardFeatures *f) {
+    uint16_t seen = 0; // 上方已经出现过方块的列
+    uint16_t prev = 0; // 上一行，游戏区域上方视为空
+    memset(f, 0, sizeof(*f));
+
+    // 从上往下扫描，第一次出现方块的行决定列高，被盖住的空格就是空洞
+    for (int i = 0; i < ARENA_HEIGHT; i++) {
+        uint16_t row = board->rows[i];
+        uint16_t fresh = row & ~seen;
+        while (fresh) {
+            f->heights[__builtin_ctz(fresh)] = ARENA_HEIGHT - i;
+            fresh &= fresh - 1;
+        }
+        seen |= row;
+        f->holes += __builtin_popcount(seen & ~row);
+
+        // 行变换：在两侧加上边界位后统计相邻位不同的次数
+        unsigned ext = ((unsigned)row << 1) | 1u | (1u << (ARENA_WIDTH + 1));
+        f->rowTransitions +=
+            __builtin_popcount((ext ^ (ext >> 1)) & ((1u << (ARENA_WIDTH + 1)) - 1));
+        // 列变换：与上一行比较
+        f->colTransitions += __builtin_popcount(row ^ prev);
+        prev = row;
+    }
+    f->colTransitions += __builtin_popcount(~prev & FULL_ROW); // 底部边界
+
+    for (int j = 0; j < ARENA_WIDTH; j++) {
+        f->aggregate += f->heights[j];
+        if (j + 1 < ARENA_WIDTH) {
+            f->bumpiness += abs(f->heights[j] - f->heights[j + 1]);
+        }
+        // 两侧都比自己高的列形成井，边界视为无限高
+        int left = j > 0 ? f->heights[j - 1] : ARENA_HEIGHT;
+        int right = j + 1 < ARENA_WIDTH ? f->heights[j + 1] : ARENA_HEIGHT;
+        int depth = (left < right ? left : right) - f->heights[j];
+        if (depth > 0) {
+            f->wells += depth;
+        }
+    }
+}
+
+// 评估函数各项特征的权重（消行为奖励，其余为惩罚）
+typedef struct {
+    float height;         // 总高度
+    float holes;          // 空洞数量
+    float bumpiness;      // 相邻列高度差之和
+    float wells;          // 井深之和
+    float lines;          // 消除行数
+    float rowTransitions; // 行变换次数
+    float colTransitions; // 列变换次数
+} BotWeights;
+
+BotWeights botWeights = {0.51f, 0.36f, 0.18f, 0.10f, 0.76f, 0.0f, 0.0f};
+
+// AI搜索的统计数据
+typedef struct {
+    uint64_t evals;            // 已评估的棋盘数量
+    uint64_t pruned;           // 被剪枝的节点数量
+    uint64_t boundViolations;  // 实际值超过剪枝上界的节点数量，应为0
+    uint64_t ttProbes;         // 置换表查询次数
+    uint64_t ttHits;           // 置换表命中次数
+    uint64_t ttSlotCollisions; // 查询的位置被其他局面占用的次数
+    uint64_t ttKeyCollisions;  // 哈希相同但校验码不同（真正的哈希冲突）的次数
+    uint64_t ttStores;         // 写入置换表的次数
+    uint64_t rollouts;         // 蒙特卡洛树搜索的模拟次数
+    uint64_t treeNodes;        // 蒙特卡洛树搜索分配的节点数
+    uint64_t treeNodesPeak;    // 单棵搜索树的最大节点数
+} BotStats;
+
+// 每个线程各自统计，避免线程间争用
+static _Thread_local BotStats botStats;
+
+// 把b的统计数据加到a上
+void botStatsAdd(BotStats *a, const BotStats *b) {
+    a->evals += b->evals;
+    a->pruned += b->pruned;
+    a->boundViolations += b->boundViolations;
+    a->ttProbes += b->ttProbes;
+    a->ttHits += b->ttHits;
+    a->ttSlotCollisions += b->ttSlotCollisions;
+    a->ttKeyCollisions += b->ttKeyCollisions;
+    a->ttStores += b->ttStores;
+    a->rollouts += b->rollouts;
+    a->treeNodes += b->treeNodes;
+    if (b->treeNodesPeak > a->treeNodesPeak) {
+        a->treeNodesPeak = b->treeNodesPeak;
+    }
+}
+
+// 当前线程从before以来的统计数据（峰值取当前值）
+void botStatsDelta(BotStats *delta, const BotStats *before) {
+    delta->evals = botStats.evals - before->evals;
+    delta->pruned = botStats.pruned - before->pruned;
+    delta->boundViolations =
+        botStats.boundViolations - before->boundViolations;
+    delta->ttProbes = botStats.ttProbes - before->ttProbes;
+    delta->ttHits = botStats.ttHits - before->ttHits;
+    delta->ttSlotCollisions =
+        botStats.ttSlotCollisions - before->ttSlotCollisions;
+    delta->ttKeyCollisions = botStats.ttKeyCollisions - before->ttKeyCollisions;
+    delta->ttStores = botStats.ttStores - before->ttStores;
+    delta->rollouts = botStats.rollouts - before->rollouts;
+    delta->treeNodes = botStats.treeNodes - before->treeNodes;
+    delta->treeNodesPeak = botStats.treeNodesPeak;
+}
+
+// 由特征计算分数，分数越高越好
+static inline float botScore(int aggregate, int holes, int bumpiness,
+                             int wells, int rowTransitions, int colTransitions,
+                             int lines, const BotWeights *w) {
+    return w->lines * lines - w->height * aggregate - w->holes * holes -
+           w->bumpiness * bumpiness - w->wells * wells -
+           w->rowTransitions * rowTransitions -
+           w->colTransitions * colTransitions;
+}
+
+// 评估单个棋盘，分数越高越好
+float botEvaluate(const BitBoard *board, int lines, const BotWeights *w) {
+    BoardFeatures f;
+    boardFeatures(board, &f);
+    botStats.evals++;
+    return botScore(f.aggregate, f.holes, f.bumpiness, f.wells,
+                    f.rowTransitions, f.colTransitions, lines, w);
+}
+
+// ==================== 批量特征评估 ====================
+
+#define EVAL_BATCH_MAX 32 // 一次批量评估的最大棋盘数
+
+// 转置后的一批棋盘：rows[行][棋盘]，同一行的数据连续存放，便于SIMD按行加载
+typedef struct {
+    uint16_t rows[ARENA_HEIGHT][EVAL_BATCH_MAX];
+} BoardBatch;
+
+// 一批棋盘的特征，同样按特征连续存放
+typedef struct {
+    int16_t heights[ARENA_WIDTH][EVAL_BATCH_MAX];
+    int16_t aggregate[EVAL_BATCH_MAX];
+    int16_t holes[EVAL_BATCH_MAX];
+    int16_t bumpiness[EVAL_BATCH_MAX];
+    int16_t wells[EVAL_BATCH_MAX];
+    int16_t rowTransitions[EVAL_BATCH_MAX];
+    int16_t colTransitions[EVAL_BATCH_MAX];
+} BatchFeatures;
+
+// 批量评估内核：计算batch中前count个棋盘的特征
+// SIMD内核按向量宽度（最多16个棋盘）处理，count之后补齐的通道必须已初始化
+typedef void (*EvalBatchFunc)(const BoardBatch *batch, int count,
+                              BatchFeatures *out);
+
+// 标量实现，逐个棋盘调用boardFeatures()
+static void evalBatchScalar(const BoardBatch *batch, int count,
+                            BatchFeatures *out) {
+    for (int b = 0; b < count; b++) {
+        BitBoard board;
+        BoardFeatures f;
+        for (int i = 0; i < ARENA_HEIGHT; i++) {
+            board.rows[i] = batch->rows[i][b];
+        }
+        boardFeatures(&board, &f);
+        for (int j = 0; j < ARENA_WIDTH; j++) {
+            out->heights[j][b] = f.heights[j];
+        }
+        out->aggregate[b] = f.aggregate;
+        out->holes[b] = f.holes;
+        out->bumpiness[b] = f.bumpiness;
+        out->wells[b] = f.wells;
+        out->rowTransitions[b] = f.rowTransitions;
+        out->colTransitions[b] = f.colTransitions;
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_EVAL_AVX2 1
+
+// 16个16位通道各自的1的个数
+__attribute__((target("avx2"))) static inline __m256i
+popcount16AVX2(__m256i v) {
+    const __m256i lookup =
+        _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1,
+                         1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low4 = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v, low4);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low4);
+    __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                                    _mm256_shuffle_epi8(lookup, hi));
+    return _mm256_add_epi16(_mm256_and_si256(bytes, _mm256_set1_epi16(0xff)),
+                            _mm256_srli_epi16(bytes, 8));
+}
+
+// AVX2实现：每个16位通道对应一个棋盘，一次处理16个棋盘
+__attribute__((target("avx2"))) static void
+evalBatchAVX2(const BoardBatch *batch, int count, BatchFeatures *out) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi16(1);
+    const __m256i full = _mm256_set1_epi16(FULL_ROW);
+    const __m256i walls = _mm256_set1_epi16(1 | (1 << (ARENA_WIDTH + 1)));
+    const __m256i transMask = _mm256_set1_epi16((1 << (ARENA_WIDTH + 1)) - 1);
+    const __m256i top = _mm256_set1_epi16(ARENA_HEIGHT);
+
+    for (int base = 0; base < count; base += 16) {
+        __m256i seen = zero, prev = zero;
+        __m256i holes = zero, rowTrans = zero, colTrans = zero;
+        __m256i heights[ARENA_WIDTH];
+        for (int j = 0; j < ARENA_WIDTH; j++) {
+            heights[j] = zero;
+        }
+
+        for (int i = 0; i < ARENA_HEIGHT; i++) {
+            __m256i row =
+                _mm256_loadu_si256((const __m256i *)&batch->rows[i][base]);
+            seen = _mm256_or_si256(seen, row);
+            holes = _mm256_add_epi16(holes,
+                                     popcount16AVX2(_mm256_andnot_si256(row, seen)));
+
+            __m256i ext = _mm256_or_si256(_mm256_slli_epi16(row, 1), walls);
+            __m256i trans = _mm256_and_si256(
+                _mm256_xor_si256(ext, _mm256_srli_epi16(ext, 1)), transMask);
+            rowTrans = _mm256_add_epi16(rowTrans, popcount16AVX2(trans));
+            colTrans = _mm256_add_epi16(
+                colTrans, popcount16AVX2(_mm256_xor_si256(row, prev)));
+            prev = row;
+
+            // 列高等于该列从第一次出现方块起往下的行数
+            __m256i bits = seen;
+            for (int j = 0; j < ARENA_WIDTH; j++) {
+                heights[j] =
+                    _mm256_add_epi16(heights[j], _mm256_and_si256(bits, one));
+                bits = _mm256_srli_epi16(bits, 1);
+            }
+        }
+        colTrans = _mm256_add_epi16(
+            colTrans, popcount16AVX2(_mm256_andnot_si256(prev, full)));
+
+        __m256i aggregate = zero, bumpiness = zero, wells = zero;
+        for (int j = 0; j < ARENA_WIDTH; j++) {
+            aggregate = _mm256_add_epi16(aggregate, heights[j]);
+            if (j + 1 < ARENA_WIDTH) {
+                bumpiness = _mm256_add_epi16(
+                    bumpiness,
+                    _mm256_abs_epi16(_mm256_sub_epi16(heights[j], heights[j + 1])));
+            }
+            __m256i left = j > 0 ? heights[j - 1] : top;
+            __m256i right = j + 1 < ARENA_WIDTH ? heights[j + 1] : top;
+            __m256i depth =
+                _mm256_sub_epi16(_mm256_min_epi16(left, right), heights[j]);
+            wells = _mm256_add_epi16(wells, _mm256_max_epi16(depth, zero));
+            _mm256_storeu_si256((__m256i *)&out->heights[j][base], heights[j]);
+        }
+
+        _mm256_storeu_si256((__m256i *)&out->aggregate[base], aggregate);
+        _mm256_storeu_si256((__m256i *)&out->holes[base], holes);
+        _mm256_storeu_si256((__m256i *)&out->bumpiness[base], bumpiness);
+        _mm256_storeu_si256((__m256i *)&out->wells[base], wells);
+        _mm256_storeu_si256((__m256i *)&out->rowTransitions[base], rowTrans);
+        _mm256_storeu_si256((__m256i *)&out->colTransitions[base], colTrans);
+    }
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_EVAL_NEON 1
+
+// 8个16位通道各自的1的个数
+static inline uint16x8_t popcount16NEON(uint16x8_t v) {
+    return vpaddlq_u8(vcntq_u8(vreinterpretq_u8_u16(v)));
+}
+
+// NEON实现：每个16位通道对应一个棋盘，一次处理8个棋盘
+static void evalBatchNEON(const BoardBatch *batch, int count,
+                          BatchFeatures *out) {
+    const uint16x8_t zero = vdupq_n_u16(0);
+    const uint16x8_t one = vdupq_n_u16(1);
+    const uint16x8_t full = vdupq_n_u16(FULL_ROW);
+    const uint16x8_t walls = vdupq_n_u16(1 | (1 << (ARENA_WIDTH + 1)));
+    const uint16x8_t transMask = vdupq_n_u16((1 << (ARENA_WIDTH + 1)) - 1);
+    const int16x8_t top = vdupq_n_s16(ARENA_HEIGHT);
+
+    for (int base = 0; base < count; base += 8) {
+        uint16x8_t seen = zero, prev = zero;
+        uint16x8_t holes = zero, rowTrans = zero, colTrans = zero;
+        int16x8_t heights[ARENA_WIDTH];
+        for (int j = 0; j < ARENA_WIDTH; j++) {
+            heights[j] = vdupq_n_s16(0);
+        }
+
+        for (int i = 0; i < ARENA_HEIGHT; i++) {
+            uint16x8_t row = vld1q_u16(&batch->rows[i][base]);
+            seen = vorrq_u16(seen, row);
+            holes = vaddq_u16(holes, popcount16NEON(vbicq_u16(seen, row)));
+
+            uint16x8_t ext = vorrq_u16(vshlq_n_u16(row, 1), walls);
+            uint16x8_t trans =
+                vandq_u16(veorq_u16(ext, vshrq_n_u16(ext, 1)), transMask);
+            rowTrans = vaddq_u16(rowTrans, popcount16NEON(trans));
+            colTrans = vaddq_u16(colTrans, popcount16NEON(veorq_u16(row, prev)));
+            prev = row;
+
+            // 列高等于该列从第一次出现方块起往下的行数
+            uint16x8_t bits = seen;
+            for (int j = 0; j < ARENA_WIDTH; j++) {
+                heights[j] = vaddq_s16(
+                    heights[j], vreinterpretq_s16_u16(vandq_u16(bits, one)));
+                bits = vshrq_n_u16(bits, 1);
+            }
+        }
+        colTrans = vaddq_u16(colTrans, popcount16NEON(vbicq_u16(full, prev)));
+
+        int16x8_t aggregate = vdupq_n_s16(0), bumpiness = vdupq_n_s16(0);
+        int16x8_t wells = vdupq_n_s16(0);
+        for (int j = 0; j < ARENA_WIDTH; j++) {
+            aggregate = vaddq_s16(aggregate, heights[j]);
+            if (j + 1 < ARENA_WIDTH) {
+                bumpiness =
+                    vaddq_s16(bumpiness, vabdq_s16(heights[j], heights[j + 1]));
+            }
+            int16x8_t left = j > 0 ? heights[j - 1] : top;
+            int16x8_t right = j + 1 < ARENA_WIDTH ? heights[j + 1] : top;
+            int16x8_t depth = vsubq_s16(vminq_s16(left, right), heights[j]);
+            wells = vaddq_s16(wells, vmaxq_s16(depth, vdupq_n_s16(0)));
+            vst1q_s16(&out->heights[j][base], heights[j]);
+        }
+
+        vst1q_s16(&out->aggregate[base], aggregate);
+        vst1q_s16(&out->holes[base], vreinterpretq_s16_u16(holes));
+        vst1q_s16(&out->bumpiness[base], bumpiness);
+        vst1q_s16(&out->wells[base], wells);
+        vst1q_s16(&out->rowTransitions[base], vreinterpretq_s16_u16(rowTrans));
+        vst1q_s16(&out->colTransitions[base], vreinterpretq_s16_u16(colTrans));
+    }
+}
+#endif
+
+EvalBatchFunc evalBatch = evalBatchScalar; // 当前使用的批量评估内核
+const char *evalBatchName = "scalar";      // 当前内核的名称
+
+// 根据CPU特性选择批量评估内核
+void initEvalKernel() {
+#ifdef HAVE_EVAL_AVX2
+    if (SDL_HasAVX2()) {
+        evalBatch = evalBatchAVX2;
+        evalBatchName = "avx2";
+        return;
+    }
+#endif
+#ifdef HAVE_EVAL_NEON
+    if (SDL_HasNEON()) {
+        evalBatch = evalBatchNEON;
+        evalBatchName = "neon";
+        return;
+    }
+#endif
+    evalBatch = evalBatchScalar;
+    evalBatchName = "scalar";
+}
+
+// 把若干棋盘转置后交给批量内核评估，scores[i]为boards[i]的分数
+void botEvaluateBatch(const BitBoard *boards, const int *lines, int count,
+                      const BotWeights *w, float *scores) {
+    BoardBatch batch;
+    BatchFeatures f;
+    for (int base = 0; base < count; base += EVAL_BATCH_MAX) {
+        int n = count - base;
+        if (n > EVAL_BATCH_MAX) {
+            n = EVAL_BATCH_MAX;
+        }
+        int padded = (n + 15) & ~15; // 补齐到SIMD宽度，补齐部分填空棋盘
+        for (int i = 0; i < ARENA_HEIGHT; i++) {
+            for (int b = 0; b < n; b++) {
+                batch.rows[i][b] = boards[base + b].rows[i];
+            }
+            for (int b = n; b < padded; b++) {
+                batch.rows[i][b] = 0;
+            }
+        }
+        evalBatch(&batch, n, &f);
+        for (int b = 0; b < n; b++) {
+            scores[base + b] =
+                botScore(f.aggregate[b], f.holes[b], f.bumpiness[b], f.wells[b],
+                         f.rowTransitions[b], f.colTransitions[b],
+                         lines[base + b], w);
+        }
+    }
+    botStats.evals += count;
+}
+
+// 一个落点：目标旋转状态和最终位置
+typedef struct {
+    int rotation;
+    int x, y;
+} Placement;
+
+// 枚举方块从(x0, y0, rot0)出发能到达的所有落点
+// 路径与玩家操作一致：先原地旋转，再水平移动，最后下落
+int botEnumPlacements(const BitBoard *board, int type, int rot0, int x0, int y0,
+                      Placement *out) {
+    int count = 0;
+    for (int k = 0; k < 4; k++) {
+        int rot = (rot0 + k) % 4;
+        // 旋转被挡住时后面的旋转状态也无法到达
+        if (bitCollision(board, type, rot, x0, y0)) {
+            break;
+        }
+
+        // 向左移动到所有能到达的位置
+        for (int x = x0; !bitCollision(board, type, rot, x, y0); x--) {
+            out[count].rotation = rot;
+            out[count].x = x;
+            out[count].y = bitDrop(board, type, rot, x, y0);
+            count++;
+        }
+        // 向右移动到所有能到达的位置
+        for (int x = x0 + 1; !bitCollision(board, type, rot, x, y0); x++) {
+            out[count].rotation = rot;
+            out[count].x = x;
+            out[count].y = bitDrop(board, type, rot, x, y0);
+            count++;
+        }
+    }
+    return count;
+}
+
+// AI选出的一步操作
+typedef struct {
+    int rotations;         // 需要按旋转键的次数
+    int dx;                // 需要水平移动的格数（负数表示向左）
+    int rotation, x, y;    // 最终落点
+    float score;           // 搜索得到的评估分数
+} BotMove;
+
+// 束搜索中的一个候选节点
+typedef struct {
+    BitBoard board;  // 放下当前方块后的棋盘
+    int first;       // 对应的当前方块落点下标
+    int lines;       // 累计消除行数
+    float score;     // 第一层的评估分数
+} BotNode;
+
+#define BOT_MAX_BEAM 64        // 束宽上限
+#define BOT_DEAD_SCORE -1.0e9f // 导致游戏结束的落点的分数
+
+int botBeamWidth = 8; // 束搜索宽度：第一层保留多少个候选进入第二层
+
+// 展开一个节点：枚举方块的所有落点，锁定后批量评估
+// children/lines/scores/placements按落点一一对应，返回落点数量
+int botExpand(const BitBoard *board, int type, int rot0, int x0, int y0,
+              int baseLines, const BotWeights *w, BitBoard *children,
+              int *lines, float *scores, Placement *placements) {
+    int count = botEnumPlacements(board, type, rot0, x0, y0, placements);
+    for (int i = 0; i < count; i++) {
+        children[i] = *board;
+        lines[i] = baseLines + bitLock(&children[i], type,
+                                       placements[i].rotation,
+                                       placements[i].x, placements[i].y);
+    }
+    botEvaluateBatch(children, lines, count, w, scores);
+    // 顶行有方块时游戏结束
+    for (int i = 0; i < count; i++) {
+        if (children[i].rows[0]) {
+            scores[i] = BOT_DEAD_SCORE;
+        }
+    }
+    return count;
+}
+
+// ==================== 置换表 ====================
+
+#define TT_BITS 18              // 置换表大小为2^TT_BITS个条目
+#define TT_SIZE (1 << TT_BITS)
+
+// 置换表条目。写入时不加锁，check保存key ^ data，
+// 读取时如果两个字被不同线程写坏，key就对不上，当作未命中处理
+typedef struct {
+    uint64_t check;
+    uint64_t data; // 低32位为分数，之后依次为深度（8位）、校验码（16位）、代数（8位）
+} TTEntry;
+
+static TTEntry ttTable[TT_SIZE];
+static SDL_atomic_t ttGeneration; // 每次搜索加1，旧搜索留下的条目可以直接覆盖
+
+// 与Zobrist无关的16位校验码，用来发现两个不同棋盘哈希相同的情况
+static inline uint16_t ttVerify(const BitBoard *board, int lines) {
+    uint32_t h = 2166136261u ^ (uint32_t)lines;
+    for (int i = 0; i < ARENA_HEIGHT; i++) {
+        h = (h ^ board->rows[i]) * 16777619u;
+    }
+    return (uint16_t)(h ^ (h >> 16));
+}
+
+// 查询置换表，找到同一局面、同样深度的结果时返回true
+bool ttProbe(uint64_t key, uint16_t verify, int depth, float *value) {
+    TTEntry *e = &ttTable[key & (TT_SIZE - 1)];
+    uint64_t check = __atomic_load_n(&e->check, __ATOMIC_RELAXED);
+    uint64_t data = __atomic_load_n(&e->data, __ATOMIC_RELAXED);
+    botStats.ttProbes++;
+    if ((check ^ data) != key) {
+        if (data) {
+            botStats.ttSlotCollisions++;
+        }
+        return false;
+    }
+    if ((uint16_t)(data >> 40) != verify) {
+        botStats.ttKeyCollisions++;
+        return false;
+    }
+    if ((int)((data >> 32) & 0xff) != depth) {
+        return false;
+    }
+    uint32_t bits = (uint32_t)data;
+    memcpy(value, &bits, sizeof(*value));
+    botStats.ttHits++;
+    return true;
+}
+
+// 清空置换表，比较两次搜索时避免后一次直接用上前一次的结果
+void ttClear() {
+    memset(ttTable, 0, sizeof(ttTable));
+}
+
+// 写入置换表：位置上是本次搜索写入的更深的结果时保留原条目，否则覆盖
+void ttStore(uint64_t key, uint16_t verify, int depth, float value) {
+    TTEntry *e = &ttTable[key & (TT_SIZE - 1)];
+    uint64_t old = __atomic_load_n(&e->data, __ATOMIC_RELAXED);
+    uint8_t generation = (uint8_t)SDL_AtomicGet(&ttGeneration);
+    if (old && (uint8_t)(old >> 56) == generation &&
+        (int)((old >> 32) & 0xff) > depth) {
+        return;
+    }
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint64_t data = bits | ((uint64_t)(depth & 0xff) << 32) |
+                    ((uint64_t)verify << 40) | ((uint64_t)generation << 56);
+    __atomic_store_n(&e->data, data, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->check, key ^ data, __ATOMIC_RELAXED);
+    botStats.ttStores++;
+}
+
+// ==================== 多线程前瞻搜索 ====================
+
+#define BOT_MAX_THREADS 64 // 搜索线程数上限
+#define BOT_MAX_SAMPLES 32 // 未来方块采样序列数上限
+#define BOT_MAX_FUTURE 4   // 下一个方块之后最多再看几个方块
+
+// 搜索参数
+typedef struct {
+    const BotWeights *weights; // 评估权重
+    int beamWidth;             // 第一层保留的候选数量
+    int depth;                 // 前瞻深度：2表示当前+下一个，更大时采样未来方块
+    int samples;               // 未来方块的采样序列数
+    Uint32 budget;             // 搜索时间上限（毫秒），0表示不限
+    SDL_atomic_t *cancel;      // 外部取消标志，非零时尽快放弃搜索，可以为NULL
+} BotSearchConfig;
+
+// 一次搜索任务，根节点（当前方块的候选落点）就是分配给线程的工作单元
+typedef struct {
+    BotNode roots[BOT_MAX_BEAM]; // 第一层候选，按第一层分数从高到低排列
+    int rootCount;
+    int beamWidth;                // 每一层保留的候选数量
+    int nextType;                 // 下一个方块
+    int future[BOT_MAX_SAMPLES][BOT_MAX_FUTURE]; // 采样的未来方块序列
+    int samples;                  // 采样序列数
+    int futureDepth;              // 每个序列的长度
+    const BotWeights *weights;
+    bool prunable;                // 权重非负时才能使用上界剪枝
+    Uint32 deadline;              // 截止时间（SDL_GetTicks），0表示不限
+    SDL_atomic_t *cancel;         // 外部取消标志，可以为NULL
+
+    float values[BOT_MAX_BEAM];   // 每个根节点的搜索结果
+    SDL_atomic_t alpha;           // 已完成根节点的最好分数（保序编码的浮点数）
+    SDL_atomic_t aborted;         // 是否因超时而放弃
+    uint64_t ttSalt;              // 混入置换表键的搜索参数（采样种子、权重等）
+    BotStats workerStats[BOT_MAX_THREADS]; // 各工作线程的统计数据
+
+    // 工作窃取：每个线程有一段连续的根节点，做完后从其他线程的段中取
+    SDL_atomic_t next[BOT_MAX_THREADS];
+    int end[BOT_MAX_THREADS];
+    int workers;
+} SearchJob;
+
+// 浮点数与保序整数互相转换，使整数比较的结果与浮点数比较一致
+static inline int floatToOrdered(float f) {
+    int i;
+    memcpy(&i, &f, sizeof(i));
+    return i < 0 ? i ^ 0x7fffffff : i;
+}
+
+static inline float orderedToFloat(int i) {
+    float f;
+    i = i < 0 ? i ^ 0x7fffffff : i;
+    memcpy(&f, &i, sizeof(f));
+    return f;
+}
+
+// 无锁地把alpha提高到value
+static void atomicMaxFloat(SDL_atomic_t *a, float value) {
+    int v = floatToOrdered(value);
+    int old = SDL_AtomicGet(a);
+    while (v > old && !SDL_AtomicCAS(a, old, v)) {
+        old = SDL_AtomicGet(a);
+    }
+}
+
+// 棋盘在之后再放k个方块时能达到的分数上界，其余特征的惩罚都不小于0，只估计
+// 消行奖励和总高度：
+// 1. k个方块只有4k格，被消除的行的空格加起来不能超过4k，按空格从少到多
+//    选行，能选出的行数就是最多消除的行数maxLines
+// 2. 剩下的格数不少于cells+4k-ARENA_WIDTH*maxLines，每列高度不低于该列的格数
+// 3. 一列中原有的方块从上往下第j+1格保留下来时，上面j格所在的行都被消除了，
+//    它下面最多再消除maxLines-j行，所以这一列的高度不低于它的高度减去
+//    maxLines-j；对j取最小值。有空洞的列消行时可能降低不止一格，就是这里的j
+// 总高度取2和3中较大的下界
+float botUpperBound(const BitBoard *board, int lines, int k,
+                    const BotWeights *w) {
+    int cells = 0;
+    int rowsWithEmpty[ARENA_WIDTH + 1] = {0}; // 按空格数统计行数
+    for (int i = 0; i < ARENA_HEIGHT; i++) {
+        int filled = __builtin_popcount(board->rows[i]);
+        cells += filled;
+        rowsWithEmpty[ARENA_WIDTH - filled]++;
+    }
+    int maxLines = 0;
+    int budget = 4 * k;
+    for (int e = 1; e <= ARENA_WIDTH && budget >= e; e++) {
+        int n = rowsWithEmpty[e] < budget / e ? rowsWithEmpty[e] : budget / e;
+        maxLines += n;
+        budget -= n * e;
+    }
+
+    int minCells = cells + 4 * k - ARENA_WIDTH * maxLines;
+    int minHeight = 0;
+    for (int c = 0; c < ARENA_WIDTH; c++) {
+        int column = 0; // 这一列在j取各值时高度下界中的最小值
+        int j = 0;
+        for (int i = 0; i < ARENA_HEIGHT && j <= maxLines; i++) {
+            if (!(board->rows[i] >> c & 1)) {
+                continue;
+            }
+            int height = ARENA_HEIGHT - i - (maxLines - j);
+            height = height < 1 ? 1 : height;
+            column = j == 0 || height < column ? height : column;
+            j++;
+        }
+        if (j <= maxLines) {
+            column = 0; // 原有的方块可能全部被消除
+        }
+        minHeight += column;
+    }
+    if (minHeight < minCells) {
+        minHeight = minCells;
+    }
+    return w->lines * (lines + maxLines) - w->height * minHeight;
+}
+
+bool botPrune = true; // 允许上界剪枝，--check-prune用它与不剪枝的搜索比较
+
+// 沿一个采样序列贪心地放置未来方块，返回最终棋盘的分数
+static float botRollout(const SearchJob *job, const BitBoard *board, int lines,
+                        int sample) {
+    BitBoard current = *board;
+    float value = BOT_DEAD_SCORE;
+    for (int level = 0; level < job->futureDepth; level++) {
+        Placement placements[BOT_MAX_PLACEMENTS];
+        BitBoard children[BOT_MAX_PLACEMENTS];
+        int childLines[BOT_MAX_PLACEMENTS];
+        float scores[BOT_MAX_PLACEMENTS];
+        int count = botExpand(&current, job->future[sample][level], 0,
+                              ARENA_WIDTH / 2 - 2, -2, lines, job->weights,
+                              children, childLines, scores, placements);
+        int best = -1;
+        for (int i = 0; i < count; i++) {
+            if (best < 0 || scores[i] > scores[best]) {
+                best = i;
+            }
+        }
+        if (best < 0 || scores[best] <= BOT_DEAD_SCORE) {
+            return BOT_DEAD_SCORE;
+        }
+        current = children[best];
+        lines = childLines[best];
+        value = scores[best];
+    }
+    return value;
+}
+
+// 计算一个根节点的分数：下一个方块所有落点中最好的那个
+// 没有未来方块时落点分数就是评估分数，否则是各采样序列结果的平均值
+static float botRootValue(SearchJob *job, int r) {
+    const BotNode *root = &job->roots[r];
+    if (root->score <= BOT_DEAD_SCORE) {
+        return BOT_DEAD_SCORE;
+    }
+
+    Placement placements[BOT_MAX_PLACEMENTS];
+    BitBoard children[BOT_MAX_PLACEMENTS];
+    int lines[BOT_MAX_PLACEMENTS];
+    float scores[BOT_MAX_PLACEMENTS];
+    int count = botExpand(&root->board, job->nextType, 0, ARENA_WIDTH / 2 - 2,
+                          -2, root->lines, job->weights, children, lines,
+                          scores, placements);
+
+    float value = BOT_DEAD_SCORE;
+    if (job->futureDepth == 0) {
+        for (int i = 0; i < count; i++) {
+            if (scores[i] > value) {
+                value = scores[i];
+            }
+        }
+        atomicMaxFloat(&job->alpha, value);
+        return value;
+    }
+
+    // 下一个方块的落点同样只保留最好的beamWidth个做采样，分数相同时保留靠前的
+    int order[BOT_MAX_PLACEMENTS];
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        if (scores[i] <= BOT_DEAD_SCORE) {
+            continue;
+        }
+        if (kept == job->beamWidth && scores[i] <= scores[order[kept - 1]]) {
+            continue;
+        }
+        int pos = kept < job->beamWidth ? kept++ : kept - 1;
+        while (pos > 0 && scores[order[pos - 1]] < scores[i]) {
+            order[pos] = order[pos - 1];
+            pos--;
+        }
+        order[pos] = i;
+    }
+
+    for (int k = 0; k < kept; k++) {
+        int i = order[k];
+
+        // 同一个局面可能由不同的落点顺序得到，先查置换表
+        uint64_t key = children[i].hash ^ mix64(job->ttSalt + lines[i]);
+        uint16_t verify = ttVerify(&children[i], lines[i]);
+        float cached;
+        if (ttProbe(key, verify, job->futureDepth, &cached)) {
+            if (cached > value) {
+                value = cached;
+            }
+            continue;
+        }
+
+        // 上界不超过本节点已有的结果或其他根节点的最好结果时，这个落点不可能改变最终选择
+        float bound = INFINITY;
+        if (job->prunable) {
+            bound = botUpperBound(&children[i], lines[i], job->futureDepth,
+                                  job->weights);
+            float alpha = orderedToFloat(SDL_AtomicGet(&job->alpha));
+            if (bound < value || bound < alpha) {
+                botStats.pruned++;
+                continue;
+            }
+        }
+
+        float sum = 0;
+        for (int s = 0; s < job->samples; s++) {
+            sum += botRollout(job, &children[i], lines[i], s);
+        }
+        float mean = sum / job->samples;
+        // 上界低于实际值说明剪枝会丢掉更好的落点，容差只覆盖浮点舍入
+        if (mean > bound + 1e-4f * (1 + fabsf(bound))) {
+            botStats.boundViolations++;
+        }
+        ttStore(key, verify, job->futureDepth, mean);
+        if (mean > value) {
+            value = mean;
+        }
+
+        if ((job->deadline && SDL_GetTicks() >= job->deadline) ||
+            (job->cancel && SDL_AtomicGet(job->cancel))) {
+            SDL_AtomicSet(&job->aborted, 1);
+            return value;
+        }
+    }
+    atomicMaxFloat(&job->alpha, value);
+    return value;
+}
+
+// 取下一个根节点：先从自己的段中取，取完后从其他线程的段中窃取
+static int searchTakeTask(SearchJob *job, int self) {
+    for (int k = 0; k < job->workers; k++) {
+        int victim = (self + k) % job->workers;
+        if (SDL_AtomicGet(&job->next[victim]) >= job->end[victim]) {
+            continue;
+        }
+        int index = SDL_AtomicAdd(&job->next[victim], 1);
+        if (index < job->end[victim]) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+// 一个线程的搜索循环
+static void searchWork(SearchJob *job, int self) {
+    BotStats before = botStats;
+    int index;
+    while ((index = searchTakeTask(job, self)) >= 0) {
+        if (SDL_AtomicGet(&job->aborted)) {
+            continue; // 已超时，只把剩下的任务取完
+        }
+        job->values[index] = botRootValue(job, index);
+    }
+    // 记录本线程在这次任务中的统计数据
+    botStatsDelta(&job->workerStats[self], &before);
+}
+
+// 搜索线程池，主线程作为0号线程参与搜索
+typedef struct {
+    SDL_Thread *threads[BOT_MAX_THREADS];
+    SDL_sem *start[BOT_MAX_THREADS]; // 每个线程的开始信号
+    SDL_sem *finished;                // 线程完成一次任务的信号
+    int count;                        // 线程总数（包括主线程）
+    void (*task)(void *job, int self); // 当前任务，每个线程以自己的编号调用
+    void *job;
+    bool quit;                        // 通知线程退出
+} SearchPool;
+
+SearchPool searchPool = {0};
+int botThreads = 1; // 搜索线程数
+
+typedef struct {
+    SearchPool *pool;
+    int index;
+} SearchThreadArg;
+
+static int searchThreadMain(void *data) {
+    SearchThreadArg *arg = data;
+    SearchPool *pool = arg->pool;
+    int self = arg->index;
+    free(arg);
+    for (;;) {
+        SDL_SemWait(pool->start[self]);
+        if (pool->quit) {
+            break;
+        }
+        pool->task(pool->job, self);
+        SDL_SemPost(pool->finished);
+    }
+    return 0;
+}
+
+// 创建threads个线程的线程池（包括主线程）
+bool searchPoolInit(SearchPool *pool, int threads) {
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > BOT_MAX_THREADS) {
+        threads = BOT_MAX_THREADS;
+    }
+    memset(pool, 0, sizeof(*pool));
+    pool->count = 1;
+    pool->finished = SDL_CreateSemaphore(0);
+    if (!pool->finished) {
+        return false;
+    }
+    for (int i = 1; i < threads; i++) {
+        SearchThreadArg *arg = malloc(sizeof(*arg));
+        pool->start[i] = SDL_CreateSemaphore(0);
+        if (!arg || !pool->start[i]) {
+            free(arg);
+            break;
+        }
+        arg->pool = pool;
+        arg->index = i;
+        pool->threads[i] = SDL_CreateThread(searchThreadMain, "search", arg);
+        if (!pool->threads[i]) {
+            printf("Failed to create search thread! SDL_Error: %s\n",
+                   SDL_GetError());
+            free(arg);
+            SDL_DestroySemaphore(pool->start[i]);
+            pool->start[i] = NULL;
+            break;
+        }
+        pool->count++;
+    }
+    return true;
+}
+
+void searchPoolShutdown(SearchPool *pool) {
+    pool->quit = true;
+    for (int i = 1; i < pool->count; i++) {
+        SDL_SemPost(pool->start[i]);
+    }
+    for (int i = 1; i < pool->count; i++) {
+        SDL_WaitThread(pool->threads[i], NULL);
+        SDL_DestroySemaphore(pool->start[i]);
+    }
+    if (pool->finished) {
+        SDL_DestroySemaphore(pool->finished);
+    }
+    memset(pool, 0, sizeof(*pool));
+}
+
+// 用线程池的前workers个线程执行task，当前线程作为0号线程参与
+static void poolRun(SearchPool *pool, int workers, void (*task)(void *, int),
+                    void *job) {
+    if (workers == 1) {
+        task(job, 0);
+        return;
+    }
+    pool->task = task;
+    pool->job = job;
+    for (int t = 1; t < workers; t++) {
+        SDL_SemPost(pool->start[t]);
+    }
+    task(job, 0);
+    for (int t = 1; t < workers; t++) {
+        SDL_SemWait(pool->finished);
+    }
+}
+
+static void searchTask(void *job, int self) {
+    searchWork(job, self);
+}
+
+// 用线程池执行搜索任务，pool为NULL时在当前线程中执行
+static void searchRun(SearchPool *pool, SearchJob *job) {
+    int workers = pool && pool->count > 1 ? pool->count : 1;
+    if (workers > job->rootCount) {
+        workers = job->rootCount > 0 ? job->rootCount : 1;
+    }
+    job->workers = workers;
+    // 把根节点平均分成若干段
+    for (int t = 0; t < workers; t++) {
+        SDL_AtomicSet(&job->next[t], job->rootCount * t / workers);
+        job->end[t] = job->rootCount * (t + 1) / workers;
+    }
+    poolRun(pool, workers, searchTask, job);
+}
+
+// 搜索当前方块的最佳落点：第一层保留最好的beamWidth个候选，
+// 然后由线程池并行计算每个候选在下一个方块（以及采样的未来方块）之后的分数。
+// 剪枝只会跳过不可能被选中的节点，所以结果与线程数无关
+bool botSearch(const BitBoard *board, int curType, int curRot, int curX,
+               int curY, int nextType, const BotSearchConfig *cfg,
+               SearchPool *pool, BotMove *best) {
+    static _Thread_local SearchJob job;
+    Placement first[BOT_MAX_PLACEMENTS];
+    BitBoard children[BOT_MAX_PLACEMENTS];
+    int lines[BOT_MAX_PLACEMENTS];
+    float scores[BOT_MAX_PLACEMENTS];
+    const BotWeights *w = cfg->weights;
+    int firstCount = botExpand(board, curType, curRot, curX, curY, 0, w,
+                               children, lines, scores, first);
+    if (firstCount == 0) {
+        return false;
+    }
+    int beamWidth = cfg->beamWidth;
+    if (beamWidth < 1) {
+        beamWidth = 1;
+    }
+    if (beamWidth > BOT_MAX_BEAM) {
+        beamWidth = BOT_MAX_BEAM;
+    }
+
+    // 第一层：只保留当前方块最好的beamWidth个落点
+    BotNode *beam = job.roots;
+    int beamCount = 0;
+    for (int i = 0; i < firstCount; i++) {
+        // 插入排序，beam按分数从高到低排列
+        if (beamCount == beamWidth && scores[i] <= beam[beamCount - 1].score) {
+            continue;
+        }
+        int pos = beamCount < beamWidth ? beamCount++ : beamCount - 1;
+        while (pos > 0 && beam[pos - 1].score < scores[i]) {
+            beam[pos] = beam[pos - 1];
+            pos--;
+        }
+        beam[pos].board = children[i];
+        beam[pos].first = i;
+        beam[pos].lines = lines[i];
+        beam[pos].score = scores[i];
+    }
+
+    // 准备任务，所有根节点使用同一组采样序列，种子来自局面的Zobrist哈希，
+    // 同样的局面总是得到同样的采样序列
+    job.rootCount = beamCount;
+    job.beamWidth = beamWidth;
+    job.nextType = nextType;
+    job.weights = w;
+    job.futureDepth = cfg->depth - 2;
+    if (job.futureDepth < 0) {
+        job.futureDepth = 0;
+    }
+    if (job.futureDepth > BOT_MAX_FUTURE) {
+        job.futureDepth = BOT_MAX_FUTURE;
+    }
+    job.samples = cfg->samples < 1 ? 1 : cfg->samples;
+    if (job.samples > BOT_MAX_SAMPLES) {
+        job.samples = BOT_MAX_SAMPLES;
+    }
+    uint64_t seed = board->hash ^ zobristCurrent[curType] ^ zobristNext[nextType];
+    uint32_t rng = (uint32_t)mix64(seed);
+    for (int s = 0; s < job.samples; s++) {
+        for (int level = 0; level < job.futureDepth; level++) {
+            rng = rng * 1664525u + 1013904223u;
+            job.future[s][level] = (rng >> 16) % 7;
+        }
+    }
+    job.prunable = botPrune && w->height >= 0 && w->holes >= 0 &&
+                   w->bumpiness >= 0 &&
+                   w->wells >= 0 && w->lines >= 0 &&
+                   w->rowTransitions >= 0 && w->colTransitions >= 0;
+    job.deadline = cfg->budget ? SDL_GetTicks() + cfg->budget : 0;
+    job.cancel = cfg->cancel;
+    SDL_AtomicSet(&job.alpha, floatToOrdered(BOT_DEAD_SCORE));
+    SDL_AtomicSet(&job.aborted, 0);
+    // 节点的值取决于采样序列、权重和搜索参数，都混入置换表的键
+    uint32_t wbits[sizeof(BotWeights) / sizeof(uint32_t)];
+    memcpy(wbits, w, sizeof(wbits));
+    job.ttSalt = mix64(seed ^ ((uint64_t)job.futureDepth << 32) ^
+                       ((uint64_t)job.samples << 40) ^
+                       ((uint64_t)job.beamWidth << 48));
+    for (int k = 0; k < (int)(sizeof(wbits) / sizeof(wbits[0])); k++) {
+        job.ttSalt = mix64(job.ttSalt ^ wbits[k]);
+    }
+    SDL_AtomicAdd(&ttGeneration, 1);
+
+    searchRun(pool, &job);
+    // 工作线程的统计数据计入调用者（当前线程的部分已经在botStats里）
+    for (int t = 1; t < job.workers; t++) {
+        botStatsAdd(&botStats, &job.workerStats[t]);
+    }
+
+    // 超时时退回到只看下一个方块的结果
+    if (SDL_AtomicGet(&job.aborted) && job.futureDepth > 0) {
+        BotSearchConfig shallow = *cfg;
+        shallow.depth = 2;
+        shallow.budget = 0;
+        return botSearch(board, curType, curRot, curX, curY, nextType,
+                         &shallow, NULL, best);
+    }
+
+    // 按根节点顺序选出最好的，分数相同时取排在前面的
+    int bestIndex = 0;
+    for (int b = 1; b < beamCount; b++) {
+        if (job.values[b] > job.values[bestIndex]) {
+            bestIndex = b;
+        }
+    }
+
+    Placement *p = &first[beam[bestIndex].first];
+    best->rotation = p->rotation;
+    best->x = p->x;
+    best->y = p->y;
+    best->rotations = (p->rotation - curRot + 4) % 4;
+    best->dx = p->x - curX;
+    best->score = job.values[bestIndex];
+    return true;
+}
+
+// ==================== 蒙特卡洛树搜索 ====================
+
+#define MCTS_MAX_NODES 65536 // 每棵树的节点池大小
+#define MCTS_MAX_PATH 64     // 一次选择最多经过的节点数
+#define MCTS_CHANCE -1       // 机会节点：方块未知，7个子节点对应7种方块
+
+// 树中的一个节点，子节点在节点池中连续存放
+typedef struct {
+    BitBoard board;  // 到达本节点时的棋盘
+    int firstChild;  // 第一个子节点的下标，-1表示还没有展开
+    int childCount;
+    int visits;      // 访问次数
+    float total;     // 累计回报
+    int lines;       // 从根节点到本节点累计消除的行数
+    int8_t type;     // 本节点要放置的方块，MCTS_CHANCE表示机会节点
+    bool dead;       // 游戏已结束，或所有落点都会导致游戏结束
+} MctsNode;
+
+// 一棵搜索树，节点池在第一次使用时分配，之后每步搜索都复用
+typedef struct {
+    MctsNode *nodes;
+    int used;
+    float minValue, maxValue; // 已见回报的范围，用于把回报归一化到[0,1]
+    uint32_t rng;
+} MctsTree;
+
+// 根并行：线程池的每个线程各自搜索一棵独立的树，最后合并根节点的访问次数。
+// 树由调用者提供，同时搜索的调用者（如提示线程）各用一组
+MctsTree mctsTrees[BOT_MAX_THREADS];
+
+int mctsRollouts = 2000;      // 每步的模拟次数（所有线程合计）
+int mctsRolloutDepth = 2;     // 每次模拟随机放置的方块数
+float mctsExploration = 0.7f; // UCT探索系数
+bool botUseMcts = false;      // AI使用蒙特卡洛树搜索代替束搜索
+
+// 一次搜索任务
+typedef struct {
+    BitBoard board;
+    int curType, curRot, curX, curY; // 当前方块及其位置
+    int nextType;                    // 预览中的下一个方块
+    const BotWeights *weights;
+    int iterations;   // 每棵树的模拟次数
+    int rolloutDepth;
+    Uint32 deadline;  // 截止时间（SDL_GetTicks），0表示不限
+    uint64_t seed;
+    MctsTree *trees;  // 调用者的树，每个工作线程一棵
+    int rootCount;    // 当前方块的落点数
+    int visits[BOT_MAX_THREADS][BOT_MAX_PLACEMENTS]; // 各树根节点子节点的访问次数
+    float totals[BOT_MAX_THREADS][BOT_MAX_PLACEMENTS]; // 各树根节点子节点的累计回报
+    BotStats workerStats[BOT_MAX_THREADS];
+} MctsJob;
+
+static inline uint32_t mctsRandom(MctsTree *tree) {
+    tree->rng ^= tree->rng << 13;
+    tree->rng ^= tree->rng >> 17;
+    tree->rng ^= tree->rng << 5;
+    return tree->rng;
+}
+
+static void mctsSeeValue(MctsTree *tree, float value) {
+    if (value < tree->minValue) {
+        tree->minValue = value;
+    }
+    if (value > tree->maxValue) {
+        tree->maxValue = value;
+    }
+}
+
+// 展开节点：决策节点的子节点是所有落点，先用评估分数作为一次虚拟访问；
+// 机会节点的子节点是7种方块。节点池不够时返回false
+static bool mctsExpand(MctsTree *tree, int n, const MctsJob *job) {
+    MctsNode *node = &tree->nodes[n];
+    if (node->type == MCTS_CHANCE) {
+        if (tree->used + 7 > MCTS_MAX_NODES) {
+            return false;
+        }
+        node->firstChild = tree->used;
+        node->childCount = 7;
+        for (int t = 0; t < 7; t++) {
+            MctsNode *child = &tree->nodes[tree->used++];
+            child->board = node->board;
+            child->firstChild = -1;
+            child->childCount = 0;
+            child->visits = 0;
+            child->total = 0;
+            child->lines = node->lines;
+            child->type = t;
+            child->dead = false;
+        }
+        return true;
+    }
+
+    Placement placements[BOT_MAX_PLACEMENTS];
+    BitBoard children[BOT_MAX_PLACEMENTS];
+    int lines[BOT_MAX_PLACEMENTS];
+    float scores[BOT_MAX_PLACEMENTS];
+    int count;
+    // 只有根节点的方块在当前位置，其余方块从出生位置开始
+    if (n == 0) {
+        count = botExpand(&node->board, node->type, job->curRot, job->curX,
+                          job->curY, node->lines, job->weights, children,
+                          lines, scores, placements);
+    } else {
+        count = botExpand(&node->board, node->type, 0, ARENA_WIDTH / 2 - 2, -2,
+                          node->lines, job->weights, children, lines, scores,
+                          placements);
+    }
+    if (tree->used + count > MCTS_MAX_NODES) {
+        return false;
+    }
+    // 根节点的子节点要放置预览中的下一个方块，更深的方块是随机的
+    int childType = n == 0 ? job->nextType : MCTS_CHANCE;
+    node->firstChild = tree->used;
+    node->childCount = count;
+    node->dead = true;
+    for (int i = 0; i < count; i++) {
+        MctsNode *child = &tree->nodes[tree->used++];
+        child->board = children[i];
+        child->firstChild = -1;
+        child->childCount = 0;
+        child->lines = lines[i];
+        child->type = (int8_t)childType;
+        child->dead = scores[i] <= BOT_DEAD_SCORE;
+        child->visits = 1;
+        child->total = child->dead ? 0 : scores[i];
+        if (!child->dead) {
+            node->dead = false;
+            mctsSeeValue(tree, scores[i]);
+        }
+    }
+    return true;
+}
+
+// 用UCT公式选择决策节点的子节点，所有子节点都导致游戏结束时返回-1
+static int mctsSelect(MctsTree *tree, int n) {
+    MctsNode *node = &tree->nodes[n];
+    float range = tree->maxValue - tree->minValue;
+    float logN = logf((float)node->visits + 1);
+    int best = -1;
+    float bestValue = 0;
+    for (int i = 0; i < node->childCount; i++) {
+        const MctsNode *child = &tree->nodes[node->firstChild + i];
+        if (child->dead) {
+            continue;
+        }
+        float q = range > 0
+                      ? (child->total / child->visits - tree->minValue) / range
+                      : 0.5f;
+        float u = q + mctsExploration * sqrtf(logN / child->visits);
+        if (best < 0 || u > bestValue) {
+            best = node->firstChild + i;
+            bestValue = u;
+        }
+    }
+    if (best < 0) {
+        node->dead = true;
+    }
+    return best;
+}
+
+// 从节点出发模拟：随机生成方块，每个方块贪心地放到评估分数最高的落点，
+// 返回最终棋盘的评估分数，游戏结束时返回BOT_DEAD_SCORE
+static float mctsSimulate(MctsTree *tree, const MctsNode *node,
+                          const MctsJob *job) {
+    if (node->dead) {
+        return BOT_DEAD_SCORE;
+    }
+    BitBoard current = node->board;
+    int lines = node->lines;
+    float value = BOT_DEAD_SCORE;
+    for (int k = 0; k < job->rolloutDepth; k++) {
+        int type = k == 0 && node->type != MCTS_CHANCE
+                       ? node->type
+                       : (int)(mctsRandom(tree) % 7);
+        Placement placements[BOT_MAX_PLACEMENTS];
+        BitBoard children[BOT_MAX_PLACEMENTS];
+        int childLines[BOT_MAX_PLACEMENTS];
+        float scores[BOT_MAX_PLACEMENTS];
+        int count = botExpand(&current, type, 0, ARENA_WIDTH / 2 - 2, -2, lines,
+                              job->weights, children, childLines, scores,
+                              placements);
+        int best = -1;
+        for (int i = 0; i < count; i++) {
+            if (best < 0 || scores[i] > scores[best]) {
+                best = i;
+            }
+        }
+        if (best < 0 || scores[best] <= BOT_DEAD_SCORE) {
+            return BOT_DEAD_SCORE;
+        }
+        current = children[best];
+        lines = childLines[best];
+        value = scores[best];
+    }
+    botStats.rollouts++;
+    return value;
+}
+
+// 一次迭代：选择、展开、模拟、回传
+static void mctsIterate(MctsTree *tree, const MctsJob *job) {
+    int path[MCTS_MAX_PATH];
+    int length = 0;
+    int n = 0;
+    path[length++] = n;
+    while (!tree->nodes[n].dead && length < MCTS_MAX_PATH) {
+        MctsNode *node = &tree->nodes[n];
+        bool expanded = false;
+        if (node->firstChild < 0) {
+            if (!mctsExpand(tree, n, job)) {
+                break; // 节点池已满，直接从这里模拟
+            }
+            expanded = true;
+        }
+        int next = node->type == MCTS_CHANCE
+                       ? node->firstChild + (int)(mctsRandom(tree) % 7)
+                       : mctsSelect(tree, n);
+        if (next < 0) {
+            break;
+        }
+        path[length++] = n = next;
+        // 决策节点刚展开时从选中的落点开始模拟
+        if (expanded && node->type != MCTS_CHANCE) {
+            break;
+        }
+    }
+
+    float value = mctsSimulate(tree, &tree->nodes[n], job);
+    // 导致游戏结束的回报记为已见的最差回报
+    if (value <= BOT_DEAD_SCORE) {
+        value = tree->minValue;
+    } else {
+        mctsSeeValue(tree, value);
+    }
+    for (int i = 0; i < length; i++) {
+        tree->nodes[path[i]].visits++;
+        tree->nodes[path[i]].total += value;
+    }
+}
+
+// 一个线程搜索自己的树
+static void mctsWork(void *data, int self) {
+    MctsJob *job = data;
+    MctsTree *tree = &job->trees[self];
+    BotStats before = botStats;
+    memset(job->visits[self], 0, sizeof(job->visits[self]));
+    memset(job->totals[self], 0, sizeof(job->totals[self]));
+    if (!tree->nodes) {
+        tree->nodes = malloc(sizeof(MctsNode) * MCTS_MAX_NODES);
+    }
+    if (tree->nodes) {
+        tree->used = 1;
+        tree->minValue = INFINITY;
+        tree->maxValue = -INFINITY;
+        tree->rng = (uint32_t)mix64(job->seed + self) | 1;
+        MctsNode *root = &tree->nodes[0];
+        root->board = job->board;
+        root->firstChild = -1;
+        root->childCount = 0;
+        root->visits = 0;
+        root->total = 0;
+        root->lines = 0;
+        root->type = (int8_t)job->curType;
+        root->dead = false;
+        for (int i = 0; i < job->iterations && !root->dead; i++) {
+            if (job->deadline && (i & 15) == 0 &&
+                SDL_GetTicks() >= job->deadline) {
+                break;
+            }
+            mctsIterate(tree, job);
+        }
+        for (int i = 0; i < root->childCount && i < job->rootCount; i++) {
+            const MctsNode *child = &tree->nodes[root->firstChild + i];
+            job->visits[self][i] = child->dead ? 0 : child->visits;
+            job->totals[self][i] = child->total;
+        }
+        botStats.treeNodes += tree->used;
+        if ((uint64_t)tree->used > botStats.treeNodesPeak) {
+            botStats.treeNodesPeak = tree->used;
+        }
+    }
+    botStatsDelta(&job->workerStats[self], &before);
+}
+
+// 用蒙特卡洛树搜索选择当前方块的落点：每个线程独立建一棵树，
+// 合并后选择访问次数最多的落点。budget为时间上限（毫秒），0表示只按次数。
+// trees至少有BOT_MAX_THREADS棵，节点池在第一次使用时分配并跨步复用
+bool mctsSearch(const BitBoard *board, int curType, int curRot, int curX,
+                int curY, int nextType, const BotWeights *w, Uint32 budget,
+                MctsTree *trees, SearchPool *pool, BotMove *best) {
+    static _Thread_local MctsJob job;
+    Placement first[BOT_MAX_PLACEMENTS];
+    job.rootCount = botEnumPlacements(board, curType, curRot, curX, curY, first);
+    if (job.rootCount == 0) {
+        return false;
+    }
+    int workers = pool && pool->count > 1 ? pool->count : 1;
+    job.board = *board;
+    job.curType = curType;
+    job.curRot = curRot;
+    job.curX = curX;
+    job.curY = curY;
+    job.nextType = nextType;
+    job.weights = w;
+    job.iterations = (mctsRollouts + workers - 1) / workers;
+    job.rolloutDepth = mctsRolloutDepth < 1 ? 1 : mctsRolloutDepth;
+    job.deadline = budget ? SDL_GetTicks() + budget : 0;
+    job.seed = board->hash ^ zobristCurrent[curType] ^ zobristNext[nextType];
+    job.trees = trees;
+    poolRun(pool, workers, mctsWork, &job);
+    for (int t = 1; t < workers; t++) {
+        botStatsAdd(&botStats, &job.workerStats[t]);
+    }
+
+    // 访问次数最多的落点，次数相同时取平均回报高的
+    int bestIndex = -1, bestVisits = 0;
+    float bestMean = 0;
+    for (int i = 0; i < job.rootCount; i++) {
+        int visits = 0;
+        float total = 0;
+        for (int t = 0; t < workers; t++) {
+            visits += job.visits[t][i];
+            total += job.totals[t][i];
+        }
+        float mean = visits ? total / visits : BOT_DEAD_SCORE;
+        if (bestIndex < 0 || visits > bestVisits ||
+            (visits == bestVisits && mean > bestMean)) {
+            bestIndex = i;
+            bestVisits = visits;
+            bestMean = mean;
+        }
+    }
+
+    Placement *p = &first[bestIndex];
+    best->rotation = p->rotation;
+    best->x = p->x;
+    best->y = p->y;
+    best->rotations = (p->rotation - curRot + 4) % 4;
+    best->dx = p->x - curX;
+    best->score = bestMean;
+    return true;
+}
+
+// 释放一组搜索树的节点池
+void mctsFreeTrees(MctsTree *trees) {
+    for (int t = 0; t < BOT_MAX_THREADS; t++) {
+        free(trees[t].nodes);
+        trees[t].nodes = NULL;
+    }
+}
+
+// ==================== 价值网络 ====================
+
+// 多层感知机：输入为12x20的占用情况、下一个方块和这一步消除的行数，
+// 两个隐藏层使用ReLU，输出一个分数。权重为int8，推理时整批计算。
+// 占用情况之外还有一个"阴影"平面（每列最高的方块及其下方的格子），
+// 这样列高和空洞都是输入的线性函数，小网络也能学好
+#define NN_INPUTS 512 // 2x240个格子 + 7种下一个方块 + 消除0~4行，补齐到32的倍数
+#define NN_HIDDEN1 64
+#define NN_HIDDEN2 32
+#define NN_CELLS (ARENA_WIDTH * ARENA_HEIGHT)
+#define NN_SHADOW_INPUT NN_CELLS
+#define NN_NEXT_INPUT (2 * NN_CELLS)
+#define NN_LINES_INPUT (NN_NEXT_INPUT + 7)
+_Static_assert(NN_LINES_INPUT + 5 <= NN_INPUTS, "NN_INPUTS too small");
+_Static_assert(NN_INPUTS % 32 == 0 && NN_HIDDEN1 % 32 == 0 &&
+                   NN_HIDDEN2 % 32 == 0,
+               "layer sizes must be multiples of the SIMD width");
+
+// 量化后的网络：浮点值 = 整数 * 比例。输入为0或1，隐藏层输出量化到0~127。
+// 权重按输出神经元各用一个比例，隐藏层输出的比例已经乘进下一层的权重
+typedef struct {
+    float w1Scale[NN_HIDDEN1];   // 第一层每个神经元的累加结果比例
+    float act1Scale[NN_HIDDEN1]; // 第一个隐藏层每个输出的量化比例
+    float w2Scale[NN_HIDDEN2];
+    float act2Scale[NN_HIDDEN2];
+    float w3Scale;
+    float b1[NN_HIDDEN1];
+    float b2[NN_HIDDEN2];
+    float b3;
+    int8_t w1[NN_HIDDEN1][NN_INPUTS]; // 每个神经元的权重连续存放
+    int8_t w2[NN_HIDDEN2][NN_HIDDEN1];
+    int8_t w3[NN_HIDDEN2];
+} ValueNet;
+
+#define NN_FILE_MAGIC 0x314e4e54 // 权重文件头"TNN1"
+
+ValueNet valueNet;        // AI使用的价值网络
+bool botUseNet = false;   // AI用价值网络选择落点
+
+// 从文件读取网络权重，文件头中的层大小必须与程序一致
+bool netLoad(const char *path, ValueNet *net) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    int32_t header[4];
+    bool ok = fread(header, sizeof(header), 1, file) == 1 &&
+              header[0] == NN_FILE_MAGIC && header[1] == NN_INPUTS &&
+              header[2] == NN_HIDDEN1 && header[3] == NN_HIDDEN2 &&
+              fread(net, sizeof(*net), 1, file) == 1;
+    fclose(file);
+    return ok;
+}
+
+bool netSave(const char *path, const ValueNet *net) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    int32_t header[4] = {NN_FILE_MAGIC, NN_INPUTS, NN_HIDDEN1, NN_HIDDEN2};
+    bool ok = fwrite(header, sizeof(header), 1, file) == 1 &&
+              fwrite(net, sizeof(*net), 1, file) == 1;
+    fclose(file);
+    return ok;
+}
+
+// 把放置后的棋盘编码为网络输入
+void netEncode(const BitBoard *board, int nextType, int lines, uint8_t *x) {
+    memset(x, 0, NN_INPUTS);
+    uint16_t shadow = 0;
+    for (int i = 0; i < ARENA_HEIGHT; i++) {
+        shadow |= board->rows[i];
+        for (int j = 0; j < ARENA_WIDTH; j++) {
+            x[i * ARENA_WIDTH + j] = (board->rows[i] >> j) & 1;
+            x[NN_SHADOW_INPUT + i * ARENA_WIDTH + j] = (shadow >> j) & 1;
+        }
+    }
+    x[NN_NEXT_INPUT + nextType] = 1;
+    x[NN_LINES_INPUT + (lines < 4 ? lines : 4)] = 1;
+}
+
+// 整数点积内核：对count个输入（每个length字节，相邻输入相隔stride字节）
+// 和outputs个神经元计算acc[b * outputs + j] = sum(x[b][i] * w[j][i])。
+// 输入必须在0~127之间，length必须是32的倍数
+typedef void (*NetDotFunc)(const uint8_t *x, int stride, int count,
+                           const int8_t *w, int length, int outputs,
+                           int32_t *acc);
+
+static void netDotScalar(const uint8_t *x, int stride, int count,
+                         const int8_t *w, int length, int outputs,
+                         int32_t *acc) {
+    for (int j = 0; j < outputs; j++) {
+        const int8_t *wj = w + j * length;
+        for (int b = 0; b < count; b++) {
+            const uint8_t *xb = x + b * stride;
+            int32_t sum = 0;
+            for (int i = 0; i < length; i++) {
+                sum += xb[i] * wj[i];
+            }
+            acc[b * outputs + j] = sum;
+        }
+    }
+}
+
+#ifdef HAVE_EVAL_AVX2
+// AVX2实现：maddubs一次做32个u8 x i8乘法，相邻两个乘积相加不会溢出int16
+__attribute__((target("avx2"))) static void
+netDotAVX2(const uint8_t *x, int stride, int count, const int8_t *w,
+           int length, int outputs, int32_t *acc) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    for (int j = 0; j < outputs; j++) {
+        const int8_t *wj = w + j * length;
+        for (int b = 0; b < count; b++) {
+            const uint8_t *xb = x + b * stride;
+            __m256i sum = _mm256_setzero_si256();
+            for (int i = 0; i < length; i += 32) {
+                __m256i xv = _mm256_loadu_si256((const __m256i *)(xb + i));
+                __m256i wv = _mm256_loadu_si256((const __m256i *)(wj + i));
+                sum = _mm256_add_epi32(
+                    sum, _mm256_madd_epi16(_mm256_maddubs_epi16(xv, wv), ones));
+            }
+            __m128i s = _mm_add_epi32(_mm256_castsi256_si128(sum),
+                                      _mm256_extracti128_si256(sum, 1));
+            s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+            s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+            acc[b * outputs + j] = _mm_cvtsi128_si32(s);
+        }
+    }
+}
+#endif
+
+#ifdef HAVE_EVAL_NEON
+// NEON实现：输入不超过127，可以当作有符号数做int8乘法
+static void netDotNEON(const uint8_t *x, int stride, int count,
+                       const int8_t *w, int length, int outputs,
+                       int32_t *acc) {
+    for (int j = 0; j < outputs; j++) {
+        const int8_t *wj = w + j * length;
+        for (int b = 0; b < count; b++) {
+            const int8_t *xb = (const int8_t *)(x + b * stride);
+            int32x4_t sum = vdupq_n_s32(0);
+            for (int i = 0; i < length; i += 16) {
+                int8x16_t xv = vld1q_s8(xb + i);
+                int8x16_t wv = vld1q_s8(wj + i);
+                sum = vpadalq_s16(sum,
+                                  vmull_s8(vget_low_s8(xv), vget_low_s8(wv)));
+                sum = vpadalq_s16(sum,
+                                  vmull_s8(vget_high_s8(xv), vget_high_s8(wv)));
+            }
+            acc[b * outputs + j] = vaddvq_s32(sum);
+        }
+    }
+}
+#endif
+
+NetDotFunc netDot = netDotScalar; // 当前使用的点积内核
+const char *netDotName = "scalar";
+
+// 根据CPU特性选择点积内核
+void initNetKernel() {
+#ifdef HAVE_EVAL_AVX2
+    if (SDL_HasAVX2()) {
+        netDot = netDotAVX2;
+        netDotName = "avx2";
+        return;
+    }
+#endif
+#ifdef HAVE_EVAL_NEON
+    if (SDL_HasNEON()) {
+        netDot = netDotNEON;
+        netDotName = "neon";
+        return;
+    }
+#endif
+    netDot = netDotScalar;
+    netDotName = "scalar";
+}
+
+// 把累加结果换算为浮点数，经过ReLU后重新量化到0~127
+static inline uint8_t netRequantize(int32_t acc, float scale, float bias,
+                                    float invActScale) {
+    float z = acc * scale + bias;
+    if (z <= 0) {
+        return 0;
+    }
+    int q = (int)(z * invActScale + 0.5f);
+    return (uint8_t)(q > 127 ? 127 : q);
+}
+
+#define NN_MAX_BATCH BOT_MAX_PLACEMENTS // 一次前向计算的最大棋盘数
+
+// 一次前向计算count个输入（count不超过NN_MAX_BATCH），out[b]为分数
+void netForward(const ValueNet *net, const uint8_t (*inputs)[NN_INPUTS],
+                int count, float *out) {
+    int32_t acc[NN_MAX_BATCH * NN_HIDDEN1];
+    uint8_t h1[NN_MAX_BATCH][NN_HIDDEN1];
+    uint8_t h2[NN_MAX_BATCH][NN_HIDDEN2];
+
+    netDot(inputs[0], NN_INPUTS, count, net->w1[0], NN_INPUTS, NN_HIDDEN1,
+           acc);
+    for (int b = 0; b < count; b++) {
+        for (int j = 0; j < NN_HIDDEN1; j++) {
+            h1[b][j] = netRequantize(acc[b * NN_HIDDEN1 + j], net->w1Scale[j],
+                                     net->b1[j], 1.0f / net->act1Scale[j]);
+        }
+    }
+
+    netDot(h1[0], NN_HIDDEN1, count, net->w2[0], NN_HIDDEN1, NN_HIDDEN2, acc);
+    for (int b = 0; b < count; b++) {
+        for (int k = 0; k < NN_HIDDEN2; k++) {
+            h2[b][k] = netRequantize(acc[b * NN_HIDDEN2 + k], net->w2Scale[k],
+                                     net->b2[k], 1.0f / net->act2Scale[k]);
+        }
+    }
+
+    netDot(h2[0], NN_HIDDEN2, count, net->w3, NN_HIDDEN2, 1, acc);
+    for (int b = 0; b < count; b++) {
+        out[b] = acc[b] * net->w3Scale + net->b3;
+    }
+    botStats.evals += count;
+}
+
+// 用价值网络选择当前方块的落点：所有落点放在一起做一次前向计算
+bool netSearch(const BitBoard *board, int curType, int curRot, int curX,
+               int curY, int nextType, const ValueNet *net, BotMove *best) {
+    Placement placements[BOT_MAX_PLACEMENTS];
+    BitBoard children[BOT_MAX_PLACEMENTS];
+    uint8_t inputs[BOT_MAX_PLACEMENTS][NN_INPUTS];
+    float values[BOT_MAX_PLACEMENTS];
+    int count =
+        botEnumPlacements(board, curType, curRot, curX, curY, placements);
+    if (count == 0) {
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        children[i] = *board;
+        int lines = bitLock(&children[i], curType, placements[i].rotation,
+                            placements[i].x, placements[i].y);
+        netEncode(&children[i], nextType, lines, inputs[i]);
+    }
+    netForward(net, inputs, count, values);
+
+    int bestIndex = 0;
+    for (int i = 0; i < count; i++) {
+        // 顶行有方块时游戏结束
+        if (children[i].rows[0]) {
+            values[i] = BOT_DEAD_SCORE;
+        }
+        if (values[i] > values[bestIndex]) {
+            bestIndex = i;
+        }
+    }
+    Placement *p = &placements[bestIndex];
+    best->rotation = p->rotation;
+    best->x = p->x;
+    best->y = p->y;
+    best->rotations = (p->rotation - curRot + 4) % 4;
+    best->dx = p->x - curX;
+    best->score = values[bestIndex];
+    return true;
+}
+
+// ==================== 外部AI接口 ====================
+// 外部进程中的AI有两种接入方式：
+// 1. 共享内存：请求（棋盘、当前方块、预览方块）和回复（落点）放在两个环形
+//    缓冲区里，双方只交换序号，不做任何序列化；等待时先自旋，再在序号上
+//    睡眠（Linux用futex，Windows用命名事件）
+// 2. 文本协议：游戏启动外部程序，每个请求是标准输入中的一行，回复是标准
+//    输出中的一行，适合脚本语言写的AI
+#define BRIDGE_MAGIC 0x54425231u // "TBR1"
+#define BRIDGE_VERSION 1
+#define BRIDGE_RING 8      // 环形缓冲区的槽数
+#define BRIDGE_QUEUE 6     // 请求中最多附带的预览方块数
+#define BRIDGE_SPIN 20000  // 睡眠前自旋检查的次数（只在多核时自旋）
+#define BRIDGE_GRACE 200   // 等待回复的时间在思考时间上限之外的余量（毫秒）
+#define BRIDGE_CONNECT 10000 // 等待外部AI连接共享内存的时间上限（毫秒）
+
+typedef struct {
+    uint32_t seq;                // 请求序号，从1开始
+    uint32_t budget;             // 思考时间上限（毫秒），0表示不限
+    int32_t score;               // 当前分数
+    uint16_t rows[ARENA_HEIGHT]; // 棋盘，每行一个位掩码，第j位表示第j列
+    int8_t type, rotation, x, y; // 当前方块的类型、旋转状态和位置
+    int8_t queueLength;          // 预览方块数
+    int8_t queue[BRIDGE_QUEUE];  // 预览方块的类型
+} BridgeRequest;
+
+typedef struct {
+    uint32_t seq;         // 对应的请求序号
+    int8_t rotation, x;   // 落点：目标旋转状态和列
+    int8_t resign;        // 非0表示认输
+} BridgeReply;
+
+// 一个方向的通知：head是已发布的序号（也是futex字），sleeping表示对方
+// 正在head上睡眠，发布时只有对方睡眠才需要系统调用
+// 每个通道独占一个缓存行，两个进程不会互相使对方的缓存行失效
+typedef struct {
+    _Alignas(64) uint32_t head;
+    uint32_t sleeping;
+} BridgeChannel;
+
+enum { BRIDGE_REQUEST, BRIDGE_REPLY, BRIDGE_READY, BRIDGE_CHANNELS };
+
+// 共享内存的布局，游戏和外部AI必须一致
+typedef struct {
+    uint32_t magic, version;
+    uint32_t shutdown;                        // 游戏退出，外部AI应断开
+    BridgeChannel channels[BRIDGE_CHANNELS];  // 请求、回复、外部AI已连接
+    BridgeRequest requests[BRIDGE_RING];      // 第seq个请求在seq%BRIDGE_RING
+    BridgeReply replies[BRIDGE_RING];         // 第seq个回复在seq%BRIDGE_RING
+} BridgeShared;
+
+typedef struct {
+    BridgeShared *shared; // 共享内存，为NULL时使用文本协议
+    bool owner;           // 共享内存由本进程创建，关闭时负责删除
+    bool spin;            // 多核时先自旋再睡眠
+    char name[64];        // 共享内存的系统名称
+    FILE *out;            // 文本协议：外部AI的标准输入
+    char line[1024];      // 文本协议：已读到但还没有处理的外部AI输出
+    int lineLength;
+    uint32_t seq;         // 本进程最后发布的序号
+#ifdef _WIN32
+    HANDLE in;            // 文本协议：外部AI的标准输出
+    HANDLE mapping;
+    HANDLE events[BRIDGE_CHANNELS]; // 每个通道一个自动重置的命名事件
+    HANDLE process;
+#else
+    int in;
+    pid_t process;
+#endif
+} BotBridge;
+
+typedef enum { BRIDGE_OK, BRIDGE_RESIGN, BRIDGE_ERROR } BridgeResult;
+
+BotBridge botBridge;       // 游戏使用的外部AI连接
+bool botUseBridge = false; // AI由外部进程控制
+
+static inline bool seqReached(uint32_t head, uint32_t target) {
+    return (int32_t)(head - target) >= 0;
+}
+
+static inline void bridgePause() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    _mm_pause();
+#endif
+}
+
+// 在通道上睡眠，直到head不再等于seen或超时（timeout为0表示不限）
+static void bridgeSleep(BotBridge *b, int c, uint32_t seen, Uint32 timeout) {
+#ifdef _WIN32
+    (void)seen;
+    WaitForSingleObject(b->events[c], timeout ? timeout : INFINITE);
+#elif defined(__linux__)
+    // 共享内存在两个进程之间，不能用FUTEX_PRIVATE_FLAG
+    struct timespec ts = {timeout / 1000, (long)(timeout % 1000) * 1000000};
+    syscall(SYS_futex, &b->shared->channels[c].head, FUTEX_WAIT, seen,
+            timeout ? &ts : NULL, NULL, 0);
+#else
+    (void)b;
+    (void)c;
+    (void)seen;
+    (void)timeout;
+    usleep(50);
+#endif
+}
+
+static void bridgeWake(BotBridge *b, int c) {
+#ifdef _WIN32
+    SetEvent(b->events[c]);
+#elif defined(__linux__)
+    syscall(SYS_futex, &b->shared->channels[c].head, FUTEX_WAKE, 1, NULL, NULL,
+            0);
+#else
+    (void)b;
+    (void)c;
+#endif
+}
+
+// 等待通道的序号达到target，超时返回false
+bool bridgeWait(BotBridge *b, int c, uint32_t target, Uint32 timeout) {
+    BridgeChannel *ch = &b->shared->channels[c];
+    for (int i = 0; b->spin && i < BRIDGE_SPIN; i++) {
+        if (seqReached(__atomic_load_n(&ch->head, __ATOMIC_ACQUIRE), target)) {
+            return true;
+        }
+        bridgePause();
+    }
+    Uint32 start = SDL_GetTicks();
+    for (;;) {
+        // 先声明要睡眠再检查序号，与bridgePublish()中先发布再检查
+        // sleeping的顺序配合，保证不会错过唤醒
+        __atomic_store_n(&ch->sleeping, 1, __ATOMIC_SEQ_CST);
+        uint32_t head = __atomic_load_n(&ch->head, __ATOMIC_SEQ_CST);
+        if (seqReached(head, target)) {
+            __atomic_store_n(&ch->sleeping, 0, __ATOMIC_RELAXED);
+            return true;
+        }
+        Uint32 waited = SDL_GetTicks() - start;
+        if (timeout && waited >= timeout) {
+            __atomic_store_n(&ch->sleeping, 0, __ATOMIC_RELAXED);
+            return false;
+        }
+        bridgeSleep(b, c, head, timeout ? timeout - waited : 0);
+    }
+}
+
+// 发布通道的新序号，对方在睡眠时唤醒它
+void bridgePublish(BotBridge *b, int c, uint32_t value) {
+    BridgeChannel *ch = &b->shared->channels[c];
+    __atomic_store_n(&ch->head, value, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ch->sleeping, __ATOMIC_SEQ_CST)) {
+        bridgeWake(b, c);
+    }
+}
+
+// 创建（游戏端）或打开（外部AI端）名为name的共享内存
+bool bridgeOpen(BotBridge *b, const char *name, bool create) {
+    memset(b, 0, sizeof(*b));
+    b->owner = create;
+    b->spin = SDL_GetCPUCount() > 1;
+    size_t size = sizeof(BridgeShared);
+    void *mem;
+#ifdef _WIN32
+    snprintf(b->name, sizeof(b->name), "Local\\tetris-%s", name);
+    b->mapping = create ? CreateFileMappingA(INVALID_HANDLE_VALUE, NULL,
+                                             PAGE_READWRITE, 0, (DWORD)size,
+                                             b->name)
+                        : OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, b->name);
+    if (!b->mapping) {
+        return false;
+    }
+    mem = MapViewOfFile(b->mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (!mem) {
+        CloseHandle(b->mapping);
+        return false;
+    }
+    for (int c = 0; c < BRIDGE_CHANNELS; c++) {
+        char event[80];
+        snprintf(event, sizeof(event), "%s-%d", b->name, c);
+        b->events[c] = CreateEventA(NULL, FALSE, FALSE, event);
+    }
+#else
+    snprintf(b->name, sizeof(b->name), "/tetris-%s", name);
+    int fd = shm_open(b->name, create ? O_CREAT | O_RDWR : O_RDWR, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    if (create && ftruncate(fd, (off_t)size) != 0) {
+        close(fd);
+        shm_unlink(b->name);
+        return false;
+    }
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        if (create) {
+            shm_unlink(b->name);
+        }
+        return false;
+    }
+#endif
+    b->shared = mem;
+    if (create) {
+        memset(b->shared, 0, size);
+        b->shared->version = BRIDGE_VERSION;
+        __atomic_store_n(&b->shared->magic, BRIDGE_MAGIC, __ATOMIC_RELEASE);
+    } else if (__atomic_load_n(&b->shared->magic, __ATOMIC_ACQUIRE) !=
+                   BRIDGE_MAGIC ||
+               b->shared->version != BRIDGE_VERSION) {
+        printf("Shared memory %s is not a bot bridge (version %u)\n", name,
+               b->shared->version);
+        return false;
+    }
+    return true;
+}
+
+// 启动外部程序，它的标准输入输出接到b->out和b->in。读取端不用stdio，
+// 以便在等待回复时检查超时
+bool bridgeSpawn(BotBridge *b, const char *command) {
+#ifdef _WIN32
+    SECURITY_ATTRIBUTES sa = {sizeof(sa), NULL, TRUE};
+    HANDLE childIn, toChild, fromChild, childOut;
+    if (!CreatePipe(&childIn, &toChild, &sa, 0)) {
+        return false;
+    }
+    if (!CreatePipe(&fromChild, &childOut, &sa, 0)) {
+        CloseHandle(childIn);
+        CloseHandle(toChild);
+        return false;
+    }
+    // 游戏端的管道句柄不能被子进程继承，否则子进程读不到EOF
+    SetHandleInformation(toChild, HANDLE_FLAG_INHERIT, 0);
+    SetHandleInformation(fromChild, HANDLE_FLAG_INHERIT, 0);
+    STARTUPINFOA si;
+    PROCESS_INFORMATION pi;
+    memset(&si, 0, sizeof(si));
+    si.cb = sizeof(si);
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdInput = childIn;
+    si.hStdOutput = childOut;
+    si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+    char line[1024];
+    snprintf(line, sizeof(line), "%s", command);
+    bool started = CreateProcessA(NULL, line, NULL, NULL, TRUE, 0, NULL, NULL,
+                                  &si, &pi);
+    CloseHandle(childIn);
+    CloseHandle(childOut);
+    if (!started) {
+        CloseHandle(toChild);
+        CloseHandle(fromChild);
+        return false;
+    }
+    CloseHandle(pi.hThread);
+    b->process = pi.hProcess;
+    b->out = _fdopen(_open_osfhandle((intptr_t)toChild, 0), "w");
+    b->in = fromChild;
+    return b->out != NULL;
+#else
+    int toChild[2], fromChild[2];
+    if (pipe(toChild) != 0) {
+        return false;
+    }
+    if (pipe(fromChild) != 0) {
+        close(toChild[0]);
+        close(toChild[1]);
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(toChild[0], 0);
+        dup2(fromChild[1], 1);
+        close(toChild[0]);
+        close(toChild[1]);
+        close(fromChild[0]);
+        close(fromChild[1]);
+        execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+        _exit(127);
+    }
+    close(toChild[0]);
+    close(fromChild[1]);
+    if (pid < 0) {
+        close(toChild[1]);
+        close(fromChild[0]);
+        return false;
+    }
+    // 外部程序退出后写管道不应该终止游戏
+    signal(SIGPIPE, SIG_IGN);
+    b->process = pid;
+    b->out = fdopen(toChild[1], "w");
+    b->in = fromChild[0];
+    return b->out != NULL;
+#endif
+}
+
+// 断开连接：通知外部AI退出，关闭管道并等待启动的外部程序结束
+void bridgeClose(BotBridge *b) {
+    if (b->shared && b->owner) {
+        __atomic_store_n(&b->shared->shutdown, 1, __ATOMIC_SEQ_CST);
+        bridgePublish(b, BRIDGE_REQUEST, ++b->seq);
+    }
+    if (b->out) {
+        fclose(b->out);
+    }
+#ifdef _WIN32
+    if (b->in) {
+        CloseHandle(b->in);
+    }
+    if (b->process) {
+        WaitForSingleObject(b->process, 2000);
+        CloseHandle(b->process);
+    }
+    if (b->shared) {
+        UnmapViewOfFile(b->shared);
+        CloseHandle(b->mapping);
+        for (int c = 0; c < BRIDGE_CHANNELS; c++) {
+            if (b->events[c]) {
+                CloseHandle(b->events[c]);
+            }
+        }
+    }
+#else
+    if (b->in > 0) {
+        close(b->in);
+    }
+    // 和Windows一样最多等2秒，没有响应的外部程序直接结束
+    for (int i = 0; b->process > 0 && i < 200; i++) {
+        if (waitpid(b->process, NULL, WNOHANG) != 0) {
+            b->process = 0;
+            break;
+        }
+        SDL_Delay(10);
+    }
+    if (b->process > 0) {
+        kill(b->process, SIGKILL);
+        waitpid(b->process, NULL, 0);
+    }
+    if (b->shared) {
+        munmap(b->shared, sizeof(BridgeShared));
+        if (b->owner) {
+            shm_unlink(b->name);
+        }
+    }
+#endif
+    memset(b, 0, sizeof(*b));
+}
+
+// 文本协议的请求行：
+//   move <seq> <方块> <旋转> <x> <y> <预览方块> <思考时间> <分数> <20行的十六进制位掩码>
+// 方块用字母IOTSZJL表示，没有预览方块时为"-"；回复行为"<seq> <旋转> <x>"或
+// "<seq> resign"
+static void bridgeWriteRequest(FILE *out, const BridgeRequest *r) {
+    char queue[BRIDGE_QUEUE + 1];
+    for (int i = 0; i < r->queueLength; i++) {
+        queue[i] = pieceLetters[r->queue[i]];
+    }
+    queue[r->queueLength] = '\0';
+    fprintf(out, "move %u %c %d %d %d %s %u %d", r->seq,
+            pieceLetters[r->type], r->rotation, r->x, r->y,
+            r->queueLength ? queue : "-", r->budget, r->score);
+    for (int i = 0; i < ARENA_HEIGHT; i++) {
+        fprintf(out, " %03x", r->rows[i]);
+    }
+    fputc('\n', out);
+    fflush(out);
+}
+
+static int pieceFromLetter(char c) {
+    const char *p = memchr(pieceLetters, c, 7);
+    return p ? (int)(p - pieceLetters) : -1;
+}
+
+// 解析文本协议的请求行，格式错误返回false
+static bool bridgeParseRequest(const char *line, BridgeRequest *r) {
+    char type, queue[32];
+    int rotation, x, y, n;
+    memset(r, 0, sizeof(*r));
+    if (sscanf(line, "move %u %c %d %d %d %31s %u %d%n", &r->seq, &type,
+               &rotation, &x, &y, queue, &r->budget, &r->score, &n) != 8) {
+        return false;
+    }
+    r->type = pieceFromLetter(type);
+    r->rotation = rotation;
+    r->x = x;
+    r->y = y;
+    if (r->type < 0 || rotation < 0 || rotation > 3) {
+        return false;
+    }
+    if (strcmp(queue, "-") != 0) {
+        for (int i = 0; queue[i] && i < BRIDGE_QUEUE; i++) {
+            if ((r->queue[i] = pieceFromLetter(queue[i])) < 0) {
+                return false;
+            }
+            r->queueLength++;
+        }
+    }
+    line += n;
+    for (int i = 0; i < ARENA_HEIGHT; i++) {
+        unsigned mask;
+        int used;
+        if (sscanf(line, "%x%n", &mask, &used) != 1 || mask > FULL_ROW) {
+            return false;
+        }
+        r->rows[i] = mask;
+        line += used;
+    }
+    return true;
+}
+
+// 从外部AI的标准输出读取一行到line（不含换行），从start起timeout毫秒内没有
+// 读到完整的一行或管道关闭时返回false，timeout为0表示不限。过长的行按缓冲区
+// 大小截断
+static bool bridgeReadLine(BotBridge *b, char *line, int size, Uint32 start,
+                           Uint32 timeout) {
+    for (;;) {
+        char *end = memchr(b->line, '\n', b->lineLength);
+        if (end || b->lineLength == (int)sizeof(b->line)) {
+            int length = end ? (int)(end - b->line) : b->lineLength;
+            int used = end ? length + 1 : length;
+            int copy = length < size - 1 ? length : size - 1;
+            memcpy(line, b->line, copy);
+            line[copy] = '\0';
+            b->lineLength -= used;
+            memmove(b->line, b->line + used, b->lineLength);
+            return true;
+        }
+        int wait = -1;
+        if (timeout) {
+            Uint32 waited = SDL_GetTicks() - start;
+            if (waited >= timeout) {
+                return false;
+            }
+            wait = (int)(timeout - waited);
+        }
+        int room = (int)sizeof(b->line) - b->lineLength;
+#ifdef _WIN32
+        // 匿名管道不支持重叠读取，先查询可读的字节数，避免ReadFile阻塞
+        DWORD available = 0;
+        if (!PeekNamedPipe(b->in, NULL, 0, NULL, &available, NULL)) {
+            return false; // 外部程序已退出
+        }
+        if (available == 0) {
+            Sleep(wait < 0 || wait > 1 ? 1 : (DWORD)wait);
+            continue;
+        }
+        DWORD got = 0;
+        if (!ReadFile(b->in, b->line + b->lineLength,
+                      available < (DWORD)room ? available : (DWORD)room, &got,
+                      NULL) ||
+            got == 0) {
+            return false;
+        }
+#else
+        struct pollfd pfd = {b->in, POLLIN, 0};
+        int ready = poll(&pfd, 1, wait);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            return false;
+        }
+        ssize_t got = read(b->in, b->line + b->lineLength, room);
+        if (got <= 0) {
+            return false;
+        }
+#endif
+        b->lineLength += (int)got;
+    }
+}
+
+// 发送一个请求并等待回复，timeout为0表示不限
+BridgeResult bridgeExchange(BotBridge *b, BridgeRequest *r, BridgeReply *reply,
+                            Uint32 timeout) {
+    r->seq = ++b->seq;
+    if (b->shared) {
+        b->shared->requests[r->seq % BRIDGE_RING] = *r;
+        bridgePublish(b, BRIDGE_REQUEST, r->seq);
+        // 超时的请求以后仍可能收到回复，按序号跳过
+        do {
+            if (!bridgeWait(b, BRIDGE_REPLY, r->seq, timeout)) {
+                return BRIDGE_ERROR;
+            }
+            *reply = b->shared->replies[r->seq % BRIDGE_RING];
+        } while (reply->seq != r->seq);
+    } else {
+        char line[256];
+        unsigned seq;
+        int rotation, x;
+        Uint32 start = SDL_GetTicks();
+        bridgeWriteRequest(b->out, r);
+        do {
+            if (!bridgeReadLine(b, line, sizeof(line), start, timeout)) {
+                return BRIDGE_ERROR;
+            }
+            // 不是回复的行（例如外部AI的调试输出）直接跳过
+            char word[8] = "";
+            if (sscanf(line, "%u %d %d", &seq, &rotation, &x) == 3) {
+                reply->resign = 0;
+            } else if (sscanf(line, "%u %7s", &seq, word) == 2 &&
+                       strcmp(word, "resign") == 0) {
+                reply->resign = 1;
+                rotation = x = 0;
+            } else {
+                seq = 0;
+            }
+        } while (seq != r->seq);
+        reply->seq = seq;
+        reply->rotation = rotation;
+        reply->x = x;
+    }
+    return reply->resign ? BRIDGE_RESIGN : BRIDGE_OK;
+}
+
+// 向外部AI请求当前方块的落点，回复的落点必须能按玩家的操作方式到达
+BridgeResult bridgePlan(BotBridge *b, const BitBoard *board, int curType,
+                        int curRot, int curX, int curY, int nextType,
+                        Uint32 budget, BotMove *move) {
+    BridgeRequest r;
+    BridgeReply reply;
+    memset(&r, 0, sizeof(r));
+    memcpy(r.rows, board->rows, sizeof(r.rows));
+    r.type = curType;
+    r.rotation = curRot;
+    r.x = curX;
+    r.y = curY;
+    r.queueLength = 1;
+    r.queue[0] = nextType;
+    r.budget = budget;
+    r.score = session.score;
+    BridgeResult result =
+        bridgeExchange(b, &r, &reply, budget ? budget + BRIDGE_GRACE : 0);
+    if (result != BRIDGE_OK) {
+        return result;
+    }
+
+    Placement placements[BOT_MAX_PLACEMENTS];
+    int count =
+        botEnumPlacements(board, curType, curRot, curX, curY, placements);
+    for (int i = 0; i < count; i++) {
+        if (placements[i].rotation == reply.rotation &&
+            placements[i].x == reply.x) {
+            move->rotation = reply.rotation;
+            move->x = reply.x;
+            move->y = placements[i].y;
+            move->rotations = (reply.rotation - curRot + 4) % 4;
+            move->dx = reply.x - curX;
+            move->score = 0;
+            return BRIDGE_OK;
+        }
+    }
+    printf("External bot returned unreachable placement (rotation %d, x %d)\n",
+           reply.rotation, reply.x);
+    return BRIDGE_ERROR;
+}
+
+// 按命令行参数连接外部AI：shm为共享内存名称，command为文本协议的外部程序
+bool bridgeConnect(const char *shm, const char *command) {
+    if (shm) {
+        if (!bridgeOpen(&botBridge, shm, true)) {
+            printf("Failed to create shared memory %s\n", shm);
+            return false;
+        }
+        printf("Waiting for external bot on shared memory %s\n", shm);
+        if (!bridgeWait(&botBridge, BRIDGE_READY, 1, BRIDGE_CONNECT)) {
+            printf("External bot did not connect within %d ms\n",
+                   BRIDGE_CONNECT);
+            bridgeClose(&botBridge);
+            return false;
+        }
+    } else if (!bridgeSpawn(&botBridge, command)) {
+        printf("Failed to start external bot %s\n", command);
+        bridgeClose(&botBridge);
+        return false;
+    }
+    botUseBridge = true;
+    return true;
+}
+
+int botDepth = 2;           // 前瞻深度：2表示当前方块+下一个方块
+int botSamples = 8;         // 深度大于2时每个落点采样的未来方块序列数
+Uint32 botTimeBudget = 12;  // 窗口模式下每次搜索的时间上限（毫秒）
+
+// 用内置AI计算任意局面的下一步，budget为时间上限（毫秒），0表示不限
+bool botPlanBoard(const BitBoard *board, int curType, int curRot, int curX,
+                  int curY, int nextType, Uint32 budget, BotMove *move) {
+    if (botUseNet) {
+        return netSearch(board, curType, curRot, curX, curY, nextType,
+                         &valueNet, move);
+    }
+    if (botUseMcts) {
+        return mctsSearch(board, curType, curRot, curX, curY, nextType,
+                          &botWeights, budget, mctsTrees, &searchPool, move);
+    }
+    BotSearchConfig cfg = {.weights = &botWeights,
+                           .beamWidth = botBeamWidth,
+                           .depth = botDepth,
+                           .samples = botSamples,
+                           .budget = budget};
+    return botSearch(board, curType, curRot, curX, curY, nextType, &cfg,
+                     &searchPool, move);
+}
+
+// 从当前游戏状态出发计算AI的下一步
+bool botPlan(BotMove *move, Uint32 budget) {
+    const Tetromino *piece = &session.currentPiece;
+    BitBoard board = boardFromArena(&session);
+    int rotation = pieceRotation(piece);
+    if (botUseBridge) {
+        BridgeResult result =
+            bridgePlan(&botBridge, &board, piece->type, rotation, piece->x,
+                       piece->y, session.nextPiece.type, budget, move);
+        if (result != BRIDGE_ERROR) {
+            return result == BRIDGE_OK;
+        }
+        // 外部AI超时、断开或给出无效落点时这一步改用内置AI
+        printf("External bot failed, using the built-in bot for this move\n");
+    }
+    return botPlanBoard(&board, piece->type, rotation, piece->x, piece->y,
+                        session.nextPiece.type, budget, move);
+}
+
+bool botEnabled = false;       // 是否由AI控制当前方块
+Uint32 botMoveInterval = 40;   // AI每次操作之间的间隔（毫秒）
+Uint32 botLastMove = 0;        // AI上次操作的时间
+BotMove botCurrentMove;        // AI正在执行的操作
+int botMovePiece = -1;         // botCurrentMove对应的方块序号，-1表示没有计划
+
+// 每帧调用一次，AI通过与键盘相同的movePiece()/rotatePiece()操作方块
+void botStep() {
+    if (!botEnabled || isPaused || session.gameOver ||
+        session.clearAnim.isAnimating) {
+        return;
+    }
+    if (SDL_GetTicks() - botLastMove < botMoveInterval) {
+        return;
+    }
+    botLastMove = SDL_GetTicks();
+
+    // 新方块出现时重新规划
+    if (botMovePiece != session.pieceCount) {
+        if (!botPlan(&botCurrentMove, botTimeBudget)) {
+            return;
+        }
+        botMovePiece = session.pieceCount;
+    }
+
+    // 每次只执行一个操作：旋转、平移，最后软降，落地后由自动下落锁定
+    // 操作失败（例如被方块挡住）时在下一次操作前重新规划
+    if (botCurrentMove.rotations > 0) {
+        if (playerInput(GAME_INPUT_ROTATE)) {
+            botCurrentMove.rotations--;
+        } else {
+            botMovePiece = -1;
+        }
+    } else if (botCurrentMove.dx != 0) {
+        int step = botCurrentMove.dx > 0 ? 1 : -1;
+        if (playerInput(step > 0 ? GAME_INPUT_RIGHT : GAME_INPUT_LEFT)) {
+            botCurrentMove.dx -= step;
+        } else {
+            botMovePiece = -1;
+        }
+    } else {
+        playerInput(GAME_INPUT_DOWN);
+    }
+}
+
+// ==================== 提示模式 ====================
+
+// 单槽邮箱（三缓冲）：写者和读者各自持有一个槽，第三个槽用于交换。
+// state的低两位是交换槽的下标，MAILBOX_FRESH表示交换槽里是读者还没取走的新数据。
+// 写者写完自己的槽后与交换槽对调，读者发现有新数据时再与交换槽对调，
+// 双方都不会等待对方，读者总是拿到最新一次完整写入的数据
+typedef struct {
+    SDL_atomic_t state;
+    int back;  // 写者正在写的槽
+    int front; // 读者正在读的槽
+} Mailbox;
+
+#define MAILBOX_FRESH 4
+
+void mailboxInit(Mailbox *m) {
+    SDL_AtomicSet(&m->state, 0);
+    m->back = 1;
+    m->front = 2;
+}
+
+// 写者写完back槽后调用，之后改写新的back槽
+void mailboxPublish(Mailbox *m) {
+    SDL_MemoryBarrierRelease();
+    m->back = SDL_AtomicSet(&m->state, m->back | MAILBOX_FRESH) & 3;
+}
+
+// 读者调用，有新数据时换到最新的槽并返回true，数据在front槽中
+bool mailboxFetch(Mailbox *m) {
+    if (!(SDL_AtomicGet(&m->state) & MAILBOX_FRESH)) {
+        return false;
+    }
+    m->front = SDL_AtomicSet(&m->state, m->front) & 3;
+    SDL_MemoryBarrierAcquire();
+    return true;
+}
+
+// 提示线程要搜索的局面
+typedef struct {
+    uint64_t key;    // 局面标识，结果用它与当前局面对应
+    BitBoard board;
+    int type, rotation, x, y;
+    int nextType;
+} HintRequest;
+
+// 提示线程每完成一轮更深的搜索就发布一次结果
+typedef struct {
+    uint64_t key;    // 对应的HintRequest::key
+    BotMove move;
+    int level;       // 完成的搜索轮次（从1开始）
+} HintResult;
+
+// 逐轮加深的搜索参数，后一轮的结果取代前一轮
+static const struct {
+    int beamWidth, depth, samples;
+} hintLevels[] = {
+    {4, 2, 1}, {8, 2, 1}, {8, 3, 4}, {16, 3, 8}, {16, 4, 8}, {32, 4, 16},
+};
+
+typedef struct {
+    SDL_Thread *thread;
+    SDL_sem *wake;          // 有新请求或需要退出时唤醒提示线程
+    SDL_atomic_t cancel;    // 有新请求时置1，让正在进行的搜索尽快放弃
+    SDL_atomic_t quit;
+    Mailbox requestBox;     // 主线程 -> 提示线程
+    HintRequest requests[3];
+    Mailbox resultBox;      // 提示线程 -> 主线程
+    HintResult results[3];
+    uint64_t postedKey;     // 主线程最近一次发出的请求
+} HintWorker;
+
+HintWorker hintWorker = {0};
+bool hintEnabled = false; // 是否显示最佳落点提示
+// 每个方块的提示搜索时间上限（毫秒）。提示线程不跟随帧：较深的几轮要几十毫秒，
+// 按帧截止就永远完成不了。主循环每帧只取邮箱中最新的结果，从不等待搜索，
+// 所以每完成一轮，下一帧就能显示。250毫秒内最深的一轮通常也能完成，
+// 而一个方块在最快的下落速度下也要停留远超过这个时间
+Uint32 hintBudget = 250;
+
+// 提示线程：取最新的请求逐轮加深搜索，每轮都要在截止时间前完成才发布，
+// 超时的一轮直接丢弃，已发布的较浅结果仍然有效。
+// 被取消时回到循环开头取新请求，没有新请求（取消标志与请求交错）就重新搜索原来的局面
+static int hintThreadMain(void *arg) {
+    HintWorker *h = arg;
+    HintRequest r;
+    bool pending = false; // r是否还需要搜索
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+    while (!SDL_AtomicGet(&h->quit)) {
+        // 先清除取消标志再取请求，之后到达的请求一定会再次取消
+        SDL_AtomicSet(&h->cancel, 0);
+        if (mailboxFetch(&h->requestBox)) {
+            r = h->requests[h->requestBox.front];
+            pending = true;
+        } else if (!pending) {
+            SDL_SemWait(h->wake);
+            continue;
+        }
+
+        Uint32 deadline = SDL_GetTicks() + hintBudget;
+        int levels = (int)(sizeof(hintLevels) / sizeof(hintLevels[0]));
+        bool cancelled = false;
+        for (int level = 0; level < levels; level++) {
+            Uint32 now = SDL_GetTicks();
+            if (now >= deadline) {
+                break;
+            }
+            BotSearchConfig cfg = {.weights = &botWeights,
+                                   .beamWidth = hintLevels[level].beamWidth,
+                                   .depth = hintLevels[level].depth,
+                                   .samples = hintLevels[level].samples,
+                                   .budget = deadline - now,
+                                   .cancel = &h->cancel};
+            BotMove move;
+            // 在提示线程中单线程搜索，不占用AI的线程池
+            bool found = botSearch(&r.board, r.type, r.rotation, r.x, r.y,
+                                   r.nextType, &cfg, NULL, &move);
+            cancelled = SDL_AtomicGet(&h->cancel) != 0;
+            if (!found || cancelled || SDL_GetTicks() >= deadline) {
+                break;
+            }
+            HintResult *out = &h->results[h->resultBox.back];
+            out->key = r.key;
+            out->move = move;
+            out->level = level + 1;
+            mailboxPublish(&h->resultBox);
+        }
+        pending = cancelled;
+    }
+    return 0;
+}
+
+bool hintStart(HintWorker *h) {
+    memset(h, 0, sizeof(*h));
+    mailboxInit(&h->requestBox);
+    mailboxInit(&h->resultBox);
+    h->wake = SDL_CreateSemaphore(0);
+    if (!h->wake) {
+        return false;
+    }
+    h->thread = SDL_CreateThread(hintThreadMain, "hint", h);
+    if (!h->thread) {
+        SDL_DestroySemaphore(h->wake);
+        h->wake = NULL;
+        return false;
+    }
+    return true;
+}
+
+void hintShutdown(HintWorker *h) {
+    if (!h->thread) {
+        return;
+    }
+    SDL_AtomicSet(&h->quit, 1);
+    SDL_AtomicSet(&h->cancel, 1);
+    SDL_SemPost(h->wake);
+    SDL_WaitThread(h->thread, NULL);
+    SDL_DestroySemaphore(h->wake);
+    memset(h, 0, sizeof(*h));
+}
+
+// 当前局面的标识：棋盘、方块序号、当前和下一个方块
+uint64_t hintKey() {
+    return mix64(session.arenaHash ^ ((uint64_t)session.pieceCount << 8) ^
+                 ((uint64_t)session.currentPiece.type << 4) ^
+                 session.nextPiece.type);
+}
+
+// 每帧调用一次：局面变化时把新请求放进邮箱并取消正在进行的搜索，从不等待提示线程
+void hintUpdate(HintWorker *h) {
+    if (!hintEnabled || !h->thread || session.gameOver) {
+        return;
+    }
+    uint64_t key = hintKey();
+    if (key == h->postedKey) {
+        return;
+    }
+    h->postedKey = key;
+    HintRequest *r = &h->requests[h->requestBox.back];
+    r->key = key;
+    r->board = boardFromArena(&session);
+    r->type = session.currentPiece.type;
+    r->rotation = pieceRotation(&session.currentPiece);
+    r->x = session.currentPiece.x;
+    r->y = session.currentPiece.y;
+    r->nextType = session.nextPiece.type;
+    // 正在进行的搜索已经过时，让它尽快放弃
+    SDL_AtomicSet(&h->cancel, 1);
+    mailboxPublish(&h->requestBox);
+    SDL_SemPost(h->wake);
+}
+
+// 取出最新的提示，属于当前局面时返回true
+bool hintCurrent(HintWorker *h, HintResult *result) {
+    if (!h->thread) {
+        return false;
+    }
+    mailboxFetch(&h->resultBox);
+    const HintResult *latest = &h->results[h->resultBox.front];
+    if (latest->level == 0 || latest->key != h->postedKey) {
+        return false;
+    }
+    *result = *latest;
+    return true;
+}
+
+// 像落点预览一样用轮廓画出提示的落点
+void drawHint(SDL_Renderer *renderer) {
+    HintResult result;
+    if (!hintEnabled || session.gameOver ||
+        !hintCurrent(&hintWorker, &result)) {
+        return;
+    }
+    Tetromino hint = session.currentPiece;
+    memcpy(hint.shape, pieceShapes[hint.type][result.move.rotation],
+           sizeof(hint.shape));
+    hint.x = result.move.x;
+    hint.y = result.move.y;
+    SDL_Color color = {255, 255, 255, 0};
+    drawOutline(renderer, &hint, color, 2);
+}
+
+// ==================== 对局记录 ====================
+
+// 在lockPiece()之前调用，记录当前方块的落点
+void replayRecord(Replay *r) {
+    ReplayMove m;
+    memset(&m, 0, sizeof(m));
+    BitBoard board = boardFromArena(&session);
+    memcpy(m.rows, board.rows, sizeof(m.rows));
+    m.type = session.currentPiece.type;
+    m.nextType = session.nextPiece.type;
+    m.rotation = pieceRotation(&session.currentPiece);
+    m.x = session.currentPiece.x;
+    m.y = session.currentPiece.y;
+    replayAppend(r, &m);
+}
+
+bool replaySave(const char *path, const Replay *r) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    int32_t header[4] = {REPLAY_FILE_MAGIC, (int32_t)sizeof(ReplayMove),
+                         r->count, r->score};
+    bool ok = fwrite(header, sizeof(header), 1, file) == 1 &&
+              fwrite(r->moves, sizeof(ReplayMove), r->count, file) ==
+                  (size_t)r->count;
+    fclose(file);
+    return ok;
+}
+
+bool replayLoad(const char *path, Replay *r) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    int32_t header[4];
+    bool ok = fread(header, sizeof(header), 1, file) == 1 &&
+              header[0] == REPLAY_FILE_MAGIC &&
+              header[1] == (int32_t)sizeof(ReplayMove) && header[2] >= 0;
+    replayClear(r);
+    for (int i = 0; ok && i < header[2]; i++) {
+        ReplayMove m;
+        ok = fread(&m, sizeof(m), 1, file) == 1 && m.type < 7 &&
+             m.nextType < 7 && m.rotation < 4 && replayAppend(r, &m);
+    }
+    fclose(file);
+    if (ok) {
+        r->score = header[3];
+    }
+    return ok;
+}
+
+// 无窗口运行AI对局，用于测试吞吐量和长时间运行的稳定性
+// replayFile不为NULL时保存最后一局的对局记录，inputPrefix不为NULL时
+// 把每一局的输入记录保存为inputPrefix加局号的文件
+int runHeadless(int games, int maxPieces, unsigned int seed,
+                const char *replayFile, const char *inputPrefix) {
+    long long totalPieces = 0, totalLines = 0, totalScore = 0;
+    memset(&botStats, 0, sizeof(botStats));
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    for (int g = 0; g < games; g++) {
+        startGame(seed + g);
+        int pieces = 0;
+        while (!session.gameOver && pieces < maxPieces) {
+            BotMove move;
+            if (!botPlan(&move, 0)) {
+                break;
+            }
+            // 与窗口模式相同的操作路径
+            while (move.rotations-- > 0) {
+                playerInput(GAME_INPUT_ROTATE);
+            }
+            for (; move.dx < 0 && playerInput(GAME_INPUT_LEFT); move.dx++) {
+            }
+            for (; move.dx > 0 && playerInput(GAME_INPUT_RIGHT); move.dx--) {
+            }
+            if (replayFile) {
+                Tetromino dropped = session.currentPiece;
+                while (movePiece(&session, 0, 1)) {
+                }
+                replayRecord(&gameReplay);
+                session.currentPiece = dropped;
+            }
+            playerInput(GAME_INPUT_DROP); // 无窗口时不播放消除动画
+            pieces++;
+        }
+        printf("game %d: pieces %d, lines %d, score %d%s\n", g + 1, pieces,
+               session.lines, session.score,
+               session.gameOver ? " (game over)" : "");
+        if (inputPrefix) {
+            char path[512];
+            snprintf(path, sizeof(path), "%s%05d.inp", inputPrefix, g);
+            if (!inputLogSave(&gameInputs, session.score, path)) {
+                printf("Failed to save %s\n", path);
+            }
+        }
+        totalPieces += pieces;
+        totalLines += session.lines;
+        totalScore += session.score;
+    }
+
+    double seconds = (double)(SDL_GetPerformanceCounter() - start) /
+                     SDL_GetPerformanceFrequency();
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+    printf("games %d, pieces %lld, lines %lld, avg score %.1f\n", games,
+           totalPieces, totalLines, games > 0 ? (double)totalScore / games : 0);
+    printf("time %.3f s, %.0f pieces/s, %.0f evals/s (beam %d, depth %d, "
+           "samples %d, threads %d)\n",
+           seconds, totalPieces / seconds, botStats.evals / seconds,
+           botBeamWidth, botDepth, botSamples, searchPool.count);
+    printf("pruned %llu nodes, %llu bound violations\n",
+           (unsigned long long)botStats.pruned,
+           (unsigned long long)botStats.boundViolations);
+    if (botUseMcts) {
+        printf("mcts: %.0f rollouts/s (%d per move, rollout depth %d), "
+               "%.0f tree nodes per move, peak tree %.1f KB\n",
+               botStats.rollouts / seconds, mctsRollouts, mctsRolloutDepth,
+               totalPieces ? (double)botStats.treeNodes / totalPieces : 0,
+               botStats.treeNodesPeak * sizeof(MctsNode) / 1024.0);
+    }
+    printf("transposition table: %llu probes, %.1f%% hits, %llu slot "
+           "collisions, %llu key collisions, %llu stores\n",
+           (unsigned long long)botStats.ttProbes,
+           botStats.ttProbes ? 100.0 * botStats.ttHits / botStats.ttProbes : 0,
+           (unsigned long long)botStats.ttSlotCollisions,
+           (unsigned long long)botStats.ttKeyCollisions,
+           (unsigned long long)botStats.ttStores);
+    if (replayFile) {
+        gameReplay.score = session.score;
+        if (!replaySave(replayFile, &gameReplay)) {
+            printf("Failed to save replay %s\n", replayFile);
+            return 1;
+        }
+        printf("saved %d moves of game %d to %s\n", gameReplay.count, games,
+               replayFile);
+    }
+    return botStats.boundViolations ? 1 : 0;
+}
+
+// 剪枝的检查：AI对局的每一步都先不剪枝、再剪枝各搜索一次（每次之前清空
+// 置换表），两次选出的落点和分数必须完全相同，并且剪枝确实发生过
+int runPruneCheck(int games, int maxPieces, unsigned int seed) {
+    memset(&botStats, 0, sizeof(botStats));
+    int moves = 0, mismatches = 0;
+    for (int g = 0; g < games; g++) {
+        startGame(seed + g);
+        for (int pieces = 0; !session.gameOver && pieces < maxPieces;
+             pieces++) {
+            BotMove exact, pruned;
+            ttClear();
+            botPrune = false;
+            bool okExact = botPlan(&exact, 0);
+            ttClear();
+            botPrune = true;
+            bool okPruned = botPlan(&pruned, 0);
+            if (!okExact || !okPruned) {
+                mismatches += okExact != okPruned;
+                break;
+            }
+            if (exact.rotation != pruned.rotation || exact.x != pruned.x ||
+                exact.y != pruned.y || exact.score != pruned.score) {
+                printf("game %d piece %d: exact rot %d x %d (%.4f), pruned "
+                       "rot %d x %d (%.4f)\n",
+                       g + 1, pieces + 1, exact.rotation, exact.x,
+                       exact.score, pruned.rotation, pruned.x, pruned.score);
+                mismatches++;
+            }
+            moves++;
+            while (pruned.rotations-- > 0) {
+                playerInput(GAME_INPUT_ROTATE);
+            }
+            for (; pruned.dx < 0 && playerInput(GAME_INPUT_LEFT);
+                 pruned.dx++) {
+            }
+            for (; pruned.dx > 0 && playerInput(GAME_INPUT_RIGHT);
+                 pruned.dx--) {
+            }
+            playerInput(GAME_INPUT_DROP);
+        }
+    }
+    printf("%d moves (depth %d, samples %d, threads %d): pruned %llu nodes, "
+           "%d mismatches, %llu bound violations\n",
+           moves, botDepth, botSamples, searchPool.count,
+           (unsigned long long)botStats.pruned, mismatches,
+           (unsigned long long)botStats.boundViolations);
+    return mismatches || botStats.boundViolations || !botStats.pruned ? 1 : 0;
+}
+
+// 批量评估内核的微基准：比较标量实现和SIMD实现的速度并校验结果一致
+int runEvalBenchmark() {
+    enum { POOL = 4096, ROUNDS = 200 };
+    static BitBoard pool[POOL];
+    static BoardBatch batches[POOL / 8];
+    static BatchFeatures expected, actual;
+
+    // 用随机落点生成接近实战的棋盘
+    uint32_t rng = 12345;
+    BitBoard board = {0};
+    for (int n = 0; n < POOL; n++) {
+        rng = rng * 1664525u + 1013904223u;
+        int type = (rng >> 16) % 7;
+        int rot = (rng >> 8) & 3;
+        int span = ARENA_WIDTH - pieceMaxCol[type][rot] + pieceMinCol[type][rot];
+        int x = (int)((rng >> 20) % span) - pieceMinCol[type][rot];
+        if (bitCollision(&board, type, rot, x, -2)) {
+            memset(&board, 0, sizeof(board));
+        }
+        bitLock(&board, type, rot, x, bitDrop(&board, type, rot, x, -2));
+        if (board.rows[0] || board.rows[4]) {
+            memset(&board, 0, sizeof(board)); // 堆得太高时重新开始
+        }
+        pool[n] = board;
+    }
+
+    printf("batch feature kernel benchmark (%dx%d boards, kernel: %s)\n",
+           ARENA_WIDTH, ARENA_HEIGHT, evalBatchName);
+
+    int batchSizes[] = {8, 16, 32};
+    for (int s = 0; s < 3; s++) {
+        int size = batchSizes[s];
+        int batchCount = POOL / size;
+        // 预先转置，只测量内核本身
+        for (int k = 0; k < batchCount; k++) {
+            for (int i = 0; i < ARENA_HEIGHT; i++) {
+                for (int b = 0; b < EVAL_BATCH_MAX; b++) {
+                    batches[k].rows[i][b] =
+                        b < size ? pool[k * size + b].rows[i] : 0;
+                }
+            }
+        }
+
+        // 校验SIMD内核与标量实现的结果完全一致
+        for (int k = 0; k < batchCount; k++) {
+            evalBatchScalar(&batches[k], size, &expected);
+            evalBatch(&batches[k], size, &actual);
+            for (int b = 0; b < size; b++) {
+                bool same = expected.aggregate[b] == actual.aggregate[b] &&
+                            expected.holes[b] == actual.holes[b] &&
+                            expected.bumpiness[b] == actual.bumpiness[b] &&
+                            expected.wells[b] == actual.wells[b] &&
+                            expected.rowTransitions[b] == actual.rowTransitions[b] &&
+                            expected.colTransitions[b] == actual.colTransitions[b];
+                for (int j = 0; j < ARENA_WIDTH; j++) {
+                    same = same && expected.heights[j][b] == actual.heights[j][b];
+                }
+                if (!same) {
+                    printf("mismatch: batch %d, board %d\n", k, b);
+                    return 1;
+                }
+            }
+        }
+
+        EvalBatchFunc kernels[2] = {evalBatchScalar, evalBatch};
+        double rate[2];
+        int16_t sink = 0; // 防止编译器把计算优化掉
+        for (int kernel = 0; kernel < 2; kernel++) {
+            Uint64 start = SDL_GetPerformanceCounter();
+            for (int round = 0; round < ROUNDS; round++) {
+                for (int k = 0; k < batchCount; k++) {
+                    kernels[kernel](&batches[k], size, &actual);
+                    sink += actual.holes[0];
+                }
+            }
+            double seconds = (double)(SDL_GetPerformanceCounter() - start) /
+                             SDL_GetPerformanceFrequency();
+            rate[kernel] = (double)ROUNDS * batchCount * size /
+                           (seconds > 0 ? seconds : 1e-9);
+        }
+        printf("batch %2d: scalar %.2f M boards/s, %s %.2f M boards/s, "
+               "speedup %.2fx (%d)\n",
+               size, rate[0] / 1e6, evalBatchName, rate[1] / 1e6,
+               rate[1] / rate[0], sink & 1);
+    }
+    return 0;
+}
+
+// ==================== 外部AI客户端与通信延迟测试 ====================
+
+// 外部AI的参考实现：连接到游戏后用内置AI回答每个请求
+// name为"-"时使用文本协议（标准输入输出），否则连接名为name的共享内存；
+// echo为true时直接让方块原地落下，用于测量通信本身的延迟
+int runBridgeClient(const char *name, bool echo) {
+    BotBridge b;
+    bool text = strcmp(name, "-") == 0;
+    if (text) {
+        memset(&b, 0, sizeof(b));
+    } else if (!bridgeOpen(&b, name, false)) {
+        fprintf(stderr, "Failed to open bot bridge %s\n", name);
+        return 1;
+    } else {
+        bridgePublish(&b, BRIDGE_READY, 1);
+    }
+
+    uint32_t served = 0; // 已回答的最后一个请求序号
+    for (;;) {
+        BridgeRequest r;
+        BridgeReply reply;
+        if (text) {
+            char line[512];
+            if (!fgets(line, sizeof(line), stdin) ||
+                strncmp(line, "quit", 4) == 0) {
+                break;
+            }
+            if (!bridgeParseRequest(line, &r)) {
+                fprintf(stderr, "Bad request: %s", line);
+                continue;
+            }
+        } else {
+            bridgeWait(&b, BRIDGE_REQUEST, served + 1, 0);
+            if (__atomic_load_n(&b.shared->shutdown, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            // 游戏在超时后可能已经覆盖了旧的请求，直接跳到槽里的序号
+            r = b.shared->requests[(served + 1) % BRIDGE_RING];
+            served = r.seq;
+        }
+
+        memset(&reply, 0, sizeof(reply));
+        reply.seq = r.seq;
+        if (echo) {
+            reply.rotation = r.rotation;
+            reply.x = r.x;
+        } else {
+            BitBoard board;
+            BotMove move;
+            board.hash = 0;
+            for (int i = 0; i < ARENA_HEIGHT; i++) {
+                board.rows[i] = r.rows[i];
+                board.hash ^= zobristRow(i, r.rows[i]);
+            }
+            if (botPlanBoard(&board, r.type, r.rotation, r.x, r.y,
+                             r.queueLength ? r.queue[0] : r.type, r.budget,
+                             &move)) {
+                reply.rotation = move.rotation;
+                reply.x = move.x;
+            } else {
+                reply.resign = 1;
+            }
+        }
+
+        if (text) {
+            if (reply.resign) {
+                printf("%u resign\n", reply.seq);
+            } else {
+                printf("%u %d %d\n", reply.seq, reply.rotation, reply.x);
+            }
+            fflush(stdout);
+        } else {
+            b.shared->replies[r.seq % BRIDGE_RING] = reply;
+            bridgePublish(&b, BRIDGE_REPLY, r.seq);
+        }
+    }
+    if (!text) {
+        bridgeClose(&b);
+    }
+    return 0;
+}
+
+static int compareDouble(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// 测量rounds次请求/回复的往返延迟并打印分布
+static void bridgeMeasure(BotBridge *b, const char *label, int rounds) {
+    enum { WARMUP = 1000, MAX_ROUNDS = 100000 };
+    static double samples[MAX_ROUNDS];
+    if (rounds > MAX_ROUNDS) {
+        rounds = MAX_ROUNDS;
+    }
+    // 固定的中盘局面：底部几行有空洞
+    BridgeRequest r;
+    BridgeReply reply;
+    memset(&r, 0, sizeof(r));
+    for (int i = ARENA_HEIGHT - 6; i < ARENA_HEIGHT; i++) {
+        r.rows[i] = FULL_ROW & ~(1 << (i * 7 % ARENA_WIDTH));
+    }
+    r.type = 2;
+    r.x = ARENA_WIDTH / 2 - 2;
+    r.queueLength = 1;
+    r.queue[0] = 0;
+
+    for (int i = 0; i < WARMUP; i++) {
+        bridgeExchange(b, &r, &reply, 0);
+    }
+    double freq = (double)SDL_GetPerformanceFrequency();
+    double total = 0;
+    for (int i = 0; i < rounds; i++) {
+        Uint64 start = SDL_GetPerformanceCounter();
+        if (bridgeExchange(b, &r, &reply, 0) != BRIDGE_OK) {
+            printf("%s: external bot stopped answering\n", label);
+            return;
+        }
+        samples[i] = (SDL_GetPerformanceCounter() - start) * 1e6 / freq;
+        total += samples[i];
+    }
+    qsort(samples, rounds, sizeof(samples[0]), compareDouble);
+    printf("  %-14s mean %7.2f us, p50 %7.2f us, p99 %7.2f us, max %8.1f us "
+           "(%d round trips)\n",
+           label, total / rounds, samples[rounds / 2],
+           samples[rounds * 99 / 100], samples[rounds - 1], rounds);
+}
+
+// 启动自身作为echo模式的外部AI，比较共享内存和文本协议的往返延迟
+int runBridgeBenchmark(const char *self) {
+    char name[32], command[1024];
+    BotBridge b;
+    snprintf(name, sizeof(name), "bench-%llx",
+             (unsigned long long)SDL_GetPerformanceCounter());
+    printf("External bot round trip latency (%d CPUs, %s)\n", SDL_GetCPUCount(),
+           SDL_GetCPUCount() > 1 ? "spin then sleep" : "sleep only");
+
+    if (!bridgeOpen(&b, name, true)) {
+        printf("Failed to create shared memory %s\n", name);
+        return 1;
+    }
+    snprintf(command, sizeof(command), "\"%s\" --bot-client %s --bot-echo",
+             self, name);
+    if (!bridgeSpawn(&b, command) || !bridgeWait(&b, BRIDGE_READY, 1, 5000)) {
+        printf("External bot did not connect: %s\n", command);
+        bridgeClose(&b);
+        return 1;
+    }
+    bridgeMeasure(&b, "shared memory", 100000);
+    bridgeClose(&b);
+
+    snprintf(command, sizeof(command), "\"%s\" --bot-client - --bot-echo",
+             self);
+    if (!bridgeSpawn(&b, command)) {
+        printf("Failed to start %s\n", command);
+        return 1;
+    }
+    bridgeMeasure(&b, "stdio text", 20000);
+    bridgeClose(&b);
+    return 0;
+}
+
+// ==================== 无窗口对局与权重调优 ====================
+
+// 不依赖全局变量的无窗口对局，规则与lockPiece()/clearLines()/newPiece()一致，
+// 可以在多个线程中同时进行
+typedef struct {
+    BitBoard board;
+    int curType, nextType; // 当前方块和下一个方块
+    int score, lines, pieces;
+    uint32_t rng;          // 本局的随机数状态
+    bool over;             // 是否已经结束
+} SimGame;
+
+// 本局随机数生成器产生下一个方块类型
+static int simRandomPiece(SimGame *g) {
+    return randomPieceType(&g->rng);
+}
+
+void simReset(SimGame *g, uint32_t seed) {
+    memset(g, 0, sizeof(*g));
+    g->rng = (uint32_t)mix64(seed) | 1; // xorshift的状态不能为0
+    g->curType = simRandomPiece(g);
+    g->nextType = simRandomPiece(g);
+}
+
+// 用AI放置当前方块并生成新方块，游戏结束时返回false
+bool simStep(SimGame *g, const BotSearchConfig *cfg) {
+    BotMove move;
+    if (g->over || !botSearch(&g->board, g->curType, 0, ARENA_WIDTH / 2 - 2,
+                              -2, g->nextType, cfg, NULL, &move)) {
+        g->over = true;
+        return false;
+    }
+    int lines = bitLock(&g->board, g->curType, move.rotation, move.x, move.y);
+    g->lines += lines;
+    g->score += lineClearScores[lines] * scoreMultiplier;
+    g->pieces++;
+    // 与newPiece()相同：最顶行有方块时游戏结束
+    if (g->board.rows[0]) {
+        g->over = true;
+        return false;
+    }
+    g->curType = g->nextType;
+    g->nextType = simRandomPiece(g);
+    return true;
+}
+
+// ==================== 强化学习批量环境 ====================
+
+// 一次调用推进成千上万局相互独立的游戏，规则与SimGame相同
+// （即lockPiece()/clearLines()/newPiece()）。动作直接指定落点：
+// 动作 = 旋转状态*ARENA_WIDTH + 方块最左一格所在的列，方块从出生位置
+// 先旋转、再平移、最后落下，与玩家的操作路径相同
+#define ENV_ACTIONS (4 * ARENA_WIDTH)
+#define ENV_CHUNK 1024 // 每个线程至少分到的局数，太少时不值得唤醒线程
+_Static_assert(ENV_ACTIONS <= 64, "legal action mask is a uint64_t");
+
+// 一局游戏的观察，按局连续写入调用者提供的缓冲区
+typedef struct {
+    uint16_t rows[ARENA_HEIGHT]; // 棋盘，每行一个位掩码
+    uint8_t curType, nextType;   // 当前方块和下一个方块
+    uint8_t pad[6];
+    uint64_t legal;              // 合法动作的位掩码
+} EnvObservation;
+
+// 所有状态按字段分别存放（结构数组），每个数组有count个元素
+typedef struct {
+    int count;
+    BitBoard *boards;
+    uint8_t *curType, *nextType;
+    uint64_t *legal;      // 当前方块的合法动作
+    uint32_t *rng;        // 每局的随机数状态
+    uint32_t *seed;       // 每局当前回合的种子，自动重置时加count
+    int32_t *score, *lines, *pieces;   // 当前回合的统计
+    int32_t *finalScore, *finalPieces; // 上一个结束的回合的统计
+    // 调用者提供的输出缓冲区，每个数组有count个元素
+    EnvObservation *obs;
+    float *rewards;
+    uint8_t *dones;
+    SearchPool *pool; // 为NULL时在当前线程中推进
+} EnvBatch;
+
+// 出生位置上方两行为空时，所有不越界的落点都能到达
+static uint64_t envOpenActions[7];
+// 顶行为空时合法动作只取决于第二行，按第二行的位掩码查表
+static uint64_t envSpawnActions[7][1 << ARENA_WIDTH];
+
+static uint64_t envSearchActions(const BitBoard *board, int type);
+
+static void envInitTables() {
+    for (int t = 0; t < 7; t++) {
+        envOpenActions[t] = 0;
+        for (int r = 0; r < 4; r++) {
+            int width = pieceMaxCol[t][r] - pieceMinCol[t][r] + 1;
+            for (int col = 0; col + width <= ARENA_WIDTH; col++) {
+                envOpenActions[t] |= 1ULL << (r * ARENA_WIDTH + col);
+            }
+        }
+        BitBoard board;
+        memset(&board, 0, sizeof(board));
+        for (int mask = 0; mask < 1 << ARENA_WIDTH; mask++) {
+            board.rows[1] = mask;
+            envSpawnActions[t][mask] = envSearchActions(&board, t);
+        }
+    }
+}
+
+// 当前方块的合法动作，到达方式与botEnumPlacements()相同，但不需要计算落点
+static uint64_t envLegalActions(const BitBoard *board, int type) {
+    if (!board->rows[0]) {
+        return envSpawnActions[type][board->rows[1]];
+    }
+    return envSearchActions(board, type);
+}
+
+// 从出生位置逐个检查能到达的落点
+static uint64_t envSearchActions(const BitBoard *board, int type) {
+    const int x0 = ARENA_WIDTH / 2 - 2, y0 = -2;
+    uint64_t legal = 0;
+    for (int rot = 0; rot < 4 && !bitCollision(board, type, rot, x0, y0);
+         rot++) {
+        int base = rot * ARENA_WIDTH + pieceMinCol[type][rot];
+        for (int x = x0; !bitCollision(board, type, rot, x, y0); x--) {
+            legal |= 1ULL << (base + x);
+        }
+        for (int x = x0 + 1; !bitCollision(board, type, rot, x, y0); x++) {
+            legal |= 1ULL << (base + x);
+        }
+    }
+    return legal;
+}
+
+// 方块从上方直接落下后的y坐标：上方两行为空时只看各列最高的方块
+static int envLanding(const BitBoard *board, int type, int rot, int x) {
+    if (board->rows[0] | board->rows[1]) {
+        return bitDrop(board, type, rot, x, -2);
+    }
+    // 只找方块所在各列的最高方块，找齐后立即停止
+    int top[4] = {ARENA_HEIGHT, ARENA_HEIGHT, ARENA_HEIGHT, ARENA_HEIGHT};
+    int minCol = pieceMinCol[type][rot], maxCol = pieceMaxCol[type][rot];
+    uint16_t want = (uint16_t)(((1 << (maxCol - minCol + 1)) - 1) << (x + minCol));
+    for (int i = 2; i < ARENA_HEIGHT && want; i++) {
+        uint16_t fresh = board->rows[i] & want;
+        want &= ~fresh;
+        for (; fresh; fresh &= fresh - 1) {
+            top[__builtin_ctz(fresh) - x] = i;
+        }
+    }
+    int y = ARENA_HEIGHT;
+    for (int j = minCol; j <= maxCol; j++) {
+        int landing = top[j] - 1 - pieceColBottom[type][rot][j];
+        if (landing < y) {
+            y = landing;
+        }
+    }
+    return y;
+}
+
+static void envWriteObservation(const EnvBatch *e, int i) {
+    EnvObservation *o = &e->obs[i];
+    memcpy(o->rows, e->boards[i].rows, sizeof(o->rows));
+    o->curType = e->curType[i];
+    o->nextType = e->nextType[i];
+    o->legal = e->legal[i];
+}
+
+// 用e->seed[i]开始第i局的新回合
+static void envResetOne(EnvBatch *e, int i) {
+    memset(&e->boards[i], 0, sizeof(e->boards[i]));
+    e->rng[i] = (uint32_t)mix64(e->seed[i]) | 1; // xorshift的状态不能为0
+    e->curType[i] = randomPieceType(&e->rng[i]);
+    e->nextType[i] = randomPieceType(&e->rng[i]);
+    e->legal[i] = envOpenActions[e->curType[i]];
+    e->score[i] = e->lines[i] = e->pieces[i] = 0;
+}
+
+// 推进第i局一步；回合结束（游戏结束或非法动作）时记录统计并自动重置，
+// 写入的观察是新回合的第一个观察
+static void envStepOne(EnvBatch *e, int i, int action) {
+    BitBoard *board = &e->boards[i];
+    int type = e->curType[i];
+    float reward = 0;
+    bool done = true;
+    if (action >= 0 && action < ENV_ACTIONS && (e->legal[i] >> action & 1)) {
+        int rot = action / ARENA_WIDTH;
+        int x = action % ARENA_WIDTH - pieceMinCol[type][rot];
+        int y = envLanding(board, type, rot, x);
+        int lines = bitLock(board, type, rot, x, y);
+        reward = lineClearScores[lines] * scoreMultiplier;
+        e->score[i] += lineClearScores[lines] * scoreMultiplier;
+        e->lines[i] += lines;
+        e->pieces[i]++;
+        // 与newPiece()相同：最顶行有方块时游戏结束
+        if (!board->rows[0]) {
+            e->curType[i] = e->nextType[i];
+            e->nextType[i] = randomPieceType(&e->rng[i]);
+            e->legal[i] = envLegalActions(board, e->curType[i]);
+            done = e->legal[i] == 0;
+        }
+    }
+    if (done) {
+        e->finalScore[i] = e->score[i];
+        e->finalPieces[i] = e->pieces[i];
+        e->seed[i] += e->count;
+        envResetOne(e, i);
+    }
+    e->rewards[i] = reward;
+    e->dones[i] = done;
+    envWriteObservation(e, i);
+}
+
+void envDestroy(EnvBatch *e) {
+    free(e->boards);
+    free(e->curType);
+    free(e->nextType);
+    free(e->legal);
+    free(e->rng);
+    free(e->seed);
+    free(e->score);
+    free(e->lines);
+    free(e->pieces);
+    free(e->finalScore);
+    free(e->finalPieces);
+    free(e);
+}
+
+// 创建count局游戏，第i局第一个回合的种子为seed+i（调用envReset()前可以修改
+// e->seed）；obs、rewards、dones是调用者提供的输出缓冲区，每个有count个元素
+EnvBatch *envCreate(int count, uint32_t seed, EnvObservation *obs,
+                    float *rewards, uint8_t *dones, SearchPool *pool) {
+    if (!envOpenActions[0]) {
+        envInitTables();
+    }
+    EnvBatch *e = calloc(1, sizeof(*e));
+    if (!e) {
+        return NULL;
+    }
+    e->count = count;
+    e->obs = obs;
+    e->rewards = rewards;
+    e->dones = dones;
+    e->pool = pool;
+    e->boards = calloc(count, sizeof(*e->boards));
+    e->curType = calloc(count, sizeof(*e->curType));
+    e->nextType = calloc(count, sizeof(*e->nextType));
+    e->legal = calloc(count, sizeof(*e->legal));
+    e->rng = calloc(count, sizeof(*e->rng));
+    e->seed = calloc(count, sizeof(*e->seed));
+    e->score = calloc(count, sizeof(*e->score));
+    e->lines = calloc(count, sizeof(*e->lines));
+    e->pieces = calloc(count, sizeof(*e->pieces));
+    e->finalScore = calloc(count, sizeof(*e->finalScore));
+    e->finalPieces = calloc(count, sizeof(*e->finalPieces));
+    if (!e->boards || !e->curType || !e->nextType || !e->legal || !e->rng ||
+        !e->seed || !e->score || !e->lines || !e->pieces || !e->finalScore ||
+        !e->finalPieces) {
+        envDestroy(e);
+        return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        e->seed[i] = seed + i;
+    }
+    return e;
+}
+
+// 所有局开始新回合并写入第一个观察
+void envReset(EnvBatch *e) {
+    for (int i = 0; i < e->count; i++) {
+        envResetOne(e, i);
+        e->rewards[i] = 0;
+        e->dones[i] = 0;
+        envWriteObservation(e, i);
+    }
+}
+
+typedef struct {
+    EnvBatch *envs;
+    const int32_t *actions;
+    int n, workers;
+} EnvJob;
+
+// 每个线程推进连续的一段局，各局互不相关，不需要同步
+static void envTask(void *data, int self) {
+    EnvJob *job = data;
+    int begin = (int)((long long)job->n * self / job->workers);
+    int end = (int)((long long)job->n * (self + 1) / job->workers);
+    for (int i = begin; i < end; i++) {
+        envStepOne(job->envs, i, job->actions[i]);
+    }
+}
+
+// 用actions[i]推进前n局各一步，结果写入创建时提供的缓冲区
+void envStepBatch(EnvBatch *envs, const int32_t *actions, int n) {
+    EnvJob job = {envs, actions, n < envs->count ? n : envs->count, 1};
+    if (envs->pool && envs->pool->count > 1) {
+        job.workers = job.n / ENV_CHUNK;
+        if (job.workers > envs->pool->count) {
+            job.workers = envs->pool->count;
+        }
+        if (job.workers < 1) {
+            job.workers = 1;
+        }
+    }
+    poolRun(envs->pool, job.workers, envTask, &job);
+}
+
+// 批量环境的吞吐量测试：每局随机选择合法动作
+int runEnvBenchmark(int count, unsigned int seed) {
+    EnvObservation *obs = malloc(sizeof(*obs) * count);
+    float *rewards = malloc(sizeof(*rewards) * count);
+    uint8_t *dones = malloc(count);
+    int32_t *actions = malloc(sizeof(*actions) * count);
+    EnvBatch *envs = obs && rewards && dones && actions
+                         ? envCreate(count, seed, obs, rewards, dones,
+                                     &searchPool)
+                         : NULL;
+    if (!envs) {
+        printf("Failed to allocate %d environments\n", count);
+        free(obs);
+        free(rewards);
+        free(dones);
+        free(actions);
+        return 1;
+    }
+    envReset(envs);
+
+    uint32_t rng = (uint32_t)mix64(seed) | 1;
+    long long steps = 0, episodes = 0, episodePieces = 0;
+    double stepSeconds = 0, freq = (double)SDL_GetPerformanceFrequency();
+    Uint64 start = SDL_GetPerformanceCounter();
+    while (SDL_GetPerformanceCounter() - start < 2 * freq) {
+        // 在合法动作中均匀随机选择（不计入环境的时间）
+        for (int i = 0; i < count; i++) {
+            uint64_t legal = obs[i].legal;
+            int k = xorshift32(&rng) % __builtin_popcountll(legal);
+            for (; k > 0; k--) {
+                legal &= legal - 1;
+            }
+            actions[i] = __builtin_ctzll(legal);
+        }
+        Uint64 t = SDL_GetPerformanceCounter();
+        envStepBatch(envs, actions, count);
+        stepSeconds += (SDL_GetPerformanceCounter() - t) / freq;
+        steps += count;
+        for (int i = 0; i < count; i++) {
+            if (dones[i]) {
+                episodes++;
+                episodePieces += envs->finalPieces[i];
+            }
+        }
+    }
+    printf("env: %d games x %lld batches, %.0f steps/s (%d threads), "
+           "%.1f ns per step\n",
+           count, steps / count, steps / stepSeconds, searchPool.count,
+           stepSeconds * 1e9 / steps);
+    printf("env: %lld episodes, avg %.1f pieces per episode (random "
+           "actions), observation %d bytes\n",
+           episodes, episodes ? (double)episodePieces / episodes : 0,
+           (int)sizeof(EnvObservation));
+    envDestroy(envs);
+    free(obs);
+    free(rewards);
+    free(dones);
+    free(actions);
+    return 0;
+}
+
+// ==================== 位切片模拟内核 ====================
+
+// 随机对局的极限吞吐量：把256局游戏转置存放，每个格子是一个256位的向量，
+// 第k位表示第k局的这个格子，下落、碰撞、锁定和满行检测对256局同时用位运算
+// 完成。每局的方块序列、选择动作和合法性判断仍然逐局标量计算（每步每局
+// 只有几个操作），规则与批量环境相同
+#define SLICE_LANES 256
+#define SLICE_WORDS (SLICE_LANES / 64)
+
+typedef struct {
+    // 第i行第j列在各局中是否有方块
+    _Alignas(32) uint64_t cells[ARENA_HEIGHT][ARENA_WIDTH][SLICE_WORDS];
+    // 本步各局的方块，第i行相对于方块的y坐标，所有方块从同一高度开始下落
+    _Alignas(32) uint64_t piece[4][ARENA_WIDTH][SLICE_WORDS];
+    // 内核的输出：本步消除行数的二进制各位、顶行有方块（游戏结束）、
+    // 第二行有方块（出生位置附近被挡住，需要逐个检查合法动作）
+    _Alignas(32) uint64_t lines[3][SLICE_WORDS];
+    _Alignas(32) uint64_t over[SLICE_WORDS];
+    _Alignas(32) uint64_t crowded[SLICE_WORDS];
+    // 每局的标量状态
+    uint8_t curType[SLICE_LANES], nextType[SLICE_LANES];
+    uint64_t legal[SLICE_LANES];
+    uint32_t rng[SLICE_LANES], seed[SLICE_LANES];
+    int32_t score[SLICE_LANES];
+    long long pieces, episodes; // 所有局合计
+} SliceBatch;
+
+// 下落、锁定并消除满行
+typedef void (*SliceDropFunc)(SliceBatch *s);
+
+// 每种旋转状态的4个格子在4x4矩阵中的行和列
+static int8_t sliceCells[7][4][4][2];
+
+static inline bool sliceBit(const uint64_t *v, int lane) {
+    return v[lane >> 6] >> (lane & 63) & 1;
+}
+
+// 随机策略：从随机位置开始的第一个合法动作，两种实现共用
+static inline int slicePolicy(uint64_t legal, uint32_t *rng) {
+    int start = xorshift32(rng) & 63;
+    uint64_t rotated = legal >> start | (start ? legal << (64 - start) : 0);
+    return (start + __builtin_ctzll(rotated)) & 63;
+}
+
+static void sliceResetLane(SliceBatch *s, int lane) {
+    s->rng[lane] = (uint32_t)mix64(s->seed[lane]) | 1;
+    s->curType[lane] = randomPieceType(&s->rng[lane]);
+    s->nextType[lane] = randomPieceType(&s->rng[lane]);
+    s->legal[lane] = envOpenActions[s->curType[lane]];
+    s->score[lane] = 0;
+}
+
+void sliceInit(SliceBatch *s, uint32_t seed) {
+    if (!envOpenActions[0]) {
+        envInitTables();
+    }
+    for (int t = 0; t < 7; t++) {
+        for (int r = 0; r < 4; r++) {
+            int n = 0;
+            for (int i = 0; i < 4; i++) {
+                for (int j = 0; j < 4; j++) {
+                    if (pieceShapes[t][r][i][j]) {
+                        sliceCells[t][r][n][0] = i;
+                        sliceCells[t][r][n][1] = j;
+                        n++;
+                    }
+                }
+            }
+        }
+    }
+    memset(s, 0, sizeof(*s));
+    for (int lane = 0; lane < SLICE_LANES; lane++) {
+        s->seed[lane] = seed + lane;
+        sliceResetLane(s, lane);
+    }
+}
+
+// 第lane局的棋盘（用于校验）
+BitBoard sliceLaneBoard(const SliceBatch *s, int lane) {
+    BitBoard board;
+    board.hash = 0;
+    for (int i = 0; i < ARENA_HEIGHT; i++) {
+        board.rows[i] = 0;
+        for (int j = 0; j < ARENA_WIDTH; j++) {
+            board.rows[i] |= sliceBit(s->cells[i][j], lane) << j;
+        }
+        board.hash ^= zobristRow(i, board.rows[i]);
+    }
+    return board;
+}
+
+// 64位标量实现，每个字处理64局
+static void sliceDropScalar(SliceBatch *s) {
+    for (int w = 0; w < SLICE_WORDS; w++) {
+        uint64_t any[4];
+        for (int i = 0; i < 4; i++) {
+            any[i] = 0;
+            for (int c = 0; c < ARENA_WIDTH; c++) {
+                any[i] |= s->piece[i][c][w];
+            }
+        }
+        uint64_t falling = ~0ULL;
+        for (int y = -2; falling; y++) {
+            // 下移一格是否碰撞（超出底部或与已有方块重叠）
+            uint64_t coll = 0;
+            for (int i = 0; i < 4; i++) {
+                int row = y + 1 + i;
+                if (row >= ARENA_HEIGHT) {
+                    coll |= any[i];
+                } else if (row >= 0) {
+                    for (int c = 0; c < ARENA_WIDTH; c++) {
+                        coll |= s->piece[i][c][w] & s->cells[row][c][w];
+                    }
+                }
+            }
+            // 碰撞的局在y处锁定，游戏区域上方的部分被丢弃
+            uint64_t land = falling & coll;
+            for (int i = 0; land && i < 4; i++) {
+                int row = y + i;
+                if (row >= 0 && row < ARENA_HEIGHT) {
+                    for (int c = 0; c < ARENA_WIDTH; c++) {
+                        s->cells[row][c][w] |= s->piece[i][c][w] & land;
+                    }
+                }
+            }
+            falling &= ~coll;
+        }
+
+        // 从下往上消除满行，消除后同一行要再检查一次；消除行数用三个
+        // 位平面按位累加
+        uint64_t c0 = 0, c1 = 0, c2 = 0;
+        for (int r = ARENA_HEIGHT - 1; r >= 0;) {
+            uint64_t full = ~0ULL;
+            for (int c = 0; c < ARENA_WIDTH; c++) {
+                full &= s->cells[r][c][w];
+            }
+            if (!full) {
+                r--;
+                continue;
+            }
+            uint64_t carry = c0 & full;
+            c0 ^= full;
+            c2 |= c1 & carry;
+            c1 ^= carry;
+            for (int rr = r; rr > 0; rr--) {
+                for (int c = 0; c < ARENA_WIDTH; c++) {
+                    s->cells[rr][c][w] = (s->cells[rr - 1][c][w] & full) |
+                                         (s->cells[rr][c][w] & ~full);
+                }
+            }
+            for (int c = 0; c < ARENA_WIDTH; c++) {
+                s->cells[0][c][w] &= ~full;
+            }
+        }
+        uint64_t top = 0, second = 0;
+        for (int c = 0; c < ARENA_WIDTH; c++) {
+            top |= s->cells[0][c][w];
+            second |= s->cells[1][c][w];
+        }
+        s->lines[0][w] = c0;
+        s->lines[1][w] = c1;
+        s->lines[2][w] = c2;
+        s->over[w] = top;
+        s->crowded[w] = second;
+    }
+}
+
+#ifdef HAVE_EVAL_AVX2
+#define SLICE_LOAD(p) _mm256_load_si256((const __m256i *)(p))
+#define SLICE_STORE(p, v) _mm256_store_si256((__m256i *)(p), (v))
+
+// AVX2实现：一条指令处理256局
+__attribute__((target("avx2"))) static void sliceDropAVX2(SliceBatch *s) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    __m256i piece[4][ARENA_WIDTH], any[4];
+    for (int i = 0; i < 4; i++) {
+        any[i] = zero;
+        for (int c = 0; c < ARENA_WIDTH; c++) {
+            piece[i][c] = SLICE_LOAD(s->piece[i][c]);
+            any[i] = _mm256_or_si256(any[i], piece[i][c]);
+        }
+    }
+    __m256i falling = ones;
+    for (int y = -2; !_mm256_testz_si256(falling, falling); y++) {
+        __m256i coll = zero;
+        for (int i = 0; i < 4; i++) {
+            int row = y + 1 + i;
+            if (row >= ARENA_HEIGHT) {
+                coll = _mm256_or_si256(coll, any[i]);
+            } else if (row >= 0) {
+                for (int c = 0; c < ARENA_WIDTH; c++) {
+                    coll = _mm256_or_si256(
+                        coll, _mm256_and_si256(piece[i][c],
+                                               SLICE_LOAD(s->cells[row][c])));
+                }
+            }
+        }
+        __m256i land = _mm256_and_si256(falling, coll);
+        if (!_mm256_testz_si256(land, land)) {
+            for (int i = 0; i < 4; i++) {
+                int row = y + i;
+                if (row < 0 || row >= ARENA_HEIGHT) {
+                    continue;
+                }
+                for (int c = 0; c < ARENA_WIDTH; c++) {
+                    SLICE_STORE(s->cells[row][c],
+                                _mm256_or_si256(
+                                    SLICE_LOAD(s->cells[row][c]),
+                                    _mm256_and_si256(piece[i][c], land)));
+                }
+            }
+        }
+        falling = _mm256_andnot_si256(coll, falling);
+    }
+
+    __m256i c0 = zero, c1 = zero, c2 = zero;
+    for (int r = ARENA_HEIGHT - 1; r >= 0;) {
+        __m256i full = ones;
+        for (int c = 0; c < ARENA_WIDTH; c++) {
+            full = _mm256_and_si256(full, SLICE_LOAD(s->cells[r][c]));
+        }
+        if (_mm256_testz_si256(full, full)) {
+            r--;
+            continue;
+        }
+        __m256i carry = _mm256_and_si256(c0, full);
+        c0 = _mm256_xor_si256(c0, full);
+        c2 = _mm256_or_si256(c2, _mm256_and_si256(c1, carry));
+        c1 = _mm256_xor_si256(c1, carry);
+        for (int rr = r; rr > 0; rr--) {
+            for (int c = 0; c < ARENA_WIDTH; c++) {
+                // 掩码是按位的，不能用按字节选择的blendv
+                SLICE_STORE(
+                    s->cells[rr][c],
+                    _mm256_or_si256(
+                        _mm256_and_si256(full, SLICE_LOAD(s->cells[rr - 1][c])),
+                        _mm256_andnot_si256(full,
+                                            SLICE_LOAD(s->cells[rr][c]))));
+            }
+        }
+        for (int c = 0; c < ARENA_WIDTH; c++) {
+            SLICE_STORE(s->cells[0][c],
+                        _mm256_andnot_si256(full, SLICE_LOAD(s->cells[0][c])));
+        }
+    }
+    __m256i top = zero, second = zero;
+    for (int c = 0; c < ARENA_WIDTH; c++) {
+        top = _mm256_or_si256(top, SLICE_LOAD(s->cells[0][c]));
+        second = _mm256_or_si256(second, SLICE_LOAD(s->cells[1][c]));
+    }
+    SLICE_STORE(s->lines[0], c0);
+    SLICE_STORE(s->lines[1], c1);
+    SLICE_STORE(s->lines[2], c2);
+    SLICE_STORE(s->over, top);
+    SLICE_STORE(s->crowded, second);
+}
+#endif
+
+// 所有局各放置一个方块，结束的局立即用下一个种子重新开始
+void sliceStep(SliceBatch *s, SliceDropFunc drop) {
+    // 按策略选择动作，把方块写入转置的方块窗口
+    memset(s->piece, 0, sizeof(s->piece));
+    for (int lane = 0; lane < SLICE_LANES; lane++) {
+        int type = s->curType[lane];
+        int action = slicePolicy(s->legal[lane], &s->rng[lane]);
+        int rot = action / ARENA_WIDTH;
+        int x = action % ARENA_WIDTH - pieceMinCol[type][rot];
+        uint64_t bit = 1ULL << (lane & 63);
+        for (int k = 0; k < 4; k++) {
+            const int8_t *cell = sliceCells[type][rot][k];
+            s->piece[cell[0]][x + cell[1]][lane >> 6] |= bit;
+        }
+    }
+
+    drop(s);
+
+    uint64_t reset[SLICE_WORDS] = {0};
+    for (int lane = 0; lane < SLICE_LANES; lane++) {
+        int w = lane >> 6;
+        uint64_t bit = 1ULL << (lane & 63);
+        // 大多数局没有消行、没有结束、出生位置也没有被挡住
+        if (!((s->lines[0][w] | s->lines[1][w] | s->lines[2][w] | s->over[w] |
+               s->crowded[w]) &
+              bit)) {
+            s->curType[lane] = s->nextType[lane];
+            s->nextType[lane] = randomPieceType(&s->rng[lane]);
+            s->legal[lane] = envOpenActions[s->curType[lane]];
+            continue;
+        }
+        int lines = sliceBit(s->lines[0], lane) |
+                    sliceBit(s->lines[1], lane) << 1 |
+                    sliceBit(s->lines[2], lane) << 2;
+        s->score[lane] += lineClearScores[lines] * scoreMultiplier;
+        bool over = sliceBit(s->over, lane);
+        if (!over) {
+            s->curType[lane] = s->nextType[lane];
+            s->nextType[lane] = randomPieceType(&s->rng[lane]);
+            // 顶行为空，合法动作只取决于第二行
+            int second = 0;
+            if (sliceBit(s->crowded, lane)) {
+                for (int c = 0; c < ARENA_WIDTH; c++) {
+                    second |= sliceBit(s->cells[1][c], lane) << c;
+                }
+            }
+            s->legal[lane] = envSpawnActions[s->curType[lane]][second];
+            over = s->legal[lane] == 0;
+        }
+        if (over) {
+            reset[w] |= bit;
+            s->seed[lane] += SLICE_LANES;
+            s->episodes++;
+            sliceResetLane(s, lane);
+        }
+    }
+    s->pieces += SLICE_LANES;
+
+    // 清空重新开始的局的棋盘
+    if (reset[0] | reset[1] | reset[2] | reset[3]) {
+        for (int i = 0; i < ARENA_HEIGHT; i++) {
+            for (int j = 0; j < ARENA_WIDTH; j++) {
+                for (int w = 0; w < SLICE_WORDS; w++) {
+                    s->cells[i][j][w] &= ~reset[w];
+                }
+            }
+        }
+    }
+}
+
+// 逐局的参考实现：与sliceStep()相同的策略和规则，每局一个BitBoard
+typedef struct {
+    BitBoard boards[SLICE_LANES];
+    uint8_t curType[SLICE_LANES], nextType[SLICE_LANES];
+    uint64_t legal[SLICE_LANES];
+    uint32_t rng[SLICE_LANES], seed[SLICE_LANES];
+    int32_t score[SLICE_LANES];
+    long long pieces, episodes;
+} SliceReference;
+
+static void sliceReferenceReset(SliceReference *r, int lane) {
+    memset(&r->boards[lane], 0, sizeof(r->boards[lane]));
+    r->rng[lane] = (uint32_t)mix64(r->seed[lane]) | 1;
+    r->curType[lane] = randomPieceType(&r->rng[lane]);
+    r->nextType[lane] = randomPieceType(&r->rng[lane]);
+    r->legal[lane] = envOpenActions[r->curType[lane]];
+    r->score[lane] = 0;
+}
+
+void sliceReferenceInit(SliceReference *r, uint32_t seed) {
+    if (!envOpenActions[0]) {
+        envInitTables();
+    }
+    memset(r, 0, sizeof(*r));
+    for (int lane = 0; lane < SLICE_LANES; lane++) {
+        r->seed[lane] = seed + lane;
+        sliceReferenceReset(r, lane);
+    }
+}
+
+void sliceReferenceStep(SliceReference *r) {
+    for (int lane = 0; lane < SLICE_LANES; lane++) {
+        BitBoard *board = &r->boards[lane];
+        int type = r->curType[lane];
+        int action = slicePolicy(r->legal[lane], &r->rng[lane]);
+        int rot = action / ARENA_WIDTH;
+        int x = action % ARENA_WIDTH - pieceMinCol[type][rot];
+        int lines =
+            bitLock(board, type, rot, x, envLanding(board, type, rot, x));
+        r->score[lane] += lineClearScores[lines] * scoreMultiplier;
+        bool over = board->rows[0] != 0;
+        if (!over) {
+            r->curType[lane] = r->nextType[lane];
+            r->nextType[lane] = randomPieceType(&r->rng[lane]);
+            r->legal[lane] = envLegalActions(board, r->curType[lane]);
+            over = r->legal[lane] == 0;
+        }
+        if (over) {
+            r->seed[lane] += SLICE_LANES;
+            r->episodes++;
+            sliceReferenceReset(r, lane);
+        }
+    }
+    r->pieces += SLICE_LANES;
+}
+
+// 位切片内核与逐局实现的差分测试和吞吐量比较
+int runSliceBenchmark(unsigned int seed) {
+    enum { CHECK_STEPS = 3000 };
+    static SliceBatch slice;
+    static SliceReference reference;
+    struct {
+        const char *name;
+        SliceDropFunc drop;
+    } kernels[] = {
+        {"scalar64", sliceDropScalar},
+#ifdef HAVE_EVAL_AVX2
+        {"avx2", SDL_HasAVX2() ? sliceDropAVX2 : NULL},
+#endif
+    };
+    int kernelCount = sizeof(kernels) / sizeof(kernels[0]);
+
+    // 差分测试：每一步比较所有局的棋盘、分数和方块
+    for (int k = 0; k < kernelCount; k++) {
+        if (!kernels[k].drop) {
+            continue;
+        }
+        sliceInit(&slice, seed);
+        sliceReferenceInit(&reference, seed);
+        long long mismatches = 0;
+        for (int step = 0; step < CHECK_STEPS; step++) {
+            sliceStep(&slice, kernels[k].drop);
+            sliceReferenceStep(&reference);
+            for (int lane = 0; lane < SLICE_LANES; lane++) {
+                BitBoard board = sliceLaneBoard(&slice, lane);
+                if (memcmp(board.rows, reference.boards[lane].rows,
+                           sizeof(board.rows)) != 0 ||
+                    slice.score[lane] != reference.score[lane] ||
+                    slice.curType[lane] != reference.curType[lane] ||
+                    slice.legal[lane] != reference.legal[lane]) {
+                    mismatches++;
+                }
+            }
+        }
+        printf("differential check (%s): %d steps x %d games, %lld episodes, "
+               "%lld mismatches\n",
+               kernels[k].name, CHECK_STEPS, SLICE_LANES, slice.episodes,
+               mismatches);
+        if (mismatches) {
+            return 1;
+        }
+    }
+
+    // 吞吐量：每种实现各运行约一秒
+    double freq = (double)SDL_GetPerformanceFrequency();
+    double baseline = 0;
+    for (int k = -1; k < kernelCount; k++) {
+        if (k >= 0 && !kernels[k].drop) {
+            continue;
+        }
+        sliceInit(&slice, seed);
+        sliceReferenceInit(&reference, seed);
+        long long pieces = 0;
+        Uint64 start = SDL_GetPerformanceCounter();
+        while (SDL_GetPerformanceCounter() - start < freq) {
+            for (int i = 0; i < 64; i++) {
+                if (k < 0) {
+                    sliceReferenceStep(&reference);
+                } else {
+                    sliceStep(&slice, kernels[k].drop);
+                }
+            }
+            pieces += 64 * SLICE_LANES;
+        }
+        double rate = pieces / ((SDL_GetPerformanceCounter() - start) / freq);
+        if (k < 0) {
+            baseline = rate;
+        }
+        printf("  %-10s %10.0f pieces/s (%.2fx per-board)\n",
+               k < 0 ? "per-board" : kernels[k].name, rate, rate / baseline);
+    }
+    return 0;
+}
+
+// ==================== 内存映射文件 ====================
+
+typedef struct {
+    void *data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file, mapping;
+#else
+    int fd;
+#endif
+} MappedFile;
+
+// 创建（或覆盖）大小为size的文件并映射为可写
+bool mapFileWrite(MappedFile *m, const char *path, size_t size) {
+    memset(m, 0, sizeof(*m));
+    m->size = size;
+#ifdef _WIN32
+    m->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                          CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m->file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    // 创建映射时文件会被扩展到size
+    m->mapping = CreateFileMappingA(m->file, NULL, PAGE_READWRITE,
+                                    (DWORD)((uint64_t)size >> 32),
+                                    (DWORD)size, NULL);
+    m->data = m->mapping ? MapViewOfFile(m->mapping, FILE_MAP_WRITE, 0, 0, size)
+                         : NULL;
+    if (!m->data) {
+        if (m->mapping) {
+            CloseHandle(m->mapping);
+        }
+        CloseHandle(m->file);
+        return false;
+    }
+#else
+    m->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (m->fd < 0) {
+        return false;
+    }
+    if (ftruncate(m->fd, (off_t)size) != 0) {
+        close(m->fd);
+        return false;
+    }
+    m->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+    if (m->data == MAP_FAILED) {
+        m->data = NULL;
+        close(m->fd);
+        return false;
+    }
+#endif
+    return true;
+}
+
+// 只读映射整个文件
+bool mapFileRead(MappedFile *m, const char *path) {
+    memset(m, 0, sizeof(*m));
+#ifdef _WIN32
+    LARGE_INTEGER size;
+    m->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m->file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    if (!GetFileSizeEx(m->file, &size) || size.QuadPart == 0) {
+        CloseHandle(m->file);
+        return false;
+    }
+    m->size = (size_t)size.QuadPart;
+    m->mapping = CreateFileMappingA(m->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    m->data =
+        m->mapping ? MapViewOfFile(m->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (!m->data) {
+        if (m->mapping) {
+            CloseHandle(m->mapping);
+        }
+        CloseHandle(m->file);
+        return false;
+    }
+#else
+    struct stat st;
+    m->fd = open(path, O_RDONLY);
+    if (m->fd < 0) {
+        return false;
+    }
+    if (fstat(m->fd, &st) != 0 || st.st_size == 0) {
+        close(m->fd);
+        return false;
+    }
+    m->size = (size_t)st.st_size;
+    m->data = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, m->fd, 0);
+    if (m->data == MAP_FAILED) {
+        m->data = NULL;
+        close(m->fd);
+        return false;
+    }
+#endif
+    return true;
+}
+
+void unmapFile(MappedFile *m) {
+    if (!m->data) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(m->data);
+    CloseHandle(m->mapping);
+    CloseHandle(m->file);
+#else
+    munmap(m->data, m->size);
+    close(m->fd);
+#endif
+    memset(m, 0, sizeof(*m));
+}
+
+// ==================== 资源包 ====================
+
+// 字体、音效和背景音乐打包成一个文件：开头是目录，每个资源按页对齐连续存放。
+// 运行时只读映射整个资源包，用SDL_RWFromConstMem直接从映射读取资源，
+// 不复制，只有真正用到的页才会从磁盘读入。不在资源包里的资源仍从散文件读取
+#define ASSET_MAGIC 0x4B415054u // "TPAK"
+#define ASSET_VERSION 1
+#define ASSET_ALIGN 4096 // 每个资源的起始偏移按页对齐
+
+typedef struct {
+    char name[48];
+    uint64_t offset; // 资源相对文件开头的偏移
+    uint64_t size;
+} AssetEntry;
+
+typedef struct {
+    uint32_t magic, version;
+    uint32_t count;
+    uint32_t pad;
+    AssetEntry entries[]; // 紧跟在文件头之后的目录
+} AssetHeader;
+
+MappedFile assetPack;
+const AssetHeader *assetHeader; // 打开的资源包，没有时为NULL
+
+// 打开资源包，检查文件头和每一项的范围，失败时保持使用散文件
+bool assetPackOpen(const char *path) {
+    if (!mapFileRead(&assetPack, path)) {
+        return false;
+    }
+    const AssetHeader *h = assetPack.data;
+    bool valid = assetPack.size >= sizeof(AssetHeader) &&
+                 h->magic == ASSET_MAGIC && h->version == ASSET_VERSION &&
+                 h->count <= (assetPack.size - sizeof(AssetHeader)) /
+                                 sizeof(AssetEntry);
+    for (uint32_t i = 0; valid && i < h->count; i++) {
+        const AssetEntry *e = &h->entries[i];
+        valid = memchr(e->name, 0, sizeof(e->name)) &&
+                e->offset <= assetPack.size &&
+                e->size <= assetPack.size - e->offset;
+    }
+    if (!valid) {
+        printf("Ignoring invalid asset pack %s\n", path);
+        unmapFile(&assetPack);
+        return false;
+    }
+    assetHeader = h;
+    return true;
+}
+
+void assetPackClose() {
+    assetHeader = NULL;
+    unmapFile(&assetPack);
+}
+
+static const AssetEntry *assetFind(const char *name) {
+    for (uint32_t i = 0; assetHeader && i < assetHeader->count; i++) {
+        if (strcmp(assetHeader->entries[i].name, name) == 0) {
+            return &assetHeader->entries[i];
+        }
+    }
+    return NULL;
+}
+
+// 打开名为name的资源：优先从资源包的映射读取，否则打开同名散文件，
+// 都没有时返回NULL。返回的SDL_RWops在资源包关闭前有效
+SDL_RWops *assetOpen(const char *name) {
+    const AssetEntry *e = assetFind(name);
+    if (e) {
+        return SDL_RWFromConstMem((const uint8_t *)assetPack.data + e->offset,
+                                  (int)e->size);
+    }
+    return SDL_RWFromFile(name, "rb");
+}
+
+bool assetExists(const char *name) {
+    SDL_RWops *rw = assetOpen(name);
+    if (rw) {
+        SDL_RWclose(rw);
+    }
+    return rw != NULL;
+}
+
+// 把names中存在的散文件打包写入path，返回打包的资源数，失败时返回-1
+int assetPackWrite(const char *path, const char *const *names, int count) {
+    MappedFile *files = calloc(count > 0 ? count : 1, sizeof(MappedFile));
+    if (!files) {
+        return -1;
+    }
+    int packed = 0;
+    uint64_t size = sizeof(AssetHeader);
+    for (int i = 0; i < count; i++) {
+        if (strlen(names[i]) < sizeof(((AssetEntry *)0)->name) &&
+            mapFileRead(&files[i], names[i])) {
+            packed++;
+        }
+    }
+    size += packed * sizeof(AssetEntry);
+    for (int i = 0; i < count; i++) {
+        if (files[i].data) {
+            size = (size + ASSET_ALIGN - 1) & ~(uint64_t)(ASSET_ALIGN - 1);
+            size += files[i].size;
+        }
+    }
+    MappedFile out;
+    bool ok = mapFileWrite(&out, path, (size_t)size);
+    if (ok) {
+        uint8_t *base = out.data;
+        AssetHeader *h = out.data;
+        memset(h, 0, sizeof(AssetHeader) + packed * sizeof(AssetEntry));
+        h->magic = ASSET_MAGIC;
+        h->version = ASSET_VERSION;
+        uint64_t offset = sizeof(AssetHeader) + packed * sizeof(AssetEntry);
+        for (int i = 0; i < count; i++) {
+            if (!files[i].data) {
+                continue;
+            }
+            AssetEntry *e = &h->entries[h->count++];
+            offset = (offset + ASSET_ALIGN - 1) & ~(uint64_t)(ASSET_ALIGN - 1);
+            snprintf(e->name, sizeof(e->name), "%s", names[i]);
+            e->offset = offset;
+            e->size = files[i].size;
+            memcpy(base + offset, files[i].data, files[i].size);
+            offset += files[i].size;
+        }
+        unmapFile(&out);
+    }
+    for (int i = 0; i < count; i++) {
+        unmapFile(&files[i]);
+    }
+    free(files);
+    return ok ? packed : -1;
+}
+
+// ==================== 自我对局数据集 ====================
+
+// 训练数据按分片文件保存：文件开头是索引头，之后每一列（棋盘、当前方块、
+// 下一个方块、落点、奖励、回合结束）各占一段连续的定长数组。文件大小由容量
+// 决定，训练程序可以直接mmap后随机访问第i条记录，不需要解析
+#define SHARD_MAGIC 0x44535454u // "TTSD"
+#define SHARD_VERSION 1
+#define SHARD_ALIGN 64 // 每列的起始偏移按缓存行对齐
+
+enum {
+    SHARD_BOARD,  // uint16_t[ARENA_HEIGHT]，每行一个位掩码
+    SHARD_PIECE,  // uint8_t，当前方块类型
+    SHARD_NEXT,   // uint8_t，下一个方块类型
+    SHARD_ACTION, // uint8_t，旋转状态*ARENA_WIDTH+方块最左一格的列
+    SHARD_REWARD, // float，这一步得到的分数
+    SHARD_DONE,   // uint8_t，这一步之后游戏结束
+    SHARD_COLUMNS
+};
+
+typedef struct {
+    char name[16];
+    uint64_t offset;   // 列数据相对文件开头的偏移
+    uint32_t elemSize; // 每条记录在这一列中的字节数
+    uint32_t pad;
+} ShardColumn;
+
+typedef struct {
+    uint32_t magic, version;
+    uint64_t capacity; // 每列预留的记录数
+    uint64_t count;    // 已写入的记录数，关闭分片时写入
+    uint32_t columnCount;
+    uint32_t arenaWidth, arenaHeight;
+    uint32_t pad;
+    ShardColumn columns[SHARD_COLUMNS];
+} ShardHeader;
+
+static const struct {
+    const char *name;
+    uint32_t elemSize;
+} shardLayout[SHARD_COLUMNS] = {
+    {"board", sizeof(uint16_t) * ARENA_HEIGHT},
+    {"piece", 1},
+    {"next", 1},
+    {"action", 1},
+    {"reward", sizeof(float)},
+    {"done", 1},
+};
+
+typedef struct {
+    MappedFile file;
+    ShardHeader *header;
+    uint16_t (*boards)[ARENA_HEIGHT];
+    uint8_t *pieces, *nexts, *actions, *dones;
+    float *rewards;
+    uint64_t count;
+} ShardWriter;
+
+// 创建能容纳capacity条记录的分片文件
+bool shardOpen(ShardWriter *w, const char *path, uint64_t capacity) {
+    uint64_t offsets[SHARD_COLUMNS];
+    uint64_t size = (sizeof(ShardHeader) + SHARD_ALIGN - 1) & ~(uint64_t)(SHARD_ALIGN - 1);
+    for (int c = 0; c < SHARD_COLUMNS; c++) {
+        offsets[c] = size;
+        size += (capacity * shardLayout[c].elemSize + SHARD_ALIGN - 1) &
+                ~(uint64_t)(SHARD_ALIGN - 1);
+    }
+    memset(w, 0, sizeof(*w));
+    if (!mapFileWrite(&w->file, path, (size_t)size)) {
+        return false;
+    }
+    uint8_t *base = w->file.data;
+    w->header = (ShardHeader *)base;
+    memset(w->header, 0, sizeof(*w->header));
+    w->header->magic = SHARD_MAGIC;
+    w->header->version = SHARD_VERSION;
+    w->header->capacity = capacity;
+    w->header->columnCount = SHARD_COLUMNS;
+    w->header->arenaWidth = ARENA_WIDTH;
+    w->header->arenaHeight = ARENA_HEIGHT;
+    for (int c = 0; c < SHARD_COLUMNS; c++) {
+        snprintf(w->header->columns[c].name, sizeof(w->header->columns[c].name),
+                 "%s", shardLayout[c].name);
+        w->header->columns[c].offset = offsets[c];
+        w->header->columns[c].elemSize = shardLayout[c].elemSize;
+    }
+    w->boards = (void *)(base + offsets[SHARD_BOARD]);
+    w->pieces = base + offsets[SHARD_PIECE];
+    w->nexts = base + offsets[SHARD_NEXT];
+    w->actions = base + offsets[SHARD_ACTION];
+    w->rewards = (float *)(base + offsets[SHARD_REWARD]);
+    w->dones = base + offsets[SHARD_DONE];
+    return true;
+}
+
+static inline void shardAppend(ShardWriter *w, const BitBoard *board,
+                               int piece, int next, int action, float reward,
+                               bool done) {
+    uint64_t i = w->count++;
+    memcpy(w->boards[i], board->rows, sizeof(w->boards[i]));
+    w->pieces[i] = piece;
+    w->nexts[i] = next;
+    w->actions[i] = action;
+    w->rewards[i] = reward;
+    w->dones[i] = done;
+}
+
+// 写入记录数并关闭分片，未写满的部分保持为0
+void shardClose(ShardWriter *w) {
+    if (w->header) {
+        w->header->count = w->count;
+        unmapFile(&w->file);
+    }
+    memset(w, 0, sizeof(*w));
+}
+
+typedef enum { POLICY_GREEDY, POLICY_RANDOM, POLICY_EPSILON } DataPolicy;
+
+typedef struct {
+    const char *prefix;    // 分片文件名前缀
+    DataPolicy policy;
+    float epsilon;         // epsilon策略中随机落子的概率
+    int games, maxPieces;  // 总对局数和每局最多的方块数
+    uint32_t seed;
+    uint64_t shardRecords; // 每个分片的容量
+} DataConfig;
+
+typedef struct {
+    const DataConfig *cfg;
+    SDL_atomic_t nextGame; // 下一个待领取的对局
+    long long records[BOT_MAX_THREADS];
+    int shards[BOT_MAX_THREADS];
+    SDL_atomic_t failed;   // 有线程创建分片失败，其他线程不再领取对局
+} DataJob;
+
+// 按策略选择当前方块的动作（编码与批量环境相同），没有合法动作时返回-1
+static int dataChooseAction(const BitBoard *board, int type,
+                            const DataConfig *cfg, uint32_t *rng) {
+    uint64_t legal = envLegalActions(board, type);
+    if (!legal) {
+        return -1;
+    }
+    bool explore = cfg->policy == POLICY_RANDOM;
+    if (cfg->policy == POLICY_EPSILON) {
+        explore = xorshift32(rng) % 10000 < cfg->epsilon * 10000;
+    }
+    if (explore) {
+        for (int k = xorshift32(rng) % __builtin_popcountll(legal); k > 0;
+             k--) {
+            legal &= legal - 1;
+        }
+        return __builtin_ctzll(legal);
+    }
+
+    // 贪心：只看当前方块的一层评估
+    BitBoard children[ENV_ACTIONS];
+    int actions[ENV_ACTIONS], lines[ENV_ACTIONS];
+    float scores[ENV_ACTIONS];
+    int count = 0;
+    for (; legal; legal &= legal - 1, count++) {
+        int action = __builtin_ctzll(legal);
+        int rot = action / ARENA_WIDTH;
+        int x = action % ARENA_WIDTH - pieceMinCol[type][rot];
+        children[count] = *board;
+        lines[count] = bitLock(&children[count], type, rot, x,
+                               envLanding(board, type, rot, x));
+        actions[count] = action;
+    }
+    botEvaluateBatch(children, lines, count, &botWeights, scores);
+    int best = 0;
+    for (int i = 1; i < count; i++) {
+        if (scores[i] > scores[best]) {
+            best = i;
+        }
+    }
+    return actions[best];
+}
+
+// 每个线程写自己的分片，线程之间只共享对局计数器
+static void dataWork(void *data, int self) {
+    DataJob *job = data;
+    const DataConfig *cfg = job->cfg;
+    ShardWriter w = {0};
+    char path[512];
+    int g;
+    while (!SDL_AtomicGet(&job->failed) &&
+           (g = SDL_AtomicAdd(&job->nextGame, 1)) < cfg->games) {
+        uint32_t rng = (uint32_t)mix64(cfg->seed + g) | 1;
+        BitBoard board;
+        memset(&board, 0, sizeof(board));
+        int type = randomPieceType(&rng), next = randomPieceType(&rng);
+        for (int pieces = 0; pieces < cfg->maxPieces; pieces++) {
+            int action = dataChooseAction(&board, type, cfg, &rng);
+            if (action < 0) {
+                break;
+            }
+            if (w.count == cfg->shardRecords || !w.header) {
+                shardClose(&w);
+                snprintf(path, sizeof(path), "%s-%02d-%04d.bin", cfg->prefix,
+                         self, job->shards[self]);
+                if (!shardOpen(&w, path, cfg->shardRecords)) {
+                    printf("Failed to create shard %s\n", path);
+                    SDL_AtomicSet(&job->failed, 1);
+                    return;
+                }
+                job->shards[self]++;
+            }
+            BitBoard before = board;
+            int rot = action / ARENA_WIDTH;
+            int x = action % ARENA_WIDTH - pieceMinCol[type][rot];
+            int lines = bitLock(&board, type, rot, x,
+                                envLanding(&board, type, rot, x));
+            // 与newPiece()相同：最顶行有方块时游戏结束；下一个方块没有落点
+            // 时同样结束
+            bool done = board.rows[0] != 0 ||
+                        envLegalActions(&board, next) == 0;
+            shardAppend(&w, &before, type, next, action,
+                        (float)(lineClearScores[lines] * scoreMultiplier), done);
+            job->records[self]++;
+            if (done) {
+                break;
+            }
+            type = next;
+            next = randomPieceType(&rng);
+        }
+    }
+    shardClose(&w);
+}
+
+// 多线程自我对局，把记录写入内存映射的分片文件
+int runDataGenerator(const DataConfig *cfg, SearchPool *pool) {
+    static const char *policyNames[] = {"greedy", "random", "epsilon"};
+    static DataJob job;
+    memset(&job, 0, sizeof(job));
+    job.cfg = cfg;
+    if (!envOpenActions[0]) {
+        envInitTables();
+    }
+    int workers = pool && pool->count > 1 ? pool->count : 1;
+    Uint64 start = SDL_GetPerformanceCounter();
+    poolRun(pool, workers, dataWork, &job);
+    double seconds = (double)(SDL_GetPerformanceCounter() - start) /
+                     SDL_GetPerformanceFrequency();
+
+    long long records = 0;
+    int shards = 0;
+    for (int t = 0; t < workers; t++) {
+        records += job.records[t];
+        shards += job.shards[t];
+    }
+    uint64_t recordBytes = 0;
+    for (int c = 0; c < SHARD_COLUMNS; c++) {
+        recordBytes += shardLayout[c].elemSize;
+    }
+    printf("%s policy: %d games, %lld records in %d shards (%s-TT-NNNN.bin)\n",
+           policyNames[cfg->policy], cfg->games, records, shards, cfg->prefix);
+    printf("time %.3f s, %.0f records/s, %.1f MB/s of records (%d bytes each, "
+           "%d threads)\n",
+           seconds, records / seconds, records * recordBytes / seconds / 1e6,
+           (int)recordBytes, workers);
+    return SDL_AtomicGet(&job.failed) ? 1 : 0;
+}
+
+// ==================== 失误分析 ====================
+
+// 一步的分析结果，分数与AI深度为2的搜索一致：放下当前方块后，下一个方块最好落点的评估分数
+typedef struct {
+    float played;            // 玩家落点的分数
+    float best;              // 最佳落点的分数
+    Placement bestPlacement; // 最佳落点
+} MoveAnalysis;
+
+// 与botExpand()从出生位置展开的结果相同，但用强化学习环境的合法动作表和落点计算代替逐个搜索
+static int analyzeExpand(const BitBoard *board, int type, int baseLines,
+                         const BotWeights *w, BitBoard *children, int *lines,
+                         float *scores, Placement *placements) {
+    int count = 0;
+    for (uint64_t legal = envLegalActions(board, type); legal;
+         legal &= legal - 1, count++) {
+        int action = __builtin_ctzll(legal);
+        int rot = action / ARENA_WIDTH;
+        int x = action % ARENA_WIDTH - pieceMinCol[type][rot];
+        placements[count].rotation = rot;
+        placements[count].x = x;
+        placements[count].y = envLanding(board, type, rot, x);
+        children[count] = *board;
+        lines[count] = baseLines + bitLock(&children[count], type, rot, x,
+                                           placements[count].y);
+    }
+    botEvaluateBatch(children, lines, count, w, scores);
+    for (int i = 0; i < count; i++) {
+        if (children[i].rows[0]) {
+            scores[i] = BOT_DEAD_SCORE;
+        }
+    }
+    return count;
+}
+
+// 放下当前方块后的棋盘的分数
+static float analyzeValue(const BitBoard *board, int lines, int nextType,
+                          const BotWeights *w) {
+    if (board->rows[0]) {
+        return BOT_DEAD_SCORE;
+    }
+    Placement placements[BOT_MAX_PLACEMENTS];
+    BitBoard children[BOT_MAX_PLACEMENTS];
+    int childLines[BOT_MAX_PLACEMENTS];
+    float scores[BOT_MAX_PLACEMENTS];
+    int count = analyzeExpand(board, nextType, lines, w, children, childLines,
+                              scores, placements);
+    float value = BOT_DEAD_SCORE;
+    for (int i = 0; i < count; i++) {
+        if (scores[i] > value) {
+            value = scores[i];
+        }
+    }
+    return value;
+}
+
+// 分析一步：枚举当前方块的所有落点找出最好的，再用同样的方法给玩家的落点打分
+void analyzeMove(const ReplayMove *m, const BotWeights *w, MoveAnalysis *out) {
+    BitBoard board;
+    memcpy(board.rows, m->rows, sizeof(board.rows));
+    board.hash = 0;
+    Placement placements[BOT_MAX_PLACEMENTS];
+    BitBoard children[BOT_MAX_PLACEMENTS];
+    int lines[BOT_MAX_PLACEMENTS];
+    float scores[BOT_MAX_PLACEMENTS];
+    int count = analyzeExpand(&board, m->type, 0, w, children, lines, scores,
+                              placements);
+    out->best = BOT_DEAD_SCORE;
+    memset(&out->bestPlacement, 0, sizeof(out->bestPlacement));
+    for (int i = 0; i < count; i++) {
+        float value = analyzeValue(&children[i], lines[i], m->nextType, w);
+        if (i == 0 || value > out->best) {
+            out->best = value;
+            out->bestPlacement = placements[i];
+        }
+    }
+
+    // 玩家的落点直接锁定，不要求在枚举结果中（例如滑入的落点）
+    if (bitCollision(&board, m->type, m->rotation, m->x, m->y)) {
+        out->played = BOT_DEAD_SCORE;
+        return;
+    }
+    BitBoard played = board;
+    int playedLines = bitLock(&played, m->type, m->rotation, m->x, m->y);
+    out->played = analyzeValue(&played, playedLines, m->nextType, w);
+}
+
+// 每一步的分析互不相关，线程按块领取任务
+#define ANALYSIS_CHUNK 16
+
+typedef struct {
+    const Replay *replay;
+    const BotWeights *weights;
+    MoveAnalysis *out;
+    SDL_atomic_t next; // 下一个未领取的步数
+} AnalysisJob;
+
+static void analysisTask(void *arg, int self) {
+    (void)self;
+    AnalysisJob *job = arg;
+    for (;;) {
+        int start = SDL_AtomicAdd(&job->next, ANALYSIS_CHUNK);
+        if (start >= job->replay->count) {
+            return;
+        }
+        int end = start + ANALYSIS_CHUNK;
+        if (end > job->replay->count) {
+            end = job->replay->count;
+        }
+        for (int i = start; i < end; i++) {
+            analyzeMove(&job->replay->moves[i], job->weights, &job->out[i]);
+        }
+    }
+}
+
+// 用线程池分析整局的每一步，pool为NULL时在当前线程中执行
+void analyzeReplay(const Replay *r, const BotWeights *w, MoveAnalysis *out,
+                   SearchPool *pool) {
+    if (!envOpenActions[0]) {
+        envInitTables();
+    }
+    AnalysisJob job = {r, w, out, {0}};
+    int workers = pool && pool->count > 1 ? pool->count : 1;
+    int chunks = (r->count + ANALYSIS_CHUNK - 1) / ANALYSIS_CHUNK;
+    if (workers > chunks) {
+        workers = chunks > 0 ? chunks : 1;
+    }
+    poolRun(pool, workers, analysisTask, &job);
+}
+
+// 找出分数损失最大的top步（损失为0的不算失误），按损失从大到小写入order，返回个数
+int analysisMistakes(const MoveAnalysis *a, int count, int *order, int top) {
+    int found = 0;
+    for (int i = 0; i < count && top > 0; i++) {
+        float drop = a[i].best - a[i].played;
+        if (drop <= 0) {
+            continue;
+        }
+        if (found == top && drop <= a[order[found - 1]].best -
+                                         a[order[found - 1]].played) {
+            continue;
+        }
+        int pos = found < top ? found++ : found - 1;
+        while (pos > 0 && a[order[pos - 1]].best - a[order[pos - 1]].played <
+                              drop) {
+            order[pos] = order[pos - 1];
+            pos--;
+        }
+        order[pos] = i;
+    }
+    return found;
+}
+
+#define ANALYSIS_SCREEN_LINES 5 // 结束界面上显示的失误数
+
+// 结束界面的失误分析
+typedef struct {
+    int moves; // 分析的步数
+    int mistakes;
+    int order[ANALYSIS_SCREEN_LINES];
+    MoveAnalysis top[ANALYSIS_SCREEN_LINES];
+    ReplayMove topMoves[ANALYSIS_SCREEN_LINES];
+} GameAnalysis;
+
+GameAnalysis gameAnalysis = {0};
+
+// 游戏结束时保存对局记录并分析，结果供结束界面显示
+void analyzeFinishedGame(const char *path) {
+    gameReplay.score = session.score;
+    if (path && !replaySave(path, &gameReplay)) {
+        printf("Failed to save replay %s\n", path);
+    }
+    memset(&gameAnalysis, 0, sizeof(gameAnalysis));
+    gameAnalyzed = true;
+    gameAnalysis.moves = gameReplay.count;
+    MoveAnalysis *a = malloc((gameReplay.count + 1) * sizeof(*a));
+    if (!a) {
+        return;
+    }
+    analyzeReplay(&gameReplay, &botWeights, a, &searchPool);
+    gameAnalysis.mistakes = analysisMistakes(a, gameReplay.count,
+                                             gameAnalysis.order,
+                                             ANALYSIS_SCREEN_LINES);
+    for (int k = 0; k < gameAnalysis.mistakes; k++) {
+        gameAnalysis.top[k] = a[gameAnalysis.order[k]];
+        gameAnalysis.topMoves[k] = gameReplay.moves[gameAnalysis.order[k]];
+    }
+    free(a);
+}
+
+// 结束界面：在按钮下方列出损失最大的几步和最佳落点
+void drawAnalysis(SDL_Renderer *renderer) {
+    if (!gameAnalyzed || gameAnalysis.moves == 0) {
+        return;
+    }
+    TTF_Font *font = fontOpen(18);
+    if (!font) {
+        return;
+    }
+    SDL_Color textColor = {255, 255, 255, 255};
+    char line[160];
+    int y = WINDOW_HEIGHT / 2 + 120;
+    for (int k = -1; k < gameAnalysis.mistakes; k++) {
+        if (k < 0) {
+            snprintf(line, sizeof(line),
+                     gameAnalysis.mistakes ? "失误分析（共%d块）："
+                                           : "失误分析（共%d块）：没有失误",
+                     gameAnalysis.moves);
+        } else {
+            const ReplayMove *m = &gameAnalysis.topMoves[k];
+            const MoveAnalysis *a = &gameAnalysis.top[k];
+            snprintf(line, sizeof(line),
+                     "第%d块 %c：实际 旋转%d 第%d列，最佳 旋转%d 第%d列，损失%.1f",
+                     gameAnalysis.order[k] + 1, pieceLetters[m->type],
+                     m->rotation, m->x + pieceMinCol[m->type][m->rotation] + 1,
+                     a->bestPlacement.rotation,
+                     a->bestPlacement.x +
+                         pieceMinCol[m->type][a->bestPlacement.rotation] + 1,
+                     a->best - a->played);
+        }
+        SDL_Surface *textSurface = TTF_RenderUTF8_Solid(font, line, textColor);
+        if (textSurface) {
+            SDL_Texture *textTexture =
+                SDL_CreateTextureFromSurface(renderer, textSurface);
+            if (textTexture) {
+                SDL_Rect textRect = {(WINDOW_WIDTH - textSurface->w) / 2, y,
+                                     textSurface->w, textSurface->h};
+                SDL_RenderCopy(renderer, textTexture, NULL, &textRect);
+                SDL_DestroyTexture(textTexture);
+            }
+            y += textSurface->h + 4;
+            SDL_FreeSurface(textSurface);
+        }
+    }
+}
+
+// 分析保存的对局记录：先用线程池并行分析，再单线程分析一遍核对结果，打印损失最大的top步
+int runReplayAnalysis(const char *path, int top) {
+    Replay replay = {0};
+    if (!replayLoad(path, &replay)) {
+        printf("Failed to load replay %s\n", path);
+        replayFree(&replay);
+        return 1;
+    }
+    MoveAnalysis *a = malloc((replay.count + 1) * sizeof(*a));
+    MoveAnalysis *check = malloc((replay.count + 1) * sizeof(*check));
+    int *order = malloc((top > 0 ? top : 1) * sizeof(*order));
+    if (!a || !check || !order) {
+        free(a);
+        free(check);
+        free(order);
+        replayFree(&replay);
+        return 1;
+    }
+
+    // 动作表只初始化一次，不计入分析时间
+    if (!envOpenActions[0]) {
+        envInitTables();
+    }
+    Uint64 start = SDL_GetPerformanceCounter();
+    analyzeReplay(&replay, &botWeights, a, &searchPool);
+    double seconds = (double)(SDL_GetPerformanceCounter() - start) /
+                     SDL_GetPerformanceFrequency();
+    start = SDL_GetPerformanceCounter();
+    analyzeReplay(&replay, &botWeights, check, NULL);
+    double serial = (double)(SDL_GetPerformanceCounter() - start) /
+                    SDL_GetPerformanceFrequency();
+    int mismatches = 0;
+    for (int i = 0; i < replay.count; i++) {
+        if (memcmp(&a[i], &check[i], sizeof(a[i])) != 0) {
+            mismatches++;
+        }
+    }
+
+    int mistakes = analysisMistakes(a, replay.count, order, top);
+    double totalDrop = 0;
+    int optimal = 0;
+    for (int i = 0; i < replay.count; i++) {
+        totalDrop += a[i].best - a[i].played;
+        optimal += a[i].best - a[i].played <= 0;
+    }
+    printf("%s: %d pieces, score %d, %d best moves (%.1f%%), avg drop %.2f\n",
+           path, replay.count, replay.score, optimal,
+           replay.count ? 100.0 * optimal / replay.count : 0,
+           replay.count ? totalDrop / replay.count : 0);
+    for (int k = 0; k < mistakes; k++) {
+        const ReplayMove *m = &replay.moves[order[k]];
+        const MoveAnalysis *r = &a[order[k]];
+        printf("  piece %4d %c: played rot %d x %2d y %2d (%.2f), best rot %d "
+               "x %2d y %2d (%.2f), drop %.2f\n",
+               order[k] + 1, pieceLetters[m->type], m->rotation, m->x, m->y,
+               r->played, r->bestPlacement.rotation, r->bestPlacement.x,
+               r->bestPlacement.y, r->best, r->best - r->played);
+    }
+    printf("time %.3f ms (%.1f us/piece, threads %d), single thread %.3f ms, "
+           "mismatches %d\n",
+           seconds * 1000, replay.count ? seconds * 1e6 / replay.count : 0,
+           searchPool.count, serial * 1000, mismatches);
+    free(a);
+    free(check);
+    free(order);
+    replayFree(&replay);
+    return mismatches ? 1 : 0;
+}
+
+// 映射一个分片并检查索引头，打印记录统计
+int runShardCheck(const char *path) {
+    MappedFile m;
+    if (!mapFileRead(&m, path)) {
+        printf("Failed to map %s\n", path);
+        return 1;
+    }
+    const ShardHeader *h = m.data;
+    bool valid = m.size >= sizeof(*h) && h->magic == SHARD_MAGIC &&
+                 h->version == SHARD_VERSION &&
+                 h->columnCount == SHARD_COLUMNS &&
+                 h->arenaWidth == ARENA_WIDTH &&
+                 h->arenaHeight == ARENA_HEIGHT && h->count <= h->capacity;
+    for (int c = 0; valid && c < SHARD_COLUMNS; c++) {
+        valid = h->columns[c].elemSize == shardLayout[c].elemSize &&
+                h->columns[c].offset +
+                        h->capacity * h->columns[c].elemSize <= m.size;
+    }
+    if (!valid) {
+        printf("%s is not a valid shard\n", path);
+        unmapFile(&m);
+        return 1;
+    }
+    const uint8_t *base = m.data;
+    const uint8_t *pieces = base + h->columns[SHARD_PIECE].offset;
+    const float *rewards = (const float *)(base + h->columns[SHARD_REWARD].offset);
+    const uint8_t *dones = base + h->columns[SHARD_DONE].offset;
+    long long histogram[7] = {0}, episodes = 0;
+    double reward = 0;
+    for (uint64_t i = 0; i < h->count; i++) {
+        histogram[pieces[i] % 7]++;
+        reward += rewards[i];
+        episodes += dones[i];
+    }
+    printf("%s: %llu / %llu records, %lld game overs, avg reward %.2f\n", path,
+           (unsigned long long)h->count, (unsigned long long)h->capacity,
+           episodes, h->count ? reward / h->count : 0);
+    printf("pieces:");
+    for (int t = 0; t < 7; t++) {
+        printf(" %c %.1f%%", pieceLetters[t],
+               h->count ? 100.0 * histogram[t] / h->count : 0);
+    }
+    printf("\n");
+    unmapFile(&m);
+    return 0;
+}
+
+// 权重在文件中的名称，顺序与BotWeights的字段一致
+static const char *weightNames[] = {"height", "holes", "bumpiness", "wells",
+                                    "lines", "row_transitions",
+                                    "col_transitions"};
+#define WEIGHT_COUNT (int)(sizeof(weightNames) / sizeof(weightNames[0]))
+_Static_assert(sizeof(BotWeights) == sizeof(float) * 7,
+               "weightNames must match BotWeights");
+
+// 从文件读取权重，每行为"名称 数值"，#开头的行为注释，文件不存在时返回false
+bool botLoadWeights(const char *path, BotWeights *w) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    float *values = (float *)w;
+    char line[128];
+    while (fgets(line, sizeof(line), file)) {
+        char name[32];
+        float value;
+        if (line[0] == '#' || sscanf(line, "%31s %f", name, &value) != 2) {
+            continue;
+        }
+        for (int k = 0; k < WEIGHT_COUNT; k++) {
+            if (strcmp(name, weightNames[k]) == 0) {
+                values[k] = value;
+            }
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+bool botSaveWeights(const char *path, const BotWeights *w) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        return false;
+    }
+    const float *values = (const float *)w;
+    fprintf(file, "# Tetris bot evaluation weights\n");
+    for (int k = 0; k < WEIGHT_COUNT; k++) {
+        fprintf(file, "%s %.6f\n", weightNames[k], values[k]);
+    }
+    fclose(file);
+    return true;
+}
+
+#define TUNE_MAX_POPULATION 64 // 每代候选数量上限
+#define TUNE_MAX_GAMES 4096    // 每个候选对局数上限
+
+// 调优参数
+typedef struct {
+    int population;   // 每代候选数量（lambda）
+    int games;        // 每个候选的对局数
+    int maxPieces;    // 每局最多的方块数
+    int generations;  // 本次运行的代数
+    unsigned int seed;
+    int threads;
+    const char *checkpoint; // 检查点文件
+    const char *output;     // 输出的权重文件
+} TuneConfig;
+
+// 调优状态（分离式CMA-ES：协方差矩阵只保留对角线），全部保存到检查点
+typedef struct {
+    int generation;
+    double sigma;                // 步长
+    double mean[WEIGHT_COUNT];   // 分布均值
+    double diag[WEIGHT_COUNT];   // 协方差矩阵的对角线
+    double pc[WEIGHT_COUNT];     // 协方差进化路径
+    double ps[WEIGHT_COUNT];     // 步长进化路径
+    uint64_t rng;                // 采样用的随机数状态
+    double bestFitness;          // 历史最好的候选分数
+    double best[WEIGHT_COUNT];   // 历史最好的候选
+} TuneState;
+
+// 一代中所有对局共享的数据，工作线程按原子计数器领取对局
+typedef struct {
+    BotWeights candidates[TUNE_MAX_POPULATION];
+    int *lines;           // lines[c * games + g]为候选c第g局的消行数
+    long long *pieces;    // 每个工作线程放置的方块数
+    int population, games, maxPieces;
+    uint32_t seedBase;    // 本代对局的种子，所有候选使用同一组种子
+    SDL_atomic_t next;    // 下一个待领取的对局
+} TuneBatch;
+
+typedef struct {
+    TuneBatch *batch;
+    int index;
+} TuneWorkerArg;
+
+static int tuneWorker(void *data) {
+    TuneWorkerArg *arg = data;
+    TuneBatch *batch = arg->batch;
+    int total = batch->population * batch->games;
+    long long pieces = 0;
+    int task;
+    while ((task = SDL_AtomicAdd(&batch->next, 1)) < total) {
+        int c = task / batch->games;
+        int g = task % batch->games;
+        // 调优时只看当前方块和下一个方块，束宽较小以提高速度
+        BotSearchConfig cfg = {.weights = &batch->candidates[c],
+                               .beamWidth = 4,
+                               .depth = 2,
+                               .samples = 1};
+        SimGame game;
+        simReset(&game, batch->seedBase + g);
+        while (game.pieces < batch->maxPieces && simStep(&game, &cfg)) {
+        }
+        batch->lines[task] = game.lines;
+        pieces += game.pieces;
+    }
+    batch->pieces[arg->index] = pieces;
+    return 0;
+}
+
+// 标准正态分布随机数（Box-Muller）
+static double tuneGaussian(uint64_t *state) {
+    double u1, u2;
+    do {
+        *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+        u1 = (double)(*state >> 11) / 9007199254740992.0;
+        *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+        u2 = (double)(*state >> 11) / 9007199254740992.0;
+    } while (u1 <= 1e-300);
+    return sqrt(-2.0 * log(u1)) * cos(6.283185307179586 * u2);
+}
+
+bool tuneSaveCheckpoint(const char *path, const TuneState *st) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "generation %d\nsigma %.17g\nrng %llu\nbest_fitness %.17g\n",
+            st->generation, st->sigma, (unsigned long long)st->rng,
+            st->bestFitness);
+    for (int k = 0; k < WEIGHT_COUNT; k++) {
+        fprintf(file, "%s %.17g %.17g %.17g %.17g %.17g\n", weightNames[k],
+                st->mean[k], st->diag[k], st->pc[k], st->ps[k], st->best[k]);
+    }
+    fclose(file);
+    return true;
+}
+
+bool tuneLoadCheckpoint(const char *path, TuneState *st) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    unsigned long long rng = 0;
+    int ok = fscanf(file, " generation %d sigma %lf rng %llu best_fitness %lf",
+                    &st->generation, &st->sigma, &rng, &st->bestFitness) == 4;
+    st->rng = rng;
+    for (int k = 0; ok && k < WEIGHT_COUNT; k++) {
+        char name[32];
+        ok = fscanf(file, " %31s %lf %lf %lf %lf %lf", name, &st->mean[k],
+                    &st->diag[k], &st->pc[k], &st->ps[k], &st->best[k]) == 6 &&
+             strcmp(name, weightNames[k]) == 0;
+    }
+    fclose(file);
+    return ok;
+}
+
+// 把权重向量缩放为单位长度（评估函数只关心权重的比例）
+static void tuneNormalize(const double *x, BotWeights *w) {
+    double norm = 0;
+    for (int k = 0; k < WEIGHT_COUNT; k++) {
+        norm += x[k] * x[k];
+    }
+    norm = norm > 0 ? sqrt(norm) : 1;
+    float *values = (float *)w;
+    for (int k = 0; k < WEIGHT_COUNT; k++) {
+        values[k] = (float)(x[k] / norm);
+    }
+}
+
+// 用分离式CMA-ES调优评估权重：每代所有候选在同一组种子的对局上比较消行数
+int runTuner(const TuneConfig *cfg) {
+    const int n = WEIGHT_COUNT;
+    int lambda = cfg->population;
+    if (lambda < 4) {
+        lambda = 4;
+    }
+    if (lambda > TUNE_MAX_POPULATION) {
+        lambda = TUNE_MAX_POPULATION;
+    }
+    int games = cfg->games < 1 ? 1 : cfg->games;
+    if (games > TUNE_MAX_GAMES) {
+        games = TUNE_MAX_GAMES;
+    }
+    int threads = cfg->threads < 1 ? 1 : cfg->threads;
+    if (threads > BOT_MAX_THREADS) {
+        threads = BOT_MAX_THREADS;
+    }
+
+    // 重组权重和学习率（Hansen的默认参数，分离式版本放大协方差学习率）
+    int mu = lambda / 2;
+    double recombination[TUNE_MAX_POPULATION];
+    double sum = 0, sumSq = 0;
+    for (int i = 0; i < mu; i++) {
+        recombination[i] = log(mu + 0.5) - log(i + 1.0);
+        sum += recombination[i];
+    }
+    for (int i = 0; i < mu; i++) {
+        recombination[i] /= sum;
+        sumSq += recombination[i] * recombination[i];
+    }
+    double mueff = 1.0 / sumSq;
+    double cs = (mueff + 2) / (n + mueff + 5);
+    double ds = 1 + 2 * fmax(0, sqrt((mueff - 1) / (n + 1)) - 1) + cs;
+    double cc = (4 + mueff / n) / (n + 4 + 2 * mueff / n);
+    double c1 = 2 / ((n + 1.3) * (n + 1.3) + mueff) * (n + 2) / 3.0;
+    double cmu = fmin(1 - c1, 2 * (mueff - 2 + 1 / mueff) /
+                                  ((n + 2) * (n + 2) + mueff) * (n + 2) / 3.0);
+    double chiN = sqrt(n) * (1 - 1.0 / (4 * n) + 1.0 / (21.0 * n * n));
+
+    TuneState st;
+    if (tuneLoadCheckpoint(cfg->checkpoint, &st)) {
+        printf("resuming from %s at generation %d\n", cfg->checkpoint,
+               st.generation);
+    } else {
+        // 从当前权重出发
+        memset(&st, 0, sizeof(st));
+        const float *start = (const float *)&botWeights;
+        for (int k = 0; k < n; k++) {
+            st.mean[k] = start[k];
+            st.diag[k] = 1;
+        }
+        st.sigma = 0.2;
+        st.rng = mix64(cfg->seed) | 1;
+        st.bestFitness = -1;
+    }
+
+    TuneBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.population = lambda;
+    batch.games = games;
+    batch.maxPieces = cfg->maxPieces;
+    batch.lines = malloc(sizeof(int) * lambda * games);
+    batch.pieces = malloc(sizeof(long long) * threads);
+    if (!batch.lines || !batch.pieces) {
+        printf("Out of memory!\n");
+        free(batch.lines);
+        free(batch.pieces);
+        return 1;
+    }
+
+    printf("tuning %d weights: population %d, %d games x %d pieces, "
+           "%d threads\n",
+           n, lambda, games, cfg->maxPieces, threads);
+
+    int lastGeneration = st.generation + cfg->generations;
+    while (st.generation < lastGeneration) {
+        // 采样候选：x = mean + sigma * sqrt(diag) * z
+        double z[TUNE_MAX_POPULATION][WEIGHT_COUNT];
+        double x[TUNE_MAX_POPULATION][WEIGHT_COUNT];
+        for (int c = 0; c < lambda; c++) {
+            for (int k = 0; k < n; k++) {
+                z[c][k] = tuneGaussian(&st.rng);
+                x[c][k] = st.mean[k] + st.sigma * sqrt(st.diag[k]) * z[c][k];
+            }
+            tuneNormalize(x[c], &batch.candidates[c]);
+        }
+
+        // 所有候选使用同一组种子（公共随机数），减少比较的方差
+        batch.seedBase = cfg->seed + (uint32_t)st.generation * games;
+        SDL_AtomicSet(&batch.next, 0);
+        Uint64 start = SDL_GetPerformanceCounter();
+        SDL_Thread *workers[BOT_MAX_THREADS];
+        TuneWorkerArg args[BOT_MAX_THREADS];
+        int started = 0;
+        for (int t = 1; t < threads; t++) {
+            args[t].batch = &batch;
+            args[t].index = t;
+            workers[t] = SDL_CreateThread(tuneWorker, "tune", &args[t]);
+            if (!workers[t]) {
+                break;
+            }
+            started = t;
+        }
+        args[0].batch = &batch;
+        args[0].index = 0;
+        tuneWorker(&args[0]);
+        long long pieces = batch.pieces[0];
+        for (int t = 1; t <= started; t++) {
+            SDL_WaitThread(workers[t], NULL);
+            pieces += batch.pieces[t];
+        }
+        double seconds = (double)(SDL_GetPerformanceCounter() - start) /
+                         SDL_GetPerformanceFrequency();
+        if (seconds <= 0) {
+            seconds = 1e-9;
+        }
+
+        // 候选的分数为平均消行数，按分数从高到低排序
+        double fitness[TUNE_MAX_POPULATION];
+        int order[TUNE_MAX_POPULATION];
+        double meanFitness = 0;
+        for (int c = 0; c < lambda; c++) {
+            long long total = 0;
+            for (int g = 0; g < games; g++) {
+                total += batch.lines[c * games + g];
+            }
+            fitness[c] = (double)total / games;
+            meanFitness += fitness[c] / lambda;
+            int pos = c;
+            while (pos > 0 && fitness[order[pos - 1]] < fitness[c]) {
+                order[pos] = order[pos - 1];
+                pos--;
+            }
+            order[pos] = c;
+        }
+        if (fitness[order[0]] > st.bestFitness) {
+            st.bestFitness = fitness[order[0]];
+            for (int k = 0; k < n; k++) {
+                st.best[k] = x[order[0]][k];
+            }
+        }
+
+        // 更新均值和进化路径
+        double yw[WEIGHT_COUNT] = {0};
+        double psNorm = 0;
+        for (int k = 0; k < n; k++) {
+            double old = st.mean[k];
+            st.mean[k] = 0;
+            for (int i = 0; i < mu; i++) {
+                st.mean[k] += recombination[i] * x[order[i]][k];
+            }
+            yw[k] = (st.mean[k] - old) / st.sigma;
+            st.ps[k] = (1 - cs) * st.ps[k] +
+                       sqrt(cs * (2 - cs) * mueff) * yw[k] / sqrt(st.diag[k]);
+            psNorm += st.ps[k] * st.ps[k];
+        }
+        psNorm = sqrt(psNorm);
+        bool hsig = psNorm / sqrt(1 - pow(1 - cs, 2 * (st.generation + 1))) <
+                    (1.4 + 2.0 / (n + 1)) * chiN;
+        for (int k = 0; k < n; k++) {
+            st.pc[k] = (1 - cc) * st.pc[k] +
+                       (hsig ? sqrt(cc * (2 - cc) * mueff) * yw[k] : 0);
+            double rankMu = 0;
+            for (int i = 0; i < mu; i++) {
+                double y = sqrt(st.diag[k]) * z[order[i]][k];
+                rankMu += recombination[i] * y * y;
+            }
+            st.diag[k] = (1 - c1 - cmu) * st.diag[k] +
+                         c1 * (st.pc[k] * st.pc[k] +
+                               (hsig ? 0 : cc * (2 - cc) * st.diag[k])) +
+                         cmu * rankMu;
+        }
+        st.sigma *= exp((cs / ds) * (psNorm / chiN - 1));
+        st.generation++;
+
+        // 每代都保存检查点和当前均值对应的权重
+        BotWeights result;
+        tuneNormalize(st.mean, &result);
+        if (!tuneSaveCheckpoint(cfg->checkpoint, &st)) {
+            printf("Failed to write checkpoint %s\n", cfg->checkpoint);
+        }
+        if (!botSaveWeights(cfg->output, &result)) {
+            printf("Failed to write weights %s\n", cfg->output);
+        }
+
+        printf("gen %d: best %.2f, mean %.2f lines (best ever %.2f), "
+               "sigma %.4f, %.1f games/s (%.1f per core), %.0f pieces/s\n",
+               st.generation, fitness[order[0]], meanFitness, st.bestFitness,
+               st.sigma, lambda * games / seconds,
+               lambda * games / seconds / (started + 1), pieces / seconds);
+        const float *values = (const float *)&result;
+        printf("  weights:");
+        for (int k = 0; k < n; k++) {
+            printf(" %s=%.4f", weightNames[k], values[k]);
+        }
+        printf("\n");
+    }
+
+    free(batch.lines);
+    free(batch.pieces);
+    return 0;
+}
+
+// ==================== 成绩验证 ====================
+
+// 提交的成绩附带输入记录（inputLogSave），验证时从种子开始把每个操作重新
+// 执行一遍，得到的分数与声称的分数一致才接受。每个文件互不相关，
+// 批量验证时线程池的线程按块领取文件
+#define VERIFY_CHUNK 4
+#define VERIFY_BATCH 256 // 从标准输入读取路径时每批验证的文件数
+
+// 映射到内存中的一份输入记录
+typedef struct {
+    uint32_t seed;
+    int count;       // 操作数
+    int claimed;     // 声称的分数
+    int multiplier;  // 分数倍数
+    int interval;    // 检查点间隔
+    int checkpointCount;
+    const uint8_t *inputs;
+    const uint8_t *checkpoints; // 可能没有对齐，用inputLogSnapshot()读取
+} InputLogView;
+
+bool inputLogParse(const void *data, size_t size, InputLogView *v) {
+    int32_t header[INPUT_LOG_HEADER];
+    memset(v, 0, sizeof(*v));
+    if (size < sizeof(header)) {
+        return false;
+    }
+    memcpy(header, data, sizeof(header));
+    if (header[0] != INPUT_LOG_MAGIC || header[2] < 0 || header[4] < 1 ||
+        header[4] > 9 || header[5] < 1) {
+        return false;
+    }
+    v->seed = (uint32_t)header[1];
+    v->count = header[2];
+    v->claimed = header[3];
+    v->multiplier = header[4];
+    v->interval = header[5];
+    v->checkpointCount = v->count / v->interval;
+    v->inputs = (const uint8_t *)data + sizeof(header);
+    v->checkpoints = v->inputs + v->count;
+    return size == sizeof(header) + (size_t)v->count +
+                       (size_t)v->checkpointCount * sizeof(InputSnapshot);
+}
+
+// 第k个检查点（第(k+1)*interval个操作之后）的快照
+void inputLogSnapshot(const InputLogView *v, int k, InputSnapshot *snap) {
+    memcpy(snap, v->checkpoints + (size_t)k * sizeof(*snap), sizeof(*snap));
+}
+
+// 第k个检查点的状态哈希链（快照的第一个字段），二分查找时只读这一个字段
+uint64_t inputLogCheckpoint(const InputLogView *v, int k) {
+    uint64_t chain;
+    memcpy(&chain, v->checkpoints + (size_t)k * sizeof(InputSnapshot),
+           sizeof(chain));
+    return chain;
+}
+
+typedef enum {
+    VERIFY_ACCEPT,
+    VERIFY_UNREADABLE,    // 文件无法打开
+    VERIFY_BAD_HEADER,    // 文件头或长度不对
+    VERIFY_BAD_INPUT,     // 未知的操作
+    VERIFY_NO_EFFECT,     // 记录了不生效的操作，正常客户端不会写入
+    VERIFY_AFTER_OVER,    // 游戏结束后还有操作
+    VERIFY_HASH_MISMATCH, // 检查点的快照与重新模拟的不同
+    VERIFY_SCORE_MISMATCH,
+} VerifyStatus;
+
+const char *verifyReasons[] = {"ok",
+                               "unreadable",
+                               "bad header",
+                               "unknown input",
+                               "input without effect",
+                               "input after game over",
+                               "state hash mismatch",
+                               "score mismatch"};
+
+typedef struct {
+    VerifyStatus status;
+    int claimed; // 文件声称的分数
+    int score;   // 重新模拟得到的分数
+    int lines;
+    int pieces;
+    int inputs;
+    int at;      // 出错的操作序号
+    uint32_t seed;
+} VerifyResult;
+
+// 验证内存中的一份输入记录
+void verifyInputs(const void *data, size_t size, VerifyResult *r) {
+    memset(r, 0, sizeof(*r));
+    InputLogView v;
+    if (!inputLogParse(data, size, &v)) {
+        r->status = VERIFY_BAD_HEADER;
+        return;
+    }
+    r->seed = v.seed;
+    r->inputs = v.count;
+    r->claimed = v.claimed;
+    GameSession s;
+    resetGame(&s, v.seed, v.multiplier);
+    for (int i = 0; i < v.count; i++) {
+        r->at = i;
+        if (s.gameOver) {
+            r->status = VERIFY_AFTER_OVER;
+            break;
+        }
+        if (v.inputs[i] < GAME_INPUT_LEFT || v.inputs[i] > GAME_INPUT_CLEAR) {
+            r->status = VERIFY_BAD_INPUT;
+            break;
+        }
+        if (!applyInput(&s, v.inputs[i])) {
+            r->status = VERIFY_NO_EFFECT;
+            break;
+        }
+        if ((i + 1) % v.interval == 0) {
+            InputSnapshot recorded, replayed;
+            inputLogSnapshot(&v, (i + 1) / v.interval - 1, &recorded);
+            sessionSnapshot(&s, &replayed);
+            if (memcmp(&recorded, &replayed, sizeof(recorded)) != 0) {
+                r->status = VERIFY_HASH_MISMATCH;
+                break;
+            }
+        }
+    }
+    r->score = s.score;
+    r->lines = s.lines;
+    r->pieces = s.pieceCount;
+    if (r->status == VERIFY_ACCEPT && r->score != r->claimed) {
+        r->status = VERIFY_SCORE_MISMATCH;
+    }
+}
+
+void verifyFile(const char *path, VerifyResult *r) {
+    MappedFile m;
+    if (!mapFileRead(&m, path)) {
+        memset(r, 0, sizeof(*r));
+        r->status = VERIFY_UNREADABLE;
+        return;
+    }
+    verifyInputs(m.data, m.size, r);
+    unmapFile(&m);
+}
+
+typedef struct {
+    char **paths;
+    VerifyResult *out;
+    int count;
+    SDL_atomic_t next; // 下一个未领取的文件
+} VerifyJob;
+
+static void verifyTask(void *arg, int self) {
+    (void)self;
+    VerifyJob *job = arg;
+    for (;;) {
+        int start = SDL_AtomicAdd(&job->next, VERIFY_CHUNK);
+        if (start >= job->count) {
+            return;
+        }
+        int end = start + VERIFY_CHUNK;
+        if (end > job->count) {
+            end = job->count;
+        }
+        for (int i = start; i < end; i++) {
+            verifyFile(job->paths[i], &job->out[i]);
+        }
+    }
+}
+
+// 用线程池验证一批文件，打印每个文件的结果，返回被拒绝的数量
+int verifyBatch(char **paths, int count, VerifyResult *out, SearchPool *pool) {
+    VerifyJob job = {paths, out, count, {0}};
+    int workers = pool->count > 1 ? pool->count : 1;
+    poolRun(pool, workers, verifyTask, &job);
+    int rejected = 0;
+    for (int i = 0; i < count; i++) {
+        const VerifyResult *r = &out[i];
+        if (r->status == VERIFY_ACCEPT) {
+            printf("ACCEPT %s score %d lines %d pieces %d\n", paths[i],
+                   r->score, r->lines, r->pieces);
+            continue;
+        }
+        rejected++;
+        if (r->status == VERIFY_UNREADABLE || r->status == VERIFY_BAD_HEADER) {
+            printf("REJECT %s %s\n", paths[i], verifyReasons[r->status]);
+        } else if (r->status == VERIFY_SCORE_MISMATCH) {
+            printf("REJECT %s %s (claimed %d, recomputed %d)\n", paths[i],
+                   verifyReasons[r->status], r->claimed, r->score);
+        } else {
+            printf("REJECT %s %s at input %d (claimed %d, recomputed %d)\n",
+                   paths[i], verifyReasons[r->status], r->at, r->claimed,
+                   r->score);
+        }
+    }
+    fflush(stdout);
+    return rejected;
+}
+
+typedef struct {
+    char **paths;
+    int count;
+    int capacity;
+} PathList;
+
+bool pathListAdd(PathList *list, const char *path) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 256;
+        char **paths = realloc(list->paths, capacity * sizeof(*paths));
+        if (!paths) {
+            return false;
+        }
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+    char *copy = strdup(path);
+    if (!copy) {
+        return false;
+    }
+    list->paths[list->count++] = copy;
+    return true;
+}
+
+void pathListClear(PathList *list) {
+    for (int i = 0; i < list->count; i++) {
+        free(list->paths[i]);
+    }
+    list->count = 0;
+}
+
+// 列出目录中所有.inp文件，path不是目录时返回false
+bool listInputFiles(const char *dir, PathList *list) {
+    char path[1024];
+#ifdef _WIN32
+    DWORD attributes = GetFileAttributesA(dir);
+    if (attributes == INVALID_FILE_ATTRIBUTES ||
+        !(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        return false;
+    }
+    WIN32_FIND_DATAA entry;
+    snprintf(path, sizeof(path), "%s\\*.inp", dir);
+    HANDLE find = FindFirstFileA(path, &entry);
+    if (find == INVALID_HANDLE_VALUE) {
+        return true;
+    }
+    do {
+        snprintf(path, sizeof(path), "%s\\%s", dir, entry.cFileName);
+        pathListAdd(list, path);
+    } while (FindNextFileA(find, &entry));
+    FindClose(find);
+#else
+    DIR *d = opendir(dir);
+    if (!d) {
+        return false;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d))) {
+        size_t length = strlen(entry->d_name);
+        if (length > 4 && strcmp(entry->d_name + length - 4, ".inp") == 0) {
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            pathListAdd(list, path);
+        }
+    }
+    closedir(d);
+#endif
+    return true;
+}
+
+static int comparePaths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// 验证提交的输入记录。path可以是一个文件、一个目录（验证其中所有.inp文件），
+// 或"-"：从标准输入逐行读取路径，每读满一批就验证并输出结果
+int runVerify(const char *path) {
+    PathList list = {0};
+    VerifyResult *out = NULL;
+    int total = 0, rejected = 0;
+    Uint64 start = SDL_GetPerformanceCounter();
+    if (strcmp(path, "-") == 0) {
+        out = malloc(VERIFY_BATCH * sizeof(*out));
+        char line[1024];
+        bool more = out != NULL;
+        while (more) {
+            more = fgets(line, sizeof(line), stdin) != NULL;
+            if (more) {
+                line[strcspn(line, "\r\n")] = '\0';
+                if (line[0] && !pathListAdd(&list, line)) {
+                    break;
+                }
+            }
+            if (list.count == VERIFY_BATCH || (!more && list.count > 0)) {
+                rejected += verifyBatch(list.paths, list.count, out,
+                                        &searchPool);
+                total += list.count;
+                pathListClear(&list);
+            }
+        }
+    } else {
+        if (listInputFiles(path, &list)) {
+            qsort(list.paths, list.count, sizeof(*list.paths), comparePaths);
+        } else {
+            pathListAdd(&list, path);
+        }
+        out = malloc((list.count + 1) * sizeof(*out));
+        if (out) {
+            rejected = verifyBatch(list.paths, list.count, out, &searchPool);
+            total = list.count;
+        }
+    }
+    double seconds = (double)(SDL_GetPerformanceCounter() - start) /
+                     SDL_GetPerformanceFrequency();
+    int workers = searchPool.count > 1 ? searchPool.count : 1;
+    printf("verified %d files: %d accepted, %d rejected, %.3f s, "
+           "%.0f verifications/s (%.0f per worker, threads %d)\n",
+           total, total - rejected, rejected, seconds,
+           seconds > 0 ? total / seconds : 0,
+           seconds > 0 ? total / seconds / workers : 0, workers);
+    pathListClear(&list);
+    free(list.paths);
+    free(out);
+    return rejected || !out ? 1 : 0;
+}
+
+// 操作的名称，用于打印
+const char *gameInputNames[] = {"none", "left",    "right", "down",
+                                "rotate", "drop", "gravity", "clear"};
+
+static const char *inputName(const InputLogView *v, int i) {
+    if (i >= v->count) {
+        return "end";
+    }
+    return v->inputs[i] <= GAME_INPUT_CLEAR ? gameInputNames[v->inputs[i]]
+                                            : "invalid";
+}
+
+// 找出两份输入记录第一个不同的操作。状态哈希链的每个值都包含之前的全部历史，
+// 一旦不同之后就一直不同，所以先在检查点上二分查找第一个不同的检查点，
+// 只需比较O(log n)个哈希；再从前一个（最后一个相同的）检查点的快照恢复两局，
+// 只重新模拟这一个检查点间隔，逐个操作比较链值得到确切位置。
+// 记录的哈希不同但操作相同时，说明记录来自行为不同的版本
+int runDiverge(const char *pathA, const char *pathB) {
+    MappedFile fa, fb;
+    InputLogView a, b;
+    if (!mapFileRead(&fa, pathA)) {
+        printf("Failed to map %s\n", pathA);
+        return 1;
+    }
+    if (!mapFileRead(&fb, pathB)) {
+        printf("Failed to map %s\n", pathB);
+        unmapFile(&fa);
+        return 1;
+    }
+    bool validA = inputLogParse(fa.data, fa.size, &a);
+    if (!validA || !inputLogParse(fb.data, fb.size, &b)) {
+        printf("%s is not a valid input log\n", validA ? pathB : pathA);
+        unmapFile(&fa);
+        unmapFile(&fb);
+        return 1;
+    }
+    if (a.seed != b.seed) {
+        printf("logs diverge before the first input: seeds %u and %u\n",
+               a.seed, b.seed);
+        unmapFile(&fa);
+        unmapFile(&fb);
+        return 1;
+    }
+    Uint64 begin = SDL_GetPerformanceCounter();
+    int common = a.count < b.count ? a.count : b.count;
+    int n = a.checkpointCount < b.checkpointCount ? a.checkpointCount
+                                                  : b.checkpointCount;
+    if (a.interval != b.interval) {
+        n = 0; // 检查点不能对应，只能从头逐个比较
+    }
+    int lo = 0, hi = n, probes = 0;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        probes++;
+        if (inputLogCheckpoint(&a, mid) == inputLogCheckpoint(&b, mid)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    int start = lo * a.interval; // lo大于0时两份记录的检查点间隔相同
+    int end = lo < n ? (lo + 1) * a.interval : common;
+
+    // 从最后一个相同的检查点开始同时重新模拟两份记录，直到第一个不同的检查点
+    GameSession sa, sb;
+    if (lo > 0) {
+        InputSnapshot snap;
+        inputLogSnapshot(&a, lo - 1, &snap);
+        sessionRestore(&sa, &snap, a.multiplier);
+        inputLogSnapshot(&b, lo - 1, &snap);
+        sessionRestore(&sb, &snap, b.multiplier);
+    } else {
+        resetGame(&sa, a.seed, a.multiplier);
+        resetGame(&sb, b.seed, b.multiplier);
+    }
+    int tick = -1;
+    int localA = -1, localB = -1; // 本地模拟与记录的检查点第一次不同的位置
+    int simulated = 0;
+    for (int i = start; i < end && tick < 0; i++, simulated++) {
+        bool okA = !sa.gameOver && applyInput(&sa, a.inputs[i]);
+        bool okB = !sb.gameOver && applyInput(&sb, b.inputs[i]);
+        if (!okA || !okB || sa.chain != sb.chain) {
+            tick = i;
+        }
+        if ((i + 1) % a.interval == 0 && a.interval == b.interval) {
+            int k = (i + 1) / a.interval - 1;
+            if (localA < 0 && inputLogCheckpoint(&a, k) != sa.chain) {
+                localA = i;
+            }
+            if (localB < 0 && inputLogCheckpoint(&b, k) != sb.chain) {
+                localB = i;
+            }
+        }
+    }
+    double ms = (double)(SDL_GetPerformanceCounter() - begin) * 1000 /
+                SDL_GetPerformanceFrequency();
+
+    printf("%s: %d inputs, %s: %d inputs, %d checkpoints every %d inputs\n",
+           pathA, a.count, pathB, b.count, n, a.interval);
+    printf("binary search: %d hash comparisons, re-simulated %d inputs from "
+           "input #%d in %.3f ms\n",
+           probes, simulated, start, ms);
+    int result = 1;
+    if (tick >= 0) {
+        printf("first divergent input #%d: %s vs %s (score %d vs %d, "
+               "piece %d vs %d)\n",
+               tick, inputName(&a, tick), inputName(&b, tick), sa.score,
+               sb.score, sa.pieceCount, sb.pieceCount);
+    } else if (lo < n) {
+        // 操作相同，只有记录的哈希不同
+        printf("recorded hashes differ at checkpoint %d (inputs #%d-#%d) "
+               "but the inputs replay identically; this build matches %s\n",
+               lo, lo * a.interval, end - 1,
+               localA < 0 && localB < 0 ? "both"
+               : localA < 0             ? pathA
+               : localB < 0             ? pathB
+                                        : "neither");
+    } else if (a.count != b.count) {
+        printf("logs agree on the first %d inputs; %s continues with %s\n",
+               common, a.count > b.count ? pathA : pathB,
+               a.count > b.count ? inputName(&a, common)
+                                 : inputName(&b, common));
+    } else {
+        printf("logs are identical\n");
+        result = 0;
+    }
+    unmapFile(&fa);
+    unmapFile(&fb);
+    return result;
+}
+
+// ==================== 多进程集群自我对局 ====================
+
+// 协调者把带种子的对局批次通过TCP或Unix套接字分给工作进程，工作进程每完成一局
+// 就发回一条定长记录。连接断开或长时间没有消息的工作进程，其未完成的批次重新排队。
+// 消息是定长结构体，按本机字节序传输（各平台都是小端）
+
+#ifdef _WIN32
+typedef SOCKET ClusterSocket;
+typedef HANDLE ClusterProcess;
+#define CLUSTER_NO_SOCKET INVALID_SOCKET
+#define clusterCloseSocket closesocket
+#define clusterPoll WSAPoll
+#else
+typedef int ClusterSocket;
+typedef pid_t ClusterProcess;
+#define CLUSTER_NO_SOCKET -1
+#define clusterCloseSocket close
+#define clusterPoll poll
+#endif
+
+#define CLUSTER_MAGIC 0x4c435254 // 握手记录"TRCL"
+#define CLUSTER_MAX_CONNS 64      // 同时连接的工作进程上限
+#define CLUSTER_TIMEOUT 30000     // 有任务的工作进程多久没有消息就视为失败（毫秒）
+
+enum {
+    CLUSTER_HELLO = 1, // 工作进程连接后发送
+    CLUSTER_RESULT,    // 一局的结果
+    CLUSTER_DONE,      // 一批全部完成
+    CLUSTER_BATCH,     // 协调者分配一批对局
+    CLUSTER_STOP,      // 协调者通知工作进程退出
+};
+
+// 工作进程发给协调者的记录
+typedef struct {
+    int32_t type;   // CLUSTER_HELLO / CLUSTER_RESULT / CLUSTER_DONE
+    int32_t game;   // HELLO为CLUSTER_MAGIC，RESULT为对局编号，DONE为批次编号
+    int32_t pieces; // HELLO为进程号
+    int32_t lines;
+    int32_t score;
+} ClusterRecord;
+
+// 协调者发给工作进程的一批对局，第g局的种子为seed + g
+typedef struct {
+    int32_t type; // CLUSTER_BATCH / CLUSTER_STOP
+    int32_t batch;
+    int32_t firstGame;
+    int32_t games;
+    int32_t maxPieces;
+    uint32_t seed;
+    int32_t beamWidth, depth, samples;
+    BotWeights weights;
+} ClusterBatch;
+
+// 协调者参数
+typedef struct {
+    const char *listen;   // 监听地址，HOST:PORT或unix:PATH
+    const char *exe;      // 启动本机工作进程用的程序路径
+    int localWorkers;     // 启动的本机工作进程数
+    int games, maxPieces;
+    uint32_t seed;
+    int batchGames;       // 每批对局数
+    int crashAfter;       // 大于0时第一个本机工作进程完成这么多局后直接退出（故障测试）
+} ClusterConfig;
+
+// 一次集群运行的汇总
+typedef struct {
+    double seconds;
+    long long pieces, lines, score;
+    int games;
+    int requeued; // 重新排队的批次数
+    int workers;  // 连接过的工作进程数
+} ClusterStats;
+
+// 一个工作进程的连接，记录按字节读入buffer，凑满一条再处理
+typedef struct {
+    ClusterSocket socket;
+    int batch;   // 正在进行的批次，-1表示空闲
+    bool hello;  // 是否已经握手
+    int id;      // 连接编号（接受的顺序），压缩连接数组后不变
+    int pid;     // 工作进程报告的进程号，只用于日志
+    Uint32 lastSeen;
+    int have;
+    ClusterRecord buffer;
+} ClusterConn;
+
+bool clusterNetInit() {
+#ifdef _WIN32
+    WSADATA data;
+    return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+#else
+    // 对方断开后写套接字不应该终止进程
+    signal(SIGPIPE, SIG_IGN);
+    return true;
+#endif
+}
+
+void clusterNetQuit() {
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+// 解析地址：unix:PATH为Unix套接字，否则为HOST:PORT的TCP地址
+static bool clusterAddress(const char *spec, struct sockaddr_storage *addr,
+                           socklen_t *length) {
+    memset(addr, 0, sizeof(*addr));
+    if (strncmp(spec, "unix:", 5) == 0) {
+#ifdef _WIN32
+        printf("Unix sockets are not supported on this platform\n");
+        return false;
+#else
+        struct sockaddr_un *un = (struct sockaddr_un *)addr;
+        if (strlen(spec + 5) >= sizeof(un->sun_path)) {
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, spec + 5);
+        *length = sizeof(*un);
+        return true;
+#endif
+    }
+    char host[256];
+    const char *colon = strrchr(spec, ':');
+    if (!colon || colon - spec >= (int)sizeof(host)) {
+        return false;
+    }
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host[0] ? host : NULL, colon + 1, &hints, &result) != 0) {
+        return false;
+    }
+    memcpy(addr, result->ai_addr, result->ai_addrlen);
+    *length = (socklen_t)result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+// 记录很小，关闭Nagle算法避免攒包延迟（Unix套接字上会失败，忽略即可）
+static void clusterNoDelay(ClusterSocket s) {
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&one, sizeof(one));
+}
+
+// 监听spec，actual写入工作进程应该连接的地址（端口为0时是系统分配的端口）
+ClusterSocket clusterListen(const char *spec, char *actual, int size) {
+    struct sockaddr_storage addr;
+    socklen_t length;
+    if (!clusterAddress(spec, &addr, &length)) {
+        return CLUSTER_NO_SOCKET;
+    }
+    ClusterSocket s = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (s == CLUSTER_NO_SOCKET) {
+        return s;
+    }
+#ifndef _WIN32
+    if (addr.ss_family == AF_UNIX) {
+        unlink(((struct sockaddr_un *)&addr)->sun_path);
+    }
+#endif
+    int one = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char *)&one, sizeof(one));
+    if (bind(s, (struct sockaddr *)&addr, length) != 0 ||
+        listen(s, CLUSTER_MAX_CONNS) != 0) {
+        clusterCloseSocket(s);
+        return CLUSTER_NO_SOCKET;
+    }
+    snprintf(actual, size, "%s", spec);
+    if (addr.ss_family == AF_INET) {
+        struct sockaddr_in bound;
+        socklen_t boundLength = sizeof(bound);
+        getsockname(s, (struct sockaddr *)&bound, &boundLength);
+        // 监听所有网卡时本机工作进程连接回环地址
+        char host[64];
+        inet_ntop(AF_INET, &bound.sin_addr, host, sizeof(host));
+        snprintf(actual, size, "%s:%d",
+                 bound.sin_addr.s_addr == htonl(INADDR_ANY) ? "127.0.0.1"
+                                                            : host,
+                 ntohs(bound.sin_port));
+    }
+    return s;
+}
+
+// 连接协调者，协调者可能还没开始监听，失败时重试几秒
+ClusterSocket clusterConnect(const char *spec) {
+    struct sockaddr_storage addr;
+    socklen_t length;
+    if (!clusterAddress(spec, &addr, &length)) {
+        return CLUSTER_NO_SOCKET;
+    }
+    for (int attempt = 0; attempt < 50; attempt++) {
+        ClusterSocket s = socket(addr.ss_family, SOCK_STREAM, 0);
+        if (s == CLUSTER_NO_SOCKET) {
+            return s;
+        }
+        if (connect(s, (struct sockaddr *)&addr, length) == 0) {
+            clusterNoDelay(s);
+            return s;
+        }
+        clusterCloseSocket(s);
+        SDL_Delay(100);
+    }
+    return CLUSTER_NO_SOCKET;
+}
+
+static bool clusterSend(ClusterSocket s, const void *data, int size) {
+    const char *p = data;
+    while (size > 0) {
+        int n = (int)send(s, p, size, 0);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool clusterRecv(ClusterSocket s, void *data, int size) {
+    char *p = data;
+    while (size > 0) {
+        int n = (int)recv(s, p, size, 0);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// 工作进程：连接协调者，逐批完成对局并逐局发回结果，收到STOP或连接断开时退出。
+// crashAfter大于0时完成这么多局后不发DONE直接退出，用来测试重新排队
+int runClusterWorker(const char *address, int crashAfter) {
+    if (!clusterNetInit()) {
+        return 1;
+    }
+    ClusterSocket s = clusterConnect(address);
+    if (s == CLUSTER_NO_SOCKET) {
+        printf("Failed to connect to coordinator %s\n", address);
+        clusterNetQuit();
+        return 1;
+    }
+#ifdef _WIN32
+    int pid = (int)GetCurrentProcessId();
+#else
+    int pid = (int)getpid();
+#endif
+    ClusterRecord hello = {CLUSTER_HELLO, CLUSTER_MAGIC, pid, 0, 0};
+    bool ok = clusterSend(s, &hello, sizeof(hello));
+    int played = 0;
+    ClusterBatch b;
+    while (ok && clusterRecv(s, &b, sizeof(b)) && b.type == CLUSTER_BATCH) {
+        BotSearchConfig cfg = {.weights = &b.weights,
+                               .beamWidth = b.beamWidth,
+                               .depth = b.depth,
+                               .samples = b.samples};
+        for (int g = 0; ok && g < b.games; g++) {
+            SimGame game;
+            simReset(&game, b.seed + b.firstGame + g);
+            while (game.pieces < b.maxPieces && simStep(&game, &cfg)) {
+            }
+            ClusterRecord r = {CLUSTER_RESULT, b.firstGame + g, game.pieces,
+                               game.lines, game.score};
+            ok = clusterSend(s, &r, sizeof(r));
+            if (++played == crashAfter) {
+                _exit(3); // 模拟进程崩溃
+            }
+        }
+        ClusterRecord done = {CLUSTER_DONE, b.batch, 0, 0, 0};
+        ok = ok && clusterSend(s, &done, sizeof(done));
+    }
+    clusterCloseSocket(s);
+    clusterNetQuit();
+    return 0;
+}
+
+// 启动一个本机工作进程
+static bool clusterSpawn(const char *exe, const char *address, int crashAfter,
+                         ClusterProcess *process) {
+    char crash[16];
+    snprintf(crash, sizeof(crash), "%d", crashAfter);
+#ifdef _WIN32
+    STARTUPINFOA si;
+    PROCESS_INFORMATION pi;
+    memset(&si, 0, sizeof(si));
+    si.cb = sizeof(si);
+    char line[1024];
+    snprintf(line, sizeof(line),
+             "\"%s\" --cluster-worker %s --cluster-crash %s --threads 1", exe,
+             address, crash);
+    if (!CreateProcessA(NULL, line, NULL, NULL, FALSE, 0, NULL, NULL, &si,
+                        &pi)) {
+        return false;
+    }
+    CloseHandle(pi.hThread);
+    *process = pi.hProcess;
+    return true;
+#else
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl(exe, exe, "--cluster-worker", address, "--cluster-crash", crash,
+              "--threads", "1", (char *)NULL);
+        _exit(127);
+    }
+    *process = pid;
+    return pid > 0;
+#endif
+}
+
+static void clusterReap(ClusterProcess process) {
+#ifdef _WIN32
+    WaitForSingleObject(process, 5000);
+    CloseHandle(process);
+#else
+    waitpid(process, NULL, 0);
+#endif
+}
+
+// 关闭连接，未完成的批次重新排队
+static void clusterDrop(ClusterConn *c, int *batchOwner, ClusterStats *stats,
+                        const char *reason) {
+    if (c->batch >= 0) {
+        printf("worker %d %s, requeued batch %d\n", c->pid, reason, c->batch);
+        batchOwner[c->batch] = -1;
+        stats->requeued++;
+    }
+    clusterCloseSocket(c->socket);
+    c->socket = CLUSTER_NO_SOCKET;
+    c->batch = -1;
+}
+
+// 协调者：监听并启动本机工作进程，把对局分批发出，收齐所有批次后汇总结果
+bool runClusterCoordinator(const ClusterConfig *cfg, ClusterStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    int batchCount = (cfg->games + cfg->batchGames - 1) / cfg->batchGames;
+    // 每批的状态：-1排队，-2完成，否则为执行它的连接编号
+    int *batchOwner = malloc((batchCount + 1) * sizeof(int));
+    ClusterRecord *results = calloc(cfg->games + 1, sizeof(ClusterRecord));
+    ClusterProcess processes[CLUSTER_MAX_CONNS];
+    ClusterConn conns[CLUSTER_MAX_CONNS];
+    int spawned = 0, connCount = 0, doneBatches = 0;
+    char address[256];
+    ClusterSocket listener = CLUSTER_NO_SOCKET;
+    bool ok = batchOwner && results;
+    if (ok) {
+        listener = clusterListen(cfg->listen, address, sizeof(address));
+        if (listener == CLUSTER_NO_SOCKET) {
+            printf("Failed to listen on %s\n", cfg->listen);
+            ok = false;
+        }
+    }
+    for (int b = 0; b < batchCount; b++) {
+        batchOwner[b] = -1;
+    }
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int w = 0; ok && w < cfg->localWorkers && w < CLUSTER_MAX_CONNS; w++) {
+        if (!clusterSpawn(cfg->exe, address, w == 0 ? cfg->crashAfter : 0,
+                          &processes[spawned])) {
+            printf("Failed to start worker %d\n", w);
+            continue;
+        }
+        spawned++;
+    }
+    if (ok && cfg->localWorkers == 0) {
+        printf("Waiting for workers on %s\n", address);
+    }
+
+    Uint32 idleSince = SDL_GetTicks(); // 没有任何连接的起始时间
+    while (ok && doneBatches < batchCount) {
+        struct pollfd fds[CLUSTER_MAX_CONNS + 1];
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < connCount; i++) {
+            fds[i + 1].fd = conns[i].socket;
+            fds[i + 1].events = POLLIN;
+        }
+        if (clusterPoll(fds, connCount + 1, 1000) < 0) {
+            ok = false;
+            break;
+        }
+        Uint32 now = SDL_GetTicks();
+        int polled = connCount; // 这次poll覆盖的连接
+
+        // 新的工作进程
+        if (fds[0].revents & POLLIN) {
+            ClusterSocket s = accept(listener, NULL, NULL);
+            if (s != CLUSTER_NO_SOCKET && connCount < CLUSTER_MAX_CONNS) {
+                ClusterConn *c = &conns[connCount++];
+                memset(c, 0, sizeof(*c));
+                c->socket = s;
+                c->batch = -1;
+                c->id = stats->workers++;
+                c->lastSeen = now;
+                clusterNoDelay(s);
+            } else if (s != CLUSTER_NO_SOCKET) {
+                clusterCloseSocket(s);
+            }
+        }
+
+        // 读取记录
+        for (int i = 0; i < polled; i++) {
+            ClusterConn *c = &conns[i];
+            if (!(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            int n = (int)recv(c->socket, (char *)&c->buffer + c->have,
+                              sizeof(c->buffer) - c->have, 0);
+            if (n <= 0) {
+                clusterDrop(c, batchOwner, stats, "disconnected");
+                continue;
+            }
+            c->lastSeen = now;
+            c->have += n;
+            if (c->have < (int)sizeof(c->buffer)) {
+                continue;
+            }
+            c->have = 0;
+            ClusterRecord *r = &c->buffer;
+            if (r->type == CLUSTER_HELLO && r->game == CLUSTER_MAGIC) {
+                c->hello = true;
+                c->pid = r->pieces;
+            } else if (r->type == CLUSTER_RESULT && c->batch >= 0 &&
+                       r->game >= c->batch * cfg->batchGames &&
+                       r->game < cfg->games &&
+                       r->game < (c->batch + 1) * cfg->batchGames) {
+                results[r->game] = *r;
+            } else if (r->type == CLUSTER_DONE && r->game == c->batch) {
+                batchOwner[c->batch] = -2;
+                c->batch = -1;
+                doneBatches++;
+            } else {
+                clusterDrop(c, batchOwner, stats, "sent an invalid record");
+            }
+        }
+
+        // 超时的工作进程视为失败
+        for (int i = 0; i < connCount; i++) {
+            if (conns[i].socket != CLUSTER_NO_SOCKET && conns[i].batch >= 0 &&
+                now - conns[i].lastSeen > CLUSTER_TIMEOUT) {
+                clusterDrop(&conns[i], batchOwner, stats, "timed out");
+            }
+        }
+
+        // 移除已关闭的连接
+        int kept = 0;
+        for (int i = 0; i < connCount; i++) {
+            if (conns[i].socket != CLUSTER_NO_SOCKET) {
+                conns[kept++] = conns[i];
+            }
+        }
+        connCount = kept;
+
+        // 给空闲的工作进程分配排队中的批次
+        int next = 0;
+        for (int i = 0; i < connCount; i++) {
+            ClusterConn *c = &conns[i];
+            if (!c->hello || c->batch >= 0) {
+                continue;
+            }
+            while (next < batchCount && batchOwner[next] != -1) {
+                next++;
+            }
+            if (next == batchCount) {
+                break;
+            }
+            ClusterBatch b;
+            memset(&b, 0, sizeof(b));
+            b.type = CLUSTER_BATCH;
+            b.batch = next;
+            b.firstGame = next * cfg->batchGames;
+            b.games = cfg->games - b.firstGame < cfg->batchGames
+                          ? cfg->games - b.firstGame
+                          : cfg->batchGames;
+            b.maxPieces = cfg->maxPieces;
+            b.seed = cfg->seed;
+            b.beamWidth = botBeamWidth;
+            b.depth = botDepth;
+            b.samples = botSamples;
+            b.weights = botWeights;
+            if (clusterSend(c->socket, &b, sizeof(b))) {
+                batchOwner[next] = c->id;
+                c->batch = next;
+                c->lastSeen = now;
+            } else {
+                clusterDrop(c, batchOwner, stats, "disconnected");
+            }
+        }
+
+        // 本机工作进程全部退出、也没有其他工作进程时放弃
+        if (connCount > 0) {
+            idleSince = now;
+        } else if (cfg->localWorkers > 0 && now - idleSince > CLUSTER_TIMEOUT) {
+            printf("No workers left with %d batches unfinished\n",
+                   batchCount - doneBatches);
+            ok = false;
+        }
+    }
+    stats->seconds = (double)(SDL_GetPerformanceCounter() - start) /
+                     SDL_GetPerformanceFrequency();
+
+    // 通知工作进程退出
+    for (int i = 0; i < connCount; i++) {
+        ClusterBatch stop;
+        memset(&stop, 0, sizeof(stop));
+        stop.type = CLUSTER_STOP;
+        clusterSend(conns[i].socket, &stop, sizeof(stop));
+        clusterCloseSocket(conns[i].socket);
+    }
+    if (listener != CLUSTER_NO_SOCKET) {
+        clusterCloseSocket(listener);
+    }
+#ifndef _WIN32
+    if (strncmp(cfg->listen, "unix:", 5) == 0) {
+        unlink(cfg->listen + 5);
+    }
+#endif
+    for (int w = 0; w < spawned; w++) {
+        clusterReap(processes[w]);
+    }
+
+    if (ok) {
+        stats->games = cfg->games;
+        for (int g = 0; g < cfg->games; g++) {
+            stats->pieces += results[g].pieces;
+            stats->lines += results[g].lines;
+            stats->score += results[g].score;
+        }
+    }
+    free(batchOwner);
+    free(results);
+    return ok;
+}
+
+// 按1、2、4……个本机工作进程依次运行同一组对局，报告吞吐量的扩展情况。
+// 对局只由种子决定，每次运行的汇总必须相同
+int runCluster(ClusterConfig *cfg) {
+    if (!clusterNetInit()) {
+        printf("Failed to initialize sockets\n");
+        return 1;
+    }
+    int maxWorkers = cfg->localWorkers;
+    ClusterStats first = {0};
+    double baseRate = 0;
+    int failed = 0;
+    // 故障测试时至少要有一个工作进程在崩溃后接手它的批次
+    int startWorkers = cfg->crashAfter > 0 ? 2 : 1;
+    if (startWorkers > maxWorkers) {
+        startWorkers = maxWorkers;
+    }
+    for (int workers = startWorkers;; workers *= 2) {
+        if (workers > maxWorkers) {
+            workers = maxWorkers;
+        }
+        cfg->localWorkers = workers;
+        ClusterStats stats;
+        if (!runClusterCoordinator(cfg, &stats)) {
+            failed = 1;
+            break;
+        }
+        double rate = stats.games / stats.seconds;
+        if (baseRate == 0) {
+            baseRate = rate;
+            first = stats;
+        }
+        bool same = stats.pieces == first.pieces && stats.lines == first.lines &&
+                    stats.score == first.score;
+        failed |= !same;
+        printf("%2d workers (%d connected): %d games, %lld pieces, %lld lines "
+               "in %.3f s, %.1f games/s, %.0f pieces/s, speedup %.2fx, "
+               "%d requeued%s\n",
+               workers, stats.workers, stats.games, stats.pieces, stats.lines,
+               stats.seconds, rate, stats.pieces / stats.seconds,
+               rate / baseRate, stats.requeued, same ? "" : " (MISMATCH)");
+        if (workers >= maxWorkers) {
+            break;
+        }
+    }
+    cfg->localWorkers = maxWorkers;
+    clusterNetQuit();
+    return failed;
+}
+
+// ==================== 对战回滚网络同步 ====================
+
+// 双人对战：双方在本地运行同一个确定性模拟，每帧只交换按键。
+// 对方的按键还没到时沿用它最后一次确认的按键（预测），迟到的按键与预测不同时
+// 恢复那一帧的快照，用正确的按键重新模拟到当前帧（回滚）。
+// 模拟只用整数和位棋盘，不依赖全局游戏状态和设置，两端的结果逐位相同
+
+enum {
+    VS_LEFT = 1,   // 按住时每帧左移一格
+    VS_RIGHT = 2,  // 按住时每帧右移一格
+    VS_ROTATE = 4, // 按下时旋转一次
+    VS_SOFT = 8,   // 按住时每帧下落一格
+    VS_HARD = 16,  // 按下时直接落到底并锁定
+};
+
+#define VS_FALL_FRAMES 20 // 自然下落间隔（帧）
+#define VS_FRAME_MS (1000.0 / 60) // 每帧的时长
+
+// 对战中一方的状态
+typedef struct {
+    BitBoard board;
+    int8_t type, rotation, x, y; // 当前方块
+    int8_t nextType;
+    uint8_t fallTimer;  // 距离上次自然下落的帧数
+    uint8_t lastInput;  // 上一帧的按键，用来判断按下
+    bool over;
+    uint16_t garbage;   // 等待加入的垃圾行
+    uint32_t rng;       // 方块序列
+    uint32_t holeRng;   // 垃圾行的缺口位置
+    int32_t lines, score;
+    int32_t pieces;     // 已锁定的方块数
+} VsPlayer;
+
+typedef struct {
+    VsPlayer players[2];
+    int32_t frame;
+} VersusState;
+
+// 双方使用同一个种子，方块序列相同
+void versusReset(VersusState *s, uint32_t seed) {
+    memset(s, 0, sizeof(*s));
+    for (int p = 0; p < 2; p++) {
+        VsPlayer *v = &s->players[p];
+        v->rng = (uint32_t)mix64(seed) | 1;
+        v->holeRng = (uint32_t)mix64(seed + 1 + p) | 1;
+        v->nextType = randomPieceType(&v->rng);
+        v->type = randomPieceType(&v->rng);
+        v->x = ARENA_WIDTH / 2 - 2;
+        v->y = -2;
+    }
+}
+
+// 把垃圾行从底部推入，每行有一个随机缺口，顶部被推出的行有方块时结束
+static void vsAddGarbage(VsPlayer *v) {
+    int n = v->garbage < ARENA_HEIGHT ? v->garbage : ARENA_HEIGHT;
+    v->garbage = 0;
+    for (int i = 0; i < n; i++) {
+        if (v->board.rows[i]) {
+            v->over = true;
+        }
+    }
+    memmove(v->board.rows, v->board.rows + n,
+            (ARENA_HEIGHT - n) * sizeof(v->board.rows[0]));
+    for (int i = ARENA_HEIGHT - n; i < ARENA_HEIGHT; i++) {
+        v->board.rows[i] =
+            FULL_ROW & (uint16_t)~(1u << (xorshift32(&v->holeRng) % ARENA_WIDTH));
+    }
+}
+
+// 推进一方一帧，返回送给对方的垃圾行数
+static int vsStep(VsPlayer *v, uint8_t input) {
+    if (v->over) {
+        return 0;
+    }
+    uint8_t pressed = input & ~v->lastInput;
+    v->lastInput = input;
+    if ((pressed & VS_ROTATE) &&
+        !bitCollision(&v->board, v->type, (v->rotation + 1) & 3, v->x, v->y)) {
+        v->rotation = (v->rotation + 1) & 3;
+    }
+    if ((input & VS_LEFT) &&
+        !bitCollision(&v->board, v->type, v->rotation, v->x - 1, v->y)) {
+        v->x--;
+    }
+    if ((input & VS_RIGHT) &&
+        !bitCollision(&v->board, v->type, v->rotation, v->x + 1, v->y)) {
+        v->x++;
+    }
+
+    bool lock = false;
+    if (pressed & VS_HARD) {
+        v->y = bitDrop(&v->board, v->type, v->rotation, v->x, v->y);
+        lock = true;
+    } else if ((input & VS_SOFT) || ++v->fallTimer >= VS_FALL_FRAMES) {
+        v->fallTimer = 0;
+        if (bitCollision(&v->board, v->type, v->rotation, v->x, v->y + 1)) {
+            lock = true;
+        } else {
+            v->y++;
+        }
+    }
+    if (!lock) {
+        return 0;
+    }
+
+    int lines = bitLock(&v->board, v->type, v->rotation, v->x, v->y);
+    v->lines += lines;
+    v->score += lineClearScores[lines];
+    // 消2行送1行，消3行送2行，消4行送4行；没有消行时才加入收到的垃圾行
+    int sent = lines == 4 ? 4 : lines > 1 ? lines - 1 : 0;
+    if (lines == 0 && v->garbage) {
+        vsAddGarbage(v);
+    }
+    if (v->board.rows[0]) {
+        v->over = true;
+    }
+    v->pieces++;
+    v->type = v->nextType;
+    v->nextType = randomPieceType(&v->rng);
+    v->rotation = 0;
+    v->x = ARENA_WIDTH / 2 - 2;
+    v->y = -2;
+    v->fallTimer = 0;
+    return sent;
+}
+
+// 用双方这一帧的按键推进对局
+void versusStep(VersusState *s, uint8_t input0, uint8_t input1) {
+    int sent0 = vsStep(&s->players[0], input0);
+    int sent1 = vsStep(&s->players[1], input1);
+    s->players[1].garbage += sent0;
+    s->players[0].garbage += sent1;
+    s->frame++;
+}
+
+// 对局状态的哈希，逐个字段计算，不受结构体填充字节影响
+uint64_t versusHash(const VersusState *s) {
+    uint64_t h = mix64((uint64_t)s->frame);
+    for (int p = 0; p < 2; p++) {
+        const VsPlayer *v = &s->players[p];
+        for (int i = 0; i < ARENA_HEIGHT; i++) {
+            h = mix64(h ^ v->board.rows[i]);
+        }
+        h = mix64(h ^ ((uint64_t)(uint8_t)v->type << 56) ^
+                  ((uint64_t)(uint8_t)v->rotation << 48) ^
+                  ((uint64_t)(uint8_t)v->x << 40) ^
+                  ((uint64_t)(uint8_t)v->y << 32) ^
+                  ((uint64_t)(uint8_t)v->nextType << 24) ^
+                  ((uint64_t)v->fallTimer << 16) ^ ((uint64_t)v->lastInput << 8) ^
+                  v->over);
+        h = mix64(h ^ ((uint64_t)v->garbage << 32) ^ v->rng);
+        h = mix64(h ^ ((uint64_t)v->holeRng << 32) ^ (uint32_t)v->lines);
+        h = mix64(h ^ ((uint64_t)(uint32_t)v->pieces << 32) ^
+                  (uint32_t)v->score);
+    }
+    return h;
+}
+
+#define RB_RING 64        // 快照和按键环形缓冲区的帧数
+#define RB_MAX_AHEAD 16   // 最多领先对方已确认按键多少帧，超过时等待
+#define RB_MAX_DELAY 8    // 输入延迟上限（帧）
+#define RB_MAX_INPUTS 40  // 一个数据包最多携带的按键数
+#define RB_QUEUE 256      // 延迟注入队列长度
+#define RB_MAGIC 0x42524c54 // 数据包头"TLRB"
+
+_Static_assert(RB_MAX_AHEAD + RB_MAX_DELAY < RB_MAX_INPUTS &&
+                   RB_MAX_INPUTS < RB_RING,
+               "unacknowledged inputs must fit in one packet and the ring");
+
+// 数据包：从firstFrame开始的本方按键，对方按键的确认进度，以及一帧已确认状态的哈希
+typedef struct {
+    uint32_t magic;
+    int32_t firstFrame;
+    int32_t count;
+    int32_t ack;       // 发送方已连续收到对方按键的最后一帧
+    int32_t hashFrame; // hash对应的帧，-1表示没有
+    uint64_t hash;
+    uint8_t inputs[RB_MAX_INPUTS];
+} RbPacket;
+
+// 延迟注入队列中的数据包
+typedef struct {
+    double release; // 发出时间（毫秒）
+    RbPacket packet;
+} RbQueued;
+
+typedef struct {
+    int local;               // 本方是0号还是1号玩家
+    int delay;               // 输入延迟（帧）：本帧的按键在delay帧后生效
+    VersusState current;     // 当前状态（frame为下一帧）
+    VersusState snapshots[RB_RING]; // snapshots[f % RB_RING]为第f帧开始前的状态
+    uint8_t inputs[2][RB_RING];     // 模拟第f帧时实际使用的按键
+    uint8_t localInputs[RB_RING];   // 本方按键
+    int32_t localTag[RB_RING];      // localInputs对应的帧
+    uint8_t remoteInputs[RB_RING];  // 收到的对方按键
+    int32_t remoteTag[RB_RING];     // remoteInputs对应的帧，-1表示没有
+    uint64_t hashes[RB_RING];       // 已确认帧的状态哈希
+    int32_t hashTag[RB_RING];
+    int32_t localLatest;     // 已安排的本方按键的最后一帧
+    int32_t remoteConfirmed; // 已连续收到对方按键的最后一帧
+    int32_t remoteAck;       // 对方已连续收到本方按键的最后一帧
+    int32_t rollbackTo;      // 需要回滚到的帧，INT32_MAX表示不需要
+    int32_t hashed;          // 已计算哈希的最后一个确认帧
+
+    // 统计
+    long long rollbacks, resimulated, mispredictions, stalls, desyncs;
+    long long packetsSent, packetsReceived, packetsDropped;
+    int maxRollback;
+
+    // 网络和延迟注入
+    ClusterSocket socket;
+    struct sockaddr_storage peer;
+    socklen_t peerLength;
+    double latency, jitter; // 单程延迟和抖动（毫秒）
+    double loss;            // 丢包率
+    uint32_t netRng;
+    RbQueued queue[RB_QUEUE];
+    int queued;
+} RollbackSession;
+
+// 打开本地UDP端口，address为HOST:PORT（端口为0时由系统分配）
+bool rollbackOpen(RollbackSession *s, int local, int delay, uint32_t seed,
+                  const char *address) {
+    memset(s, 0, sizeof(*s));
+    s->socket = CLUSTER_NO_SOCKET;
+    s->local = local;
+    s->delay = delay < 0 ? 0 : delay > RB_MAX_DELAY ? RB_MAX_DELAY : delay;
+    versusReset(&s->current, seed);
+    for (int i = 0; i < RB_RING; i++) {
+        s->localTag[i] = s->remoteTag[i] = s->hashTag[i] = -1;
+    }
+    // 输入延迟的前几帧没有按键
+    for (int f = 0; f < s->delay; f++) {
+        s->localTag[f] = f;
+    }
+    s->localLatest = s->delay - 1;
+    s->remoteConfirmed = -1;
+    s->remoteAck = -1;
+    s->rollbackTo = INT32_MAX;
+    s->hashed = -1;
+    s->netRng = (uint32_t)mix64(seed + 17 + local) | 1;
+
+    struct sockaddr_storage addr;
+    socklen_t length;
+    if (!clusterAddress(address, &addr, &length)) {
+        return false;
+    }
+    s->socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s->socket == CLUSTER_NO_SOCKET) {
+        return false;
+    }
+    if (bind(s->socket, (struct sockaddr *)&addr, length) != 0) {
+        clusterCloseSocket(s->socket);
+        s->socket = CLUSTER_NO_SOCKET;
+        return false;
+    }
+#ifdef _WIN32
+    u_long nonBlocking = 1;
+    ioctlsocket(s->socket, FIONBIO, &nonBlocking);
+#else
+    fcntl(s->socket, F_SETFL, fcntl(s->socket, F_GETFL) | O_NONBLOCK);
+#endif
+    return true;
+}
+
+// 本地端口号
+int rollbackPort(const RollbackSession *s) {
+    struct sockaddr_in bound;
+    socklen_t length = sizeof(bound);
+    if (getsockname(s->socket, (struct sockaddr *)&bound, &length) != 0) {
+        return -1;
+    }
+    return ntohs(bound.sin_port);
+}
+
+// 设置对方地址HOST:PORT
+bool rollbackConnect(RollbackSession *s, const char *peer) {
+    return clusterAddress(peer, &s->peer, &s->peerLength);
+}
+
+void rollbackClose(RollbackSession *s) {
+    if (s->socket != CLUSTER_NO_SOCKET) {
+        clusterCloseSocket(s->socket);
+        s->socket = CLUSTER_NO_SOCKET;
+    }
+}
+
+// 把到期的数据包真正发出
+static void rollbackFlush(RollbackSession *s, double now) {
+    int kept = 0;
+    for (int i = 0; i < s->queued; i++) {
+        if (s->queue[i].release <= now) {
+            sendto(s->socket, (const char *)&s->queue[i].packet,
+                   sizeof(RbPacket), 0, (struct sockaddr *)&s->peer,
+                   s->peerLength);
+        } else {
+            s->queue[kept++] = s->queue[i];
+        }
+    }
+    s->queued = kept;
+}
+
+// 发送对方还没确认的本方按键，经过延迟注入队列（没有设置延迟时立即发出）
+static void rollbackSend(RollbackSession *s, double now) {
+    RbPacket p;
+    memset(&p, 0, sizeof(p));
+    p.magic = RB_MAGIC;
+    p.firstFrame = s->remoteAck + 1;
+    p.count = s->localLatest - p.firstFrame + 1;
+    if (p.count > RB_MAX_INPUTS) {
+        p.count = RB_MAX_INPUTS;
+    }
+    for (int i = 0; i < p.count; i++) {
+        p.inputs[i] = s->localInputs[(p.firstFrame + i) % RB_RING];
+    }
+    p.ack = s->remoteConfirmed;
+    p.hashFrame = s->hashed;
+    p.hash = s->hashed >= 0 ? s->hashes[s->hashed % RB_RING] : 0;
+    s->packetsSent++;
+    if (s->loss > 0 && xorshift32(&s->netRng) % 10000 < s->loss * 10000) {
+        s->packetsDropped++;
+        return;
+    }
+    if (s->queued == RB_QUEUE) {
+        rollbackFlush(s, INFINITY);
+    }
+    double jitter = s->jitter * (xorshift32(&s->netRng) % 1000) / 1000.0;
+    s->queue[s->queued].release = now + s->latency + jitter;
+    s->queue[s->queued].packet = p;
+    s->queued++;
+    rollbackFlush(s, now);
+}
+
+// 接收所有到达的数据包，迟到的按键与预测不同时记下回滚位置
+void rollbackPoll(RollbackSession *s, double now) {
+    rollbackFlush(s, now);
+    RbPacket p;
+    int remote = 1 - s->local;
+    while (recvfrom(s->socket, (char *)&p, sizeof(p), 0, NULL, NULL) ==
+           (int)sizeof(p)) {
+        if (p.magic != RB_MAGIC || p.count < 0 || p.count > RB_MAX_INPUTS) {
+            continue;
+        }
+        s->packetsReceived++;
+        for (int i = 0; i < p.count; i++) {
+            int32_t f = p.firstFrame + i;
+            // 只接受环形缓冲区窗口内还没收到的帧
+            if (f <= s->remoteConfirmed || f >= s->current.frame + RB_RING / 2 ||
+                s->remoteTag[f % RB_RING] == f) {
+                continue;
+            }
+            s->remoteTag[f % RB_RING] = f;
+            s->remoteInputs[f % RB_RING] = p.inputs[i];
+            if (f < s->current.frame && s->inputs[remote][f % RB_RING] != p.inputs[i]) {
+                s->mispredictions++;
+                if (f < s->rollbackTo) {
+                    s->rollbackTo = f;
+                }
+            }
+        }
+        while (s->remoteTag[(s->remoteConfirmed + 1) % RB_RING] ==
+               s->remoteConfirmed + 1) {
+            s->remoteConfirmed++;
+        }
+        if (p.ack > s->remoteAck) {
+            s->remoteAck = p.ack;
+        }
+        // 对方已确认帧的哈希与本地不同说明两端模拟不一致
+        if (p.hashFrame >= 0 && s->hashTag[p.hashFrame % RB_RING] == p.hashFrame &&
+            s->hashes[p.hashFrame % RB_RING] != p.hash) {
+            s->desyncs++;
+        }
+    }
+}
+
+// 对方第f帧的按键：已收到就用实际按键，否则预测为最后确认的按键
+static uint8_t rollbackRemoteInput(const RollbackSession *s, int32_t f) {
+    if (s->remoteTag[f % RB_RING] == f) {
+        return s->remoteInputs[f % RB_RING];
+    }
+    int32_t last = s->remoteConfirmed;
+    return last >= 0 ? s->remoteInputs[last % RB_RING] : 0;
+}
+
+// 模拟一帧：保存开始前的快照和使用的按键
+static void rollbackSimulate(RollbackSession *s) {
+    int32_t f = s->current.frame;
+    s->snapshots[f % RB_RING] = s->current;
+    uint8_t in[2];
+    in[s->local] = s->localInputs[f % RB_RING];
+    in[1 - s->local] = rollbackRemoteInput(s, f);
+    s->inputs[0][f % RB_RING] = in[0];
+    s->inputs[1][f % RB_RING] = in[1];
+    versusStep(&s->current, in[0], in[1]);
+}
+
+// 每帧调用一次：安排本方按键，需要时回滚重算，然后模拟一帧并发送按键。
+// 领先对方太多时不推进（返回false），只重发按键等待对方
+bool rollbackAdvance(RollbackSession *s, uint8_t input, double now) {
+    rollbackPoll(s, now);
+    if (s->current.frame - s->remoteConfirmed > RB_MAX_AHEAD) {
+        s->stalls++;
+        rollbackSend(s, now);
+        return false;
+    }
+    int32_t f = s->current.frame + s->delay;
+    s->localInputs[f % RB_RING] = input;
+    s->localTag[f % RB_RING] = f;
+    s->localLatest = f;
+
+    // 从第一个预测错误的帧开始重算
+    if (s->rollbackTo < s->current.frame) {
+        int32_t target = s->current.frame;
+        int depth = target - s->rollbackTo;
+        s->current = s->snapshots[s->rollbackTo % RB_RING];
+        while (s->current.frame < target) {
+            rollbackSimulate(s);
+        }
+        s->rollbacks++;
+        s->resimulated += depth;
+        if (depth > s->maxRollback) {
+            s->maxRollback = depth;
+        }
+    }
+    s->rollbackTo = INT32_MAX;
+    rollbackSimulate(s);
+
+    // 双方按键都已确认的帧不会再改变，记下哈希供对方核对
+    while (s->hashed + 1 <= s->remoteConfirmed &&
+           s->hashed + 1 < s->current.frame) {
+        s->hashed++;
+        const VersusState *state = s->hashed + 1 < s->current.frame
+                                       ? &s->snapshots[(s->hashed + 1) % RB_RING]
+                                       : &s->current;
+        s->hashes[s->hashed % RB_RING] = versusHash(state);
+        s->hashTag[s->hashed % RB_RING] = s->hashed;
+    }
+    rollbackSend(s, now);
+    return true;
+}
+
+// 测试用的按键来源：每个新方块用一层贪心评估选出落点，然后逐帧旋转、平移，
+// 对准后硬降；偶尔随机乱按，让预测经常出错。按键要过输入延迟才生效，
+// 每次按下后等同样多帧再看局面，免得重复旋转或移过头
+typedef struct {
+    uint32_t rng;
+    int32_t piece;        // 已选好落点的方块序号
+    int rotation, x;      // 目标落点
+    int delay, cooldown;  // 输入延迟、还要等待的帧数
+    uint8_t held;         // 上一帧的按键
+} VsTestPlayer;
+
+static uint8_t rollbackTestInput(VsTestPlayer *t, const VsPlayer *v) {
+    static const uint8_t noise[] = {0,       VS_LEFT, VS_RIGHT,
+                                    VS_ROTATE, VS_SOFT, VS_LEFT | VS_ROTATE};
+    uint32_t r = xorshift32(&t->rng);
+    uint8_t input = 0;
+    if (t->cooldown > 0) {
+        t->cooldown--;
+    } else if (r % 16 == 0) {
+        input = noise[(r >> 8) % (sizeof(noise) / sizeof(noise[0]))];
+    } else if (!v->over) {
+        if (t->piece != v->pieces) {
+            t->piece = v->pieces;
+            Placement placements[BOT_MAX_PLACEMENTS];
+            BitBoard children[BOT_MAX_PLACEMENTS];
+            int lines[BOT_MAX_PLACEMENTS];
+            float scores[BOT_MAX_PLACEMENTS];
+            int count = botExpand(&v->board, v->type, v->rotation, v->x, v->y,
+                                  0, &botWeights, children, lines, scores,
+                                  placements);
+            t->rotation = v->rotation;
+            t->x = v->x;
+            for (int i = 0, best = -1; i < count; i++) {
+                if (best < 0 || scores[i] > scores[best]) {
+                    best = i;
+                    t->rotation = placements[i].rotation;
+                    t->x = placements[i].x;
+                }
+            }
+        }
+        if (v->rotation != t->rotation) {
+            input = (t->held & VS_ROTATE) ? 0 : VS_ROTATE;
+        } else if (v->x < t->x) {
+            input = VS_RIGHT;
+        } else if (v->x > t->x) {
+            input = VS_LEFT;
+        } else {
+            input = (t->held & VS_HARD) ? 0 : VS_HARD;
+        }
+    }
+    if (input) {
+        t->cooldown = t->delay;
+    }
+    t->held = input;
+    return input;
+}
+
+static void rollbackPrintStats(const RollbackSession *s) {
+    printf("player %d: frame %d, rollbacks %lld (max %d frames, %lld "
+           "resimulated), mispredictions %lld, stalls %lld, desyncs %lld, "
+           "packets %lld sent / %lld received / %lld dropped\n",
+           s->local, s->current.frame, s->rollbacks, s->maxRollback,
+           s->resimulated, s->mispredictions, s->stalls, s->desyncs,
+           s->packetsSent, s->packetsReceived, s->packetsDropped);
+}
+
+// 回环测试：同一进程中的两个对端通过本机UDP对战，发送时注入延迟、抖动和丢包，
+// 时间按帧推进不实际等待。结束后用双方实际生效的按键单独重新模拟，
+// 最终状态必须与两端回滚后得到的状态一致；最后测量快照恢复并重算若干帧的耗时
+int runRollbackBenchmark(int frames, int delay, double latency, double jitter,
+                         double loss, uint32_t seed) {
+    if (!clusterNetInit()) {
+        return 1;
+    }
+    static RollbackSession peers[2];
+    uint8_t *accepted[2];
+    int acceptedCount[2] = {0, 0};
+    int capacity = frames * 4 + RB_RING * 4;
+    accepted[0] = malloc(capacity);
+    accepted[1] = malloc(capacity);
+    bool ok = accepted[0] && accepted[1];
+    for (int p = 0; ok && p < 2; p++) {
+        ok = rollbackOpen(&peers[p], p, delay, seed, "127.0.0.1:0");
+        peers[p].latency = latency;
+        peers[p].jitter = jitter;
+        peers[p].loss = loss;
+    }
+    for (int p = 0; ok && p < 2; p++) {
+        char address[64];
+        snprintf(address, sizeof(address), "127.0.0.1:%d",
+                 rollbackPort(&peers[1 - p]));
+        ok = rollbackConnect(&peers[p], address);
+    }
+    if (!ok) {
+        printf("Failed to open UDP sockets\n");
+    }
+
+    // 两端都确认并核对到目标帧为止
+    VsTestPlayer testers[2];
+    memset(testers, 0, sizeof(testers));
+    for (int p = 0; p < 2; p++) {
+        testers[p].rng = (uint32_t)mix64(seed + 100 + 100 * p) | 1;
+        testers[p].piece = -1;
+        testers[p].delay = delay;
+    }
+    double now = 0;
+    int tick;
+    int maxTicks = frames * 8 + 1000;
+    for (tick = 0; ok && tick < maxTicks; tick++) {
+        if (peers[0].hashed >= frames - 1 && peers[1].hashed >= frames - 1) {
+            break;
+        }
+        for (int p = 0; p < 2; p++) {
+            // 按键根据本端看到的（可能是预测的）局面产生，等待对方时不生效
+            uint8_t input =
+                rollbackTestInput(&testers[p], &peers[p].current.players[p]);
+            if (acceptedCount[p] < capacity &&
+                rollbackAdvance(&peers[p], input, now)) {
+                accepted[p][acceptedCount[p]++] = input;
+            }
+        }
+        now += VS_FRAME_MS;
+    }
+
+    // 用实际生效的按键重新模拟：第f帧使用第f - delay个被接受的按键
+    int result = 0;
+    if (ok) {
+        VersusState reference;
+        versusReset(&reference, seed);
+        int d = peers[0].delay;
+        for (int f = 0; f < frames; f++) {
+            uint8_t in0 = f < d ? 0 : accepted[0][f - d];
+            uint8_t in1 = f < d ? 0 : accepted[1][f - d];
+            versusStep(&reference, in0, in1);
+        }
+        uint64_t expected = versusHash(&reference);
+        int last = (frames - 1) % RB_RING;
+        bool match = tick < maxTicks;
+        for (int p = 0; p < 2; p++) {
+            rollbackPrintStats(&peers[p]);
+            match = match && peers[p].hashTag[last] == frames - 1 &&
+                    peers[p].hashes[last] == expected && peers[p].desyncs == 0;
+        }
+        printf("%d frames, input delay %d, latency %.0f ms + %.0f ms jitter, "
+               "loss %.0f%%: scores %d / %d, lines %d / %d, final state %s\n",
+               frames, d, latency, jitter, loss * 100,
+               reference.players[0].score, reference.players[1].score,
+               reference.players[0].lines, reference.players[1].lines,
+               match ? "matches the reference simulation" : "MISMATCH");
+        result = match ? 0 : 1;
+
+        // 快照恢复+重算的耗时，与一帧的时间比较
+        RollbackSession *t = malloc(sizeof(*t));
+        if (t) {
+            *t = peers[0];
+            for (int depth = 8; depth <= RB_MAX_AHEAD; depth *= 2) {
+                int32_t target = t->current.frame;
+                int iterations = 20000;
+                Uint64 start = SDL_GetPerformanceCounter();
+                for (int i = 0; i < iterations; i++) {
+                    t->current = t->snapshots[(target - depth) % RB_RING];
+                    while (t->current.frame < target) {
+                        rollbackSimulate(t);
+                    }
+                }
+                double seconds = (double)(SDL_GetPerformanceCounter() - start) /
+                                 SDL_GetPerformanceFrequency();
+                double us = seconds * 1e6 / iterations;
+                printf("rollback of %2d frames: %.2f us (%.3f%% of a %.2f ms "
+                       "frame), state %d bytes\n",
+                       depth, us, us / (VS_FRAME_MS * 10), VS_FRAME_MS,
+                       (int)sizeof(VersusState));
+            }
+            free(t);
+        }
+    }
+    for (int p = 0; p < 2; p++) {
+        rollbackClose(&peers[p]);
+        free(accepted[p]);
+    }
+    clusterNetQuit();
+    return result;
+}
+
+// 联网对战的一端（无窗口，按键由测试按键来源产生），按真实时间每秒60帧运行。
+// address为本地UDP地址，peer为对方地址，两端的player分别为0和1
+int runVersusPeer(const char *address, const char *peer, int player, int frames,
+                  int delay, double latency, double jitter, double loss,
+                  uint32_t seed) {
+    if (!clusterNetInit()) {
+        return 1;
+    }
+    static RollbackSession s;
+    if (!rollbackOpen(&s, player & 1, delay, seed, address) ||
+        !rollbackConnect(&s, peer)) {
+        printf("Failed to open %s or resolve %s\n", address, peer);
+        rollbackClose(&s);
+        clusterNetQuit();
+        return 1;
+    }
+    s.latency = latency;
+    s.jitter = jitter;
+    s.loss = loss;
+    VsTestPlayer tester;
+    memset(&tester, 0, sizeof(tester));
+    tester.rng = (uint32_t)mix64(seed + 100 + 100 * s.local) | 1;
+    tester.piece = -1;
+    tester.delay = delay;
+    Uint64 frequency = SDL_GetPerformanceFrequency();
+    Uint64 start = SDL_GetPerformanceCounter();
+    double worst = 0;
+    // 到达目标帧后继续运行，直到目标帧得到确认，最多等待10秒
+    for (int tick = 0; s.hashed < frames - 1; tick++) {
+        double now = (double)(SDL_GetPerformanceCounter() - start) * 1000 /
+                     frequency;
+        if (now > (frames + 600) * VS_FRAME_MS) {
+            printf("Timed out waiting for the peer\n");
+            break;
+        }
+        uint8_t input =
+            rollbackTestInput(&tester, &s.current.players[s.local]);
+        Uint64 before = SDL_GetPerformanceCounter();
+        rollbackAdvance(&s, input, now);
+        double ms = (double)(SDL_GetPerformanceCounter() - before) * 1000 /
+                    frequency;
+        if (ms > worst) {
+            worst = ms;
+        }
+        double next = (tick + 1) * VS_FRAME_MS;
+        now = (double)(SDL_GetPerformanceCounter() - start) * 1000 / frequency;
+        if (next > now) {
+            SDL_Delay((Uint32)(next - now));
+        }
+    }
+    rollbackPrintStats(&s);
+    int last = (frames - 1) % RB_RING;
+    if (s.hashTag[last] == frames - 1) {
+        printf("frame %d confirmed, state hash %016llx, slowest frame %.3f ms\n",
+               frames - 1, (unsigned long long)s.hashes[last], worst);
+    }
+    int result = s.hashTag[last] == frames - 1 && s.desyncs == 0 ? 0 : 1;
+    // 再发半秒按键，对方可能还没收齐
+    for (int i = 0; i < 30; i++) {
+        double now = (double)(SDL_GetPerformanceCounter() - start) * 1000 /
+                     frequency;
+        rollbackPoll(&s, now);
+        rollbackSend(&s, now);
+        SDL_Delay(16);
+    }
+    rollbackClose(&s);
+    clusterNetQuit();
+    return result;
+}
+
+// ==================== 观战广播 ====================
+
+// 服务器用AI玩一局游戏，把每次锁定编码成一条增量消息（落点和被消除的行）广播给
+// 所有观众，每隔一段时间插入一个完整局面的关键帧，新加入的观众从最近的关键帧开始接收。
+// 所有消息只写入一个环形缓冲区一次，每个观众只记录自己发到了哪个位置，
+// 多个分片线程各用一个epoll管理一部分连接，从同一个缓冲区直接发送。
+// 落后太多（慢观众）的连接直接断开，所以每个连接占用的缓冲是有上限的。
+// 依赖epoll和eventfd，只支持Linux
+
+#define SPECTATE_RING (1 << 20)       // 广播环形缓冲区大小（字节），2的幂
+#define SPECTATE_MAX_LAG (16 << 10)   // 观众最多落后的字节数（约500条增量），超过就断开
+#define SPECTATE_SNDBUF (16 << 10)    // 每个连接的内核发送缓冲区大小
+#define SPECTATE_KEYFRAME_EVERY 64    // 每锁定多少个方块发一次关键帧
+#define SPECTATE_MAX_SHARDS 64
+#define SPECTATE_ACCEPT_BATCH 64      // 一次唤醒最多接受的连接数，让其他分片也能分到
+#define SPECTATE_LATENCY_BUCKETS 100000 // 延迟直方图，每格10微秒，最多1秒
+
+enum {
+    SPECTATE_KEYFRAME = 1, // 完整局面
+    SPECTATE_DELTA,        // 一次锁定
+};
+
+// 所有消息共用的头部
+typedef struct {
+    uint16_t type, size; // 消息类型和总字节数
+    uint32_t seq;        // 消息序号，连续递增
+    uint64_t time;       // 发出时间（单调时钟，微秒），用于测量本机延迟
+} SpectateHeader;
+
+// 一次锁定：方块的最终位置、消除的行（锁定前的行号）和锁定后的分数
+typedef struct {
+    SpectateHeader h;
+    uint8_t type, rotation, nextType, pad;
+    int8_t x, y, pad2[2];
+    uint32_t cleared; // 第i位表示第i行被消除
+    int32_t score;
+} SpectateDelta;
+
+// 完整局面，新观众从这里开始
+typedef struct {
+    SpectateHeader h;
+    uint16_t rows[ARENA_HEIGHT];
+    uint8_t curType, nextType, pad[2];
+    int32_t score, lines, pieces;
+    uint32_t game; // 第几局，重新开局时变化
+    uint8_t pad2[4];
+} SpectateKeyframe;
+
+_Static_assert(sizeof(SpectateDelta) == 32, "delta layout");
+_Static_assert(sizeof(SpectateKeyframe) == 80, "keyframe layout");
+
+#define SPECTATE_MAX_MESSAGE ((int)sizeof(SpectateKeyframe))
+
+#ifdef __linux__
+
+static uint64_t spectateNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// 每个观众需要一个文件描述符，上万个连接超过默认上限
+static void spectateRaiseFileLimit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static void spectateNonBlocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// 广播流：单个生产者追加消息，各分片线程只读
+typedef struct {
+    uint8_t *ring;
+    uint64_t head;     // 已发布的总字节数（原子访问）
+    uint64_t keyframe; // 最近一个关键帧的起始位置（原子访问）
+    uint32_t seq;
+} SpectateStream;
+
+// 一个观众连接
+typedef struct {
+    int fd;
+    int active;      // 在活动列表中的位置，-1表示空槽
+    bool blocked;    // 发送缓冲区已满，等待EPOLLOUT
+    uint64_t offset; // 下一个要发送的字节在流中的位置
+} SpectateClient;
+
+typedef struct {
+    SpectateStream *stream;
+    int index;
+    int epoll, wake, listener;
+    SpectateClient *clients; // 槽位，下标写在epoll事件里
+    int *activeList;
+    int activeCount, capacity, freeSlot;
+    SDL_atomic_t *stop;
+    // 统计（原子访问，主线程汇总）
+    SDL_atomic_t connected;
+    SDL_atomic_t accepted, slowDropped, closed;
+    uint64_t bytesSent, sends;
+} SpectateShard;
+
+#define SPECTATE_LISTENER_TAG 0xffffffffu
+#define SPECTATE_WAKE_TAG 0xfffffffeu
+
+// 追加一条消息并唤醒所有分片
+static void spectatePublish(SpectateStream *s, SpectateHeader *h,
+                            SpectateShard *shards, int shardCount) {
+    h->seq = s->seq++;
+    h->time = spectateNow();
+    uint64_t head = s->head; // 只有生产者写head
+    int pos = (int)(head & (SPECTATE_RING - 1));
+    int first = h->size < SPECTATE_RING - pos ? h->size : SPECTATE_RING - pos;
+    memcpy(s->ring + pos, h, first);
+    memcpy(s->ring, (const uint8_t *)h + first, h->size - first);
+    __atomic_store_n(&s->head, head + h->size, __ATOMIC_RELEASE);
+    if (h->type == SPECTATE_KEYFRAME) {
+        __atomic_store_n(&s->keyframe, head, __ATOMIC_RELEASE);
+    }
+    uint64_t one = 1;
+    for (int i = 0; i < shardCount; i++) {
+        if (write(shards[i].wake, &one, sizeof(one)) < 0) {
+            // 计数器已经非零时分片必然会被唤醒，失败可以忽略
+        }
+    }
+}
+
+static void spectateKeyframe(SpectateStream *s, const SimGame *g, uint32_t game,
+                             SpectateShard *shards, int shardCount) {
+    SpectateKeyframe k;
+    memset(&k, 0, sizeof(k));
+    k.h.type = SPECTATE_KEYFRAME;
+    k.h.size = sizeof(k);
+    memcpy(k.rows, g->board.rows, sizeof(k.rows));
+    k.curType = (uint8_t)g->curType;
+    k.nextType = (uint8_t)g->nextType;
+    k.score = g->score;
+    k.lines = g->lines;
+    k.pieces = g->pieces;
+    k.game = game;
+    spectatePublish(s, &k.h, shards, shardCount);
+}
+
+// 与simStep()相同地走一步，同时填好增量消息；游戏结束时返回false
+static bool spectateStep(SimGame *g, const BotSearchConfig *cfg,
+                         SpectateDelta *d) {
+    BotMove move;
+    if (g->over || !botSearch(&g->board, g->curType, 0, ARENA_WIDTH / 2 - 2,
+                              -2, g->nextType, cfg, NULL, &move)) {
+        g->over = true;
+        return false;
+    }
+    memset(d, 0, sizeof(*d));
+    d->h.type = SPECTATE_DELTA;
+    d->h.size = sizeof(*d);
+    d->type = (uint8_t)g->curType;
+    d->rotation = (uint8_t)move.rotation;
+    d->x = (int8_t)move.x;
+    d->y = (int8_t)move.y;
+    // 锁定前先算出会被填满的行
+    for (int i = pieceMinRow[g->curType][move.rotation];
+         i <= pieceMaxRow[g->curType][move.rotation]; i++) {
+        int row = move.y + i;
+        if (row >= 0 && row < ARENA_HEIGHT &&
+            (g->board.rows[row] |
+             shiftMask(pieceMasks[g->curType][move.rotation][i], move.x)) ==
+                FULL_ROW) {
+            d->cleared |= 1u << row;
+        }
+    }
+    int lines = bitLock(&g->board, g->curType, move.rotation, move.x, move.y);
+    g->lines += lines;
+    g->score += lineClearScores[lines] * scoreMultiplier;
+    g->pieces++;
+    g->curType = g->nextType;
+    g->nextType = simRandomPiece(g);
+    d->nextType = (uint8_t)g->nextType;
+    d->score = g->score;
+    if (g->board.rows[0]) {
+        g->over = true;
+    }
+    return true;
+}
+
+static void spectateDrop(SpectateShard *sh, int slot) {
+    SpectateClient *c = &sh->clients[slot];
+    close(c->fd); // 关闭时自动从epoll中移除
+    int last = sh->activeList[--sh->activeCount];
+    sh->activeList[c->active] = last;
+    sh->clients[last].active = c->active;
+    c->active = -1;
+    c->fd = sh->freeSlot; // 空槽串成链表
+    sh->freeSlot = slot;
+    SDL_AtomicAdd(&sh->connected, -1);
+}
+
+// 把观众落后的数据尽量发出去，发送缓冲区满时等待EPOLLOUT
+static void spectateFlush(SpectateShard *sh, int slot) {
+    SpectateClient *c = &sh->clients[slot];
+    uint64_t head = __atomic_load_n(&sh->stream->head, __ATOMIC_ACQUIRE);
+    while (c->offset < head) {
+        if (head - c->offset > SPECTATE_MAX_LAG) {
+            SDL_AtomicAdd(&sh->slowDropped, 1);
+            spectateDrop(sh, slot);
+            return;
+        }
+        int pos = (int)(c->offset & (SPECTATE_RING - 1));
+        uint64_t size = head - c->offset;
+        if (size > (uint64_t)(SPECTATE_RING - pos)) {
+            size = SPECTATE_RING - pos;
+        }
+        ssize_t n = send(c->fd, sh->stream->ring + pos, size,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                c->blocked = true;
+            } else {
+                SDL_AtomicAdd(&sh->closed, 1);
+                spectateDrop(sh, slot);
+            }
+            return;
+        }
+        // 落后不超过SPECTATE_MAX_LAG的数据不会在发送期间被覆盖，这里再确认一次
+        if (__atomic_load_n(&sh->stream->head, __ATOMIC_ACQUIRE) - c->offset >
+            SPECTATE_RING) {
+            SDL_AtomicAdd(&sh->slowDropped, 1);
+            spectateDrop(sh, slot);
+            return;
+        }
+        c->offset += (uint64_t)n;
+        __atomic_fetch_add(&sh->bytesSent, (uint64_t)n, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&sh->sends, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void spectateAccept(SpectateShard *sh) {
+    for (int i = 0; i < SPECTATE_ACCEPT_BATCH; i++) {
+        int fd = accept(sh->listener, NULL, NULL);
+        if (fd < 0) {
+            return; // 没有等待的连接，或者被其他分片接受了
+        }
+        spectateNonBlocking(fd);
+        int size = SPECTATE_SNDBUF;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        clusterNoDelay(fd);
+        if (sh->freeSlot < 0) {
+            int capacity = sh->capacity ? sh->capacity * 2 : 1024;
+            SpectateClient *clients =
+                realloc(sh->clients, capacity * sizeof(*clients));
+            int *activeList =
+                realloc(sh->activeList, capacity * sizeof(*activeList));
+            if (clients) {
+                sh->clients = clients;
+            }
+            if (activeList) {
+                sh->activeList = activeList;
+            }
+            if (!clients || !activeList) {
+                close(fd);
+                return;
+            }
+            for (int s = capacity - 1; s >= sh->capacity; s--) {
+                sh->clients[s].fd = sh->freeSlot;
+                sh->clients[s].active = -1;
+                sh->freeSlot = s;
+            }
+            sh->capacity = capacity;
+        }
+        int slot = sh->freeSlot;
+        SpectateClient *c = &sh->clients[slot];
+        sh->freeSlot = c->fd;
+        c->fd = fd;
+        c->blocked = false;
+        c->active = sh->activeCount;
+        sh->activeList[sh->activeCount++] = slot;
+        // 从最近的关键帧开始
+        c->offset = __atomic_load_n(&sh->stream->keyframe, __ATOMIC_ACQUIRE);
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u32 = (uint32_t)slot;
+        epoll_ctl(sh->epoll, EPOLL_CTL_ADD, fd, &ev);
+        SDL_AtomicAdd(&sh->accepted, 1);
+        SDL_AtomicAdd(&sh->connected, 1);
+        spectateFlush(sh, slot);
+    }
+}
+
+// 分片线程：一个epoll管理监听套接字、唤醒计数器和自己的观众
+static int spectateShardMain(void *data) {
+    SpectateShard *sh = data;
+    struct epoll_event events[256];
+    uint8_t scratch[256];
+    while (!SDL_AtomicGet(sh->stop)) {
+        int n = epoll_wait(sh->epoll, events, 256, 100);
+        bool publish = false;
+        for (int e = 0; e < n; e++) {
+            uint32_t tag = events[e].data.u32;
+            if (tag == SPECTATE_LISTENER_TAG) {
+                spectateAccept(sh);
+                continue;
+            }
+            if (tag == SPECTATE_WAKE_TAG) {
+                uint64_t count;
+                if (read(sh->wake, &count, sizeof(count)) > 0) {
+                    publish = true;
+                }
+                continue;
+            }
+            SpectateClient *c = &sh->clients[tag];
+            if (c->active < 0) {
+                continue; // 同一批事件里已经断开
+            }
+            uint32_t flags = events[e].events;
+            if (flags & EPOLLIN) {
+                // 观众不发数据，读到结束或出错就断开
+                ssize_t got;
+                while ((got = recv(c->fd, scratch, sizeof(scratch), 0)) > 0) {
+                }
+                if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    flags |= EPOLLHUP;
+                }
+            }
+            if (flags & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+                SDL_AtomicAdd(&sh->closed, 1);
+                spectateDrop(sh, (int)tag);
+                continue;
+            }
+            if (flags & EPOLLOUT) {
+                c->blocked = false;
+                spectateFlush(sh, (int)tag);
+            }
+        }
+        if (publish) {
+            // 从后往前遍历，断开的连接会被最后一个替换。发送缓冲区已满的
+            // 连接不会再有EPOLLOUT，在这里检查是否落后太多
+            uint64_t head = __atomic_load_n(&sh->stream->head, __ATOMIC_ACQUIRE);
+            for (int i = sh->activeCount - 1; i >= 0; i--) {
+                int slot = sh->activeList[i];
+                SpectateClient *c = &sh->clients[slot];
+                if (!c->blocked) {
+                    spectateFlush(sh, slot);
+                } else if (head - c->offset > SPECTATE_MAX_LAG) {
+                    SDL_AtomicAdd(&sh->slowDropped, 1);
+                    spectateDrop(sh, slot);
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// 观战服务器：address为监听地址，每秒锁定rate个方块，运行seconds秒（0表示一直运行）
+int runSpectateServer(const char *address, int shardCount, int rate,
+                      int seconds, uint32_t seed) {
+    spectateRaiseFileLimit();
+    if (!clusterNetInit()) {
+        return 1;
+    }
+    char actual[256];
+    int listener = clusterListen(address, actual, sizeof(actual));
+    if (listener < 0) {
+        printf("Failed to listen on %s\n", address);
+        return 1;
+    }
+    listen(listener, SOMAXCONN); // 上万个观众同时连接，需要更长的等待队列
+    spectateNonBlocking(listener);
+    shardCount = shardCount < 1                     ? 1
+                 : shardCount > SPECTATE_MAX_SHARDS ? SPECTATE_MAX_SHARDS
+                                                    : shardCount;
+    rate = rate < 1 ? 1 : rate;
+
+    static SpectateStream stream;
+    static SpectateShard shards[SPECTATE_MAX_SHARDS];
+    SDL_Thread *threads[SPECTATE_MAX_SHARDS];
+    SDL_atomic_t stop;
+    SDL_AtomicSet(&stop, 0);
+    memset(&stream, 0, sizeof(stream));
+    stream.ring = malloc(SPECTATE_RING);
+    // 先发第一局的关键帧，第一个观众连上时就有局面可看
+    SimGame game;
+    uint32_t gameIndex = 0;
+    simReset(&game, seed);
+    spectateKeyframe(&stream, &game, gameIndex, shards, 0);
+
+    for (int i = 0; i < shardCount; i++) {
+        SpectateShard *sh = &shards[i];
+        memset(sh, 0, sizeof(*sh));
+        sh->stream = &stream;
+        sh->index = i;
+        sh->stop = &stop;
+        sh->freeSlot = -1;
+        sh->listener = listener;
+        sh->epoll = epoll_create1(0);
+        sh->wake = eventfd(0, EFD_NONBLOCK);
+        struct epoll_event ev;
+        // 监听套接字加入每个分片，EPOLLEXCLUSIVE避免新连接唤醒所有分片
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.u32 = SPECTATE_LISTENER_TAG;
+        epoll_ctl(sh->epoll, EPOLL_CTL_ADD, listener, &ev);
+        ev.events = EPOLLIN;
+        ev.data.u32 = SPECTATE_WAKE_TAG;
+        epoll_ctl(sh->epoll, EPOLL_CTL_ADD, sh->wake, &ev);
+        threads[i] = SDL_CreateThread(spectateShardMain, "spectate", sh);
+    }
+    printf("Spectator server on %s: %d shards, %d pieces/s, keyframe every %d "
+           "pieces\n",
+           actual, shardCount, rate, SPECTATE_KEYFRAME_EVERY);
+    fflush(stdout);
+
+    BotSearchConfig cfg = {.weights = &botWeights,
+                           .beamWidth = botBeamWidth,
+                           .depth = botDepth,
+                           .samples = botSamples};
+    uint64_t start = spectateNow();
+    uint64_t nextReport = start + 1000000;
+    uint64_t lastBytes = 0;
+    long long pieces = 0;
+    for (long long tick = 1;; tick++) {
+        uint64_t due = start + (uint64_t)(tick * 1000000 / rate);
+        uint64_t now = spectateNow();
+        if (due > now) {
+            SDL_Delay((Uint32)((due - now + 999) / 1000));
+        }
+        SpectateDelta d;
+        if (spectateStep(&game, &cfg, &d)) {
+            spectatePublish(&stream, &d.h, shards, shardCount);
+            pieces++;
+        }
+        if (game.over) {
+            simReset(&game, seed + ++gameIndex);
+            spectateKeyframe(&stream, &game, gameIndex, shards, shardCount);
+        } else if (game.pieces % SPECTATE_KEYFRAME_EVERY == 0) {
+            spectateKeyframe(&stream, &game, gameIndex, shards, shardCount);
+        }
+
+        now = spectateNow();
+        if (now >= nextReport) {
+            int connected = 0, slow = 0, closed = 0;
+            uint64_t bytes = 0, sends = 0;
+            for (int i = 0; i < shardCount; i++) {
+                connected += SDL_AtomicGet(&shards[i].connected);
+                slow += SDL_AtomicGet(&shards[i].slowDropped);
+                closed += SDL_AtomicGet(&shards[i].closed);
+                bytes += __atomic_load_n(&shards[i].bytesSent, __ATOMIC_RELAXED);
+                sends += __atomic_load_n(&shards[i].sends, __ATOMIC_RELAXED);
+            }
+            printf("%5.0f s: %d spectators, %lld pieces, %.2f MB/s out, "
+                   "%llu sends, %d slow dropped, %d disconnected\n",
+                   (double)(now - start) / 1e6, connected, pieces,
+                   (double)(bytes - lastBytes) / (1 << 20),
+                   (unsigned long long)sends, slow, closed);
+            fflush(stdout);
+            lastBytes = bytes;
+            nextReport += 1000000;
+            if (seconds > 0 && now - start >= (uint64_t)seconds * 1000000) {
+                break;
+            }
+        }
+    }
+
+    SDL_AtomicSet(&stop, 1);
+    for (int i = 0; i < shardCount; i++) {
+        SpectateShard *sh = &shards[i];
+        SDL_WaitThread(threads[i], NULL);
+        for (int a = 0; a < sh->activeCount; a++) {
+            close(sh->clients[sh->activeList[a]].fd);
+        }
+        close(sh->epoll);
+        close(sh->wake);
+        free(sh->clients);
+        free(sh->activeList);
+    }
+    close(listener);
+    free(stream.ring);
+    clusterNetQuit();
+    return 0;
+}
+
+// 负载测试用的观众：按消息重建局面，并与关键帧核对
+typedef struct {
+    int fd;
+    bool slow;      // 故意不读数据的慢观众
+    bool connected, synced, closed;
+    uint64_t joined; // 连接建立的时间，之前发布的消息是补发的，不计入延迟
+    uint32_t seq;   // 期待的下一条消息序号
+    BitBoard board;
+    int32_t score;
+    int have;       // buffer中不完整消息的字节数
+    uint8_t buffer[SPECTATE_MAX_MESSAGE];
+} SpectateViewer;
+
+typedef struct {
+    long long messages, keyframes, deltas, bytes;
+    long long gaps, mismatches; // 序号不连续、局面与服务器不一致的次数
+    long long latency[SPECTATE_LATENCY_BUCKETS + 1];
+} SpectateLoadStats;
+
+// 处理一条完整的消息
+static void spectateViewerMessage(SpectateViewer *v, const uint8_t *data,
+                                  SpectateLoadStats *st, uint64_t now) {
+    SpectateHeader h;
+    memcpy(&h, data, sizeof(h));
+    st->messages++;
+    if (h.time >= v->joined) {
+        uint64_t micros = now - h.time;
+        st->latency[micros / 10 < SPECTATE_LATENCY_BUCKETS
+                        ? micros / 10
+                        : SPECTATE_LATENCY_BUCKETS]++;
+    }
+    if (v->synced && h.seq != v->seq) {
+        st->gaps++;
+    }
+    v->seq = h.seq + 1;
+    if (h.type == SPECTATE_KEYFRAME) {
+        SpectateKeyframe k;
+        memcpy(&k, data, sizeof(k));
+        st->keyframes++;
+        // 同一局中途的关键帧应该与按增量重建的局面完全一致
+        if (v->synced && k.pieces > 0 &&
+            (memcmp(k.rows, v->board.rows, sizeof(k.rows)) != 0 ||
+             k.score != v->score)) {
+            st->mismatches++;
+        }
+        memcpy(v->board.rows, k.rows, sizeof(k.rows));
+        v->board.hash = 0;
+        v->score = k.score;
+        v->synced = true;
+        return;
+    }
+    if (!v->synced) {
+        st->gaps++; // 第一条消息应该是关键帧
+        return;
+    }
+    SpectateDelta d;
+    memcpy(&d, data, sizeof(d));
+    st->deltas++;
+    if (d.type >= 7 || d.rotation >= 4 ||
+        bitCollision(&v->board, d.type, d.rotation, d.x, d.y)) {
+        st->mismatches++;
+        return;
+    }
+    BitBoard before = v->board;
+    int lines = bitLock(&v->board, d.type, d.rotation, d.x, d.y);
+    uint32_t cleared = 0;
+    for (int i = 0; i < ARENA_HEIGHT; i++) {
+        uint16_t cells = 0;
+        for (int r = pieceMinRow[d.type][d.rotation];
+             r <= pieceMaxRow[d.type][d.rotation]; r++) {
+            if (d.y + r == i) {
+                cells = shiftMask(pieceMasks[d.type][d.rotation][r], d.x);
+            }
+        }
+        if ((before.rows[i] | cells) == FULL_ROW) {
+            cleared |= 1u << i;
+        }
+    }
+    v->score += lineClearScores[lines] * scoreMultiplier;
+    if (cleared != d.cleared || v->score != d.score) {
+        st->mismatches++;
+    }
+}
+
+// 读出所有可读的数据并逐条处理，连接关闭时返回false
+static bool spectateViewerRead(SpectateViewer *v, SpectateLoadStats *st) {
+    uint8_t scratch[16384];
+    for (;;) {
+        ssize_t n = recv(v->fd, scratch, sizeof(scratch), 0);
+        if (n == 0) {
+            return false;
+        }
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        st->bytes += n;
+        uint64_t now = spectateNow();
+        int pos = 0;
+        while (pos < n) {
+            // 先凑齐头部，再凑齐整条消息
+            int need = (int)sizeof(SpectateHeader);
+            if (v->have >= need) {
+                SpectateHeader h;
+                memcpy(&h, v->buffer, sizeof(h));
+                need = h.size;
+                if (need < (int)sizeof(SpectateHeader) ||
+                    need > SPECTATE_MAX_MESSAGE) {
+                    return false; // 协议错误
+                }
+            }
+            int take = need - v->have < n - pos ? need - v->have : (int)n - pos;
+            memcpy(v->buffer + v->have, scratch + pos, take);
+            v->have += take;
+            pos += take;
+            if (v->have == need && need > (int)sizeof(SpectateHeader)) {
+                spectateViewerMessage(v, v->buffer, st, now);
+                v->have = 0;
+            }
+        }
+    }
+}
+
+// 负载生成器：建立clients个连接（其中slow个从不读数据），运行seconds秒后
+// 报告收到的消息、核对结果、本机延迟分布，以及慢观众是否被服务器断开
+int runSpectateLoad(const char *address, int clients, int slow, int seconds) {
+    spectateRaiseFileLimit();
+    struct sockaddr_storage addr;
+    socklen_t length;
+    if (!clusterNetInit() || !clusterAddress(address, &addr, &length)) {
+        printf("Failed to resolve %s\n", address);
+        return 1;
+    }
+    clients = clients < 1 ? 1 : clients;
+    slow = slow < 0 ? 0 : slow > clients ? clients : slow;
+    SpectateViewer *viewers = calloc(clients, sizeof(*viewers));
+    SpectateLoadStats *st = calloc(1, sizeof(*st));
+    int epoll = epoll_create1(0);
+    int opened = 0;
+    for (int i = 0; i < clients; i++) {
+        SpectateViewer *v = &viewers[i];
+        v->slow = i < slow;
+        v->fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (v->fd < 0) {
+            printf("Only %d connections could be opened\n", i);
+            clients = i;
+            break;
+        }
+        if (v->slow) {
+            int size = 4096;
+            setsockopt(v->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        }
+        if (connect(v->fd, (struct sockaddr *)&addr, length) < 0 &&
+            errno != EINPROGRESS) {
+            close(v->fd);
+            v->closed = true;
+            continue;
+        }
+        // 慢观众只关心连接是否建立
+        struct epoll_event ev;
+        ev.events = v->slow ? EPOLLOUT | EPOLLET
+                            : EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u32 = (uint32_t)i;
+        epoll_ctl(epoll, EPOLL_CTL_ADD, v->fd, &ev);
+        opened++;
+    }
+
+    struct epoll_event events[512];
+    int connected = 0, fastClosed = 0;
+    uint64_t start = spectateNow();
+    uint64_t end = start + (uint64_t)(seconds > 0 ? seconds : 10) * 1000000;
+    uint64_t nextReport = start + 1000000;
+    while (spectateNow() < end) {
+        int n = epoll_wait(epoll, events, 512, 50);
+        for (int e = 0; e < n; e++) {
+            SpectateViewer *v = &viewers[events[e].data.u32];
+            if (v->closed) {
+                continue;
+            }
+            if (!v->connected && (events[e].events & EPOLLOUT) &&
+                !(events[e].events & EPOLLERR)) {
+                v->connected = true;
+                v->joined = spectateNow();
+                connected++;
+            }
+            if (v->slow) {
+                continue;
+            }
+            if ((events[e].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP |
+                                     EPOLLERR)) &&
+                !spectateViewerRead(v, st)) {
+                close(v->fd);
+                v->closed = true;
+                fastClosed++;
+            }
+        }
+        if (spectateNow() >= nextReport) {
+            printf("%d/%d connected, %lld messages, %.2f MB received\n",
+                   connected, clients, st->messages,
+                   (double)st->bytes / (1 << 20));
+            fflush(stdout);
+            nextReport += 1000000;
+        }
+    }
+
+    // 慢观众：读完缓冲里剩下的数据，看到连接结束说明被服务器断开了
+    int slowDropped = 0;
+    for (int i = 0; i < slow; i++) {
+        SpectateViewer *v = &viewers[i];
+        if (v->closed) {
+            continue;
+        }
+        uint8_t scratch[16384];
+        ssize_t got;
+        while ((got = recv(v->fd, scratch, sizeof(scratch), 0)) > 0) {
+        }
+        if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            slowDropped++;
+        }
+    }
+    double elapsed = (double)(spectateNow() - start) / 1e6;
+    printf("%d clients (%d slow), %d connected, %lld messages (%lld keyframes, "
+           "%lld deltas), %.1f messages/s, %.2f MB/s\n",
+           clients, slow, connected, st->messages, st->keyframes, st->deltas,
+           st->messages / elapsed, st->bytes / elapsed / (1 << 20));
+    long long total = 0;
+    for (int b = 0; b <= SPECTATE_LATENCY_BUCKETS; b++) {
+        total += st->latency[b];
+    }
+    if (total > 0) {
+        static const double marks[] = {0.5, 0.99, 0.999};
+        printf("delivery latency:");
+        for (int m = 0; m < 3; m++) {
+            long long target = (long long)(total * marks[m]), seen = 0;
+            int b = 0;
+            while (b < SPECTATE_LATENCY_BUCKETS &&
+                   (seen += st->latency[b]) <= target) {
+                b++;
+            }
+            printf(" p%g %s%.2f ms", marks[m] * 100,
+                   b == SPECTATE_LATENCY_BUCKETS ? ">" : "", b * 0.01);
+        }
+        printf("\n");
+    }
+    printf("sequence gaps %lld, state mismatches %lld, fast clients "
+           "disconnected %d, slow clients dropped %d/%d\n",
+           st->gaps, st->mismatches, fastClosed, slowDropped, slow);
+    int result = st->gaps == 0 && st->mismatches == 0 && fastClosed == 0 &&
+                         connected == clients && st->messages > 0
+                     ? 0
+                     : 1;
+    for (int i = 0; i < clients; i++) {
+        if (!viewers[i].closed) {
+            close(viewers[i].fd);
+        }
+    }
+    close(epoll);
+    free(viewers);
+    free(st);
+    clusterNetQuit();
+    return result;
+}
+
+#else
+
+int runSpectateServer(const char *address, int shardCount, int rate,
+                      int seconds, uint32_t seed) {
+    (void)address, (void)shardCount, (void)rate, (void)seconds, (void)seed;
+    printf("The spectator server needs epoll and is only supported on Linux\n");
+    return 1;
+}
+
+int runSpectateLoad(const char *address, int clients, int slow, int seconds) {
+    (void)address, (void)clients, (void)slow, (void)seconds;
+    printf("The spectator load generator is only supported on Linux\n");
+    return 1;
+}
+
+#endif
+
+// ==================== 多局游戏服务器 ====================
+
+// 一个进程同时托管成千上万局相互独立的游戏，每局对应一个TCP连接，客户端（人或AI）
+// 每个字节是一次操作（GAME_INPUT_LEFT等）。每个分片线程（默认每个核一个）用一个epoll管理自己的连接，
+// 各局的自动下落由分片内的时间轮调度。一轮事件循环中同一局的多次变化只发送一次
+// 最新局面，发不出去的旧局面直接被新局面覆盖，所以每个连接只占一条消息的缓冲。
+// 依赖epoll，只支持Linux
+
+#define GAME_WHEEL_SLOTS 1024 // 时间轮的槽数，2的幂
+#define GAME_WHEEL_TICK 1000  // 每槽的时间（微秒）
+#define GAME_LATENCY_BUCKETS 100000 // 延迟直方图，每格1微秒，最多100毫秒
+
+// 服务器发给客户端的局面
+typedef struct {
+    uint32_t ack;     // 已处理的操作字节数，客户端用来测量往返延迟
+    uint32_t games;   // 这个连接已经结束的局数
+    int32_t score;
+    uint16_t rows[ARENA_HEIGHT];
+    uint8_t type, rotation, nextType, pad;
+    int8_t x, y, pad2[2];
+    uint8_t pad3[4];
+} GameUpdate;
+
+_Static_assert(sizeof(GameUpdate) == 64, "update layout");
+
+#ifdef __linux__
+
+// 一个连接和它的对局
+typedef struct {
+    GameSession game;
+    int fd;             // 空槽时为空闲链表的下一个槽
+    bool active;
+    bool dirty;         // 局面变化后还没有放进发送缓冲
+    uint32_t ack, games;
+    uint32_t seed;
+    uint64_t due;       // 下一次自动下落的时间（微秒）
+    int wheelNext, wheelPrev; // 时间轮槽中的双向链表
+    int sent;           // out中已经发出的字节数，等于sizeof(out)表示没有待发数据
+    GameUpdate out;
+} GameServerSession;
+
+typedef struct {
+    int index;
+    int epoll, listener;
+    SDL_atomic_t *stop;
+    uint32_t fallInterval; // 自动下落间隔（微秒）
+    int multiplier;        // 各局的分数倍数
+    uint32_t seed;
+    GameServerSession *sessions;
+    int capacity, freeSlot;
+    int *dirtyList;
+    int dirtyCount;
+    int wheel[GAME_WHEEL_SLOTS]; // 每个槽的链表头
+    uint64_t wheelTime;          // 时间轮已经推进到的时间（槽的整数倍）
+    // 统计，sessions和计数器原子访问，直方图在线程结束后汇总
+    SDL_atomic_t connected;
+    uint64_t inputs, ticks, locks, updates, gamesOver;
+    uint64_t *lateness; // 自动下落比预定时间晚了多少
+    uint64_t *loopTime; // 每轮事件循环的处理时间
+} GameServerShard;
+
+#define GAME_LISTENER_TAG 0xffffffffu
+
+static void gameWheelInsert(GameServerShard *sh, int slot) {
+    GameServerSession *s = &sh->sessions[slot];
+    // 已经过期的放进下一个要处理的槽
+    if (s->due < sh->wheelTime) {
+        s->due = sh->wheelTime;
+    }
+    int bucket = (int)(s->due / GAME_WHEEL_TICK) & (GAME_WHEEL_SLOTS - 1);
+    s->wheelPrev = -1;
+    s->wheelNext = sh->wheel[bucket];
+    if (s->wheelNext >= 0) {
+        sh->sessions[s->wheelNext].wheelPrev = slot;
+    }
+    sh->wheel[bucket] = slot;
+}
+
+static void gameWheelRemove(GameServerShard *sh, int slot) {
+    GameServerSession *s = &sh->sessions[slot];
+    if (s->wheelPrev >= 0) {
+        sh->sessions[s->wheelPrev].wheelNext = s->wheelNext;
+    } else {
+        sh->wheel[(int)(s->due / GAME_WHEEL_TICK) & (GAME_WHEEL_SLOTS - 1)] =
+            s->wheelNext;
+    }
+    if (s->wheelNext >= 0) {
+        sh->sessions[s->wheelNext].wheelPrev = s->wheelPrev;
+    }
+}
+
+static void gameMarkDirty(GameServerShard *sh, int slot) {
+    if (!sh->sessions[slot].dirty) {
+        sh->sessions[slot].dirty = true;
+        sh->dirtyList[sh->dirtyCount++] = slot;
+    }
+}
+
+// 执行一次操作（客户端的操作或自动下落）。服务器不播放消除动画，
+// 锁定后立即删除满行；游戏结束时开始新的一局
+static void gameServerInput(GameServerShard *sh, GameServerSession *s,
+                            uint8_t input) {
+    GameSession *g = &s->game;
+    int pieces = g->pieceCount, lines = g->lines;
+    if (input != GAME_INPUT_CLEAR) {
+        applyInput(g, input);
+    }
+    applyInput(g, GAME_INPUT_CLEAR);
+    if (g->pieceCount != pieces || g->gameOver) {
+        sh->locks++;
+        metricAdd(&metrics.pieces, g->pieceCount - pieces);
+        metricAdd(&metrics.lines, g->lines - lines);
+    }
+    if (g->gameOver) {
+        s->games++;
+        sh->gamesOver++;
+        resetGame(g, s->seed + s->games, sh->multiplier);
+    }
+}
+
+static void gameServerClose(GameServerShard *sh, int slot) {
+    GameServerSession *s = &sh->sessions[slot];
+    gameWheelRemove(sh, slot);
+    close(s->fd);
+    s->active = false;
+    s->fd = sh->freeSlot;
+    sh->freeSlot = slot;
+    SDL_AtomicAdd(&sh->connected, -1);
+}
+
+// 发送待发的局面，发送缓冲区满时留到EPOLLOUT或下一次变化
+static bool gameServerFlush(GameServerShard *sh, int slot) {
+    GameServerSession *s = &sh->sessions[slot];
+    while (s->sent < (int)sizeof(s->out)) {
+        ssize_t n = send(s->fd, (const uint8_t *)&s->out + s->sent,
+                         sizeof(s->out) - s->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            gameServerClose(sh, slot);
+            return false;
+        }
+        s->sent += (int)n;
+    }
+    return true;
+}
+
+static void gameServerAccept(GameServerShard *sh, uint64_t now) {
+    for (int i = 0; i < SPECTATE_ACCEPT_BATCH; i++) {
+        int fd = accept(sh->listener, NULL, NULL);
+        if (fd < 0) {
+            return;
+        }
+        spectateNonBlocking(fd);
+        clusterNoDelay(fd);
+        if (sh->freeSlot < 0) {
+            int capacity = sh->capacity ? sh->capacity * 2 : 1024;
+            GameServerSession *sessions =
+                realloc(sh->sessions, capacity * sizeof(*sessions));
+            int *dirtyList =
+                realloc(sh->dirtyList, capacity * sizeof(*dirtyList));
+            if (sessions) {
+                sh->sessions = sessions;
+            }
+            if (dirtyList) {
+                sh->dirtyList = dirtyList;
+            }
+            if (!sessions || !dirtyList) {
+                close(fd);
+                return;
+            }
+            for (int s = capacity - 1; s >= sh->capacity; s--) {
+                sh->sessions[s].active = false;
+                sh->sessions[s].fd = sh->freeSlot;
+                sh->freeSlot = s;
+            }
+            sh->capacity = capacity;
+        }
+        int slot = sh->freeSlot;
+        GameServerSession *s = &sh->sessions[slot];
+        sh->freeSlot = s->fd;
+        // 槽的上一个连接可能还在dirtyList中，保留标记避免重复加入
+        bool dirty = s->dirty;
+        memset(s, 0, sizeof(*s));
+        s->dirty = dirty;
+        s->fd = fd;
+        s->active = true;
+        s->sent = sizeof(s->out);
+        // 每个连接的种子不同，同一分片内按槽号区分
+        s->seed = sh->seed + (uint32_t)(sh->index * 1000003 + slot * 7919);
+        resetGame(&s->game, s->seed, sh->multiplier);
+        s->due = now + sh->fallInterval;
+        gameWheelInsert(sh, slot);
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u32 = (uint32_t)slot;
+        epoll_ctl(sh->epoll, EPOLL_CTL_ADD, fd, &ev);
+        SDL_AtomicAdd(&sh->connected, 1);
+        gameMarkDirty(sh, slot);
+    }
+}
+
+// 推进时间轮到now，处理所有到期的自动下落
+static void gameWheelAdvance(GameServerShard *sh, uint64_t now) {
+    while (sh->wheelTime + GAME_WHEEL_TICK <= now) {
+        int bucket =
+            (int)(sh->wheelTime / GAME_WHEEL_TICK) & (GAME_WHEEL_SLOTS - 1);
+        int slot = sh->wheel[bucket];
+        sh->wheel[bucket] = -1;
+        // 先把整个槽摘下来，没到期的（相差整数圈）放回去
+        while (slot >= 0) {
+            GameServerSession *s = &sh->sessions[slot];
+            int next = s->wheelNext;
+            if (s->due < sh->wheelTime + GAME_WHEEL_TICK) {
+                uint64_t late = now > s->due ? now - s->due : 0;
+                sh->lateness[late < GAME_LATENCY_BUCKETS
+                                 ? late
+                                 : GAME_LATENCY_BUCKETS]++;
+                gameServerInput(sh, s, GAME_INPUT_GRAVITY);
+                sh->ticks++;
+                // 落后太多时不补帧，从现在重新计时
+                s->due += sh->fallInterval;
+                if (s->due <= now) {
+                    s->due = now + sh->fallInterval;
+                }
+                gameMarkDirty(sh, slot);
+            }
+            gameWheelInsert(sh, slot);
+            slot = next;
+        }
+        sh->wheelTime += GAME_WHEEL_TICK;
+    }
+}
+
+// 把变化过的局面写进各自的发送缓冲（覆盖还没发完的旧局面）并发送
+static void gameServerPublish(GameServerShard *sh) {
+    // 需要下一轮再发的局面重新加入列表，写入位置不会超过当前读取位置
+    int count = sh->dirtyCount;
+    sh->dirtyCount = 0;
+    for (int i = 0; i < count; i++) {
+        int slot = sh->dirtyList[i];
+        GameServerSession *s = &sh->sessions[slot];
+        s->dirty = false;
+        if (!s->active) {
+            continue;
+        }
+        // 旧局面发出一部分时不能替换，等它发完后下一轮再发新局面
+        if (s->sent > 0 && s->sent < (int)sizeof(s->out)) {
+            gameServerFlush(sh, slot);
+            if (s->active) {
+                gameMarkDirty(sh, slot);
+            }
+            continue;
+        }
+        const GameSession *g = &s->game;
+        GameUpdate *u = &s->out;
+        memset(u, 0, sizeof(*u));
+        u->ack = s->ack;
+        u->games = s->games;
+        u->score = g->score;
+        for (int r = 0; r < ARENA_HEIGHT; r++) {
+            u->rows[r] = arenaRowMask(g, r);
+        }
+        u->type = (uint8_t)g->currentPiece.type;
+        u->rotation = (uint8_t)pieceRotation(&g->currentPiece);
+        u->nextType = (uint8_t)g->nextPiece.type;
+        u->x = (int8_t)g->currentPiece.x;
+        u->y = (int8_t)g->currentPiece.y;
+        s->sent = 0;
+        sh->updates++;
+        gameServerFlush(sh, slot);
+    }
+}
+
+static int gameShardMain(void *data) {
+    GameServerShard *sh = data;
+    struct epoll_event events[256];
+    uint8_t inputs[4096];
+    sh->wheelTime = spectateNow() / GAME_WHEEL_TICK * GAME_WHEEL_TICK;
+    while (!SDL_AtomicGet(sh->stop)) {
+        uint64_t now = spectateNow();
+        uint64_t next = sh->wheelTime + GAME_WHEEL_TICK;
+        int timeout = next > now ? (int)((next - now + 999) / 1000) : 0;
+        int n = epoll_wait(sh->epoll, events, 256, timeout);
+        uint64_t begin = spectateNow();
+        for (int e = 0; e < n; e++) {
+            uint32_t tag = events[e].data.u32;
+            if (tag == GAME_LISTENER_TAG) {
+                gameServerAccept(sh, begin);
+                continue;
+            }
+            GameServerSession *s = &sh->sessions[tag];
+            if (!s->active) {
+                continue;
+            }
+            uint32_t flags = events[e].events;
+            if (flags & EPOLLIN) {
+                ssize_t got;
+                while ((got = recv(s->fd, inputs, sizeof(inputs), 0)) > 0) {
+                    for (ssize_t i = 0; i < got; i++) {
+                        gameServerInput(sh, s, inputs[i]);
+                    }
+                    s->ack += (uint32_t)got;
+                    sh->inputs += (uint64_t)got;
+                    gameMarkDirty(sh, (int)tag);
+                }
+                if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    flags |= EPOLLHUP;
+                }
+            }
+            if (flags & (EPOLLERR | EPOLLHUP)) {
+                gameServerClose(sh, (int)tag);
+                continue;
+            }
+            if ((flags & EPOLLOUT) && !gameServerFlush(sh, (int)tag)) {
+                continue;
+            }
+        }
+        gameWheelAdvance(sh, begin);
+        gameServerPublish(sh);
+        uint64_t busy = spectateNow() - begin;
+        sh->loopTime[busy < GAME_LATENCY_BUCKETS ? busy
+                                                 : GAME_LATENCY_BUCKETS]++;
+    }
+    return 0;
+}
+
+// 打印微秒直方图的分位数
+static void gamePrintPercentiles(const char *label, const uint64_t *histogram) {
+    uint64_t total = 0;
+    for (int b = 0; b <= GAME_LATENCY_BUCKETS; b++) {
+        total += histogram[b];
+    }
+    if (total == 0) {
+        return;
+    }
+    static const double marks[] = {0.5, 0.9, 0.99, 0.999};
+    printf("%s:", label);
+    for (int m = 0; m < 4; m++) {
+        uint64_t target = (uint64_t)(total * marks[m]), seen = 0;
+        int b = 0;
+        while (b < GAME_LATENCY_BUCKETS && (seen += histogram[b]) <= target) {
+            b++;
+        }
+        printf(" p%g %s%d us", marks[m] * 100,
+               b == GAME_LATENCY_BUCKETS ? ">" : "", b);
+    }
+    printf(" (%llu samples)\n", (unsigned long long)total);
+}
+
+static double gameCpuSeconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// 多局游戏服务器，运行seconds秒（0表示一直运行），结束时报告自动下落的延迟分布
+// 和按CPU占用折算的每核局数
+int runGameServer(const char *address, int shardCount, int seconds,
+                  uint32_t seed) {
+    spectateRaiseFileLimit();
+    if (!clusterNetInit()) {
+        return 1;
+    }
+    char actual[256];
+    int listener = clusterListen(address, actual, sizeof(actual));
+    if (listener < 0) {
+        printf("Failed to listen on %s\n", address);
+        return 1;
+    }
+    listen(listener, SOMAXCONN);
+    spectateNonBlocking(listener);
+    shardCount = shardCount < 1                     ? 1
+                 : shardCount > SPECTATE_MAX_SHARDS ? SPECTATE_MAX_SHARDS
+                                                    : shardCount;
+    static GameServerShard shards[SPECTATE_MAX_SHARDS];
+    SDL_Thread *threads[SPECTATE_MAX_SHARDS];
+    SDL_atomic_t stop;
+    SDL_AtomicSet(&stop, 0);
+    for (int i = 0; i < shardCount; i++) {
+        GameServerShard *sh = &shards[i];
+        memset(sh, 0, sizeof(*sh));
+        sh->index = i;
+        sh->stop = &stop;
+        sh->listener = listener;
+        sh->fallInterval = lastFallInterval * 1000;
+        sh->multiplier = scoreMultiplier;
+        sh->seed = seed;
+        sh->freeSlot = -1;
+        for (int b = 0; b < GAME_WHEEL_SLOTS; b++) {
+            sh->wheel[b] = -1;
+        }
+        sh->lateness = calloc(GAME_LATENCY_BUCKETS + 1, sizeof(uint64_t));
+        sh->loopTime = calloc(GAME_LATENCY_BUCKETS + 1, sizeof(uint64_t));
+        sh->epoll = epoll_create1(0);
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.u32 = GAME_LISTENER_TAG;
+        epoll_ctl(sh->epoll, EPOLL_CTL_ADD, listener, &ev);
+        threads[i] = SDL_CreateThread(gameShardMain, "game shard", sh);
+    }
+    printf("Game server on %s: %d shards, fall interval %u ms\n", actual,
+           shardCount, lastFallInterval);
+    fflush(stdout);
+
+    uint64_t start = spectateNow();
+    double cpuStart = gameCpuSeconds();
+    uint64_t lastTicks = 0, lastUpdates = 0, lastInputs = 0;
+    int peak = 0;
+    double busyCpu = 0, busyWall = 0; // 有连接时的CPU时间和经过时间
+    for (int second = 1; seconds <= 0 || second <= seconds; second++) {
+        double cpuBefore = gameCpuSeconds();
+        SDL_Delay(1000);
+        int connected = 0;
+        uint64_t ticks = 0, updates = 0, inputs = 0, locks = 0, over = 0;
+        for (int i = 0; i < shardCount; i++) {
+            connected += SDL_AtomicGet(&shards[i].connected);
+            ticks += __atomic_load_n(&shards[i].ticks, __ATOMIC_RELAXED);
+            updates += __atomic_load_n(&shards[i].updates, __ATOMIC_RELAXED);
+            inputs += __atomic_load_n(&shards[i].inputs, __ATOMIC_RELAXED);
+            locks += __atomic_load_n(&shards[i].locks, __ATOMIC_RELAXED);
+            over += __atomic_load_n(&shards[i].gamesOver, __ATOMIC_RELAXED);
+        }
+        double cpu = gameCpuSeconds() - cpuBefore;
+        if (connected > 0 && connected >= peak) {
+            busyCpu += cpu;
+            busyWall += 1;
+        }
+        peak = connected > peak ? connected : peak;
+        printf("%4d s: %d sessions, %llu ticks/s, %llu inputs/s, %llu "
+               "updates/s, %llu pieces, %llu games over, CPU %.0f%%\n",
+               second, connected, (unsigned long long)(ticks - lastTicks),
+               (unsigned long long)(inputs - lastInputs),
+               (unsigned long long)(updates - lastUpdates),
+               (unsigned long long)locks, (unsigned long long)over,
+               cpu * 100);
+        fflush(stdout);
+        lastTicks = ticks;
+        lastUpdates = updates;
+        lastInputs = inputs;
+    }
+    SDL_AtomicSet(&stop, 1);
+    uint64_t *lateness = calloc(GAME_LATENCY_BUCKETS + 1, sizeof(uint64_t));
+    uint64_t *loopTime = calloc(GAME_LATENCY_BUCKETS + 1, sizeof(uint64_t));
+    for (int i = 0; i < shardCount; i++) {
+        GameServerShard *sh = &shards[i];
+        SDL_WaitThread(threads[i], NULL);
+        for (int b = 0; b <= GAME_LATENCY_BUCKETS; b++) {
+            lateness[b] += sh->lateness[b];
+            loopTime[b] += sh->loopTime[b];
+        }
+        for (int s = 0; s < sh->capacity; s++) {
+            if (sh->sessions[s].active) {
+                close(sh->sessions[s].fd);
+            }
+        }
+        close(sh->epoll);
+        free(sh->sessions);
+        free(sh->dirtyList);
+        free(sh->lateness);
+        free(sh->loopTime);
+    }
+    close(listener);
+    double wall = (double)(spectateNow() - start) / 1e6;
+    printf("%d shards, peak %d sessions (%.0f per shard), CPU %.1f%% of one "
+           "core over %.0f s\n",
+           shardCount, peak, (double)peak / shardCount,
+           (gameCpuSeconds() - cpuStart) / wall * 100, wall);
+    gamePrintPercentiles("tick lateness", lateness);
+    gamePrintPercentiles("event loop time", loopTime);
+    if (busyCpu > 0) {
+        printf("at peak load: %.1f%% CPU, about %.0f sessions per core\n",
+               busyCpu / busyWall * 100, peak / (busyCpu / busyWall));
+    }
+    free(lateness);
+    free(loopTime);
+    clusterNetQuit();
+    return 0;
+}
+
+// 负载测试用的客户端：随机操作，记录每次操作到收到包含它的局面的往返时间
+typedef struct {
+    int fd;
+    bool connected, closed;
+    uint32_t sent;      // 已发送的操作数
+    uint32_t timedAck;  // 正在计时的操作序号（发送后的sent值），0表示没有
+    uint64_t timedAt;
+    uint64_t nextInput; // 下一次操作的时间
+    int have;
+    GameUpdate update;
+} GameLoadClient;
+
+// 负载生成器：clients个连接，每个连接平均每秒inputRate次随机操作，运行seconds秒
+int runGameLoad(const char *address, int clients, int inputRate, int seconds) {
+    spectateRaiseFileLimit();
+    struct sockaddr_storage addr;
+    socklen_t length;
+    if (!clusterNetInit() || !clusterAddress(address, &addr, &length)) {
+        printf("Failed to resolve %s\n", address);
+        return 1;
+    }
+    clients = clients < 1 ? 1 : clients;
+    inputRate = inputRate < 1 ? 1 : inputRate;
+    GameLoadClient *c = calloc(clients, sizeof(*c));
+    uint64_t *rtt = calloc(GAME_LATENCY_BUCKETS + 1, sizeof(uint64_t));
+    int epoll = epoll_create1(0);
+    uint32_t rng = 0x9e3779b9;
+    uint64_t start = spectateNow();
+    for (int i = 0; i < clients; i++) {
+        c[i].fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (c[i].fd < 0) {
+            printf("Only %d connections could be opened\n", i);
+            clients = i;
+            break;
+        }
+        clusterNoDelay(c[i].fd);
+        if (connect(c[i].fd, (struct sockaddr *)&addr, length) < 0 &&
+            errno != EINPROGRESS) {
+            close(c[i].fd);
+            c[i].closed = true;
+            continue;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u32 = (uint32_t)i;
+        epoll_ctl(epoll, EPOLL_CTL_ADD, c[i].fd, &ev);
+        c[i].nextInput = start + xorshift32(&rng) % (2000000 / inputRate);
+    }
+
+    static const uint8_t moves[] = {GAME_INPUT_LEFT, GAME_INPUT_RIGHT,
+                                    GAME_INPUT_ROTATE, GAME_INPUT_DOWN,
+                                    GAME_INPUT_DROP};
+    struct epoll_event events[512];
+    long long updates = 0, inputs = 0;
+    int connected = 0, closed = 0;
+    uint64_t end = start + (uint64_t)(seconds > 0 ? seconds : 10) * 1000000;
+    uint64_t nextReport = start + 1000000;
+    for (uint64_t now = start; now < end; now = spectateNow()) {
+        int n = epoll_wait(epoll, events, 512, 2);
+        now = spectateNow();
+        for (int e = 0; e < n; e++) {
+            GameLoadClient *cl = &c[events[e].data.u32];
+            if (cl->closed) {
+                continue;
+            }
+            if (!cl->connected && (events[e].events & EPOLLOUT) &&
+                !(events[e].events & EPOLLERR)) {
+                cl->connected = true;
+                connected++;
+            }
+            if (!(events[e].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR))) {
+                continue;
+            }
+            for (;;) {
+                ssize_t got = recv(cl->fd, (uint8_t *)&cl->update + cl->have,
+                                   sizeof(cl->update) - cl->have, 0);
+                if (got <= 0) {
+                    if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                        close(cl->fd);
+                        cl->closed = true;
+                        closed++;
+                    }
+                    break;
+                }
+                cl->have += (int)got;
+                if (cl->have == (int)sizeof(cl->update)) {
+                    cl->have = 0;
+                    updates++;
+                    if (cl->timedAck && cl->update.ack >= cl->timedAck) {
+                        uint64_t us = now - cl->timedAt;
+                        rtt[us < GAME_LATENCY_BUCKETS ? us
+                                                      : GAME_LATENCY_BUCKETS]++;
+                        cl->timedAck = 0;
+                    }
+                }
+            }
+        }
+        // 发送到期的操作
+        for (int i = 0; i < clients; i++) {
+            GameLoadClient *cl = &c[i];
+            if (!cl->connected || cl->closed || now < cl->nextInput) {
+                continue;
+            }
+            uint8_t input = moves[xorshift32(&rng) % sizeof(moves)];
+            if (send(cl->fd, &input, 1, MSG_NOSIGNAL | MSG_DONTWAIT) == 1) {
+                cl->sent++;
+                inputs++;
+                if (!cl->timedAck) {
+                    cl->timedAck = cl->sent;
+                    cl->timedAt = now;
+                }
+            }
+            cl->nextInput = now + 1 + xorshift32(&rng) % (2000000 / inputRate);
+        }
+        if (now >= nextReport) {
+            printf("%d/%d connected, %lld inputs, %lld updates\n", connected,
+                   clients, inputs, updates);
+            fflush(stdout);
+            nextReport += 1000000;
+        }
+    }
+    double elapsed = (double)(spectateNow() - start) / 1e6;
+    printf("%d clients, %d connected, %d closed by server, %.0f inputs/s, "
+           "%.0f updates/s\n",
+           clients, connected, closed, inputs / elapsed, updates / elapsed);
+    gamePrintPercentiles("input round trip", rtt);
+    for (int i = 0; i < clients; i++) {
+        if (!c[i].closed) {
+            close(c[i].fd);
+        }
+    }
+    close(epoll);
+    free(c);
+    free(rtt);
+    clusterNetQuit();
+    return connected == clients && closed == 0 && updates > 0 ? 0 : 1;
+}
+
+#else
+
+int runGameServer(const char *address, int shardCount, int seconds,
+                  uint32_t seed) {
+    (void)address, (void)shardCount, (void)seconds, (void)seed;
+    printf("The game server needs epoll and is only supported on Linux\n");
+    return 1;
+}
+
+int runGameLoad(const char *address, int clients, int inputRate, int seconds) {
+    (void)address, (void)clients, (void)inputRate, (void)seconds;
+    printf("The game load generator is only supported on Linux\n");
+    return 1;
+}
+
+#endif
+
+// ==================== 指标端点 ====================
+
+// --metrics HOST:PORT|unix:PATH 在后台线程中提供一个HTTP端点，GET /metrics返回
+// Prometheus文本格式。记录一侧只有原子加法，直方图的累计计数、总次数和
+// 每秒方块数都在抓取时才计算
+#define METRICS_TEXT_SIZE 16384
+
+typedef struct {
+    char data[METRICS_TEXT_SIZE];
+    int length;
+} MetricsText;
+
+static void metricsHeader(MetricsText *t, const char *name, const char *type,
+                          const char *help) {
+    int room = METRICS_TEXT_SIZE - t->length;
+    int n = snprintf(t->data + t->length, room, "# HELP %s %s\n# TYPE %s %s\n",
+                     name, help, name, type);
+    t->length += n < room ? n : room - 1;
+}
+
+static void metricsValue(MetricsText *t, const char *name, const char *label,
+                         double value) {
+    int room = METRICS_TEXT_SIZE - t->length;
+    int n = snprintf(t->data + t->length, room, "%s%s %.15g\n", name, label,
+                     value);
+    t->length += n < room ? n : room - 1;
+}
+
+static void metricsCounter(MetricsText *t, const char *name, const char *help,
+                           uint64_t *counter) {
+    metricsHeader(t, name, "counter", help);
+    metricsValue(t, name, "",
+                 (double)__atomic_load_n(counter, __ATOMIC_RELAXED));
+}
+
+// 各个桶分别计数，抓取时累加成Prometheus要求的"小于等于上界"的累计计数
+static void metricsHistogram(MetricsText *t, const char *name,
+                             const char *help, MetricHistogram *h) {
+    char bucket[128], label[64];
+    metricsHeader(t, name, "histogram", help);
+    snprintf(bucket, sizeof(bucket), "%s_bucket", name);
+    uint64_t count = 0;
+    for (int b = 0; b <= METRIC_BUCKETS; b++) {
+        count += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        if (b < METRIC_BUCKETS) {
+            snprintf(label, sizeof(label), "{le=\"%g\"}", metricBounds[b]);
+        } else {
+            snprintf(label, sizeof(label), "{le=\"+Inf\"}");
+        }
+        metricsValue(t, bucket, label, (double)count);
+    }
+    snprintf(bucket, sizeof(bucket), "%s_sum", name);
+    metricsValue(t, bucket, "",
+                 __atomic_load_n(&h->sumMicros, __ATOMIC_RELAXED) / 1e6);
+    snprintf(bucket, sizeof(bucket), "%s_count", name);
+    metricsValue(t, bucket, "", (double)count);
+}
+
+ClusterSocket metricsListener = CLUSTER_NO_SOCKET;
+Uint64 metricsLastScrape = 0;    // 上次抓取的时间
+uint64_t metricsLastPieces = 0;  // 上次抓取时的方块数
+
+void metricsRender(MetricsText *t) {
+    t->length = 0;
+    metricsHistogram(t, "tetris_frame_seconds",
+                     "Time between two presented frames.", &metrics.frameTime);
+    metricsHistogram(t, "tetris_input_latency_seconds",
+                     "Time from a key event to the frame that shows it.",
+                     &metrics.inputLatency);
+    metricsHistogram(t, "tetris_save_seconds",
+                     "Time to write a savegame or an input log.",
+                     &metrics.saveTime);
+    metricsHistogram(t, "tetris_music_dsp_seconds",
+                     "Time stretching background music per audio callback.",
+                     &metrics.musicDsp);
+    metricsCounter(t, "tetris_frames_total", "Frames presented.",
+                   &metrics.frames);
+    metricsCounter(t, "tetris_inputs_total", "Effective player inputs.",
+                   &metrics.inputs);
+    metricsCounter(t, "tetris_pieces_total", "Pieces spawned in all games.",
+                   &metrics.pieces);
+    metricsCounter(t, "tetris_lines_cleared_total", "Lines cleared.",
+                   &metrics.lines);
+    metricsCounter(t, "tetris_font_cache_hits_total",
+                   "Font lookups served from the cache.", &metrics.fontHits);
+    metricsCounter(t, "tetris_font_cache_misses_total",
+                   "Font lookups that opened the font file.",
+                   &metrics.fontMisses);
+    metricsCounter(t, "tetris_audio_callbacks_total", "Audio buffers mixed.",
+                   &metrics.audioCallbacks);
+    metricsCounter(t, "tetris_audio_underruns_total",
+                   "Audio buffers that arrived late.",
+                   &metrics.audioUnderruns);
+    metricsCounter(t, "tetris_sfx_played_total", "Sound effects started.",
+                   &metrics.sfxPlayed);
+    metricsCounter(t, "tetris_sfx_stolen_total",
+                   "Sound effects that took over a busy voice.",
+                   &metrics.sfxStolen);
+    metricsCounter(t, "tetris_sfx_dropped_total",
+                   "Sound effects dropped because no voice could be stolen.",
+                   &metrics.sfxDropped);
+
+    // 每秒方块数按两次抓取之间的增量计算，第一次抓取时从端点启动算起
+    Uint64 now = SDL_GetPerformanceCounter();
+    uint64_t pieces = __atomic_load_n(&metrics.pieces, __ATOMIC_RELAXED);
+    double seconds = (double)(now - metricsLastScrape) /
+                     SDL_GetPerformanceFrequency();
+    metricsHeader(t, "tetris_pieces_per_second", "gauge",
+                  "Pieces per second since the previous scrape.");
+    metricsValue(t, "tetris_pieces_per_second", "",
+                 seconds > 0 ? (pieces - metricsLastPieces) / seconds : 0);
+    metricsLastScrape = now;
+    metricsLastPieces = pieces;
+}
+
+// 逐个处理抓取请求，每个连接只读一次请求头，回复后关闭
+static int metricsThreadMain(void *arg) {
+    (void)arg;
+    static MetricsText text;
+    for (;;) {
+        ClusterSocket c = accept(metricsListener, NULL, NULL);
+        if (c == CLUSTER_NO_SOCKET) {
+            SDL_Delay(10);
+            continue;
+        }
+        // 不发请求的客户端不能一直占住端点
+#ifdef _WIN32
+        DWORD timeout = 1000;
+#else
+        struct timeval timeout = {1, 0};
+#endif
+        setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout,
+                   sizeof(timeout));
+        char request[1024];
+        int n = (int)recv(c, request, sizeof(request) - 1, 0);
+        request[n > 0 ? n : 0] = '\0';
+        char header[160];
+        const char *body = "not found\n";
+        const char *status = "404 Not Found";
+        if (strncmp(request, "GET /metrics", 12) == 0 ||
+            strncmp(request, "GET / ", 6) == 0) {
+            metricsRender(&text);
+            body = text.data;
+            status = "200 OK";
+        }
+        int length = snprintf(header, sizeof(header),
+                              "HTTP/1.0 %s\r\nContent-Type: text/plain; "
+                              "version=0.0.4\r\nContent-Length: %d\r\n"
+                              "Connection: close\r\n\r\n",
+                              status, (int)strlen(body));
+        if (n > 0 && clusterSend(c, header, length)) {
+            clusterSend(c, body, (int)strlen(body));
+        }
+        clusterCloseSocket(c);
+    }
+    return 0;
+}
+
+// 开始在address上提供指标，端点线程一直运行到进程退出
+bool metricsStart(const char *address) {
+    char actual[256];
+    if (!clusterNetInit()) {
+        return false;
+    }
+    metricsListener = clusterListen(address, actual, sizeof(actual));
+    if (metricsListener == CLUSTER_NO_SOCKET) {
+        return false;
+    }
+    metricsLastScrape = SDL_GetPerformanceCounter();
+    SDL_Thread *thread = SDL_CreateThread(metricsThreadMain, "metrics", NULL);
+    if (!thread) {
+        clusterCloseSocket(metricsListener);
+        return false;
+    }
+    SDL_DetachThread(thread);
+    printf("Serving metrics on http://%s/metrics\n", actual);
+    return true;
+}
+
+// ==================== 消除求解器 ====================
+
+#define SOLVER_MAX_PIECES 16      // 方块序列的最大长度
+#define SOLVER_MAX_PLACEMENTS 160 // 允许软降和滑动时一个方块的最大落点数
+
+// 一个求解任务：第一块方块的每个落点是一个子树，由线程池并行搜索
+typedef struct {
+    BitBoard board;
+    int sequence[SOLVER_MAX_PIECES]; // 方块序列
+    int maxPieces;                   // 最多使用的方块数
+    int targetLines;                 // 目标消除行数，0表示完美消除（清空棋盘）
+    uint64_t salt;                   // 混入置换表键的求解参数
+
+    Placement first[SOLVER_MAX_PLACEMENTS]; // 第一块方块的落点
+    BitBoard firstBoards[SOLVER_MAX_PLACEMENTS];
+    int firstLines[SOLVER_MAX_PLACEMENTS];
+    int firstCount;
+    SDL_atomic_t nextTask; // 下一个待领取的子树
+    SDL_atomic_t found;    // 已找到解的最小子树下标，没有时为firstCount
+    Placement paths[SOLVER_MAX_PLACEMENTS][SOLVER_MAX_PIECES]; // 各子树的解
+    int pathLength[SOLVER_MAX_PLACEMENTS];
+    uint64_t nodes[BOT_MAX_THREADS]; // 各线程搜索的节点数
+    BotStats workerStats[BOT_MAX_THREADS];
+} SolveJob;
+
+typedef enum { SOLVE_FAIL, SOLVE_FOUND, SOLVE_ABORT } SolveResult;
+
+// 枚举方块从出生位置出发能到达的所有落点：与玩家一样可以旋转、左右移动、
+// 软降，所以能滑进悬空的缝隙。锁定后结果相同的落点只保留一个
+int solverPlacements(const BitBoard *board, int type, Placement *out,
+                     BitBoard *boards, int *lines) {
+    // 位置(x, y)用第x + OX位表示，每种旋转状态每行一个位掩码
+    enum { OX = 3, OY = 4, SH = ARENA_HEIGHT + OY };
+    uint16_t open[4][SH];  // 不碰撞的位置
+    uint16_t reach[4][SH]; // 能到达的位置
+    int x0 = ARENA_WIDTH / 2 - 2, y0 = -2;
+    if (bitCollision(board, type, 0, x0, y0)) {
+        return 0;
+    }
+    // 最高的方块上方都是空的，方块可以先在出生位置旋转、平移，再直接下落到
+    // 紧贴最高方块的上方，所以从那里的所有位置开始搜索
+    int top = 0;
+    while (top < ARENA_HEIGHT && !board->rows[top]) {
+        top++;
+    }
+    int ys = top - 4 > y0 ? top - 4 : y0;
+    for (int r = 0; r < 4; r++) {
+        for (int y = ys; y < ARENA_HEIGHT; y++) {
+            open[r][y + OY] = 0;
+            for (int x = -OX; x < ARENA_WIDTH; x++) {
+                if (!bitCollision(board, type, r, x, y)) {
+                    open[r][y + OY] |= 1 << (x + OX);
+                }
+            }
+            reach[r][y + OY] = 0;
+        }
+        // 没有空余的行时只从出生位置开始
+        reach[r][ys + OY] = ys == y0 ? (r == 0 ? 1 << (x0 + OX) : 0)
+                                     : open[r][ys + OY];
+    }
+
+    // 反复扩散直到不再变化：下移、左右移动、旋转（与rotatePiece()一样只有一个方向）
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int r = 0; r < 4; r++) {
+            int from = (r + 3) % 4;
+            for (int y = ys; y < ARENA_HEIGHT; y++) {
+                uint16_t f = open[r][y + OY];
+                uint16_t row = reach[r][y + OY] | (reach[from][y + OY] & f);
+                if (y > ys) {
+                    row |= reach[r][y - 1 + OY] & f;
+                }
+                uint16_t prev;
+                do {
+                    prev = row;
+                    row |= (uint16_t)((row << 1) | (row >> 1)) & f;
+                } while (row != prev);
+                if (row != reach[r][y + OY]) {
+                    reach[r][y + OY] = row;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // 不能继续下落的位置就是落点，锁定后结果相同的只保留一个
+    int count = 0;
+    for (int r = 0; r < 4; r++) {
+        for (int y = ARENA_HEIGHT - 1; y >= ys; y--) {
+            uint16_t below = y + 1 < ARENA_HEIGHT ? open[r][y + 1 + OY] : 0;
+            uint16_t landing = reach[r][y + OY] & ~below;
+            while (landing && count < SOLVER_MAX_PLACEMENTS) {
+                int x = __builtin_ctz(landing) - OX;
+                landing &= landing - 1;
+                BitBoard next = *board;
+                int cleared = bitLock(&next, type, r, x, y);
+                bool duplicate = false;
+                for (int i = 0; i < count && !duplicate; i++) {
+                    duplicate = boards[i].hash == next.hash &&
+                                memcmp(boards[i].rows, next.rows,
+                                       sizeof(next.rows)) == 0;
+                }
+                if (!duplicate) {
+                    out[count] = (Placement){r, x, y};
+                    boards[count] = next;
+                    lines[count] = cleared;
+                    count++;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+// 从顶部能到达的空格（向上、下、左、右扩散）
+static void solverReachable(const BitBoard *board, uint16_t *reach) {
+    reach[0] = ~board->rows[0] & FULL_ROW;
+    for (int i = 1; i < ARENA_HEIGHT; i++) {
+        reach[i] = 0;
+    }
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < ARENA_HEIGHT; i++) {
+            uint16_t empty = ~board->rows[i] & FULL_ROW;
+            uint16_t r = reach[i];
+            if (i > 0) {
+                r |= reach[i - 1] & empty;
+            }
+            if (i + 1 < ARENA_HEIGHT) {
+                r |= reach[i + 1] & empty;
+            }
+            // 在行内向左右扩散
+            uint16_t prev;
+            do {
+                prev = r;
+                r |= (uint16_t)((r << 1) | (r >> 1)) & empty;
+            } while (r != prev);
+            if (r != reach[i]) {
+                reach[i] = r;
+                changed = true;
+            }
+        }
+    }
+}
+
+// 剪枝：判断从这个棋盘出发，用sequence[index..limit)中的方块是否不可能达到目标
+static bool solverHopeless(const SolveJob *job, const BitBoard *board,
+                           int index, int cleared) {
+    int remaining = job->maxPieces - index;
+    int cells = 0, height = 0;
+    int rowCells[ARENA_HEIGHT];
+    for (int i = 0; i < ARENA_HEIGHT; i++) {
+        rowCells[i] = __builtin_popcount(board->rows[i]);
+        cells += rowCells[i];
+        if (board->rows[i] && height == 0) {
+            height = ARENA_HEIGHT - i;
+        }
+    }
+
+    if (job->targetLines > 0) {
+        // 还要消除need行：最满的need行缺的格子数不能超过剩余方块的格子数
+        int need = job->targetLines - cleared;
+        int missing = 0;
+        for (int k = 0; k < need; k++) {
+            int best = -1;
+            for (int i = 0; i < ARENA_HEIGHT; i++) {
+                if (rowCells[i] >= 0 && (best < 0 || rowCells[i] > rowCells[best])) {
+                    best = i;
+                }
+            }
+            missing += ARENA_WIDTH - rowCells[best];
+            rowCells[best] = -1;
+        }
+        return missing > 4 * remaining;
+    }
+
+    // 完美消除：现有的每一行都必须被填满
+    if (ARENA_WIDTH * height > cells + 4 * remaining) {
+        return true;
+    }
+
+    // 列奇偶性：满行的偶数列和奇数列格子一样多，所以清空棋盘时放入的方块
+    // 必须抵消现有的差值。O、S、Z和横放的I、T不改变差值，L和J改变±2，
+    // 竖放的T改变±2，竖放的I改变±4
+    uint16_t evenCols = 0;
+    for (int j = 0; j < ARENA_WIDTH; j += 2) {
+        evenCols |= 1 << j;
+    }
+    int diff = 0;
+    for (int i = ARENA_HEIGHT - height; i < ARENA_HEIGHT; i++) {
+        diff += __builtin_popcount(board->rows[i] & evenCols) -
+                __builtin_popcount(board->rows[i] & ~evenCols & FULL_ROW);
+    }
+    if (diff < 0) {
+        diff = -diff;
+    }
+    // 用m块方块清空棋盘需要格子数正好是整行，逐个检查可能的m
+    int bound = 0, tCount = 0, ljCount = 0;
+    bool feasible = false;
+    for (int m = 1; m <= remaining && !feasible; m++) {
+        int type = job->sequence[index + m - 1];
+        bound += type == 0 ? 4 : (type == 2 || type >= 5) ? 2 : 0;
+        tCount += type == 2;
+        ljCount += type >= 5;
+        if ((cells + 4 * m) % ARENA_WIDTH != 0 ||
+            ARENA_WIDTH * height > cells + 4 * m || diff > bound) {
+            continue;
+        }
+        // 没有T时L/J的个数决定差值除以2的奇偶
+        if (tCount == 0 && (diff / 2 + ljCount) % 2 != 0) {
+            continue;
+        }
+        // 最后的lines行中被填满的列把棋盘分成互不相通的几段，
+        // 方块不会超出这几行，所以每段的空格数必须是4的倍数
+        int lines = (cells + 4 * m) / ARENA_WIDTH;
+        uint16_t walls = FULL_ROW;
+        for (int i = ARENA_HEIGHT - lines; i < ARENA_HEIGHT; i++) {
+            walls &= board->rows[i];
+        }
+        bool divisible = true;
+        for (int j = 0; j < ARENA_WIDTH && divisible;) {
+            if (walls & (1 << j)) {
+                j++;
+                continue;
+            }
+            uint16_t segment = 0;
+            for (; j < ARENA_WIDTH && !(walls & (1 << j)); j++) {
+                segment |= 1 << j;
+            }
+            int holes = 0;
+            for (int i = ARENA_HEIGHT - lines; i < ARENA_HEIGHT; i++) {
+                holes += __builtin_popcount(~board->rows[i] & segment);
+            }
+            divisible = holes % 4 == 0;
+        }
+        feasible = divisible;
+    }
+    if (!feasible) {
+        return true;
+    }
+
+    // 封闭的空格只有在上面某一行先被消除后才可能重新打开，
+    // 而一行能被填满的前提是它自己没有封闭的空格
+    uint16_t reach[ARENA_HEIGHT];
+    solverReachable(board, reach);
+    bool completable = false; // 上面是否有可以填满的行
+    for (int i = ARENA_HEIGHT - height; i < ARENA_HEIGHT; i++) {
+        if ((~board->rows[i] & FULL_ROW) & ~reach[i]) {
+            if (!completable) {
+                return true;
+            }
+        } else {
+            completable = true;
+        }
+    }
+    return false;
+}
+
+// 深度优先搜索第index块方块的落点，path记录找到的解
+static SolveResult solverSearch(SolveJob *job, int task, const BitBoard *board,
+                                int index, int cleared, Placement *path,
+                                int self) {
+    job->nodes[self]++;
+    bool empty = true;
+    for (int i = 0; i < ARENA_HEIGHT && empty; i++) {
+        empty = board->rows[i] == 0;
+    }
+    if (job->targetLines > 0 ? cleared >= job->targetLines : empty) {
+        job->pathLength[task] = index;
+        return SOLVE_FOUND;
+    }
+    if (index >= job->maxPieces || solverHopeless(job, board, index, cleared)) {
+        return SOLVE_FAIL;
+    }
+    // 更靠前的子树已经找到解时放弃
+    if (SDL_AtomicGet(&job->found) < task) {
+        return SOLVE_ABORT;
+    }
+
+    // 已证明无解的子局面记在置换表里，所有线程共享
+    // 完美消除时棋盘和方块数已经决定了消除的行数
+    uint64_t key = board->hash ^
+                   mix64(job->salt + index * 64 +
+                         (job->targetLines > 0 ? cleared : 0));
+    uint16_t verify = ttVerify(board, cleared);
+    float value;
+    int depth = job->maxPieces - index;
+    if (ttProbe(key, verify, depth, &value)) {
+        return SOLVE_FAIL;
+    }
+
+    Placement placements[SOLVER_MAX_PLACEMENTS];
+    BitBoard children[SOLVER_MAX_PLACEMENTS];
+    int lines[SOLVER_MAX_PLACEMENTS];
+    int count = solverPlacements(board, job->sequence[index], placements,
+                                 children, lines);
+    bool aborted = false;
+    for (int i = 0; i < count; i++) {
+        if (children[i].rows[0]) {
+            continue; // 顶行有方块时游戏结束
+        }
+        path[index] = placements[i];
+        SolveResult result = solverSearch(job, task, &children[i], index + 1,
+                                          cleared + lines[i], path, self);
+        if (result == SOLVE_FOUND) {
+            return SOLVE_FOUND;
+        }
+        aborted |= result == SOLVE_ABORT;
+    }
+    if (aborted) {
+        return SOLVE_ABORT;
+    }
+    ttStore(key, verify, depth, 0);
+    return SOLVE_FAIL;
+}
+
+// 一个线程的求解循环：按顺序领取第一块方块的落点
+static void solverWork(void *data, int self) {
+    SolveJob *job = data;
+    BotStats before = botStats;
+    job->nodes[self] = 0;
+    int task;
+    while ((task = SDL_AtomicAdd(&job->nextTask, 1)) < job->firstCount) {
+        if (SDL_AtomicGet(&job->found) < task) {
+            continue;
+        }
+        Placement *path = job->paths[task];
+        path[0] = job->first[task];
+        if (job->firstBoards[task].rows[0]) {
+            continue;
+        }
+        if (solverSearch(job, task, &job->firstBoards[task], 1,
+                         job->firstLines[task], path, self) == SOLVE_FOUND) {
+            // 记录找到解的最小子树下标
+            int old = SDL_AtomicGet(&job->found);
+            while (task < old && !SDL_AtomicCAS(&job->found, old, task)) {
+                old = SDL_AtomicGet(&job->found);
+            }
+        }
+    }
+    botStatsDelta(&job->workerStats[self], &before);
+}
+
+// 求解：用sequence中最多maxPieces块方块清空棋盘（targetLines为0）或消除
+// targetLines行。方块数从少到多逐次加深，所以找到的是最短的解；
+// 同样的方块数下总是返回第一块方块落点最靠前的解，结果与线程数无关
+bool solvePuzzle(const BitBoard *board, const int *sequence, int maxPieces,
+                 int targetLines, SearchPool *pool, Placement *solution,
+                 int *length, uint64_t *nodes) {
+    static SolveJob job;
+    if (maxPieces > SOLVER_MAX_PIECES) {
+        maxPieces = SOLVER_MAX_PIECES;
+    }
+    int workers = pool && pool->count > 1 ? pool->count : 1;
+    *nodes = 0;
+    job.board = *board;
+    memcpy(job.sequence, sequence, sizeof(int) * maxPieces);
+    job.targetLines = targetLines;
+    for (int limit = 1; limit <= maxPieces; limit++) {
+        job.maxPieces = limit;
+        // 已证明无解的子局面与方块数上限和目标有关，都混入置换表的键
+        job.salt = mix64(0x50cafe ^ ((uint64_t)limit << 8) ^
+                         ((uint64_t)targetLines << 16));
+        for (int i = 0; i < limit; i++) {
+            job.salt = mix64(job.salt ^ (uint64_t)sequence[i]);
+        }
+        job.firstCount = solverPlacements(board, sequence[0], job.first,
+                                          job.firstBoards, job.firstLines);
+        SDL_AtomicSet(&job.nextTask, 0);
+        SDL_AtomicSet(&job.found, job.firstCount);
+        SDL_AtomicAdd(&ttGeneration, 1);
+
+        poolRun(pool, workers, solverWork, &job);
+        for (int t = 0; t < workers; t++) {
+            *nodes += job.nodes[t];
+            if (t > 0) {
+                botStatsAdd(&botStats, &job.workerStats[t]);
+            }
+        }
+
+        int task = SDL_AtomicGet(&job.found);
+        if (task < job.firstCount) {
+            *length = job.pathLength[task];
+            memcpy(solution, job.paths[task], sizeof(Placement) * *length);
+            return true;
+        }
+    }
+    return false;
+}
+
+// 命令行求解模式：从存档（或空棋盘）出发求解给定的方块序列并打印步骤
+int runSolver(const char *letters, int maxPieces, int targetLines) {
+    int sequence[SOLVER_MAX_PIECES];
+    int count = 0;
+    for (const char *c = letters; *c && count < SOLVER_MAX_PIECES; c++) {
+        const char *p = memchr(pieceLetters, *c & ~0x20, 7);
+        if (!p) {
+            printf("Unknown piece '%c', use letters IOTSZJL\n", *c);
+            return 1;
+        }
+        sequence[count++] = (int)(p - pieceLetters);
+    }
+    if (maxPieces <= 0 || maxPieces > count) {
+        maxPieces = count;
+    }
+
+    BitBoard board = boardFromArena(&session);
+    Placement solution[SOLVER_MAX_PIECES];
+    int length = 0;
+    uint64_t nodes = 0;
+    memset(&botStats, 0, sizeof(botStats));
+    Uint64 start = SDL_GetPerformanceCounter();
+    bool solved = solvePuzzle(&board, sequence, maxPieces, targetLines,
+                              &searchPool, solution, &length, &nodes);
+    double seconds = (double)(SDL_GetPerformanceCounter() - start) /
+                     SDL_GetPerformanceFrequency();
+
+    if (solved) {
+        printf("solved with %d pieces:\n", length);
+        for (int i = 0; i < length; i++) {
+            const Placement *p = &solution[i];
+            printf("  %d. %c rotation %d, x %d, y %d\n", i + 1,
+                   pieceLetters[sequence[i]], p->rotation, p->x, p->y);
+        }
+    } else {
+        printf("no solution within %d pieces\n", maxPieces);
+    }
+    printf("time %.2f ms, %llu nodes, %d threads, memo %llu probes, "
+           "%.1f%% hits\n",
+           seconds * 1000, (unsigned long long)nodes, searchPool.count,
+           (unsigned long long)botStats.ttProbes,
+           botStats.ttProbes ? 100.0 * botStats.ttHits / botStats.ttProbes
+                             : 0);
+    return solved ? 0 : 2;
+}
+
+// ==================== 价值网络训练 ====================
+
+// 训练用的浮点网络，第一层按输入存放，只需累加为1的输入
+typedef struct {
+    float w1[NN_INPUTS][NN_HIDDEN1];
+    float b1[NN_HIDDEN1];
+    float w2[NN_HIDDEN1][NN_HIDDEN2];
+    float b2[NN_HIDDEN2];
+    float w3[NN_HIDDEN2];
+    float b3;
+} FloatNet;
+
+#define FLOAT_NET_PARAMS (int)(sizeof(FloatNet) / sizeof(float))
+#define NN_MAX_SAMPLES 200000 // 训练样本数上限
+
+// 一个训练样本：放置后的棋盘和启发式评估函数给出的分数
+typedef struct {
+    uint16_t rows[ARENA_HEIGHT];
+    uint8_t nextType, lines;
+    float target;
+} NetSample;
+
+// 样本中为1的输入下标，返回个数
+static int netSampleActive(const NetSample *s, int *active) {
+    int count = 0;
+    uint16_t shadow = 0;
+    for (int i = 0; i < ARENA_HEIGHT; i++) {
+        shadow |= s->rows[i];
+        for (uint16_t row = s->rows[i]; row; row &= row - 1) {
+            active[count++] = i * ARENA_WIDTH + __builtin_ctz(row);
+        }
+        for (uint16_t row = shadow; row; row &= row - 1) {
+            active[count++] = NN_SHADOW_INPUT + i * ARENA_WIDTH +
+                              __builtin_ctz(row);
+        }
+    }
+    active[count++] = NN_NEXT_INPUT + s->nextType;
+    active[count++] = NN_LINES_INPUT + (s->lines < 4 ? s->lines : 4);
+    return count;
+}
+
+// 浮点前向计算，保留中间结果供反向传播使用
+static float floatNetForward(const FloatNet *net, const int *active,
+                             int activeCount, float *z1, float *z2) {
+    for (int j = 0; j < NN_HIDDEN1; j++) {
+        z1[j] = net->b1[j];
+    }
+    for (int a = 0; a < activeCount; a++) {
+        const float *w = net->w1[active[a]];
+        for (int j = 0; j < NN_HIDDEN1; j++) {
+            z1[j] += w[j];
+        }
+    }
+    for (int k = 0; k < NN_HIDDEN2; k++) {
+        z2[k] = net->b2[k];
+    }
+    for (int j = 0; j < NN_HIDDEN1; j++) {
+        float h = z1[j] > 0 ? z1[j] : 0;
+        for (int k = 0; k < NN_HIDDEN2; k++) {
+            z2[k] += h * net->w2[j][k];
+        }
+    }
+    float y = net->b3;
+    for (int k = 0; k < NN_HIDDEN2; k++) {
+        y += (z2[k] > 0 ? z2[k] : 0) * net->w3[k];
+    }
+    return y;
+}
+
+// 反向传播，把误差dy的梯度累加到grad
+static void floatNetBackward(const FloatNet *net, const int *active,
+                             int activeCount, const float *z1, const float *z2,
+                             float dy, FloatNet *grad) {
+    float dz2[NN_HIDDEN2];
+    grad->b3 += dy;
+    for (int k = 0; k < NN_HIDDEN2; k++) {
+        float h = z2[k] > 0 ? z2[k] : 0;
+        grad->w3[k] += dy * h;
+        dz2[k] = z2[k] > 0 ? dy * net->w3[k] : 0;
+        grad->b2[k] += dz2[k];
+    }
+    float dz1[NN_HIDDEN1];
+    for (int j = 0; j < NN_HIDDEN1; j++) {
+        float h = z1[j] > 0 ? z1[j] : 0;
+        float sum = 0;
+        for (int k = 0; k < NN_HIDDEN2; k++) {
+            grad->w2[j][k] += h * dz2[k];
+            sum += net->w2[j][k] * dz2[k];
+        }
+        dz1[j] = z1[j] > 0 ? sum : 0;
+        grad->b1[j] += dz1[j];
+    }
+    for (int a = 0; a < activeCount; a++) {
+        float *g = grad->w1[active[a]];
+        for (int j = 0; j < NN_HIDDEN1; j++) {
+            g[j] += dz1[j];
+        }
+    }
+}
+
+// 均匀分布随机数，范围[-1, 1)
+static float netRandom(uint32_t *rng) {
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 17;
+    *rng ^= *rng << 5;
+    return (float)(*rng >> 8) / 8388608.0f - 1.0f;
+}
+
+// 对称量化：返回比例，q = round(w / 比例)落在-127~127
+static float netQuantScale(const float *w, int count) {
+    float max = 0;
+    for (int i = 0; i < count; i++) {
+        if (fabsf(w[i]) > max) {
+            max = fabsf(w[i]);
+        }
+    }
+    return max > 0 ? max / 127.0f : 1.0f;
+}
+
+static int8_t netQuantize(float w, float scale) {
+    int q = (int)lrintf(w / scale);
+    return (int8_t)(q > 127 ? 127 : q < -127 ? -127 : q);
+}
+
+// 把训练好的浮点网络量化为int8。先在样本上找出每个隐藏层输出的最大值
+// 决定它的量化比例，再把这个比例乘进下一层的权重后按神经元量化
+void netQuantizeNet(const FloatNet *f, const NetSample *samples, int count,
+                    ValueNet *net) {
+    float max1[NN_HIDDEN1] = {0}, max2[NN_HIDDEN2] = {0};
+    for (int s = 0; s < count && s < 8192; s++) {
+        int active[NN_INPUTS];
+        float z1[NN_HIDDEN1], z2[NN_HIDDEN2];
+        int n = netSampleActive(&samples[s], active);
+        floatNetForward(f, active, n, z1, z2);
+        for (int j = 0; j < NN_HIDDEN1; j++) {
+            max1[j] = z1[j] > max1[j] ? z1[j] : max1[j];
+        }
+        for (int k = 0; k < NN_HIDDEN2; k++) {
+            max2[k] = z2[k] > max2[k] ? z2[k] : max2[k];
+        }
+    }
+
+    for (int j = 0; j < NN_HIDDEN1; j++) {
+        float w[NN_INPUTS];
+        for (int i = 0; i < NN_INPUTS; i++) {
+            w[i] = f->w1[i][j];
+        }
+        net->w1Scale[j] = netQuantScale(w, NN_INPUTS);
+        for (int i = 0; i < NN_INPUTS; i++) {
+            net->w1[j][i] = netQuantize(w[i], net->w1Scale[j]);
+        }
+        net->b1[j] = f->b1[j];
+        net->act1Scale[j] = max1[j] > 0 ? max1[j] / 127.0f : 1.0f;
+    }
+    float w3[NN_HIDDEN2];
+    for (int k = 0; k < NN_HIDDEN2; k++) {
+        float w[NN_HIDDEN1];
+        for (int j = 0; j < NN_HIDDEN1; j++) {
+            w[j] = f->w2[j][k] * net->act1Scale[j];
+        }
+        net->w2Scale[k] = netQuantScale(w, NN_HIDDEN1);
+        for (int j = 0; j < NN_HIDDEN1; j++) {
+            net->w2[k][j] = netQuantize(w[j], net->w2Scale[k]);
+        }
+        net->b2[k] = f->b2[k];
+        net->act2Scale[k] = max2[k] > 0 ? max2[k] / 127.0f : 1.0f;
+        w3[k] = f->w3[k] * net->act2Scale[k];
+    }
+    net->w3Scale = netQuantScale(w3, NN_HIDDEN2);
+    for (int k = 0; k < NN_HIDDEN2; k++) {
+        net->w3[k] = netQuantize(w3[k], net->w3Scale);
+    }
+    net->b3 = f->b3;
+}
+
+// 用启发式AI的对局生成样本，训练网络拟合评估函数，量化后写入path。
+// 选择落点只需要同一步各落点之间的相对分数，所以损失函数只看每一步内
+// 去掉平均值后的误差，网络不必学习不同棋盘之间的整体差异
+int runNetTraining(const char *path, int games, int maxPieces,
+                   unsigned int seed, int epochs) {
+    NetSample *samples = malloc(sizeof(NetSample) * NN_MAX_SAMPLES);
+    int *groups = malloc(sizeof(int) * (NN_MAX_SAMPLES + 1)); // 每一步的第一个样本
+    int *order = malloc(sizeof(int) * NN_MAX_SAMPLES);
+    FloatNet *net = calloc(1, sizeof(FloatNet));
+    FloatNet *grad = malloc(sizeof(FloatNet));
+    FloatNet *m = calloc(1, sizeof(FloatNet));
+    FloatNet *v = calloc(1, sizeof(FloatNet));
+    ValueNet *quant = malloc(sizeof(ValueNet));
+    int result = 1;
+    if (!samples || !groups || !order || !net || !grad || !m || !v ||
+        !quant) {
+        printf("Out of memory!\n");
+        goto done;
+    }
+
+    // 第一步：每一步的所有落点都是样本，目标为启发式评估分数。
+    // 十六分之一的步数随机放置，让样本中也有AI自己不会走出的坏棋盘。
+    // 总共放置games * maxPieces个方块，提前结束的对局由新的对局补上
+    int count = 0, groupCount = 0;
+    long long budget = (long long)games * maxPieces;
+    uint32_t rng = (uint32_t)mix64(seed) | 1;
+    BotSearchConfig cfg = {.weights = &botWeights,
+                           .beamWidth = botBeamWidth,
+                           .depth = 2,
+                           .samples = 1};
+    for (int g = 0; budget > 0; g++) {
+        SimGame game;
+        simReset(&game, seed + g);
+        while (game.pieces < maxPieces && budget-- > 0) {
+            Placement placements[BOT_MAX_PLACEMENTS];
+            BitBoard children[BOT_MAX_PLACEMENTS];
+            int lines[BOT_MAX_PLACEMENTS];
+            float scores[BOT_MAX_PLACEMENTS];
+            int n = botExpand(&game.board, game.curType, 0,
+                              ARENA_WIDTH / 2 - 2, -2, 0, &botWeights,
+                              children, lines, scores, placements);
+            if (count + n > NN_MAX_SAMPLES) {
+                budget = 0;
+                break;
+            }
+            groups[groupCount] = count;
+            for (int i = 0; i < n; i++) {
+                if (scores[i] <= BOT_DEAD_SCORE) {
+                    continue;
+                }
+                memcpy(samples[count].rows, children[i].rows,
+                       sizeof(samples[count].rows));
+                samples[count].nextType = (uint8_t)game.nextType;
+                samples[count].lines = (uint8_t)lines[i];
+                samples[count].target = scores[i];
+                count++;
+            }
+            // 至少有两个落点的步才能比较
+            if (count - groups[groupCount] >= 2) {
+                groupCount++;
+            } else {
+                count = groups[groupCount];
+            }
+
+            int pick = (int)((netRandom(&rng) + 1.0f) * 0.5f * n * 16);
+            if (pick < n && scores[pick] > BOT_DEAD_SCORE) {
+                game.board = children[pick];
+                game.lines += lines[pick];
+                game.pieces++;
+                game.curType = game.nextType;
+                game.nextType = simRandomPiece(&game);
+            } else if (!simStep(&game, &cfg)) {
+                break;
+            }
+        }
+    }
+    groups[groupCount] = count;
+    if (groupCount < 10) {
+        printf("not enough training samples (%d)\n", count);
+        goto done;
+    }
+
+    // 每一步内分数相对平均值的标准差，训练时目标除以它
+    double var = 0;
+    for (int g = 0; g < groupCount; g++) {
+        double mean = 0;
+        for (int s = groups[g]; s < groups[g + 1]; s++) {
+            mean += samples[s].target;
+        }
+        mean /= groups[g + 1] - groups[g];
+        for (int s = groups[g]; s < groups[g + 1]; s++) {
+            var += (samples[s].target - mean) * (samples[s].target - mean);
+        }
+    }
+    float stddev = (float)sqrt(var / count);
+    if (stddev <= 0) {
+        stddev = 1;
+    }
+
+    // 按步打乱，留出十分之一的步作为验证集
+    for (int g = 0; g < groupCount; g++) {
+        order[g] = g;
+    }
+    for (int g = groupCount - 1; g > 0; g--) {
+        int k = (int)((netRandom(&rng) + 1.0f) * 0.5f * (g + 1)) % (g + 1);
+        int t = order[g];
+        order[g] = order[k];
+        order[k] = t;
+    }
+    int validation = groupCount / 10;
+    int training = groupCount - validation;
+    printf("training value net: %d samples in %d moves (%d validation), "
+           "relative score std %.2f\n",
+           count, groupCount, validation, stddev);
+
+    // He初始化
+    for (int i = 0; i < NN_INPUTS; i++) {
+        for (int j = 0; j < NN_HIDDEN1; j++) {
+            net->w1[i][j] = netRandom(&rng) * sqrtf(6.0f / 128);
+        }
+    }
+    for (int j = 0; j < NN_HIDDEN1; j++) {
+        for (int k = 0; k < NN_HIDDEN2; k++) {
+            net->w2[j][k] = netRandom(&rng) * sqrtf(6.0f / NN_HIDDEN1);
+        }
+    }
+    for (int k = 0; k < NN_HIDDEN2; k++) {
+        net->w3[k] = netRandom(&rng) * sqrtf(6.0f / NN_HIDDEN2);
+    }
+
+    // 第二步：Adam小批量训练，每批约64个样本
+    const float lr = 1e-3f, beta1 = 0.9f, beta2 = 0.999f;
+    float *p = (float *)net, *gp = (float *)grad;
+    float *mp = (float *)m, *vp = (float *)v;
+    int step = 0;
+    for (int epoch = 0; epoch < epochs; epoch++) {
+        Uint64 start = SDL_GetPerformanceCounter();
+        double loss[2] = {0, 0};
+        int agree = 0;
+        memset(grad, 0, sizeof(*grad));
+        int batched = 0;
+        for (int k = 0; k < groupCount; k++) {
+            bool train = k < training;
+            int g = order[k];
+            int first = groups[g], n = groups[g + 1] - first;
+            static int active[BOT_MAX_PLACEMENTS][NN_INPUTS];
+            static float z1[BOT_MAX_PLACEMENTS][NN_HIDDEN1];
+            static float z2[BOT_MAX_PLACEMENTS][NN_HIDDEN2];
+            int activeCount[BOT_MAX_PLACEMENTS];
+            float err[BOT_MAX_PLACEMENTS];
+            float meanErr = 0;
+            int best = 0, predicted = 0;
+            float bestY = 0;
+            for (int i = 0; i < n; i++) {
+                const NetSample *s = &samples[first + i];
+                activeCount[i] = netSampleActive(s, active[i]);
+                float y = floatNetForward(net, active[i], activeCount[i],
+                                          z1[i], z2[i]);
+                err[i] = y - s->target / stddev;
+                meanErr += err[i] / n;
+                if (s->target > samples[first + best].target) {
+                    best = i;
+                }
+                if (i == 0 || y > bestY) {
+                    predicted = i;
+                    bestY = y;
+                }
+            }
+            agree += !train && predicted == best;
+            for (int i = 0; i < n; i++) {
+                float e = err[i] - meanErr;
+                loss[!train] += e * e;
+                if (train) {
+                    floatNetBackward(net, active[i], activeCount[i], z1[i],
+                                     z2[i], e / 64, grad);
+                }
+            }
+            if (!train) {
+                continue;
+            }
+            batched += n;
+            if (batched < 64 && k + 1 < training) {
+                continue;
+            }
+            step++;
+            float c1 = 1.0f - powf(beta1, (float)step);
+            float c2 = 1.0f - powf(beta2, (float)step);
+            for (int i = 0; i < FLOAT_NET_PARAMS; i++) {
+                mp[i] = beta1 * mp[i] + (1 - beta1) * gp[i];
+                vp[i] = beta2 * vp[i] + (1 - beta2) * gp[i] * gp[i];
+                p[i] -= lr * (mp[i] / c1) / (sqrtf(vp[i] / c2) + 1e-8f);
+            }
+            memset(grad, 0, sizeof(*grad));
+            batched = 0;
+        }
+        int validSamples = count;
+        for (int k = 0; k < training; k++) {
+            validSamples -= groups[order[k] + 1] - groups[order[k]];
+        }
+        double seconds = (double)(SDL_GetPerformanceCounter() - start) /
+                         SDL_GetPerformanceFrequency();
+        printf("epoch %d: train rmse %.3f, validation rmse %.3f, best move "
+               "agreement %.1f%% (%.1f s)\n",
+               epoch + 1, sqrt(loss[0] / (count - validSamples)) * stddev,
+               sqrt(loss[1] / validSamples) * stddev,
+               100.0 * agree / validation, seconds);
+    }
+
+    // 第三步：把标准化折算回最后一层，量化并保存
+    for (int k = 0; k < NN_HIDDEN2; k++) {
+        net->w3[k] *= stddev;
+    }
+    net->b3 *= stddev;
+    netQuantizeNet(net, samples, count, quant);
+
+    // 量化误差：在验证集上比较int8网络和浮点网络（同样只看每一步内的相对分数）
+    double quantError = 0;
+    int quantCount = 0, quantAgree = 0;
+    for (int k = training; k < groupCount; k++) {
+        int first = groups[order[k]], n = groups[order[k] + 1] - first;
+        static uint8_t inputs[NN_MAX_BATCH][NN_INPUTS];
+        float out[NN_MAX_BATCH], diff[NN_MAX_BATCH];
+        float meanDiff = 0;
+        int best = 0, predicted = 0;
+        for (int i = 0; i < n; i++) {
+            BitBoard board;
+            memcpy(board.rows, samples[first + i].rows, sizeof(board.rows));
+            netEncode(&board, samples[first + i].nextType,
+                      samples[first + i].lines, inputs[i]);
+        }
+        netForward(quant, inputs, n, out);
+        for (int i = 0; i < n; i++) {
+            int active[NN_INPUTS];
+            float z1[NN_HIDDEN1], z2[NN_HIDDEN2];
+            int a = netSampleActive(&samples[first + i], active);
+            diff[i] = out[i] - floatNetForward(net, active, a, z1, z2);
+            meanDiff += diff[i] / n;
+            if (samples[first + i].target > samples[first + best].target) {
+                best = i;
+            }
+            if (out[i] > out[predicted]) {
+                predicted = i;
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            quantError += (diff[i] - meanDiff) * (diff[i] - meanDiff);
+        }
+        quantCount += n;
+        quantAgree += predicted == best;
+    }
+    printf("int8: quantization rmse %.3f, best move agreement %.1f%%\n",
+           sqrt(quantError / quantCount), 100.0 * quantAgree / validation);
+
+    if (!netSave(path, quant)) {
+        printf("Failed to write %s\n", path);
+        goto done;
+    }
+    printf("wrote %s\n", path);
+    result = 0;
+
+done:
+    free(samples);
+    free(groups);
+    free(order);
+    free(net);
+    free(grad);
+    free(m);
+    free(v);
+    free(quant);
+    return result;
+}
+
+// 比较价值网络（标量和SIMD内核）与启发式评估函数的吞吐量，并校验两个内核结果一致
+int runNetBenchmark(const ValueNet *net) {
+    enum { POOL = 4096, BATCH = 32, ROUNDS = 20 };
+    static BitBoard pool[POOL];
+    static uint8_t inputs[POOL][NN_INPUTS];
+    static float expected[POOL], actual[POOL];
+    static int lines[POOL];
+
+    // 与runEvalBenchmark()相同的随机棋盘
+    uint32_t rng = 12345;
+    BitBoard board = {0};
+    for (int n = 0; n < POOL; n++) {
+        rng = rng * 1664525u + 1013904223u;
+        int type = (rng >> 16) % 7;
+        int rot = (rng >> 8) & 3;
+        int span = ARENA_WIDTH - pieceMaxCol[type][rot] + pieceMinCol[type][rot];
+        int x = (int)((rng >> 20) % span) - pieceMinCol[type][rot];
+        if (bitCollision(&board, type, rot, x, -2)) {
+            memset(&board, 0, sizeof(board));
+        }
+        lines[n] = bitLock(&board, type, rot, x,
+                           bitDrop(&board, type, rot, x, -2));
+        if (board.rows[0] || board.rows[4]) {
+            memset(&board, 0, sizeof(board));
+        }
+        pool[n] = board;
+        netEncode(&board, (rng >> 4) % 7, lines[n], inputs[n]);
+    }
+
+    printf("value net benchmark (%d-%d-%d-1 int8 MLP, batch %d, kernel: %s)\n",
+           NN_INPUTS, NN_HIDDEN1, NN_HIDDEN2, BATCH, netDotName);
+
+    // 校验SIMD内核与标量实现的结果完全一致
+    NetDotFunc simd = netDot;
+    netDot = netDotScalar;
+    for (int n = 0; n < POOL; n += BATCH) {
+        netForward(net, &inputs[n], BATCH, &expected[n]);
+    }
+    netDot = simd;
+    for (int n = 0; n < POOL; n += BATCH) {
+        netForward(net, &inputs[n], BATCH, &actual[n]);
+    }
+    for (int n = 0; n < POOL; n++) {
+        if (expected[n] != actual[n]) {
+            printf("mismatch: board %d (%f vs %f)\n", n, expected[n],
+                   actual[n]);
+            return 1;
+        }
+    }
+
+    // 依次测量：启发式评估、标量网络、SIMD网络
+    const char *names[3] = {"heuristic", "net scalar", "net simd"};
+    double rate[3];
+    float sink = 0; // 防止编译器把计算优化掉
+    for (int k = 0; k < 3; k++) {
+        netDot = k == 1 ? netDotScalar : simd;
+        Uint64 start = SDL_GetPerformanceCounter();
+        for (int round = 0; round < ROUNDS; round++) {
+            for (int n = 0; n < POOL; n += BATCH) {
+                if (k == 0) {
+                    botEvaluateBatch(&pool[n], &lines[n], BATCH, &botWeights,
+                                     &actual[n]);
+                } else {
+                    netForward(net, &inputs[n], BATCH, &actual[n]);
+                }
+                sink += actual[n];
+            }
+        }
+        double seconds = (double)(SDL_GetPerformanceCounter() - start) /
+                         SDL_GetPerformanceFrequency();
+        rate[k] = (double)POOL * ROUNDS / (seconds > 0 ? seconds : 1e-9);
+        printf("  %-10s %12.0f boards/s\n", names[k], rate[k]);
+    }
+    netDot = simd;
+    printf("simd speedup %.2fx, heuristic is %.2fx faster than the net "
+           "(checksum %g)\n",
+           rate[2] / rate[1], rate[0] / rate[2], sink);
+    return 0;
+}
+
+void drawNextPiece(SDL_Renderer *renderer) {
+    // 设置预览区域的位置和大小
+    int rightPanelWidth = WINDOW_WIDTH - ARENA_WIDTH * 30; // 右侧面板宽度
+    int blockSize = 20; // 预览方块的大小
+    int previewX =
+        ARENA_WIDTH * 30 + (rightPanelWidth - blockSize * 4) / 2; // 水平居中
+    int previewY = 100; // 在分数下方
+
+    // 绘制"Next Piece"文字
+    TTF_Font *font = fontOpen(30);
+
+    if (font) {
+        SDL_Color textColor = {255, 255, 255, 255};
+        SDL_Surface *textSurface =
+            TTF_RenderUTF8_Solid(font, "下一个方块:", textColor);
+        if (textSurface) {
+            SDL_Texture *textTexture =
+                SDL_CreateTextureFromSurface(renderer, textSurface);
+            if (textTexture) {
+                SDL_Rect destRect = {previewX - 30, previewY - 30,
+                                     textSurface->w, textSurface->h};
+                SDL_RenderCopy(renderer, textTexture, NULL, &destRect);
+                SDL_DestroyTexture(textTexture);
+            }
+            SDL_FreeSurface(textSurface);
+        }
+    }
+
+    // 绘制下一个方块的预览
+    SDL_Color color = pieceColors[session.nextPiece.type];
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            if (session.nextPiece.shape[i][j]) {
+                SDL_Rect rect = {previewX + j * blockSize,
+                                 30 + previewY + i * blockSize, blockSize,
+                                 blockSize};
+                SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b,
+                                       color.a);
+                SDL_RenderFillRect(renderer, &rect);
+
+                // 绘制边框
+                SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+                SDL_RenderDrawRect(renderer, &rect);
             }
         }
     }
 
     // 绘制当前模式提示
-    TTF_Font *modeFont = TTF_OpenFont("simhei.ttf", 28);
+    TTF_Font *modeFont = fontOpen(28);
     if (modeFont) {
         const char *modeText = blindMode ? "盲打模式" : "显示模式";
         SDL_Color textColor = blindMode ? (SDL_Color){255, 100, 100, 255}
@@ -423,107 +10696,1032 @@ void drawNextPiece(SDL_Renderer *renderer) {
             }
             SDL_FreeSurface(textSurface);
         }
-        TTF_CloseFont(modeFont);
     }
 }
 
-void drawScore(SDL_Renderer *renderer) {
-    // 绘制分割线
-    // 设置分割线宽度为3像素，在游戏区域和分数显示区域之间
-    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255); // 白色
-    for (int i = 0; i < 3; i++) {
-        // 绘制垂直线，从窗口顶部到底部
-        // ARENA_WIDTH * 30 是游戏区域的宽度（每个方块30像素）
-        SDL_RenderDrawLine(renderer, ARENA_WIDTH * 30 + 1 + i, 0,
-                           ARENA_WIDTH * 30 + 1 + i, WINDOW_HEIGHT);
+void drawScore(SDL_Renderer *renderer) {
+    // 绘制分割线
+    // 设置分割线宽度为3像素，在游戏区域和分数显示区域之间
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255); // 白色
+    for (int i = 0; i < 3; i++) {
+        // 绘制垂直线，从窗口顶部到底部
+        // ARENA_WIDTH * 30 是游戏区域的宽度（每个方块30像素）
+        SDL_RenderDrawLine(renderer, ARENA_WIDTH * 30 + 1 + i, 0,
+                           ARENA_WIDTH * 30 + 1 + i, WINDOW_HEIGHT);
+    }
+
+    // 加载支持中文的字体文件
+    // 使用36号字体大小
+    TTF_Font *font = fontOpen(28);
+    if (!font) {
+        printf("Failed to load font: %s\n", TTF_GetError());
+        return;
+    }
+
+    // 创建分数文本
+    // 使用UTF-8编码
+    char scoreText[32];
+    snprintf(scoreText, sizeof(scoreText), "分数: %d", session.score);
+
+    // 创建表面并渲染文本
+    // 使用白色（255,255,255）渲染文本
+    SDL_Color textColor = {255, 255, 255, 255};
+    SDL_Surface *textSurface = TTF_RenderUTF8_Solid(font, scoreText, textColor);
+    if (!textSurface) {
+        return;
+    }
+
+    // 创建纹理
+    // 将表面转换为纹理以便渲染
+    SDL_Texture *textTexture =
+        SDL_CreateTextureFromSurface(renderer, textSurface);
+    if (!textTexture) {
+        SDL_FreeSurface(textSurface);
+        return;
+    }
+
+    // 设置绘制位置
+    // 计算右侧面板的宽度（窗口总宽度减去游戏区域宽度）
+    int rightPanelWidth = WINDOW_WIDTH - ARENA_WIDTH * 30;
+    // 计算x坐标：游戏区域宽度 + (右侧面板宽度 - 文本宽度)/2，实现水平居中
+    int xPos = ARENA_WIDTH * 30 + (rightPanelWidth - textSurface->w) / 2;
+    // 设置绘制矩形：x坐标，y坐标（顶部下方10像素），使用文本的宽度和高度
+    SDL_Rect destRect = {xPos, 10, textSurface->w, textSurface->h};
+    // 将纹理复制到渲染器
+    SDL_RenderCopy(renderer, textTexture, NULL, &destRect);
+
+    // 清理资源
+    // 释放纹理、表面和字体对象
+    SDL_DestroyTexture(textTexture);
+    SDL_FreeSurface(textSurface);
+}
+
+void drawArena(SDL_Renderer *renderer) {
+    // 绘制游戏区域
+    int blockSize = 24; // 每个小方块的实际大小
+    int gap = 6;        // 方块之间的间隔
+
+    for (int i = 0; i < ARENA_HEIGHT; i++) {
+        for (int j = 0; j < ARENA_WIDTH; j++) {
+            if (session.arena[i][j] &&
+                !(blindMode && !session.clearAnim.isAnimating)) {
+                SDL_Rect rect = {j * (blockSize + gap) + gap,
+                                 i * (blockSize + gap) + gap, blockSize,
+                                 blockSize};
+
+                // 检查当前行是否在动画中
+                bool isAnimating = false;
+                for (int k = 0; k < session.clearAnim.count; k++) {
+                    if (i == session.clearAnim.lines[k]) {
+                        isAnimating = true;
+                        break;
+                    }
+                }
+
+                // 使用与方块类型对应的颜色
+                SDL_Color color = pieceColors[session.arena[i][j] - 1];
+                if (isAnimating && !session.clearAnim.visible) {
+                    // 如果是动画中的行且当前不可见，绘制黑色
+                    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+                } else {
+                    SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b,
+                                           color.a);
+                }
+                SDL_RenderFillRect(renderer, &rect);
+            }
+        }
+    }
+}
+
+#define FRAME_MAX_KEYS 16
+
+Uint32 frameKeys[FRAME_MAX_KEYS]; // 这一帧处理的按键事件的时间戳
+int frameKeyCount = 0;
+Uint64 lastPresent = 0;
+
+// 呈现画面，记录帧间隔和这一帧处理的按键从产生到显示出来的延迟
+void presentFrame(SDL_Renderer *renderer) {
+    SDL_RenderPresent(renderer);
+    Uint64 now = SDL_GetPerformanceCounter();
+    if (lastPresent) {
+        metricObserve(&metrics.frameTime, metricSince(lastPresent));
+    }
+    lastPresent = now;
+    metricAdd(&metrics.frames, 1);
+    Uint32 ticks = SDL_GetTicks();
+    for (int i = 0; i < frameKeyCount; i++) {
+        metricObserve(&metrics.inputLatency, (ticks - frameKeys[i]) / 1000.0);
+    }
+    frameKeyCount = 0;
+}
+
+int audioFrameBytes = 4; // 每个采样帧的字节数（所有声道）
+int audioFrequency = 44100;
+Uint64 audioLastMix = 0;
+
+// SDL_mixer在音频线程中每混好一块缓冲区调用一次。两次调用的间隔明显超过
+// 一块缓冲区的播放时长，说明声卡在等待数据，计为一次欠载
+void audioPostMix(void *udata, Uint8 *stream, int len) {
+    (void)udata;
+    (void)stream;
+    Uint64 now = SDL_GetPerformanceCounter();
+    metricAdd(&metrics.audioCallbacks, 1);
+    if (audioLastMix) {
+        double period = (double)len / audioFrameBytes / audioFrequency;
+        if ((double)(now - audioLastMix) / SDL_GetPerformanceFrequency() >
+            period * 1.5) {
+            metricAdd(&metrics.audioUnderruns, 1);
+        }
+    }
+    audioLastMix = now;
+}
+
+// 按打开的音频设备的实际格式开始检测欠载
+void audioMonitor() {
+    Uint16 format;
+    int channels;
+    if (Mix_QuerySpec(&audioFrequency, &format, &channels)) {
+        audioFrameBytes = SDL_AUDIO_BITSIZE(format) / 8 * channels;
+    }
+    Mix_SetPostMix(audioPostMix, NULL);
+}
+
+// 背景音乐按压缩格式优先的顺序查找，SDL_mixer在音频线程中边解码边播放，
+// 只保留解码器状态和一小块缓冲，不把整首曲子解码到内存里
+const char *musicExtensions[] = {".ogg", ".opus", ".flac", ".mp3", ".wav"};
+
+// 在资源包或散文件中找到名为name的曲目，path写入找到的资源名
+bool musicFind(const char *name, char *path, int size) {
+    for (int i = 0; i < (int)(sizeof(musicExtensions) /
+                              sizeof(musicExtensions[0]));
+         i++) {
+        snprintf(path, size, "%s%s", name, musicExtensions[i]);
+        if (assetExists(path)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 打开曲目用于流式播放，找不到或无法解码时返回NULL，调用者保持静音
+Mix_Music *musicOpen(const char *name) {
+    char path[256];
+    if (!musicFind(name, path, sizeof(path))) {
+        printf("Background music %s not found, playing without music\n",
+               name);
+        return NULL;
+    }
+    Mix_Music *music = Mix_LoadMUS_RW(assetOpen(path), 1);
+    if (!music) {
+        printf("Failed to load background music %s! Mix_Error: %s\n", path,
+               Mix_GetError());
+    }
+    return music;
+}
+
+// 进程的常驻内存（字节），不支持的平台返回-1
+long long processResidentBytes() {
+#ifdef __linux__
+    long long pages = -1, resident = -1;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file) {
+        if (fscanf(file, "%lld %lld", &pages, &resident) != 2) {
+            resident = -1;
+        }
+        fclose(file);
+    }
+    return resident < 0 ? -1 : resident * sysconf(_SC_PAGESIZE);
+#else
+    return -1;
+#endif
+}
+
+// 比较流式播放和整首解码的内存占用：先用Mix_LoadMUS流式播放seconds秒，
+// 再用Mix_LoadWAV把同一文件整个解码，报告文件大小、两种方式的常驻内存增量和欠载次数
+int runMusicBenchmark(const char *name, int buffer, int seconds) {
+    char path[256];
+    if (!musicFind(name, path, sizeof(path))) {
+        printf("No music track %s.{ogg,opus,flac,mp3,wav}\n", name);
+        return 1;
+    }
+    if (SDL_Init(SDL_INIT_AUDIO | SDL_INIT_TIMER) < 0) {
+        printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
+        return 1;
+    }
+    Mix_Init(MIX_INIT_OGG | MIX_INIT_OPUS | MIX_INIT_FLAC | MIX_INIT_MP3);
+    if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, buffer) < 0) {
+        printf("SDL_mixer could not initialize! Mix_Error: %s\n",
+               Mix_GetError());
+        Mix_Quit();
+        SDL_Quit();
+        return 1;
+    }
+    audioMonitor();
+    SDL_RWops *rw = assetOpen(path);
+    long disk = rw ? (long)SDL_RWsize(rw) : -1;
+    if (rw) {
+        SDL_RWclose(rw);
+    }
+
+    long long before = processResidentBytes();
+    Mix_Music *music = Mix_LoadMUS_RW(assetOpen(path), 1);
+    if (!music || Mix_PlayMusic(music, -1) < 0) {
+        printf("Failed to play %s! Mix_Error: %s\n", path, Mix_GetError());
+        Mix_FreeMusic(music);
+        Mix_CloseAudio();
+        Mix_Quit();
+        SDL_Quit();
+        return 1;
+    }
+    SDL_Delay(seconds * 1000);
+    long long streaming = processResidentBytes() - before;
+    Mix_HaltMusic();
+    Mix_FreeMusic(music);
+
+    before = processResidentBytes();
+    Mix_Chunk *decoded = Mix_LoadWAV_RW(assetOpen(path), 1);
+    long long whole = processResidentBytes() - before;
+    printf("%s: %ld bytes on disk\n", path, disk);
+    printf("streaming: resident +%lld KB after %d s, %llu underruns in %llu "
+           "callbacks\n",
+           streaming / 1024, seconds,
+           (unsigned long long)metrics.audioUnderruns,
+           (unsigned long long)metrics.audioCallbacks);
+    if (decoded) {
+        printf("fully decoded: %u bytes of PCM, resident +%lld KB\n",
+               decoded->alen, whole / 1024);
+        Mix_FreeChunk(decoded);
+    }
+    Mix_SetPostMix(NULL, NULL);
+    Mix_CloseAudio();
+    Mix_Quit();
+    SDL_Quit();
+    return 0;
+}
+
+// 用buffer帧的缓冲区打开音频，每秒随机播放rate个音效，另外每秒同时触发
+// 两倍声道数的音效测试抢占，结束后报告欠载次数和声道分配情况
+int runAudioBenchmark(int buffer, int seconds, int rate) {
+    if (SDL_Init(SDL_INIT_AUDIO | SDL_INIT_TIMER) < 0) {
+        printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
+        return 1;
+    }
+    if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, buffer) < 0) {
+        printf("SDL_mixer could not initialize! Mix_Error: %s\n",
+               Mix_GetError());
+        SDL_Quit();
+        return 1;
+    }
+    audioMonitor();
+    sfxLoad();
+
+    uint32_t rng = 1;
+    int calls = 0;
+    double playSeconds = 0;
+    Uint32 start = SDL_GetTicks();
+    Uint32 nextBurst = start + 1000;
+    rate = rate > 0 ? rate : 1;
+    while (SDL_GetTicks() - start < (Uint32)seconds * 1000) {
+        int count = 1;
+        if (SDL_GetTicks() >= nextBurst) {
+            count = SFX_VOICES * 2;
+            nextBurst += 1000;
+        }
+        for (int i = 0; i < count; i++) {
+            Uint64 begin = SDL_GetPerformanceCounter();
+            sfxPlay(xorshift32(&rng) % SFX_COUNT);
+            playSeconds += metricSince(begin);
+            calls++;
+        }
+        SDL_Delay(1000 / rate);
+    }
+    double elapsed = (SDL_GetTicks() - start) / 1000.0;
+    printf("audio buffer %d frames (%.1f ms at %d Hz), %d voices\n", buffer,
+           1000.0 * buffer / audioFrequency, audioFrequency, SFX_VOICES);
+    printf("%llu callbacks (%.1f/s), %llu underruns\n",
+           (unsigned long long)metrics.audioCallbacks,
+           metrics.audioCallbacks / elapsed,
+           (unsigned long long)metrics.audioUnderruns);
+    printf("%d effects: %llu played, %llu stole a voice, %llu dropped, "
+           "%.2f us per play\n",
+           calls, (unsigned long long)metrics.sfxPlayed,
+           (unsigned long long)metrics.sfxStolen,
+           (unsigned long long)metrics.sfxDropped,
+           calls ? playSeconds * 1e6 / calls : 0);
+    Mix_SetPostMix(NULL, NULL);
+    sfxFree();
+    Mix_CloseAudio();
+    SDL_Quit();
+    return metrics.audioUnderruns ? 1 : 0;
+}
+
+// ==================== 音乐变速 ====================
+
+// 下落间隔变短时背景音乐平滑加速而音高不变：在音频线程中用WSOLA做时间伸缩。
+// 每输出半个颗粒（512帧）从曲子中取一个1024帧的颗粒，名义位置按速度前进，
+// 在名义位置前后±256帧内找与上一个颗粒的自然延续最相似的起点（互相关最大），
+// 加汉宁窗后重叠相加。互相关是主要开销，按CPU特性选择标量/AVX2/NEON内核。
+// 所有缓冲区都在MusicTempo里，回调中不分配内存
+#define TEMPO_GRAIN 1024            // 颗粒长度（帧）
+#define TEMPO_HOP (TEMPO_GRAIN / 2) // 输出跳距，50%重叠的汉宁窗相加恒为1
+#define TEMPO_SEEK 256              // 对齐搜索范围（帧）
+#define TEMPO_CORR 256              // 计算互相关的长度（帧）
+#define TEMPO_MAX 1.5f              // 最快速度
+
+// 立体声交错的16位样本a、b前count帧的点积
+typedef float (*TempoCorrelateFunc)(const int16_t *a, const int16_t *b,
+                                    int count);
+
+static float tempoCorrelateScalar(const int16_t *a, const int16_t *b,
+                                  int count) {
+    int64_t sum = 0;
+    for (int i = 0; i < count * 2; i++) {
+        sum += a[i] * b[i];
     }
+    return (float)sum;
+}
 
-    // 加载支持中文的字体文件
-    // 使用36号字体大小
-    TTF_Font *font = TTF_OpenFont("simhei.ttf", 28);
-    if (!font) {
-        printf("Failed to load font: %s\n", TTF_GetError());
-        return;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_TEMPO_AVX2 1
+
+// 一次16个样本：madd把相邻两个乘积相加成32位，再转成浮点累加避免溢出
+__attribute__((target("avx2"))) static float
+tempoCorrelateAVX2(const int16_t *a, const int16_t *b, int count) {
+    __m256 sum = _mm256_setzero_ps();
+    for (int i = 0; i < count * 2; i += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+        sum = _mm256_add_ps(sum, _mm256_cvtepi32_ps(_mm256_madd_epi16(x, y)));
     }
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum),
+                             _mm256_extractf128_ps(sum, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+    return _mm_cvtss_f32(half);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_TEMPO_NEON 1
+
+// 一次8个样本，高低两半分别乘成32位后转成浮点累加
+static float tempoCorrelateNEON(const int16_t *a, const int16_t *b,
+                                int count) {
+    float32x4_t sum = vdupq_n_f32(0);
+    for (int i = 0; i < count * 2; i += 8) {
+        int16x8_t x = vld1q_s16(a + i);
+        int16x8_t y = vld1q_s16(b + i);
+        int32x4_t lo = vmull_s16(vget_low_s16(x), vget_low_s16(y));
+        int32x4_t hi = vmull_s16(vget_high_s16(x), vget_high_s16(y));
+        sum = vaddq_f32(sum, vcvtq_f32_s32(lo));
+        sum = vaddq_f32(sum, vcvtq_f32_s32(hi));
+    }
+    return vgetq_lane_f32(sum, 0) + vgetq_lane_f32(sum, 1) +
+           vgetq_lane_f32(sum, 2) + vgetq_lane_f32(sum, 3);
+}
+#endif
 
-    // 创建分数文本
-    // 使用UTF-8编码
-    char scoreText[32];
-    snprintf(scoreText, sizeof(scoreText), "分数: %d", score);
+TempoCorrelateFunc tempoCorrelate = tempoCorrelateScalar;
+const char *tempoCorrelateName = "scalar";
 
-    // 创建表面并渲染文本
-    // 使用白色（255,255,255）渲染文本
-    SDL_Color textColor = {255, 255, 255, 255};
-    SDL_Surface *textSurface = TTF_RenderUTF8_Solid(font, scoreText, textColor);
-    if (!textSurface) {
-        TTF_CloseFont(font);
+void initTempoKernel() {
+#ifdef HAVE_TEMPO_AVX2
+    if (SDL_HasAVX2()) {
+        tempoCorrelate = tempoCorrelateAVX2;
+        tempoCorrelateName = "avx2";
         return;
     }
-
-    // 创建纹理
-    // 将表面转换为纹理以便渲染
-    SDL_Texture *textTexture =
-        SDL_CreateTextureFromSurface(renderer, textSurface);
-    if (!textTexture) {
-        SDL_FreeSurface(textSurface);
-        TTF_CloseFont(font);
+#endif
+#ifdef HAVE_TEMPO_NEON
+    if (SDL_HasNEON()) {
+        tempoCorrelate = tempoCorrelateNEON;
+        tempoCorrelateName = "neon";
         return;
     }
+#endif
+    tempoCorrelate = tempoCorrelateScalar;
+    tempoCorrelateName = "scalar";
+}
 
-    // 设置绘制位置
-    // 计算右侧面板的宽度（窗口总宽度减去游戏区域宽度）
-    int rightPanelWidth = WINDOW_WIDTH - ARENA_WIDTH * 30;
-    // 计算x坐标：游戏区域宽度 + (右侧面板宽度 - 文本宽度)/2，实现水平居中
-    int xPos = ARENA_WIDTH * 30 + (rightPanelWidth - textSurface->w) / 2;
-    // 设置绘制矩形：x坐标，y坐标（顶部下方10像素），使用文本的宽度和高度
-    SDL_Rect destRect = {xPos, 10, textSurface->w, textSurface->h};
-    // 将纹理复制到渲染器
-    SDL_RenderCopy(renderer, textTexture, NULL, &destRect);
+typedef struct {
+    const int16_t *pcm; // 整首曲子，立体声交错
+    int frames;
+    double position;    // 名义输入位置（帧）
+    int previous;       // 上一个颗粒的起点
+    float window[TEMPO_GRAIN];
+    float overlap[TEMPO_HOP * 2]; // 上一个颗粒后半段加窗后的值
+    int16_t out[TEMPO_HOP * 2];   // 已完成的一跳输出
+    int outUsed;        // out中已经交给混音器的帧数
+    float tempo;        // 当前速度，每跳向目标靠近一点
+    SDL_atomic_t target; // 目标速度的千分之一，由主线程设置
+    uint64_t consumed;  // 累计前进的输入帧数，用于核对平均速度
+} MusicTempo;
+
+MusicTempo musicTempo;
+
+// 开始用WSOLA播放pcm，frames太短时返回false
+bool musicTempoStart(MusicTempo *t, const int16_t *pcm, int frames) {
+    if (frames < TEMPO_GRAIN * 4 + TEMPO_SEEK * 2) {
+        return false;
+    }
+    memset(t, 0, sizeof(*t));
+    t->pcm = pcm;
+    t->frames = frames;
+    t->position = TEMPO_SEEK;
+    t->previous = TEMPO_SEEK - TEMPO_HOP;
+    t->outUsed = TEMPO_HOP;
+    t->tempo = 1;
+    SDL_AtomicSet(&t->target, 1000);
+    for (int i = 0; i < TEMPO_GRAIN; i++) {
+        t->window[i] = 0.5f - 0.5f * cosf(2 * (float)M_PI * i / TEMPO_GRAIN);
+    }
+    return true;
+}
 
-    // 清理资源
-    // 释放纹理、表面和字体对象
-    SDL_DestroyTexture(textTexture);
-    SDL_FreeSurface(textSurface);
-    TTF_CloseFont(font);
+// 下落间隔从500毫秒缩短到100毫秒时，速度从1平滑提高到TEMPO_MAX
+void musicTempoFollow(MusicTempo *t, Uint32 fallInterval) {
+    float speed = 1 + (TEMPO_MAX - 1) * (500.0f - fallInterval) / 400;
+    speed = speed < 1 ? 1 : speed > TEMPO_MAX ? TEMPO_MAX : speed;
+    SDL_AtomicSet(&t->target, (int)(speed * 1000));
 }
 
-void drawArena(SDL_Renderer *renderer) {
-    // 绘制游戏区域
-    int blockSize = 24; // 每个小方块的实际大小
-    int gap = 6;        // 方块之间的间隔
+// 生成一跳输出
+static void musicTempoHop(MusicTempo *t) {
+    int last = t->frames - TEMPO_GRAIN - TEMPO_SEEK; // 颗粒起点的上限
+    int nominal = (int)t->position;
+    int natural = t->previous + TEMPO_HOP;
+    if (nominal > last || natural > last) {
+        // 循环播放：回到开头，这一处接缝不做对齐
+        t->position -= nominal - TEMPO_SEEK;
+        nominal = TEMPO_SEEK;
+        natural = nominal;
+    }
+    int best = nominal;
+    if (natural != nominal) {
+        const int16_t *target = t->pcm + (size_t)natural * 2;
+        float bestScore = -INFINITY;
+        for (int k = -TEMPO_SEEK; k <= TEMPO_SEEK; k++) {
+            float score = tempoCorrelate(t->pcm + (size_t)(nominal + k) * 2,
+                                         target, TEMPO_CORR);
+            if (score > bestScore) {
+                bestScore = score;
+                best = nominal + k;
+            }
+        }
+    }
+    const int16_t *grain = t->pcm + (size_t)best * 2;
+    for (int i = 0; i < TEMPO_HOP * 2; i++) {
+        float rising = t->overlap[i] + t->window[i / 2] * grain[i];
+        t->overlap[i] = t->window[TEMPO_HOP + i / 2] * grain[TEMPO_HOP * 2 + i];
+        t->out[i] = (int16_t)(rising > 32767    ? 32767
+                              : rising < -32768 ? -32768
+                                                : rising);
+    }
+    t->previous = best;
+    t->outUsed = 0;
+    float target = SDL_AtomicGet(&t->target) / 1000.0f;
+    t->tempo += (target - t->tempo) * 0.02f; // 约半秒过渡到新速度
+    t->position += TEMPO_HOP * t->tempo;
+    t->consumed += (uint64_t)(TEMPO_HOP * t->tempo);
+}
 
-    for (int i = 0; i < ARENA_HEIGHT; i++) {
-        for (int j = 0; j < ARENA_WIDTH; j++) {
-            if (arena[i][j] && !(blindMode && !clearAnim.isAnimating)) {
-                SDL_Rect rect = {j * (blockSize + gap) + gap,
-                                 i * (blockSize + gap) + gap, blockSize,
-                                 blockSize};
+// 在MusicTempo上生成frames帧立体声输出，volume为0~MIX_MAX_VOLUME
+void musicTempoRender(MusicTempo *t, int16_t *out, int frames, int volume) {
+    while (frames > 0) {
+        if (t->outUsed == TEMPO_HOP) {
+            musicTempoHop(t);
+        }
+        int n = TEMPO_HOP - t->outUsed;
+        n = n < frames ? n : frames;
+        const int16_t *src = t->out + t->outUsed * 2;
+        for (int i = 0; i < n * 2; i++) {
+            out[i] = (int16_t)(src[i] * volume / MIX_MAX_VOLUME);
+        }
+        t->outUsed += n;
+        out += n * 2;
+        frames -= n;
+    }
+}
 
-                // 检查当前行是否在动画中
-                bool isAnimating = false;
-                for (int k = 0; k < clearAnim.count; k++) {
-                    if (i == clearAnim.lines[k]) {
-                        isAnimating = true;
-                        break;
-                    }
-                }
+// Mix_HookMusic的回调，在音频线程中代替SDL_mixer播放背景音乐
+void musicTempoMix(void *udata, Uint8 *stream, int len) {
+    Uint64 start = SDL_GetPerformanceCounter();
+    musicTempoRender(udata, (int16_t *)stream, len / 4, Mix_VolumeMusic(-1));
+    metricObserve(&metrics.musicDsp, metricSince(start));
+}
 
-                // 使用与方块类型对应的颜色
-                SDL_Color color = pieceColors[arena[i][j] - 1];
-                if (isAnimating && !clearAnim.visible) {
-                    // 如果是动画中的行且当前不可见，绘制黑色
-                    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-                } else {
-                    SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b,
-                                           color.a);
-                }
-                SDL_RenderFillRect(renderer, &rect);
-            }
-        }
+// 离线测试变速：在合成的20秒曲子上以buffer帧的回调输出seconds秒，速度从1
+// 逐渐升到TEMPO_MAX，报告每次回调的耗时、折算的单核占用，并核对各内核结果一致
+int runTempoBenchmark(int buffer, int seconds) {
+    int frames = 44100 * 20;
+    int16_t *pcm = malloc((size_t)frames * 4);
+    int16_t *out = malloc((size_t)buffer * 4);
+    if (!pcm || !out || buffer < 1) {
+        free(pcm);
+        free(out);
+        return 1;
+    }
+    // 和弦加上每0.5秒一个衰减的鼓点
+    for (int i = 0; i < frames; i++) {
+        double t = (double)i / 44100;
+        double beat = fmod(t, 0.5);
+        double v = 0.2 * sin(2 * M_PI * 220 * t) + 0.15 * sin(2 * M_PI * 277 * t) +
+                   0.15 * sin(2 * M_PI * 330 * t) +
+                   0.4 * exp(-beat * 30) * sin(2 * M_PI * 60 * beat);
+        pcm[i * 2] = (int16_t)(v * 20000);
+        pcm[i * 2 + 1] = (int16_t)(v * 18000);
+    }
+
+    TempoCorrelateFunc fast = tempoCorrelate;
+    int mismatches = 0;
+    for (int k = 0; k < 64; k++) {
+        const int16_t *a = pcm + (size_t)k * 997 * 2;
+        const int16_t *b = pcm + (size_t)(k * 1231 + 5000) * 2;
+        float x = tempoCorrelateScalar(a, b, TEMPO_CORR);
+        float y = fast(a, b, TEMPO_CORR);
+        mismatches += fabsf(x - y) > fabsf(x) * 1e-5f + 1;
+    }
+
+    musicTempoStart(&musicTempo, pcm, frames);
+    int callbacks = (int)((double)seconds * 44100 / buffer);
+    double total = 0, worst = 0;
+    for (int c = 0; c < callbacks; c++) {
+        musicTempoFollow(&musicTempo,
+                         (Uint32)(500 - 400.0 * c / (callbacks > 1 ? callbacks - 1 : 1)));
+        Uint64 start = SDL_GetPerformanceCounter();
+        musicTempoRender(&musicTempo, out, buffer, MIX_MAX_VOLUME);
+        double elapsed = metricSince(start);
+        total += elapsed;
+        worst = elapsed > worst ? elapsed : worst;
+    }
+    double audio = (double)callbacks * buffer / 44100;
+    printf("tempo kernel %s, %d callbacks of %d frames (%.1f s of audio)\n",
+           tempoCorrelateName, callbacks, buffer, audio);
+    printf("dsp %.1f us per callback (worst %.1f us), %.3f%% of one core, "
+           "final tempo %.3f, average tempo %.3f\n",
+           total * 1e6 / callbacks, worst * 1e6, 100 * total / audio,
+           musicTempo.tempo, (double)musicTempo.consumed / (audio * 44100));
+    printf("kernel check: %d mismatches against scalar\n", mismatches);
+    free(pcm);
+    free(out);
+    return mismatches ? 1 : 0;
+}
+
+// 把名为name的曲目整个解码成设备格式供变速播放。变速需要比实时更快地读取
+// 输入，SDL_mixer的流式解码只能按实时速度推给混音器，所以这里用Mix_LoadWAV，
+// 整首PCM常驻内存（3分钟的曲子约30MB，流式播放只有几百KB），因此变速只在
+// --music-tempo时开启。设备不是16位立体声、找不到曲目或曲子太短时返回NULL，
+// 调用者改用流式播放
+Mix_Chunk *musicTempoOpen(const char *name) {
+    Uint16 format;
+    int channels;
+    char path[256];
+    if (!Mix_QuerySpec(NULL, &format, &channels) || format != AUDIO_S16SYS ||
+        channels != 2 || !musicFind(name, path, sizeof(path))) {
+        return NULL;
+    }
+    Mix_Chunk *chunk = Mix_LoadWAV_RW(assetOpen(path), 1);
+    if (!chunk) {
+        printf("Failed to decode background music %s! Mix_Error: %s\n", path,
+               Mix_GetError());
+        return NULL;
+    }
+    if (!musicTempoStart(&musicTempo, (const int16_t *)chunk->abuf,
+                         (int)(chunk->alen / 4))) {
+        Mix_FreeChunk(chunk);
+        return NULL;
+    }
+    return chunk;
+}
+
+// 构建步骤：把当前目录下的字体、音效和背景音乐打包成out
+int runPackAssets(const char *out) {
+    const char *names[2 + SFX_COUNT + sizeof(musicExtensions) /
+                                          sizeof(musicExtensions[0])];
+    char music[sizeof(musicExtensions) / sizeof(musicExtensions[0])][32];
+    int count = 0;
+    names[count++] = "simhei.ttf";
+    names[count++] = "arial.ttf";
+    for (int e = 0; e < SFX_COUNT; e++) {
+        names[count++] = sfxDefs[e].file;
+    }
+    for (int i = 0; i < (int)(sizeof(musicExtensions) /
+                              sizeof(musicExtensions[0]));
+         i++) {
+        snprintf(music[i], sizeof(music[i]), "background%s",
+                 musicExtensions[i]);
+        names[count++] = music[i];
     }
+    int packed = assetPackWrite(out, names, count);
+    if (packed < 0) {
+        printf("Failed to write asset pack %s\n", out);
+        return 1;
+    }
+    if (!assetPackOpen(out)) {
+        printf("Failed to read back asset pack %s\n", out);
+        return 1;
+    }
+    printf("%s: %d of %d assets, %zu bytes\n", out, packed, count,
+           assetPack.size);
+    for (uint32_t i = 0; i < assetHeader->count; i++) {
+        printf("  %-16s %10llu bytes at %llu\n", assetHeader->entries[i].name,
+               (unsigned long long)assetHeader->entries[i].size,
+               (unsigned long long)assetHeader->entries[i].offset);
+    }
+    assetPackClose();
+    return 0;
 }
 
 int main(int argv, char *args[]) {
+    initPieceTables();
+    initZobrist();
+    initEvalKernel();
+    initNetKernel();
+    initTempoKernel();
+
+    // 命令行参数：--headless 无窗口运行AI对局，--bench-eval 测试评估内核
+    bool headless = false;
+    bool benchEval = false;
+    bool checkPrune = false;
+    bool tune = false;
+    const char *solveSequence = NULL; // 求解模式的方块序列
+    int solveLines = 0;               // 求解目标行数，0表示完美消除
+    int solvePieces = 0;              // 求解最多使用的方块数，0表示整个序列
+    const char *boardFile = NULL;     // 求解用的存档文件
+    const char *netFile = NULL;       // 价值网络权重文件
+    const char *netTrainFile = NULL;  // 训练价值网络后写入的文件
+    bool benchNet = false;
+    const char *bridgeShm = NULL;     // 外部AI使用的共享内存名称
+    const char *bridgeExec = NULL;    // 使用文本协议的外部AI程序
+    const char *bridgeClient = NULL;  // 作为外部AI连接的共享内存，"-"表示文本协议
+    bool bridgeEcho = false;
+    bool benchBridge = false;
+    bool benchEnv = false;
+    bool benchSlice = false;
+    DataConfig dataConfig = {NULL, POLICY_GREEDY, 0.1f, 0, 0, 0, 1 << 20};
+    const char *shardFile = NULL;     // 要检查的数据分片
+    const char *replayFile = NULL;    // 无窗口模式保存最后一局的对局记录
+    const char *analyzeFile = NULL;   // 要分析的对局记录
+    const char *inputPrefix = NULL;   // 无窗口模式保存每局输入记录的文件名前缀
+    const char *verifyPath = NULL;    // 要验证的输入记录文件、目录或"-"
+    const char *divergeA = NULL;      // 查找第一个不同操作的两份输入记录
+    const char *divergeB = NULL;
+    const char *metricsAddress = NULL; // 指标端点地址，HOST:PORT或unix:PATH
+    int audioBuffer = 512;            // 音频缓冲区的采样帧数
+    bool benchAudio = false;
+    const char *benchMusic = NULL;    // 测试流式播放内存占用的曲目名（不带扩展名）
+    bool benchTempo = false;
+    const char *assetPath = "assets.pak"; // 资源包，不存在时读取散文件
+    const char *packAssets = NULL;    // 打包资源后写入的文件
+    bool musicTempoEnabled = false;   // 背景音乐随下落速度变速（整首解码）
+    int analyzeTop = 10;              // 分析时列出的失误数
+    ClusterConfig clusterConfig = {NULL, NULL, 0, 0, 0, 0, 4, 0};
+    bool cluster = false;
+    bool benchRollback = false;
+    const char *versusBind = NULL;    // 联网对战的本地UDP地址
+    const char *versusPeer = NULL;    // 联网对战的对方地址
+    int versusPlayer = 0;
+    int versusFrames = 3600;          // 对战测试的帧数
+    int inputDelay = 2;               // 对战的输入延迟（帧）
+    double netLatency = 0, netJitter = 0, netLoss = 0; // 注入的延迟、抖动（毫秒）和丢包率
+    const char *clusterWorker = NULL; // 作为工作进程连接的协调者地址
+    const char *spectateServer = NULL; // 观战服务器的监听地址
+    const char *spectateLoad = NULL;   // 负载测试连接的观战服务器地址
+    const char *gameServer = NULL;    // 多局游戏服务器的监听地址
+    const char *gameLoad = NULL;      // 负载测试连接的游戏服务器地址
+    int inputRate = 5;                // 游戏负载测试中每个客户端每秒的操作数
+    int spectateShards = SDL_GetCPUCount(); // 观战服务器的分片线程数
+    int spectateRate = 10;            // 观战服务器每秒锁定的方块数
+    int spectateClients = 1000;       // 负载测试的观众数
+    int spectateSlow = 0;             // 其中从不读数据的慢观众数
+    int runSeconds = 0;               // 观战服务器和负载测试的运行时间
+    int envCount = 4096;              // 批量环境测试的局数
+    int netEpochs = 8;                // 价值网络训练的轮数
+    TuneConfig tuneConfig = {16,   8, 500, 10, 1, 1, "tune_checkpoint.txt",
+                             "weights.txt"};
+    const char *weightsFile = "weights.txt"; // 启动时读取的权重文件
+    int headlessGames = 10;      // 无窗口模式的对局数
+    int headlessPieces = 10000;  // 每局最多的方块数
+    unsigned int headlessSeed = 1; // 第一局的随机数种子
+    botThreads = SDL_GetCPUCount();
+    for (int i = 1; i < argv; i++) {
+        if (strcmp(args[i], "--headless") == 0) {
+            headless = true;
+        } else if (strcmp(args[i], "--bench-eval") == 0) {
+            benchEval = true;
+        } else if (strcmp(args[i], "--check-prune") == 0) {
+            checkPrune = true;
+        } else if (strcmp(args[i], "--games") == 0 && i + 1 < argv) {
+            // 调优模式下表示每个候选的对局数，训练模式下表示生成样本的对局数
+            headlessGames = tuneConfig.games = atoi(args[++i]);
+        } else if (strcmp(args[i], "--pieces") == 0 && i + 1 < argv) {
+            headlessPieces = tuneConfig.maxPieces = atoi(args[++i]);
+        } else if (strcmp(args[i], "--seed") == 0 && i + 1 < argv) {
+            headlessSeed = (unsigned int)strtoul(args[++i], NULL, 10);
+        } else if (strcmp(args[i], "--beam") == 0 && i + 1 < argv) {
+            botBeamWidth = atoi(args[++i]);
+        } else if (strcmp(args[i], "--depth") == 0 && i + 1 < argv) {
+            botDepth = atoi(args[++i]);
+        } else if (strcmp(args[i], "--samples") == 0 && i + 1 < argv) {
+            botSamples = atoi(args[++i]);
+        } else if (strcmp(args[i], "--threads") == 0 && i + 1 < argv) {
+            botThreads = atoi(args[++i]);
+        } else if (strcmp(args[i], "--solve") == 0 && i + 1 < argv) {
+            solveSequence = args[++i];
+        } else if (strcmp(args[i], "--solve-lines") == 0 && i + 1 < argv) {
+            solveLines = atoi(args[++i]);
+        } else if (strcmp(args[i], "--solve-pieces") == 0 && i + 1 < argv) {
+            solvePieces = atoi(args[++i]);
+        } else if (strcmp(args[i], "--board") == 0 && i + 1 < argv) {
+            boardFile = args[++i];
+        } else if (strcmp(args[i], "--nn") == 0 && i + 1 < argv) {
+            netFile = args[++i];
+        } else if (strcmp(args[i], "--nn-train") == 0 && i + 1 < argv) {
+            netTrainFile = args[++i];
+        } else if (strcmp(args[i], "--epochs") == 0 && i + 1 < argv) {
+            netEpochs = atoi(args[++i]);
+        } else if (strcmp(args[i], "--bench-nn") == 0) {
+            benchNet = true;
+        } else if (strcmp(args[i], "--bot-shm") == 0 && i + 1 < argv) {
+            bridgeShm = args[++i];
+        } else if (strcmp(args[i], "--bot-exec") == 0 && i + 1 < argv) {
+            bridgeExec = args[++i];
+        } else if (strcmp(args[i], "--bot-client") == 0 && i + 1 < argv) {
+            bridgeClient = args[++i];
+        } else if (strcmp(args[i], "--bot-echo") == 0) {
+            bridgeEcho = true;
+        } else if (strcmp(args[i], "--bench-bridge") == 0) {
+            benchBridge = true;
+        } else if (strcmp(args[i], "--bench-env") == 0) {
+            benchEnv = true;
+        } else if (strcmp(args[i], "--bench-slice") == 0) {
+            benchSlice = true;
+        } else if (strcmp(args[i], "--gen-data") == 0 && i + 1 < argv) {
+            dataConfig.prefix = args[++i];
+        } else if (strcmp(args[i], "--policy") == 0 && i + 1 < argv) {
+            i++;
+            dataConfig.policy = strcmp(args[i], "random") == 0 ? POLICY_RANDOM
+                                : strcmp(args[i], "epsilon") == 0
+                                    ? POLICY_EPSILON
+                                    : POLICY_GREEDY;
+        } else if (strcmp(args[i], "--epsilon") == 0 && i + 1 < argv) {
+            dataConfig.epsilon = (float)atof(args[++i]);
+        } else if (strcmp(args[i], "--shard-records") == 0 && i + 1 < argv) {
+            dataConfig.shardRecords = strtoull(args[++i], NULL, 10);
+        } else if (strcmp(args[i], "--check-shard") == 0 && i + 1 < argv) {
+            shardFile = args[++i];
+        } else if (strcmp(args[i], "--save-replay") == 0 && i + 1 < argv) {
+            replayFile = args[++i];
+        } else if (strcmp(args[i], "--save-inputs") == 0 && i + 1 < argv) {
+            inputPrefix = args[++i];
+        } else if (strcmp(args[i], "--verify") == 0 && i + 1 < argv) {
+            verifyPath = args[++i];
+        } else if (strcmp(args[i], "--audio-buffer") == 0 && i + 1 < argv) {
+            audioBuffer = atoi(args[++i]);
+        } else if (strcmp(args[i], "--bench-music") == 0 && i + 1 < argv) {
+            benchMusic = args[++i];
+        } else if (strcmp(args[i], "--bench-audio") == 0) {
+            benchAudio = true;
+        } else if (strcmp(args[i], "--assets") == 0 && i + 1 < argv) {
+            assetPath = args[++i];
+        } else if (strcmp(args[i], "--pack-assets") == 0 && i + 1 < argv) {
+            packAssets = args[++i];
+        } else if (strcmp(args[i], "--bench-tempo") == 0) {
+            benchTempo = true;
+        } else if (strcmp(args[i], "--music-tempo") == 0) {
+            musicTempoEnabled = true;
+        } else if (strcmp(args[i], "--metrics") == 0 && i + 1 < argv) {
+            metricsAddress = args[++i];
+        } else if (strcmp(args[i], "--diverge") == 0 && i + 2 < argv) {
+            divergeA = args[++i];
+            divergeB = args[++i];
+        } else if (strcmp(args[i], "--analyze") == 0 && i + 1 < argv) {
+            analyzeFile = args[++i];
+        } else if (strcmp(args[i], "--top") == 0 && i + 1 < argv) {
+            analyzeTop = atoi(args[++i]);
+        } else if (strcmp(args[i], "--cluster") == 0 && i + 1 < argv) {
+            cluster = true;
+            clusterConfig.localWorkers = atoi(args[++i]);
+        } else if (strcmp(args[i], "--cluster-listen") == 0 && i + 1 < argv) {
+            cluster = true;
+            clusterConfig.listen = args[++i];
+        } else if (strcmp(args[i], "--cluster-worker") == 0 && i + 1 < argv) {
+            clusterWorker = args[++i];
+        } else if (strcmp(args[i], "--cluster-crash") == 0 && i + 1 < argv) {
+            clusterConfig.crashAfter = atoi(args[++i]);
+        } else if (strcmp(args[i], "--batch-games") == 0 && i + 1 < argv) {
+            clusterConfig.batchGames = atoi(args[++i]);
+        } else if (strcmp(args[i], "--bench-rollback") == 0) {
+            benchRollback = true;
+        } else if (strcmp(args[i], "--versus-peer") == 0 && i + 2 < argv) {
+            versusBind = args[++i];
+            versusPeer = args[++i];
+        } else if (strcmp(args[i], "--player") == 0 && i + 1 < argv) {
+            versusPlayer = atoi(args[++i]);
+        } else if (strcmp(args[i], "--frames") == 0 && i + 1 < argv) {
+            versusFrames = atoi(args[++i]);
+        } else if (strcmp(args[i], "--input-delay") == 0 && i + 1 < argv) {
+            inputDelay = atoi(args[++i]);
+        } else if (strcmp(args[i], "--latency") == 0 && i + 1 < argv) {
+            netLatency = atof(args[++i]);
+        } else if (strcmp(args[i], "--jitter") == 0 && i + 1 < argv) {
+            netJitter = atof(args[++i]);
+        } else if (strcmp(args[i], "--loss") == 0 && i + 1 < argv) {
+            netLoss = atof(args[++i]) / 100;
+        } else if (strcmp(args[i], "--spectate-server") == 0 && i + 1 < argv) {
+            spectateServer = args[++i];
+        } else if (strcmp(args[i], "--spectate-load") == 0 && i + 1 < argv) {
+            spectateLoad = args[++i];
+        } else if (strcmp(args[i], "--game-server") == 0 && i + 1 < argv) {
+            gameServer = args[++i];
+        } else if (strcmp(args[i], "--game-load") == 0 && i + 1 < argv) {
+            gameLoad = args[++i];
+        } else if (strcmp(args[i], "--input-rate") == 0 && i + 1 < argv) {
+            inputRate = atoi(args[++i]);
+        } else if (strcmp(args[i], "--shards") == 0 && i + 1 < argv) {
+            spectateShards = atoi(args[++i]);
+        } else if (strcmp(args[i], "--rate") == 0 && i + 1 < argv) {
+            spectateRate = atoi(args[++i]);
+        } else if (strcmp(args[i], "--clients") == 0 && i + 1 < argv) {
+            spectateClients = atoi(args[++i]);
+        } else if (strcmp(args[i], "--slow") == 0 && i + 1 < argv) {
+            spectateSlow = atoi(args[++i]);
+        } else if (strcmp(args[i], "--seconds") == 0 && i + 1 < argv) {
+            runSeconds = atoi(args[++i]);
+        } else if (strcmp(args[i], "--envs") == 0 && i + 1 < argv) {
+            envCount = atoi(args[++i]);
+        } else if (strcmp(args[i], "--mcts") == 0) {
+            botUseMcts = true;
+        } else if (strcmp(args[i], "--rollouts") == 0 && i + 1 < argv) {
+            mctsRollouts = atoi(args[++i]);
+        } else if (strcmp(args[i], "--rollout-depth") == 0 && i + 1 < argv) {
+            mctsRolloutDepth = atoi(args[++i]);
+        } else if (strcmp(args[i], "--weights") == 0 && i + 1 < argv) {
+            weightsFile = args[++i];
+        } else if (strcmp(args[i], "--tune") == 0) {
+            tune = true;
+        } else if (strcmp(args[i], "--population") == 0 && i + 1 < argv) {
+            tuneConfig.population = atoi(args[++i]);
+        } else if (strcmp(args[i], "--generations") == 0 && i + 1 < argv) {
+            tuneConfig.generations = atoi(args[++i]);
+        } else if (strcmp(args[i], "--checkpoint") == 0 && i + 1 < argv) {
+            tuneConfig.checkpoint = args[++i];
+        } else if (strcmp(args[i], "--output") == 0 && i + 1 < argv) {
+            tuneConfig.output = args[++i];
+        }
+    }
+    // 读取调优得到的权重，文件不存在时使用默认权重
+    if (botLoadWeights(weightsFile, &botWeights)) {
+        printf("Loaded bot weights from %s\n", weightsFile);
+    }
+    // 读取价值网络，AI改用网络选择落点
+    if (netFile) {
+        if (!netLoad(netFile, &valueNet)) {
+            printf("Failed to load value net %s\n", netFile);
+            return 1;
+        }
+        botUseNet = true;
+    }
+    if (packAssets) {
+        return runPackAssets(packAssets);
+    }
+    assetPackOpen(assetPath);
+    if (benchMusic) {
+        return runMusicBenchmark(benchMusic, audioBuffer,
+                                 runSeconds > 0 ? runSeconds : 5);
+    }
+    if (benchTempo) {
+        return runTempoBenchmark(audioBuffer, runSeconds > 0 ? runSeconds : 5);
+    }
+    if (benchAudio) {
+        return runAudioBenchmark(audioBuffer, runSeconds > 0 ? runSeconds : 5,
+                                 spectateRate);
+    }
+    if (netTrainFile) {
+        if (SDL_Init(SDL_INIT_TIMER) < 0) {
+            printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
+            return 1;
+        }
+        int result = runNetTraining(netTrainFile, tuneConfig.games,
+                                    tuneConfig.maxPieces, headlessSeed,
+                                    netEpochs);
+        SDL_Quit();
+        return result;
+    }
+    if (benchNet && !botUseNet) {
+        printf("--bench-nn needs --nn FILE\n");
+        return 1;
+    }
+    if (tune) {
+        if (SDL_Init(SDL_INIT_TIMER) < 0) {
+            printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
+            return 1;
+        }
+        tuneConfig.seed = headlessSeed;
+        tuneConfig.threads = botThreads;
+        int result = runTuner(&tuneConfig);
+        SDL_Quit();
+        return result;
+    }
+    if (shardFile) {
+        return runShardCheck(shardFile);
+    }
+    // 指标端点在所有模式下都可用，一直服务到进程退出
+    if (metricsAddress && !metricsStart(metricsAddress)) {
+        printf("Failed to serve metrics on %s\n", metricsAddress);
+        return 1;
+    }
+    if (headless || checkPrune || benchEval || benchNet || benchBridge || benchEnv ||
+        benchSlice || dataConfig.prefix || bridgeClient || solveSequence ||
+        analyzeFile || cluster || clusterWorker || benchRollback ||
+        versusPeer || spectateServer || spectateLoad || gameServer ||
+        gameLoad || verifyPath || divergeA) {
+        if (SDL_Init(SDL_INIT_TIMER) < 0) {
+            printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
+            return 1;
+        }
+        // 求解模式从存档（暂停菜单的保存进度）出发，没有存档时使用空棋盘
+        if (solveSequence &&
+            !loadSavedGame(&session, boardFile ? boardFile : "savegame.dat") &&
+            boardFile) {
+            printf("Failed to load board %s\n", boardFile);
+            SDL_Quit();
+            return 1;
+        }
+        if (headless && (bridgeShm || bridgeExec) &&
+            !bridgeConnect(bridgeShm, bridgeExec)) {
+            SDL_Quit();
+            return 1;
+        }
+        searchPoolInit(&searchPool, botThreads);
+        dataConfig.games = headlessGames;
+        dataConfig.maxPieces = headlessPieces;
+        dataConfig.seed = headlessSeed;
+        if (dataConfig.shardRecords < 1) {
+            dataConfig.shardRecords = 1;
+        }
+        clusterConfig.exe = args[0];
+        if (!clusterConfig.listen) {
+            clusterConfig.listen = "127.0.0.1:0"; // 系统分配端口
+        }
+        clusterConfig.games = headlessGames;
+        clusterConfig.maxPieces = headlessPieces;
+        clusterConfig.seed = headlessSeed;
+        if (clusterConfig.batchGames < 1) {
+            clusterConfig.batchGames = 1;
+        }
+        if (clusterConfig.localWorkers > CLUSTER_MAX_CONNS) {
+            clusterConfig.localWorkers = CLUSTER_MAX_CONNS;
+        }
+        int result = solveSequence  ? runSolver(solveSequence, solvePieces,
+                                                solveLines)
+                     : checkPrune   ? runPruneCheck(headlessGames, headlessPieces,
+                                                    headlessSeed)
+                     : benchEval    ? runEvalBenchmark()
+                     : benchNet     ? runNetBenchmark(&valueNet)
+                     : benchBridge  ? runBridgeBenchmark(args[0])
+                     : benchEnv     ? runEnvBenchmark(envCount, headlessSeed)
+                     : benchSlice   ? runSliceBenchmark(headlessSeed)
+                     : dataConfig.prefix
+                         ? runDataGenerator(&dataConfig, &searchPool)
+                     : bridgeClient ? runBridgeClient(bridgeClient, bridgeEcho)
+                     : analyzeFile  ? runReplayAnalysis(analyzeFile, analyzeTop)
+                     : clusterWorker
+                         ? runClusterWorker(clusterWorker,
+                                            clusterConfig.crashAfter)
+                     : cluster      ? runCluster(&clusterConfig)
+                     : benchRollback
+                         ? runRollbackBenchmark(versusFrames, inputDelay,
+                                                netLatency, netJitter, netLoss,
+                                                headlessSeed)
+                     : versusPeer
+                         ? runVersusPeer(versusBind, versusPeer, versusPlayer,
+                                         versusFrames, inputDelay, netLatency,
+                                         netJitter, netLoss, headlessSeed)
+                     : spectateServer
+                         ? runSpectateServer(spectateServer, spectateShards,
+                                             spectateRate, runSeconds,
+                                             headlessSeed)
+                     : spectateLoad
+                         ? runSpectateLoad(spectateLoad, spectateClients,
+                                           spectateSlow, runSeconds)
+                     : gameServer
+                         ? runGameServer(gameServer, spectateShards, runSeconds,
+                                         headlessSeed)
+                     : gameLoad ? runGameLoad(gameLoad, spectateClients,
+                                              inputRate, runSeconds)
+                     : verifyPath ? runVerify(verifyPath)
+                     : divergeA   ? runDiverge(divergeA, divergeB)
+                                  : runHeadless(headlessGames, headlessPieces,
+                                                headlessSeed, replayFile,
+                                                inputPrefix);
+        bridgeClose(&botBridge);
+        searchPoolShutdown(&searchPool);
+        mctsFreeTrees(mctsTrees);
+        SDL_Quit();
+        return result;
+    }
+
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
         printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
         return 1;
@@ -535,8 +11733,10 @@ int main(int argv, char *args[]) {
         return 1;
     }
 
-    // 初始化SDL_mixer
-    if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048) < 0) {
+    // 初始化SDL_mixer，缓冲区越小音效延迟越低（512帧约12毫秒）。
+    // 压缩格式的解码器按需加载，缺少的格式只影响对应的曲目
+    Mix_Init(MIX_INIT_OGG | MIX_INIT_OPUS | MIX_INIT_FLAC | MIX_INIT_MP3);
+    if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, audioBuffer) < 0) {
         printf("SDL_mixer could not initialize! Mix_Error: %s\n",
                Mix_GetError());
         TTF_Quit();
@@ -544,38 +11744,23 @@ int main(int argv, char *args[]) {
         return 1;
     }
 
-    // 加载背景音乐
-    Mix_Music *bgMusic = Mix_LoadMUS("background.wav");
-    if (!bgMusic) {
-        printf("Failed to load background music! Mix_Error: %s\n",
-               Mix_GetError());
-        Mix_CloseAudio();
-        TTF_Quit();
-        SDL_Quit();
-        return 1;
-    }
+    audioMonitor();
 
-    // 加载消除音效
-    clearSound = Mix_LoadWAV("clear.wav");
-    if (!clearSound) {
-        printf("Failed to load clear sound effect! Mix_Error: %s\n",
-               Mix_GetError());
-        Mix_FreeMusic(bgMusic);
-        Mix_CloseAudio();
-        TTF_Quit();
-        SDL_Quit();
-        return 1;
-    }
+    // 打开背景音乐：默认流式解码；--music-tempo时整首解码后变速播放，
+    // 不能变速时仍流式解码。没有曲目时静音继续
+    Mix_Chunk *tempoTrack =
+        musicTempoEnabled ? musicTempoOpen("background") : NULL;
+    Mix_Music *bgMusic = tempoTrack ? NULL : musicOpen("background");
+
+    // 加载全部音效，缺少的wav文件用合成的音效代替
+    sfxLoad();
 
     // 播放背景音乐，循环播放
-    if (Mix_PlayMusic(bgMusic, -1) == -1) {
+    if (tempoTrack) {
+        Mix_HookMusic(musicTempoMix, &musicTempo);
+    } else if (bgMusic && Mix_PlayMusic(bgMusic, -1) == -1) {
         printf("Failed to play background music! Mix_Error: %s\n",
                Mix_GetError());
-        Mix_FreeMusic(bgMusic);
-        Mix_CloseAudio();
-        TTF_Quit();
-        SDL_Quit();
-        return 1;
     }
 
     // 设置音量为原来的1/10
@@ -605,12 +11790,21 @@ int main(int argv, char *args[]) {
     }
 
     initGame();
+    searchPoolInit(&searchPool, botThreads);
+    hintStart(&hintWorker);
+    // 外部AI连接失败时继续使用内置AI
+    if (bridgeShm || bridgeExec) {
+        bridgeConnect(bridgeShm, bridgeExec);
+    }
 
     // 游戏主循环
     bool quit = false;
     SDL_Event e;
     Uint32 lastTime = SDL_GetTicks();
     while (!quit) {
+        // 背景音乐的速度跟随当前的下落间隔
+        musicTempoFollow(&musicTempo, lastFallInterval);
+
         // 帮助界面
         if (inHelpMenu) {
             // 清屏
@@ -618,7 +11812,7 @@ int main(int argv, char *args[]) {
             SDL_RenderClear(renderer);
 
             // 绘制帮助说明
-            TTF_Font *font = TTF_OpenFont("simhei.ttf", 24);
+            TTF_Font *font = fontOpen(24);
             if (font) {
                 // 游戏玩法说明文本
                 const char *helpText[] = {
@@ -742,11 +11936,10 @@ int main(int argv, char *args[]) {
                     }
                     SDL_FreeSurface(textSurface);
                 }
-                TTF_CloseFont(font);
             }
 
             // 更新屏幕
-            SDL_RenderPresent(renderer);
+            presentFrame(renderer);
 
             // 处理事件
             while (SDL_PollEvent(&e) != 0) {
@@ -765,7 +11958,7 @@ int main(int argv, char *args[]) {
             SDL_RenderClear(renderer);
 
             // 绘制标题
-            TTF_Font *titleFont = TTF_OpenFont("simhei.ttf", 48);
+            TTF_Font *titleFont = fontOpen(48);
             if (titleFont) {
                 SDL_Color textColor = {255, 255, 255, 255};
                 SDL_Surface *textSurface =
@@ -784,11 +11977,10 @@ int main(int argv, char *args[]) {
                     }
                     SDL_FreeSurface(textSurface);
                 }
-                TTF_CloseFont(titleFont);
             }
 
             // 绘制"新游戏"按钮
-            TTF_Font *buttonFont = TTF_OpenFont("simhei.ttf", 36);
+            TTF_Font *buttonFont = fontOpen(36);
             if (buttonFont) {
                 SDL_Color textColor = {255, 255, 255, 255};
                 SDL_Surface *textSurface =
@@ -866,18 +12058,8 @@ int main(int argv, char *args[]) {
                                 mouseY <= buttonY + buttonHeight) {
                                 // 开始新游戏
                                 inGameSelectMenu = false;
-                                // 清空游戏区域
-                                memset(arena, 0, sizeof(arena));
-                                score = 0;
-                                // 初始化随机数种子
-                                srand(SDL_GetTicks());
-                                // 随机生成第一个下一个方块
-                                nextPiece.type = rand() % 7;
-                                memcpy(nextPiece.shape,
-                                       tetrominoes[nextPiece.type],
-                                       sizeof(nextPiece.shape));
-                                // 生成第一个当前方块
-                                newPiece();
+                                botEnabled = false;
+                                startGame(SDL_GetTicks());
                             }
                         }
 
@@ -885,11 +12067,10 @@ int main(int argv, char *args[]) {
                     }
                     SDL_FreeSurface(textSurface);
                 }
-                TTF_CloseFont(buttonFont);
             }
 
             // 绘制"加载游戏"按钮
-            buttonFont = TTF_OpenFont("simhei.ttf", 36);
+            buttonFont = fontOpen(36);
             if (buttonFont) {
                 SDL_Color textColor = {255, 255, 255, 255};
                 SDL_Surface *textSurface =
@@ -967,6 +12148,7 @@ int main(int argv, char *args[]) {
                                 mouseY <= buttonY + buttonHeight) {
                                 // 加载游戏
                                 inGameSelectMenu = false;
+                                botEnabled = false;
                                 initGame();
                             }
                         }
@@ -975,11 +12157,10 @@ int main(int argv, char *args[]) {
                     }
                     SDL_FreeSurface(textSurface);
                 }
-                TTF_CloseFont(buttonFont);
             }
 
             // 更新屏幕
-            SDL_RenderPresent(renderer);
+            presentFrame(renderer);
 
             // 处理事件
             while (SDL_PollEvent(&e) != 0) {
@@ -998,7 +12179,7 @@ int main(int argv, char *args[]) {
             SDL_RenderClear(renderer);
 
             // 绘制标题
-            TTF_Font *titleFont = TTF_OpenFont("simhei.ttf", 48);
+            TTF_Font *titleFont = fontOpen(48);
             if (titleFont) {
                 SDL_Color textColor = {255, 255, 255, 255};
                 SDL_Surface *textSurface =
@@ -1017,18 +12198,17 @@ int main(int argv, char *args[]) {
                     }
                     SDL_FreeSurface(textSurface);
                 }
-                TTF_CloseFont(titleFont);
             }
 
             // 绘制"返回开始界面"按钮
-            TTF_Font *buttonFont = TTF_OpenFont("simhei.ttf", 36);
+            TTF_Font *buttonFont = fontOpen(36);
             if (buttonFont) {
                 SDL_Color textColor = {255, 255, 255, 255};
                 SDL_Surface *textSurface =
                     TTF_RenderUTF8_Solid(buttonFont, "返回开始界面", textColor);
 
                 // 在按钮下方添加"调整音量"提示
-                TTF_Font *hintFont = TTF_OpenFont("simhei.ttf", 24);
+                TTF_Font *hintFont = fontOpen(24);
                 if (hintFont) {
                     SDL_Surface *hintSurface =
                         TTF_RenderUTF8_Solid(hintFont, "调整音量", textColor);
@@ -1046,7 +12226,6 @@ int main(int argv, char *args[]) {
                         }
                         SDL_FreeSurface(hintSurface);
                     }
-                    TTF_CloseFont(hintFont);
                 }
                 if (textSurface) {
                     SDL_Texture *textTexture =
@@ -1130,11 +12309,10 @@ int main(int argv, char *args[]) {
                     }
                     SDL_FreeSurface(textSurface);
                 }
-                TTF_CloseFont(buttonFont);
             }
 
             // 绘制音量调整提示和滑动条
-            TTF_Font *volumeFont = TTF_OpenFont("simhei.ttf", 24);
+            TTF_Font *volumeFont = fontOpen(24);
             if (volumeFont) {
                 // 绘制"调整音量"文字
                 SDL_Color textColor = {255, 255, 255, 255};
@@ -1195,11 +12373,10 @@ int main(int argv, char *args[]) {
                     }
                 }
 
-                TTF_CloseFont(volumeFont);
             }
 
             // 绘制"方块下落速度"提示
-            TTF_Font *speedFont = TTF_OpenFont("simhei.ttf", 24);
+            TTF_Font *speedFont = fontOpen(24);
             if (speedFont) {
                 SDL_Color textColor = {255, 255, 255, 255};
                 SDL_Surface *textSurface =
@@ -1218,7 +12395,6 @@ int main(int argv, char *args[]) {
                     }
                     SDL_FreeSurface(textSurface);
                 }
-                TTF_CloseFont(speedFont);
             }
 
             // 绘制方块下落速度滑动条
@@ -1271,7 +12447,7 @@ int main(int argv, char *args[]) {
             }
 
             // 绘制"方块分数倍数"提示
-            TTF_Font *scoreFont = TTF_OpenFont("simhei.ttf", 24);
+            TTF_Font *scoreFont = fontOpen(24);
             if (scoreFont) {
                 SDL_Color textColor = {255, 255, 255, 255};
                 SDL_Surface *textSurface =
@@ -1290,7 +12466,6 @@ int main(int argv, char *args[]) {
                     }
                     SDL_FreeSurface(textSurface);
                 }
-                TTF_CloseFont(scoreFont);
             }
 
             // 绘制分数倍数按钮
@@ -1334,11 +12509,18 @@ int main(int argv, char *args[]) {
                         mouseY >= buttonY && mouseY <= buttonY + buttonSize) {
                         selectedButton = i; // 记录当前选中的按钮
                         scoreMultiplier = i + 1; // 设置分数倍数为i+1
+                        session.multiplier = scoreMultiplier;
+                        // 对局中途改变倍数后分数无法重新计算
+                        if (gameInputs.count > 0 &&
+                            gameInputs.multiplier != scoreMultiplier) {
+                            gameInputs.valid = false;
+                        }
+                        gameInputs.multiplier = scoreMultiplier;
                     }
                 }
 
                 // 绘制按钮下方的数字
-                TTF_Font *numFont = TTF_OpenFont("simhei.ttf", 24);
+                TTF_Font *numFont = fontOpen(24);
                 if (numFont) {
                     char numText[2];
                     snprintf(numText, sizeof(numText), "%d", i + 1);
@@ -1355,12 +12537,11 @@ int main(int argv, char *args[]) {
                         }
                         SDL_FreeSurface(textSurface);
                     }
-                    TTF_CloseFont(numFont);
                 }
             }
 
             // 更新屏幕
-            SDL_RenderPresent(renderer);
+            presentFrame(renderer);
 
             // 处理事件
             while (SDL_PollEvent(&e) != 0) {
@@ -1379,7 +12560,7 @@ int main(int argv, char *args[]) {
             SDL_RenderClear(renderer);
 
             // 绘制标题
-            TTF_Font *titleFont = TTF_OpenFont("simhei.ttf", 64);
+            TTF_Font *titleFont = fontOpen(64);
             if (titleFont) {
                 SDL_Color textColor = {255, 255, 255, 255};
                 SDL_Surface *textSurface =
@@ -1398,11 +12579,10 @@ int main(int argv, char *args[]) {
                     }
                     SDL_FreeSurface(textSurface);
                 }
-                TTF_CloseFont(titleFont);
             }
 
             // 绘制开始游戏按钮
-            TTF_Font *buttonFont = TTF_OpenFont("simhei.ttf", 36);
+            TTF_Font *buttonFont = fontOpen(36);
             if (buttonFont) {
                 SDL_Color textColor = {255, 255, 255, 255};
                 SDL_Surface *textSurface =
@@ -1415,9 +12595,7 @@ int main(int argv, char *args[]) {
                         int buttonWidth = textSurface->w + 40;
                         int buttonHeight = textSurface->h + 20;
                         int buttonX = (WINDOW_WIDTH - buttonWidth) / 2;
-                        int buttonY =
-                            234; // 按钮在标题下方70像素（标题高度64 + 70 =
-                                 // 134，标题位置100 + 134 = 234）
+                        int buttonY = 220; // 按钮在标题下方
 
                         // 获取鼠标位置
                         int mouseX, mouseY;
@@ -1489,11 +12667,102 @@ int main(int argv, char *args[]) {
                     }
                     SDL_FreeSurface(textSurface);
                 }
-                TTF_CloseFont(buttonFont);
+            }
+
+            // 绘制"AI演示"按钮
+            buttonFont = fontOpen(36);
+            if (buttonFont) {
+                SDL_Color textColor = {255, 255, 255, 255};
+                SDL_Surface *textSurface =
+                    TTF_RenderUTF8_Solid(buttonFont, "AI演示", textColor);
+                if (textSurface) {
+                    SDL_Texture *textTexture =
+                        SDL_CreateTextureFromSurface(renderer, textSurface);
+                    if (textTexture) {
+                        // 计算按钮位置，放在"开始游戏"按钮下方
+                        int buttonWidth = textSurface->w + 40;
+                        int buttonHeight = textSurface->h + 20;
+                        int buttonX = (WINDOW_WIDTH - buttonWidth) / 2;
+                        int buttonY = 310; // 在开始游戏按钮下方90像素
+
+                        // 获取鼠标位置
+                        int mouseX, mouseY;
+                        SDL_GetMouseState(&mouseX, &mouseY);
+
+                        // 检查鼠标是否在按钮上
+                        bool isHovered = (mouseX >= buttonX &&
+                                          mouseX <= buttonX + buttonWidth &&
+                                          mouseY >= buttonY &&
+                                          mouseY <= buttonY + buttonHeight);
+
+                        // 绘制按钮阴影
+                        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 64);
+                        SDL_Rect shadowRect = {buttonX + 4, buttonY + 4,
+                                               buttonWidth, buttonHeight};
+                        SDL_RenderFillRect(renderer, &shadowRect);
+
+                        // 根据鼠标悬停状态设置按钮颜色
+                        if (isHovered) {
+                            SDL_SetRenderDrawColor(renderer, 255, 180, 50,
+                                                   255);
+                        } else {
+                            SDL_SetRenderDrawColor(renderer, 200, 120, 0, 255);
+                        }
+                        SDL_Rect buttonRect = {buttonX, buttonY, buttonWidth,
+                                               buttonHeight};
+
+                        // 绘制圆角矩形
+                        for (int i = 0; i < 10; i++) {
+                            SDL_Rect roundRect = {
+                                buttonRect.x + i, buttonRect.y + i,
+                                buttonRect.w - i * 2, buttonRect.h - i * 2};
+                            SDL_RenderDrawRect(renderer, &roundRect);
+                        }
+                        SDL_RenderFillRect(renderer, &buttonRect);
+
+                        // 绘制按钮边框
+                        if (isHovered) {
+                            SDL_SetRenderDrawColor(renderer, 255, 210, 120,
+                                                   255);
+                        } else {
+                            SDL_SetRenderDrawColor(renderer, 255, 255, 255,
+                                                   255);
+                        }
+                        for (int i = 0; i < 2; i++) {
+                            SDL_Rect borderRect = {
+                                buttonRect.x + i, buttonRect.y + i,
+                                buttonRect.w - i * 2, buttonRect.h - i * 2};
+                            SDL_RenderDrawRect(renderer, &borderRect);
+                        }
+
+                        // 绘制按钮文字
+                        SDL_Rect textRect = {buttonX + 20, buttonY + 10,
+                                             textSurface->w, textSurface->h};
+                        SDL_RenderCopy(renderer, textTexture, NULL, &textRect);
+
+                        // 检测鼠标点击
+                        if (SDL_GetMouseState(&mouseX, &mouseY) &
+                            SDL_BUTTON(SDL_BUTTON_LEFT)) {
+                            if (mouseX >= buttonX &&
+                                mouseX <= buttonX + buttonWidth &&
+                                mouseY >= buttonY &&
+                                mouseY <= buttonY + buttonHeight) {
+                                // 开始一局由AI操作的新游戏
+                                inStartMenu = false;
+                                botEnabled = true;
+                                botMovePiece = -1;
+                                startGame(SDL_GetTicks());
+                            }
+                        }
+
+                        SDL_DestroyTexture(textTexture);
+                    }
+                    SDL_FreeSurface(textSurface);
+                }
             }
 
             // 绘制"游戏设置"按钮
-            buttonFont = TTF_OpenFont("simhei.ttf", 36);
+            buttonFont = fontOpen(36);
             if (buttonFont) {
                 SDL_Color textColor = {255, 255, 255, 255};
                 SDL_Surface *textSurface =
@@ -1502,12 +12771,11 @@ int main(int argv, char *args[]) {
                     SDL_Texture *textTexture =
                         SDL_CreateTextureFromSurface(renderer, textSurface);
                     if (textTexture) {
-                        // 计算按钮位置，放在"开始游戏"按钮下方
+                        // 计算按钮位置，放在"AI演示"按钮下方
                         int buttonWidth = textSurface->w + 40;
                         int buttonHeight = textSurface->h + 20;
                         int buttonX = (WINDOW_WIDTH - buttonWidth) / 2;
-                        int buttonY =
-                            367; // 在开始游戏按钮(234)和游戏帮助按钮(500)中间
+                        int buttonY = 400; // 在AI演示按钮下方90像素
 
                         // 获取鼠标位置
                         int mouseX, mouseY;
@@ -1581,11 +12849,10 @@ int main(int argv, char *args[]) {
                     }
                     SDL_FreeSurface(textSurface);
                 }
-                TTF_CloseFont(buttonFont);
             }
 
             // 绘制"游戏帮助"按钮
-            buttonFont = TTF_OpenFont("simhei.ttf", 36);
+            buttonFont = fontOpen(36);
             if (buttonFont) {
                 SDL_Color textColor = {255, 255, 255, 255};
                 SDL_Surface *textSurface =
@@ -1598,7 +12865,7 @@ int main(int argv, char *args[]) {
                         int buttonWidth = textSurface->w + 40;
                         int buttonHeight = textSurface->h + 20;
                         int buttonX = (WINDOW_WIDTH - buttonWidth) / 2;
-                        int buttonY = 500; // 在游戏设置按钮下方100像素
+                        int buttonY = 490; // 在游戏设置按钮下方90像素
 
                         // 获取鼠标位置
                         int mouseX, mouseY;
@@ -1670,11 +12937,10 @@ int main(int argv, char *args[]) {
                     }
                     SDL_FreeSurface(textSurface);
                 }
-                TTF_CloseFont(buttonFont);
             }
 
             // 更新屏幕
-            SDL_RenderPresent(renderer);
+            presentFrame(renderer);
 
             // 处理事件
             while (SDL_PollEvent(&e) != 0) {
@@ -1692,39 +12958,33 @@ int main(int argv, char *args[]) {
         lastTime = currentTime;
 
         // 更新动画
-        updateAnimation(deltaTime);
+        // 消除动画结束后删除满行；游戏已经结束时只清掉画面上的行
+        if (updateAnimation(&session, deltaTime) &&
+            !playerInput(GAME_INPUT_CLEAR)) {
+            removeClearedLines(&session);
+        }
+
+        // AI模式下由AI操作方块
+        botStep();
         while (SDL_PollEvent(&e) != 0) {
             if (e.type == SDL_QUIT) {
                 quit = true;
             } else if (e.type == SDL_KEYDOWN) {
-                Tetromino temp = currentPiece;
+                if (frameKeyCount < FRAME_MAX_KEYS) {
+                    frameKeys[frameKeyCount++] = e.key.timestamp;
+                }
                 switch (e.key.keysym.sym) {
                 case SDLK_a: // A键左移
-                    temp.x--;
-                    if (!checkCollision(&temp))
-                        currentPiece.x--;
+                    playerInput(GAME_INPUT_LEFT);
                     break;
                 case SDLK_d: // D键右移
-                    temp.x++;
-                    if (!checkCollision(&temp))
-                        currentPiece.x++;
+                    playerInput(GAME_INPUT_RIGHT);
                     break;
                 case SDLK_s: // S键加速下落
-                    temp.y++;
-                    if (!checkCollision(&temp))
-                        currentPiece.y++;
+                    playerInput(GAME_INPUT_DOWN);
                     break;
                 case SDLK_w: // W键旋转
-                    // 旋转方块
-                    Tetromino rotated = currentPiece;
-                    for (int i = 0; i < 4; i++) {
-                        for (int j = 0; j < 4; j++) {
-                            rotated.shape[i][j] = currentPiece.shape[3 - j][i];
-                        }
-                    }
-                    if (!checkCollision(&rotated)) {
-                        currentPiece = rotated;
-                    }
+                    playerInput(GAME_INPUT_ROTATE);
                     break;
                 case SDLK_ESCAPE: // Esc键暂停/继续
                     isPaused = !isPaused;
@@ -1732,24 +12992,30 @@ int main(int argv, char *args[]) {
                 case SDLK_TAB: // Tab键切换盲打模式
                     blindMode = !blindMode;
                     break;
+                case SDLK_h: // H键显示/隐藏最佳落点提示
+                    hintEnabled = !hintEnabled;
+                    break;
                 }
             }
         }
 
         // 自动下落（仅在未暂停时）
         if (!isPaused && SDL_GetTicks() - lastFall > lastFallInterval) {
-            Tetromino temp = currentPiece;
+            Tetromino temp = session.currentPiece;
             temp.y++;
-            if (!checkCollision(&temp)) {
-                currentPiece.y++;
-            } else {
-                lockPiece();
-                clearLines();
-                newPiece();
+            if (!session.gameOver && checkCollision(&session, &temp)) {
+                replayRecord(&gameReplay); // 这次下落会锁定方块
             }
+            playerInput(GAME_INPUT_GRAVITY);
             lastFall = SDL_GetTicks();
         }
 
+        // 游戏结束后保存提交成绩用的输入记录和对局记录，并分析每一步
+        if (session.gameOver && !gameAnalyzed) {
+            inputLogSave(&gameInputs, session.score, "inputs.dat");
+            analyzeFinishedGame("replay.dat");
+        }
+
         // 清屏
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
         SDL_RenderClear(renderer);
@@ -1759,12 +13025,16 @@ int main(int argv, char *args[]) {
         drawScore(renderer);
         drawNextPiece(renderer);
 
+        // 局面变化时把新局面交给提示线程，不等待搜索结果
+        hintUpdate(&hintWorker);
+
         // 绘制当前方块和预览（盲打模式下也显示）
-        drawPreview(renderer, &currentPiece);      // 先绘制预览
-        drawPiece(renderer, &currentPiece, false); // 再绘制当前方块
+        drawPreview(renderer, &session.currentPiece);      // 先绘制预览
+        drawHint(renderer);                                // 最佳落点提示
+        drawPiece(renderer, &session.currentPiece, false); // 再绘制当前方块
 
         // 如果游戏暂停，绘制暂停界面
-        if (isPaused && !gameOver) {
+        if (isPaused && !session.gameOver) {
             // 绘制半透明黑色背景
             SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
             SDL_SetRenderDrawColor(renderer, 0, 0, 0, 128);
@@ -1772,7 +13042,7 @@ int main(int argv, char *args[]) {
             SDL_RenderFillRect(renderer, &overlay);
 
             // 绘制"游戏暂停"文字
-            TTF_Font *font = TTF_OpenFont("simhei.ttf", 48);
+            TTF_Font *font = fontOpen(48);
             if (font) {
                 SDL_Color textColor = {255, 255, 255, 255};
                 SDL_Surface *textSurface =
@@ -1793,11 +13063,10 @@ int main(int argv, char *args[]) {
                     }
                     SDL_FreeSurface(textSurface);
                 }
-                TTF_CloseFont(font);
             }
 
             // 绘制"保存游戏进度"按钮
-            font = TTF_OpenFont("simhei.ttf", 36);
+            font = fontOpen(36);
             if (font) {
                 SDL_Color textColor = {255, 255, 255, 255};
                 SDL_Surface *textSurface =
@@ -1904,20 +13173,7 @@ int main(int argv, char *args[]) {
                                 mouseY <= buttonY + buttonHeight &&
                                 SDL_GetTicks() - mouseDownTime >= 100) {
                                 // 保存游戏进度
-                                FILE *file = fopen("savegame.dat", "wb");
-                                if (file) {
-                                    // 保存游戏区域
-                                    fwrite(arena, sizeof(arena), 1, file);
-                                    // 保存当前方块
-                                    fwrite(&currentPiece, sizeof(currentPiece),
-                                           1, file);
-                                    // 保存下一个方块
-                                    fwrite(&nextPiece, sizeof(nextPiece), 1,
-                                           file);
-                                    // 保存分数
-                                    fwrite(&score, sizeof(score), 1, file);
-                                    fclose(file);
-                                }
+                                saveGame(&session, "savegame.dat");
                             }
                             isMouseDown = false;
                         }
@@ -1926,11 +13182,10 @@ int main(int argv, char *args[]) {
                     }
                     SDL_FreeSurface(textSurface);
                 }
-                TTF_CloseFont(font);
             }
 
             // 绘制"返回上个方块"按钮
-            font = TTF_OpenFont("simhei.ttf", 36);
+            font = fontOpen(36);
             if (font) {
                 SDL_Color textColor = {255, 255, 255, 255};
                 SDL_Surface *textSurface =
@@ -2038,7 +13293,9 @@ int main(int argv, char *args[]) {
                                 mouseY <= buttonY + buttonHeight &&
                                 SDL_GetTicks() - mouseDownTime >= 100) {
                                 // 执行撤销操作
-                                undoLastMove();
+                                undoLastMove(&session);
+                                // 回退后的对局不能再从种子重新模拟
+                                gameInputs.valid = false;
                             }
                             isMouseDown = false;
                         }
@@ -2047,11 +13304,10 @@ int main(int argv, char *args[]) {
                     }
                     SDL_FreeSurface(textSurface);
                 }
-                TTF_CloseFont(font);
             }
 
             // 绘制"重新开始"按钮
-            font = TTF_OpenFont("simhei.ttf", 36);
+            font = fontOpen(36);
             if (font) {
                 SDL_Color textColor = {255, 255, 255, 255};
                 SDL_Surface *textSurface =
@@ -2145,7 +13401,7 @@ int main(int argv, char *args[]) {
                                 mouseY <= buttonY + buttonHeight) {
                                 // 返回开始界面
                                 inStartMenu = true;
-                                gameOver = false;
+                                session.gameOver = false;
                                 isPaused = false;
                             }
                         }
@@ -2154,11 +13410,10 @@ int main(int argv, char *args[]) {
                     }
                     SDL_FreeSurface(textSurface);
                 }
-                TTF_CloseFont(font);
             }
 
             // 绘制"退出游戏"按钮
-            font = TTF_OpenFont("simhei.ttf", 36);
+            font = fontOpen(36);
             if (font) {
                 SDL_Color textColor = {255, 255, 255, 255};
                 SDL_Surface *textSurface =
@@ -2258,11 +13513,10 @@ int main(int argv, char *args[]) {
                     }
                     SDL_FreeSurface(textSurface);
                 }
-                TTF_CloseFont(font);
             }
 
             // 绘制"按Esc继续"提示
-            font = TTF_OpenFont("simhei.ttf", 24);
+            font = fontOpen(24);
             if (font) {
                 SDL_Color textColor = {255, 255, 255, 255};
                 SDL_Surface *textSurface =
@@ -2283,12 +13537,11 @@ int main(int argv, char *args[]) {
                     }
                     SDL_FreeSurface(textSurface);
                 }
-                TTF_CloseFont(font);
             }
         }
 
         // 如果游戏结束，绘制退出按钮
-        if (gameOver) {
+        if (session.gameOver) {
             // 绘制半透明黑色背景
             SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
             SDL_SetRenderDrawColor(renderer, 0, 0, 0, 128);
@@ -2296,7 +13549,7 @@ int main(int argv, char *args[]) {
             SDL_RenderFillRect(renderer, &overlay);
 
             // 绘制退出按钮
-            TTF_Font *font = TTF_OpenFont("simhei.ttf", 36);
+            TTF_Font *font = fontOpen(36);
             if (font) {
                 SDL_Color textColor = {255, 255, 255, 255};
                 SDL_Surface *textSurface =
@@ -2395,11 +13648,10 @@ int main(int argv, char *args[]) {
                     }
                     SDL_FreeSurface(textSurface);
                 }
-                TTF_CloseFont(font);
             }
 
             // 绘制"返回开始界面"按钮
-            font = TTF_OpenFont("simhei.ttf", 36);
+            font = fontOpen(36);
             if (font) {
                 SDL_Color textColor = {255, 255, 255, 255};
                 SDL_Surface *textSurface =
@@ -2493,7 +13745,7 @@ int main(int argv, char *args[]) {
                                 mouseY <= buttonY + buttonHeight) {
                                 // 返回开始界面
                                 inStartMenu = true;
-                                gameOver = false;
+                                session.gameOver = false;
                             }
                         }
 
@@ -2501,25 +13753,36 @@ int main(int argv, char *args[]) {
                     }
                     SDL_FreeSurface(textSurface);
                 }
-                TTF_CloseFont(font);
             }
+
+            // 绘制失误分析
+            drawAnalysis(renderer);
         }
 
         // 更新屏幕
-        SDL_RenderPresent(renderer);
+        presentFrame(renderer);
     }
 
     // 清理资源
+    bridgeClose(&botBridge);
+    hintShutdown(&hintWorker);
+    searchPoolShutdown(&searchPool);
+    mctsFreeTrees(mctsTrees);
     // 停止并释放音乐资源
+    Mix_HookMusic(NULL, NULL);
+    Mix_FreeChunk(tempoTrack);
     Mix_HaltMusic();
     Mix_FreeMusic(bgMusic);
-    Mix_FreeChunk(clearSound);
+    sfxFree();
+    fontCacheFree();
 
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     Mix_CloseAudio();
+    Mix_Quit();
     TTF_Quit();
     SDL_Quit();
+    assetPackClose();
 
     return 0;
 }